@@ -0,0 +1,72 @@
+#include "balloon.h"
+#include <log/uart_print.h>
+
+/*
+ * Driver of the hypervisor memory balloon. The guest lends the balloon a
+ * range of its RAM that it can do without. Pages are given to the
+ * hypervisor from the top of the range down, and taken back in reverse.
+ * The range ends below the first page the hypervisor refuses.
+ */
+#define BALLOON_BASE        0x3FE00000
+#define BALLOON_TARGET      (0x00 / 4)
+#define BALLOON_ACTUAL      (0x04 / 4)
+#define BALLOON_INFLATE     (0x08 / 4)
+#define BALLOON_DEFLATE     (0x0C / 4)
+#define BALLOON_STATUS      (0x10 / 4)
+
+#define BALLOON_PAGE_SIZE   0x1000
+
+static uint32_t _balloon_base;
+static uint32_t _balloon_pages;
+
+/**
+ * @brief Lends a range of guest RAM to the balloon.
+ *
+ * The range must not be used by the guest while any page of it is held
+ * in the balloon.
+ *
+ * @param base Intermediate physical address of the range, page aligned.
+ * @param pages Size of the range in pages.
+ */
+void balloon_init(uint32_t base, uint32_t pages)
+{
+    _balloon_base = base;
+    _balloon_pages = pages;
+}
+
+/**
+ * @brief Inflates or deflates the balloon towards the target set by the
+ * hypervisor.
+ *
+ * @return Pages held in the balloon.
+ */
+uint32_t balloon_update(void)
+{
+    volatile uint32_t *base = (uint32_t *) BALLOON_BASE;
+    uint32_t target = base[BALLOON_TARGET];
+    uint32_t actual = base[BALLOON_ACTUAL];
+
+    if (target > _balloon_pages)
+        target = _balloon_pages;
+
+    while (actual < target) {
+        base[BALLOON_INFLATE] = _balloon_base +
+                (_balloon_pages - actual - 1) * BALLOON_PAGE_SIZE;
+        if (base[BALLOON_STATUS]) {
+            uart_print("balloon: inflate refused, status:");
+            uart_print_hex32(base[BALLOON_STATUS]);
+            uart_print("\n\r");
+            _balloon_base += (_balloon_pages - actual) * BALLOON_PAGE_SIZE;
+            _balloon_pages = actual;
+            break;
+        }
+        actual++;
+    }
+    while (actual > target) {
+        actual--;
+        base[BALLOON_DEFLATE] = _balloon_base +
+                (_balloon_pages - actual - 1) * BALLOON_PAGE_SIZE;
+    }
+
+    return actual;
+}
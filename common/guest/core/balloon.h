@@ -0,0 +1,10 @@
+#ifndef __BALLOON_H__
+#define __BALLOON_H__
+
+#include "hvmm_types.h"
+#include "arch_types.h"
+
+void balloon_init(uint32_t base, uint32_t pages);
+uint32_t balloon_update(void);
+
+#endif
@@ -0,0 +1,109 @@
+#include "channel.h"
+#include <asm-arm_inline.h>
+
+/*
+ * Driver of the inter-VM channels. A message is written in place in the
+ * buffer of the next free slot and published by moving head, the peer
+ * takes it from the same buffer and frees the slot by moving tail. The
+ * barriers order the buffer against head and tail, the doorbell is only
+ * needed to wake the peer up, once per batch.
+ */
+
+/**
+ * @brief Attaches to an end of a channel.
+ *
+ * @param id Channel id.
+ * @param end End of the guest, 0 or 1, it fills ring @end.
+ * @return 0, -1 if the hypervisor did not set the channel up.
+ */
+int channel_open(struct channel *ch, uint32_t id, uint32_t end)
+{
+    struct shm_channel_header *shm;
+
+    ch->base = (uint8_t *)(SHM_CHANNEL_IPA + id * SHM_CHANNEL_SIZE);
+    shm = (struct shm_channel_header *) ch->base;
+    if (shm->magic != SHM_CHANNEL_MAGIC || shm->id != id || end > 1)
+        return -1;
+
+    ch->id = id;
+    ch->tx = (struct shm_channel_ring *)
+            (ch->base + SHM_CHANNEL_RING_OFFSET(end));
+    ch->rx = (struct shm_channel_ring *)
+            (ch->base + SHM_CHANNEL_RING_OFFSET(!end));
+    ch->tx_data = end;
+    ch->rx_data = !end;
+
+    return 0;
+}
+
+/**
+ * @brief Returns the buffer of the next free slot, SHM_CHANNEL_SLOT_SIZE
+ * bytes, to write a message into.
+ *
+ * @return The buffer, 0 if the ring is full.
+ */
+void *channel_send_buf(struct channel *ch)
+{
+    uint32_t head = ch->tx->head;
+
+    if (head - ch->tx->tail >= SHM_CHANNEL_SLOTS)
+        return 0;
+
+    return ch->base + SHM_CHANNEL_DATA(ch->tx_data,
+            head & (SHM_CHANNEL_SLOTS - 1));
+}
+
+/**
+ * @brief Publishes the message written in the buffer of channel_send_buf().
+ */
+void channel_send(struct channel *ch, uint32_t len)
+{
+    uint32_t head = ch->tx->head;
+
+    ch->tx->desc[head & (SHM_CHANNEL_SLOTS - 1)].len = len;
+    /* the message before head */
+    dmb();
+    ch->tx->head = head + 1;
+}
+
+/**
+ * @brief Returns the oldest message, left in its slot until
+ * channel_recv_done().
+ *
+ * @return The buffer of the message, 0 if the ring is empty.
+ */
+void *channel_recv(struct channel *ch, uint32_t *len)
+{
+    uint32_t tail = ch->rx->tail;
+    uint32_t slot = tail & (SHM_CHANNEL_SLOTS - 1);
+
+    if (ch->rx->head == tail)
+        return 0;
+    /* head before the message */
+    dmb();
+    *len = ch->rx->desc[slot].len;
+
+    return ch->base + SHM_CHANNEL_DATA(ch->rx_data, slot);
+}
+
+void channel_recv_done(struct channel *ch)
+{
+    /* done with the message before the slot is handed back */
+    dmb();
+    ch->rx->tail++;
+}
+
+/**
+ * @brief Rings the doorbell of the peer.
+ *
+ * @return hvmm_status_t of the hypervisor, 0 on success.
+ */
+uint32_t channel_notify(struct channel *ch)
+{
+    register uint32_t r0 asm("r0") = ch->id;
+
+    dsb();
+    asm volatile("hvc #0xFFF0" : "+r" (r0) : : "memory");
+
+    return r0;
+}
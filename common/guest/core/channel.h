@@ -0,0 +1,24 @@
+#ifndef __CHANNEL_H__
+#define __CHANNEL_H__
+
+#include "hvmm_types.h"
+#include "arch_types.h"
+#include <shm_channel.h>
+
+struct channel {
+    uint8_t *base;
+    uint32_t id;
+    struct shm_channel_ring *tx;
+    struct shm_channel_ring *rx;
+    uint32_t tx_data;
+    uint32_t rx_data;
+};
+
+int channel_open(struct channel *ch, uint32_t id, uint32_t end);
+void *channel_send_buf(struct channel *ch);
+void channel_send(struct channel *ch, uint32_t len);
+void *channel_recv(struct channel *ch, uint32_t *len);
+void channel_recv_done(struct channel *ch);
+uint32_t channel_notify(struct channel *ch);
+
+#endif
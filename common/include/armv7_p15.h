@@ -17,8 +17,10 @@
 /* ARMv7 Registers */
 #define HSTR_T15	(0x1 << 15)
 #define HCPTR_TTA	(0x1 << 20)
+#define HCR_VM      0x1
 #define HCR_FMO     0x8
 #define HCR_IMO     0x10
+#define HCR_VF      (0x1 << 6)
 #define HCR_VI      (0x1 << 7)
 
 /* 32bit case only */
@@ -313,6 +315,121 @@
                                 " mcr     p15, 4, %0, c6, c0, 4\n\t" \
                                 : : "r" ((val)) : "memory", "cc")
 
+/* Performance monitors, HDCR splits the counters between hyp and guests */
+#define PMCR_E                  (1 << 0)
+#define PMCR_P                  (1 << 1)
+#define PMCR_C                  (1 << 2)
+#define PMCR_MODE_MASK          0x3F
+#define PMCNT_CCNT              (1 << 31)
+#define PMCR_N_SHIFT            11
+#define PMCR_N_MASK             0x1F
+#define HDCR_HPMN_MASK          0x1F
+#define HDCR_HPME               (1 << 7)
+
+#define read_hdcr()             ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 4, %0, c1, c1, 1\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_hdcr(val)         asm volatile(\
+                                " mcr     p15, 4, %0, c1, c1, 1\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmcr()             ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c12, 0\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmcr(val)         asm volatile(\
+                                " mcr     p15, 0, %0, c9, c12, 0\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmcntenset()       ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c12, 1\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmcntenset(val)   asm volatile(\
+                                " mcr     p15, 0, %0, c9, c12, 1\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmcntenclr()       ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c12, 2\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmcntenclr(val)   asm volatile(\
+                                " mcr     p15, 0, %0, c9, c12, 2\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmovsr()           ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c12, 3\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmovsr(val)       asm volatile(\
+                                " mcr     p15, 0, %0, c9, c12, 3\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmselr()           ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c12, 5\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmselr(val)       asm volatile(\
+                                " mcr     p15, 0, %0, c9, c12, 5\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmxevtyper()       ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c13, 1\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmxevtyper(val)   asm volatile(\
+                                " mcr     p15, 0, %0, c9, c13, 1\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmxevcntr()        ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c13, 2\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmxevcntr(val)    asm volatile(\
+                                " mcr     p15, 0, %0, c9, c13, 2\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmintenset()       ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c14, 1\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmintenset(val)   asm volatile(\
+                                " mcr     p15, 0, %0, c9, c14, 1\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmintenclr()       ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c14, 2\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmintenclr(val)   asm volatile(\
+                                " mcr     p15, 0, %0, c9, c14, 2\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmovsset()         ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c14, 3\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmovsset(val)     asm volatile(\
+                                " mcr     p15, 0, %0, c9, c14, 3\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmccntr()          ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c13, 0\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmccntr(val)      asm volatile(\
+                                " mcr     p15, 0, %0, c9, c13, 0\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
+#define read_pmuserenr()        ({ uint32_t rval; asm volatile(\
+                                " mrc     p15, 0, %0, c9, c14, 0\n\t" \
+                                : "=r" (rval) : : "memory", "cc"); rval; })
+
+#define write_pmuserenr(val)    asm volatile(\
+                                " mcr     p15, 0, %0, c9, c14, 0\n\t" \
+                                : : "r" ((val)) : "memory", "cc")
+
 #define read_mmu()            ({ uint32_t rval; asm volatile(\
                                 " mrc     p15, 0, %0, c1, c0, 0\n\t" \
                                 : "=r" (rval) : : "memory", "cc"); rval; })
@@ -320,12 +437,56 @@
 #define write_cache_clean(val)        asm volatile(\
                                 " mcr     p15, 0, %0, c7, c14, 0\n\t" \
                                 : : "r" ((val)) : "memory", "cc")
+
+/* Clean data cache line by MVA to the point of coherency (DCCMVAC) */
+#define clean_dcache_mva(va)    asm volatile(\
+                                " mcr     p15, 0, %0, c7, c10, 1\n\t" \
+                                : : "r" ((va)) : "memory", "cc")
+
+/* Stage 1 translation of the current PL1 state for a read (ATS1CPR) */
+#define write_ats1cpr(va)       asm volatile(\
+                                " mcr     p15, 0, %0, c7, c8, 0\n\t" \
+                                : : "r" ((va)) : "memory", "cc")
+
+/* PAR in the 64-bit format, which an ATS1C* from Hyp mode returns */
+#define PAR_F                   0x1
+#define PAR_PA_MASK             0x000000FFFFFFF000ULL
+
+#define read_par64()            ({ uint32_t v1, v2; asm volatile(\
+                                " mrrc     p15, 0, %0, %1, c7\n\t" \
+                                : "=r" (v1), "=r" (v2) : : "memory", "cc"); \
+                                (((uint64_t)v2 << 32) + (uint64_t)v1); })
+
+#define write_par64(val)    asm volatile(\
+                            " mcrr     p15, 0, %0, %1, c7\n\t" \
+                            : : "r" ((val) & 0xFFFFFFFF), "r" ((val) >> 32) \
+                            : "memory", "cc")
 /* TLB maintenance operations */
 
 /* Invalidate entire unified TLB */
 #define invalidate_unified_tlb(val)      asm volatile(\
                 " mcr     p15, 0, %0, c8, c7, 0\n\t" \
                 : : "r" ((val)) : "memory", "cc")
+
+/* Invalidate entire TLB of the current VMID, Inner Shareable (TLBIALLIS) */
+#define invalidate_tlb_vmid_is()      asm volatile(\
+                " mcr     p15, 0, %0, c8, c3, 0\n\t" \
+                : : "r" (0) : "memory", "cc")
+
+/* Invalidate entire Non-secure non-Hyp TLB, Inner Shareable (TLBIALLNSNHIS) */
+#define invalidate_tlb_nsnh_is()      asm volatile(\
+                " mcr     p15, 4, %0, c8, c3, 4\n\t" \
+                : : "r" (0) : "memory", "cc")
+
+/* Invalidate entire Hyp TLB, Inner Shareable (TLBIALLHIS) */
+#define invalidate_tlb_hyp_is()      asm volatile(\
+                " mcr     p15, 4, %0, c8, c3, 0\n\t" \
+                : : "r" (0) : "memory", "cc")
+
+/* Invalidate Hyp TLB entry by MVA, Inner Shareable (TLBIMVAHIS) */
+#define invalidate_tlb_mva_hyp_is(mva)      asm volatile(\
+                " mcr     p15, 4, %0, c8, c3, 1\n\t" \
+                : : "r" ((mva)) : "memory", "cc")
 #endif
 
 
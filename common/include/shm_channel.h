@@ -0,0 +1,66 @@
+#ifndef __SHM_CHANNEL_H__
+#define __SHM_CHANNEL_H__
+
+#include "arch_types.h"
+
+/**
+ * \defgroup Shm_channel
+ *
+ * Inter-VM channel, the layout the hypervisor and both guests agree on.
+ * Channel n is SHM_CHANNEL_SIZE bytes of cacheable memory shared at
+ * SHM_CHANNEL_IPA + n * SHM_CHANNEL_SIZE in both of its guests.
+ * - The header page is set up by the hypervisor and mapped read-only in
+ *   the guests, the rings and buffers follow on the next pages.
+ * - Ring n is filled by end n of the channel and drained by the other end,
+ *   single producer and single consumer, no lock.
+ * - Each ring slot owns a buffer. The producer writes a message in place
+ *   in the buffer of the slot it publishes, the consumer reads it there.
+ * - hvc #SHM_CHANNEL_HVC with the channel id in r0 rings the doorbell,
+ *   the peer takes SHM_CHANNEL_LOCAL_IRQ, core 0 pending bits of its
+ *   local interrupt controller. r0 returns the hvmm_status_t.
+ * @{
+ */
+#define SHM_CHANNEL_IPA             0x3E000000
+#define SHM_CHANNEL_SIZE            0x00040000
+#define SHM_CHANNEL_MAGIC           0x4B434831  /* "KCH1" */
+#define SHM_CHANNEL_HVC             0xFFF0
+#define SHM_CHANNEL_LOCAL_IRQ       (1 << 7)    /* mailbox 3 */
+#define SHM_CHANNEL_SLOTS           64          /* power of two */
+#define SHM_CHANNEL_LINE            64          /* cache line */
+
+#define SHM_CHANNEL_HEADER_SIZE     0x1000
+#define SHM_CHANNEL_RING_OFFSET(n)  (SHM_CHANNEL_HEADER_SIZE + (n) * 0x400)
+#define SHM_CHANNEL_DATA_OFFSET     0x2000
+#define SHM_CHANNEL_SLOT_SIZE       (((SHM_CHANNEL_SIZE - \
+        SHM_CHANNEL_DATA_OFFSET) / 2 / SHM_CHANNEL_SLOTS) & \
+        ~(SHM_CHANNEL_LINE - 1))
+#define SHM_CHANNEL_DATA(n, slot)   (SHM_CHANNEL_DATA_OFFSET + \
+        ((n) * SHM_CHANNEL_SLOTS + (slot)) * SHM_CHANNEL_SLOT_SIZE)
+/** @}*/
+
+struct shm_channel_header {
+    uint32_t magic;
+    uint32_t id;
+    uint32_t vmid[2];       /* guest at each end */
+    uint32_t slots;
+    uint32_t slot_size;
+};
+
+struct shm_channel_desc {
+    uint32_t len;
+    uint32_t flags;
+};
+
+/*
+ * head and tail are free running counters, each written by one side only
+ * and kept on its own cache line.
+ */
+struct shm_channel_ring {
+    volatile uint32_t head;     /* producer: slots published */
+    uint8_t pad0[SHM_CHANNEL_LINE - 4];
+    volatile uint32_t tail;     /* consumer: slots drained */
+    uint8_t pad1[SHM_CHANNEL_LINE - 4];
+    struct shm_channel_desc desc[SHM_CHANNEL_SLOTS];
+};
+
+#endif
@@ -7,6 +7,7 @@
 #include <log/print.h>
 #include <hvmm_trace.h>
 #include <smp.h>
+#include <memguard.h>
 
 #define NUM_GUEST_CONTEXTS        NUM_GUESTS_CPU0_STATIC
 
@@ -17,6 +18,8 @@ static struct guest_struct guests[4];
 static int _current_guest_vmid[4] = {VMID_INVALID, VMID_INVALID};
 static int _next_guest_vmid[4] = {VMID_INVALID, };
 struct guest_struct* _current_guest[4];
+static struct guest_struct _guest_snapshot[4];
+static uint32_t _guest_snapshot_valid[4];
 /* further switch request will be ignored if set */
 static uint8_t _switch_locked[4];
 
@@ -56,8 +59,10 @@ hvmm_status_t perform_switch(struct arch_regs *regs, vmid_t next_vmid)
     guest_save(&guests[_current_guest_vmid[cpu]], regs);
     memory_save();
     interrupt_save(_current_guest_vmid[cpu]);
-    if (!cpu)
-        vdev_save(_current_guest_vmid[cpu]);
+    vdev_save(_current_guest_vmid[cpu]);
+#ifdef _MEMGUARD_
+    memguard_save(_current_guest_vmid[cpu]);
+#endif
 
     /* The context of the next guest */
     guest = &guests[next_vmid];
@@ -68,12 +73,14 @@ hvmm_status_t perform_switch(struct arch_regs *regs, vmid_t next_vmid)
     if (_guest_module.ops->dump)
         _guest_module.ops->dump(GUEST_VERBOSE_LEVEL_3, &guest->regs);
 
-    if (!cpu)
-        vdev_restore(_current_guest_vmid[cpu]);
+    vdev_restore(_current_guest_vmid[cpu]);
 
 //    printH("guest pc: %x\n", regs->pc);
     interrupt_restore(_current_guest_vmid[cpu]);
     memory_restore(_current_guest_vmid[cpu]);
+#ifdef _MEMGUARD_
+    memguard_restore(_current_guest_vmid[cpu]);
+#endif
     guest_restore(guest, regs);
 
     return result;
@@ -281,6 +288,25 @@ vmid_t sched_policy_determ_next(void)
     if (next == VMID_INVALID)
         next = guest_first_vmid();
 
+#ifdef _MEMGUARD_
+    {
+        vmid_t first = next;
+        int i;
+
+        /* A throttled guest waits for the next period, unless all do */
+        for (i = 0; memguard_throttled(next); i++) {
+            next = guest_next_vmid(next);
+            if (next == VMID_INVALID)
+                next = guest_first_vmid();
+            if (next == first || i == NUM_GUESTS_STATIC) {
+                next = guest_current_vmid();
+                if (next == VMID_INVALID)
+                    next = first;
+                break;
+            }
+        }
+    }
+#endif
     return next;
 //    return 0;
 
@@ -342,6 +368,9 @@ hvmm_status_t guest_init()
             _guest_module.ops->init(guest, regs);
     }
 
+#ifdef _MEMGUARD_
+    memguard_init();
+#endif
     printH("[hyp] init_guests: return\n");
 
     /* 100Mhz -> 1 count == 10ns at RTSM_VE_CA15, fast model*/
@@ -371,6 +400,116 @@ void guest_copy(struct guest_struct *dst, vmid_t vmid_src)
     _guest_module.ops->move(dst, &(guests[vmid_src]));
 }
 
+static int guest_is_running(vmid_t vmid)
+{
+    int cpu;
+
+    for (cpu = 0; cpu < NUM_CPUS; cpu++) {
+        if (_current_guest_vmid[cpu] == vmid)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Takes a checkpoint of a guest that is not running.
+ *
+ * The registers, the saved vGIC state and the state of the virtual devices
+ * are copied now. Guest RAM is saved page by page as the guest writes it,
+ * see memory_snapshot(). A new checkpoint replaces the previous one.
+ *
+ * @param vmid Guest.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_BUSY if the guest is running.
+ */
+hvmm_status_t guest_checkpoint(vmid_t vmid)
+{
+    hvmm_status_t result;
+
+    if (vmid >= NUM_GUESTS_STATIC)
+        return HVMM_STATUS_NOT_FOUND;
+    if (guest_is_running(vmid))
+        return HVMM_STATUS_BUSY;
+
+    result = memory_snapshot(vmid, 1);
+    if (result)
+        return result;
+    interrupt_snapshot(vmid);
+    vdev_snapshot(vmid);
+    _guest_snapshot[vmid] = guests[vmid];
+    _guest_snapshot_valid[vmid] = 1;
+    printh("guest %d: checkpoint taken\n", vmid);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Resumes a guest that is not running from its last checkpoint.
+ *
+ * Only the guest pages written since the checkpoint are copied back, and
+ * the checkpoint stays for the next rollback.
+ *
+ * @param vmid Guest.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if there is no
+ *         checkpoint, HVMM_STATUS_BUSY if the guest is running.
+ */
+hvmm_status_t guest_rollback(vmid_t vmid)
+{
+    hvmm_status_t result;
+
+    if (vmid >= NUM_GUESTS_STATIC || !_guest_snapshot_valid[vmid])
+        return HVMM_STATUS_NOT_FOUND;
+    if (guest_is_running(vmid))
+        return HVMM_STATUS_BUSY;
+
+    result = memory_rollback(vmid);
+    if (result)
+        return result;
+    /* no TLB entry of the abandoned run may match the restored pages */
+    memory_renew_vmid(vmid);
+    interrupt_rollback(vmid);
+    vdev_rollback(vmid);
+    guests[vmid] = _guest_snapshot[vmid];
+    printh("guest %d: rolled back to checkpoint\n", vmid);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Makes a guest that is not running a clone of another one.
+ *
+ * The clone shares the RAM of the template copy-on-write, and takes a copy
+ * of its registers, vGIC state and virtual device state. A template that
+ * was booted once can so start any number of workers without booting them.
+ *
+ * @param dst Clone.
+ * @param src Template, not running either.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if no such guest,
+ *         HVMM_STATUS_BUSY if one of them is running or out of memory.
+ */
+hvmm_status_t guest_clone(vmid_t dst, vmid_t src)
+{
+    hvmm_status_t result;
+
+    if (dst >= NUM_GUESTS_STATIC || src >= NUM_GUESTS_STATIC || dst == src)
+        return HVMM_STATUS_NOT_FOUND;
+    if (guest_is_running(dst) || guest_is_running(src))
+        return HVMM_STATUS_BUSY;
+
+    result = memory_clone(dst, src);
+    if (result)
+        return result;
+    /* no TLB entry of the previous run of the clone may match its pages */
+    memory_renew_vmid(dst);
+    interrupt_clone(dst, src);
+    vdev_clone(dst, src);
+    guest_copy(&guests[dst], src);
+    _guest_snapshot_valid[dst] = 0;
+    printh("guest %d: cloned from guest %d\n", dst, src);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
 void reboot_guest(vmid_t vmid, uint32_t pc,
         struct arch_regs **regs)
 {
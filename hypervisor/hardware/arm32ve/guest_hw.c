@@ -193,6 +193,16 @@ static void context_save_cops(struct regs_cop *regs_cop)
     regs_cop->sctlr = read_sctlr();
 }
 
+static void context_copy_cops(struct regs_cop *cop_dst,
+        struct regs_cop *cop_src)
+{
+    cop_dst->vbar = cop_src->vbar;
+    cop_dst->ttbr0 = cop_src->ttbr0;
+    cop_dst->ttbr1 = cop_src->ttbr1;
+    cop_dst->ttbcr = cop_src->ttbcr;
+    cop_dst->sctlr = cop_src->sctlr;
+}
+
 static void context_restore_cops(struct regs_cop *regs_cop)
 {
     write_vbar(regs_cop->vbar);
@@ -413,6 +423,9 @@ hvmm_status_t guest_hw_move(struct guest_struct *dst, struct guest_struct *src)
     context_copy_regs(&(dst->regs), &(src->regs));
     context_copy_banked(&(dst->context.regs_banked),
             &(src->context.regs_banked));
+    context_copy_cops(&(dst->context.regs_cop), &(src->context.regs_cop));
+
+    return HVMM_STATUS_SUCCESS;
 }
 struct guest_ops _guest_ops = {
     .init = guest_hw_init,
@@ -5,6 +5,7 @@
 #include <log/uart_print.h>
 
 static struct vgic_status _vgic_status[NUM_GUESTS_STATIC];
+static struct vgic_status _vgic_snapshot[NUM_GUESTS_STATIC];
 
 static hvmm_status_t host_interrupt_init(void)
 {
@@ -85,6 +86,11 @@ static hvmm_status_t host_interrupt_end(uint32_t irq)
     return HVMM_STATUS_SUCCESS;
 }
 
+static hvmm_status_t host_interrupt_deactivate(uint32_t irq)
+{
+    return gic_deactivate_irq(irq);
+}
+
 static hvmm_status_t host_interrupt_dump(void)
 {
     /* TODO : dumpping the interrupt status & count */
@@ -129,6 +135,27 @@ static hvmm_status_t guest_interrupt_restore(vmid_t vmid)
     return vgic_restore_status(&_vgic_status[vmid], vmid);
 }
 
+static hvmm_status_t guest_interrupt_snapshot(vmid_t vmid)
+{
+    _vgic_snapshot[vmid] = _vgic_status[vmid];
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t guest_interrupt_rollback(vmid_t vmid)
+{
+    _vgic_status[vmid] = _vgic_snapshot[vmid];
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t guest_interrupt_clone(vmid_t dst, vmid_t src)
+{
+    _vgic_status[dst] = _vgic_status[src];
+
+    return HVMM_STATUS_SUCCESS;
+}
+
 static hvmm_status_t guest_interrupt_dump(void)
 {
     /* TODO : dumpping the injected bitmap */
@@ -141,6 +168,7 @@ struct interrupt_ops _host_interrupt_ops = {
     .disable = host_interrupt_disable,
     .configure = host_interrupt_configure,
     .end = host_interrupt_end,
+    .deactivate = host_interrupt_deactivate,
     .dump = host_interrupt_dump,
 };
 
@@ -150,6 +178,9 @@ struct interrupt_ops _guest_interrupt_ops = {
     .inject = guest_interrupt_inject,
     .save = guest_interrupt_save,
     .restore = guest_interrupt_restore,
+    .snapshot = guest_interrupt_snapshot,
+    .rollback = guest_interrupt_rollback,
+    .clone = guest_interrupt_clone,
     .dump = guest_interrupt_dump,
 };
 
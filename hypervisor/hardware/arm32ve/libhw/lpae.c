@@ -220,6 +220,36 @@ void lpaed_guest_stage2_map_page(union lpaed *pte, uint64_t pa,
     pte->p2m.sbz1 = 0;
 }
 
+static void lpaed_guest_stage2_map_block(union lpaed *pte, uint64_t pa,
+        uint64_t mask, enum memattr mattr)
+{
+    pte->bits = 0;
+    pte->p2m.valid = 1;
+    pte->p2m.table = 0;
+    pte->bits |= pa & mask;
+    /* Lower block attributes */
+    pte->p2m.mattr = mattr & 0x0F;
+    pte->p2m.read = 1;        /* Read/Write */
+    pte->p2m.write = 1;
+    pte->p2m.sh = 0;    /* Non-shareable */
+    pte->p2m.af = 1;
+    /* Upper block attributes */
+    pte->p2m.hint = 0;
+    pte->p2m.xn = 0;    /* eXecute Never = 0 */
+}
+
+void lpaed_guest_stage2_map_l1_block(union lpaed *pte, uint64_t pa,
+        enum memattr mattr)
+{
+    lpaed_guest_stage2_map_block(pte, pa, TTBL_L1_OUTADDR_MASK, mattr);
+}
+
+void lpaed_guest_stage2_map_l2_block(union lpaed *pte, uint64_t pa,
+        enum memattr mattr)
+{
+    lpaed_guest_stage2_map_block(pte, pa, TTBL_L2_OUTADDR_MASK, mattr);
+}
+
 void lpaed_guest_stage1_conf_l3_table(union lpaed *ttbl3,
         uint64_t baddr, uint8_t valid)
 {
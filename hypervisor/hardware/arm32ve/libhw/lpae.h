@@ -190,12 +190,16 @@
 /**
  * \defgroup LPAE_BLOCK_FEATURES
  *
- * This features are used to configure the bloack addres of 2MB size.
+ * This features are used to configure the bloack addres of 2MB size,
+ * and of 1GB size for level 1 blocks.
  * @{
  */
 #define LPAE_BLOCK_L2_SHIFT 21
 #define LPAE_BLOCK_L2_SIZE  (1<<LPAE_BLOCK_L2_SHIFT)
 #define LPAE_BLOCK_L2_MASK  (0x1FFFFF)
+#define LPAE_BLOCK_L1_SHIFT 30
+#define LPAE_BLOCK_L1_SIZE  (1<<LPAE_BLOCK_L1_SHIFT)
+#define LPAE_BLOCK_L1_MASK  (0x3FFFFFFF)
 /**
  * @}
  */
@@ -548,6 +552,30 @@ void lpaed_guest_stage1_disable_l3_table(union lpaed *ttbl2);
  */
 void lpaed_guest_stage2_map_page(union lpaed *pte, uint64_t pa,
         enum memattr mattr);
+/**
+ * @brief Maps the stage-2 level 1 descriptor to a 1GB block.
+ *
+ * Same attributes as lpaed_guest_stage2_map_page(), but table = 0.
+ *
+ * @param *pte Level 1 descriptor.
+ * @param pa Physical address, 1GB aligned.
+ * @param mattr Memory attribute.
+ * @return void
+ */
+void lpaed_guest_stage2_map_l1_block(union lpaed *pte, uint64_t pa,
+        enum memattr mattr);
+/**
+ * @brief Maps the stage-2 level 2 descriptor to a 2MB block.
+ *
+ * Same attributes as lpaed_guest_stage2_map_page(), but table = 0.
+ *
+ * @param *pte Level 2 descriptor.
+ * @param pa Physical address, 2MB aligned.
+ * @param mattr Memory attribute.
+ * @return void
+ */
+void lpaed_guest_stage2_map_l2_block(union lpaed *pte, uint64_t pa,
+        enum memattr mattr);
 /**
  * @brief Configure valid & table bit of the stage-2 level 1 table descriptor.
  * And set the base address.
@@ -9,6 +9,7 @@
 #define DEBUG 1
 #include <log/print.h>
 #include <interrupt.h>
+#include <memory.h>
 /**\defgroup ARM
  * <pre> ARM registers.
  * ARM registers include 13 general purpose registers r0-r12, 1 Stack Pointer,
@@ -97,6 +98,67 @@ static void _trap_dump_bregs(void)
 
 }
 
+/**@brief Finds the faulting IPA of an abort routed to Hyp mode.
+ * HPFAR holds it for translation and access flag faults, and for faults on
+ * a stage 1 table walk, but is UNKNOWN for other permission faults. Those
+ * translate the faulting virtual address by stage 1 again (ATS1CPR).
+ * @param ec Exception class, data or prefetch abort.
+ * @param iss Instruction specific syndrome of the abort.
+ * @param fipa Faulting intermediate physical address, from HPFAR.
+ * @return Returns 0 if the guest no longer maps the address, 1 otherwise.
+ */
+static int _trap_fault_ipa(uint32_t ec, uint32_t iss, uint32_t *fipa)
+{
+    uint32_t fsc = iss & ISS_FSR_MASK;
+    uint32_t far;
+    uint64_t par, saved;
+
+    if (fsc < PERM_FAULT_LEVEL1 || fsc > PERM_FAULT_LEVEL3 ||
+            (iss & ISS_S1PTW))
+        return 1;
+
+    if (ec == TRAP_EC_NON_ZERO_PREFETCH_ABORT_FROM_OTHER_MODE)
+        far = read_hifar();
+    else
+        far = read_hdfar();
+    saved = read_par64();
+    write_ats1cpr(far);
+    isb();
+    par = read_par64();
+    write_par64(saved);
+    if (par & PAR_F)
+        return 0;
+    *fipa = (uint32_t) (par & PAR_PA_MASK) | (far & HPFAR_FIPA_PAGE_MASK);
+
+    return 1;
+}
+
+/**@brief Resolves a stage-2 fault on guest memory.
+ * Guest memory may be left unmapped until it is first touched, or mapped
+ * read-only while shared between guests, in which case the faulting access
+ * is retried once the memory module fixed up the mapping. Writes to the
+ * read-only shadow registers of a vdev are not resolved, they go to the vdev.
+ * @param ec Exception class, data or prefetch abort.
+ * @param iss Instruction specific syndrome of the abort.
+ * @param fipa Faulting intermediate physical address.
+ * @return Returns 1 if the access can be retried, 0 if not guest memory.
+ */
+static int _trap_stage2_fault(uint32_t ec, uint32_t iss, uint32_t fipa)
+{
+    uint32_t fsc = iss & ISS_FSR_MASK;
+    uint32_t flags = 0;
+
+    if (fsc >= PERM_FAULT_LEVEL1 && fsc <= PERM_FAULT_LEVEL3)
+        flags |= MEMORY_FAULT_PERMISSION;
+    else if (fsc < TRANS_FAULT_LEVEL1 || fsc > TRANS_FAULT_LEVEL3)
+        return 0;
+    if (ec == TRAP_EC_NON_ZERO_DATA_ABORT_FROM_OTHER_MODE && (iss & ISS_WNR))
+        flags |= MEMORY_FAULT_WRITE;
+
+    return memory_fault(guest_current_vmid(), fipa, flags) ==
+            HVMM_STATUS_SUCCESS;
+}
+
 /*
  * hvc #imm handler
  *
@@ -137,7 +199,6 @@ static void _trap_dump_bregs(void)
  */
 enum hyp_hvc_result _hyp_hvc_service(struct arch_regs *regs)
 {
-    int32_t vdev_num = -1;
     uint32_t hsr = read_hsr();
     uint32_t ec = (hsr & HSR_EC_BIT) >> EXTRACT_EC;
     uint32_t iss = hsr & HSR_ISS_BIT;
@@ -151,6 +212,10 @@ enum hyp_hvc_result _hyp_hvc_service(struct arch_regs *regs)
     fipa = (read_hpfar() & HPFAR_FIPA_MASK) >> HPFAR_FIPA_SHIFT;
     fipa = fipa << HPFAR_FIPA_PAGE_SHIFT;
     fipa = fipa | (far & HPFAR_FIPA_PAGE_MASK);
+    if ((ec == TRAP_EC_NON_ZERO_DATA_ABORT_FROM_OTHER_MODE ||
+            ec == TRAP_EC_NON_ZERO_PREFETCH_ABORT_FROM_OTHER_MODE) &&
+            !_trap_fault_ipa(ec, iss, &fipa))
+        return HYP_RESULT_ERET; /* the guest remapped it, retry */
     info.ec = ec;
     info.iss = iss;
     info.fipa = fipa;
@@ -206,6 +271,8 @@ enum hyp_hvc_result _hyp_hvc_service(struct arch_regs *regs)
     	printH("TRAP_EC_NON_ZERO_SMC\n");
     	break;
     case TRAP_EC_NON_ZERO_PREFETCH_ABORT_FROM_OTHER_MODE:
+        if (_trap_stage2_fault(ec, iss, fipa))
+            return HYP_RESULT_ERET;
     	printH("TRAP_EC_NON_ZERO_PREFETCH_ABORT_FROM_OTHER_MODE\n");
     	break;
     case TRAP_EC_NON_ZERO_PREFETCH_ABORT_FROM_HYP_MODE:
@@ -216,11 +283,18 @@ enum hyp_hvc_result _hyp_hvc_service(struct arch_regs *regs)
         level = VDEV_LEVEL_HIGH;
         break;
     case TRAP_EC_NON_ZERO_HVC:
-    	printH("TRAP_EC_NON_ZERO_HVC\n");
-        level = VDEV_LEVEL_MIDDLE;
-        break;
+//    	printH("TRAP_EC_NON_ZERO_HVC\n");
+        /* the return address is already past the hvc, no post */
+        if (vdev_hvc(iss & ISS_HVC_IMM_MASK, &info, regs) < 0) {
+            printH("[hvc] no handler for hvc #%x\n", iss & ISS_HVC_IMM_MASK);
+            goto trap_error;
+        }
+        guest_perform_switch(regs);
+        return HYP_RESULT_ERET;
     case TRAP_EC_NON_ZERO_DATA_ABORT_FROM_OTHER_MODE:
 //    	printH("TRAP_EC_NON_ZERO_DATA_ABORT_FROM_OTHER_MODE\n");
+        if (_trap_stage2_fault(ec, iss, fipa))
+            return HYP_RESULT_ERET;
         level = VDEV_LEVEL_LOW;
         break;
     default:
@@ -230,26 +304,14 @@ enum hyp_hvc_result _hyp_hvc_service(struct arch_regs *regs)
         guest_dump_regs(regs, __func__);
         goto trap_error;
     }
-    level = VDEV_LEVEL_LOW;
 
-
-    vdev_num = vdev_find(level, &info, regs);
-    if (vdev_num < 0) {
-        printH("[hvc] cann't search vdev number\n\r");
+    if (vdev_mmio(level, &info, regs, iss & ISS_WNR) < 0) {
+        printH("[hvc] cann't serve vdev access\n\r");
         goto trap_error;
     }
 
-    if (iss & ISS_WNR) {
-        if (vdev_write(level, vdev_num, &info, regs) < 0)
-            goto trap_error;
-    } else {
-        if (vdev_read(level, vdev_num, &info, regs) < 0)
-            goto trap_error;
-
-        if(srt == 14)
-        	 asm volatile(" msr lr_svc, %0\n\t" :  : "r"(data) : "memory", "cc"); // in linux
-    }
-    vdev_post(level, vdev_num, &info, regs);
+    if (!(iss & ISS_WNR) && srt == 14)
+        asm volatile(" msr lr_svc, %0\n\t" :  : "r"(data) : "memory", "cc"); // in linux
 
 
 
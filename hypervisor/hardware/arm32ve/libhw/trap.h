@@ -69,6 +69,11 @@
 #define ACCESS_FAULT_LEVEL1                 0x09
 #define ACCESS_FAULT_LEVEL2                 0x0A
 #define ACCESS_FAULT_LEVEL3                 0x0B
+#define PERM_FAULT_LEVEL1                   0x0D
+#define PERM_FAULT_LEVEL2                   0x0E
+#define PERM_FAULT_LEVEL3                   0x0F
+
+#define ISS_S1PTW                           (1 << 7)
 
 #define ISS_WNR_SHIFT                       6
 #define ISS_WNR                             (1 << ISS_WNR_SHIFT)
@@ -86,6 +91,9 @@
 #define ISS_SRT_SHIFT                       16
 #define ISS_SRT_MASK                        (0xf << ISS_SRT_SHIFT)
 
+/* ISS of a trapped HVC instruction holds its immediate */
+#define ISS_HVC_IMM_MASK                    0x0000FFFF
+
 /* HPFAR */
 #define HPFAR_INITVAL                       0x00000000
 #define HPFAR_FIPA_MASK                     0xFFFFFFF0
@@ -4,6 +4,7 @@
 #include <gic.h>
 #include <gic_regs.h>
 #include <guest.h>
+#include <interrupt.h>
 #include <k-hypervisor-config.h>
 #include <asm-arm_inline.h>
 
@@ -481,6 +482,7 @@ static void _vgic_isr_maintenance_irq(int irq, void *pregs, void *pdata)
             pirq = vgic_slotpirq_get(vmid, slot);
             if (pirq != PIRQ_INVALID) {
                 gic_deactivate_irq(pirq);
+                interrupt_guest_eoi(vmid, pirq);
                 vgic_slotpirq_clear(vmid, slot);
                 printh("vgic: deactivated pirq %d at slot %d\n", pirq, slot);
             } else {
@@ -497,6 +499,7 @@ static void _vgic_isr_maintenance_irq(int irq, void *pregs, void *pdata)
             pirq = vgic_slotpirq_get(vmid, slot + 32);
             if (pirq != PIRQ_INVALID) {
                 gic_deactivate_irq(pirq);
+                interrupt_guest_eoi(vmid, pirq);
                 vgic_slotpirq_clear(vmid, slot + 32);
                 printh("vgic: deactivated pirq %d at slot %d\n", pirq, slot);
             } else {
@@ -4,8 +4,10 @@
 #include <hvmm_trace.h>
 #include <lpae.h>
 #include <memory.h>
+#include <page.h>
 #include <log/print.h>
 #include <log/uart_print.h>
+#include <log/string.h>
 #include <guest.h>
 #include <smp.h>
 
@@ -161,8 +163,12 @@
 /* PL2 Stage 1 Level 3 */
 #define HMM_L3_PTE_NUM  512
 
+/* Larger ranges flush the whole Hyp TLB instead of page by page */
+#define HMM_TLB_RANGE_MAX_PAGES  64
+
 #define HEAP_ADDR (CFG_MEMMAP_MON_OFFSET + 0x02000000)
-#define HEAP_SIZE 0x0D000000
+/* The page pool of the buddy allocator follows the heap */
+#define HEAP_SIZE (CFG_PAGE_POOL_BASE - HEAP_ADDR)
 
 #define L2_ENTRY_MASK 0x1FF
 #define L2_SHIFT 21
@@ -171,33 +177,13 @@
 #define L3_SHIFT 12
 
 #define HEAP_END_ADDR (HEAP_ADDR + HEAP_SIZE)
-#define NALLOC 1024
 
 /* Stage 2 Level 1 */
 #define VMM_L1_PTE_NUM          4
-#define VMM_L1_PADDING_PTE_NUM   (512 - VMM_L1_PTE_NUM)
 /* Stage 2 Level 2 */
 #define VMM_L2_PTE_NUM          512
 #define VMM_L3_PTE_NUM          512
-/**
- * @brief Gets total number of level 2 and level 3 page table entry.
- *
- * <pre>
- * VMM_L2_PTE_NUM * VMM_L3_PTE_NUM = /
- * Total Number Of Level 3 Page Table Entry
- * + VMM_L2_PTE_NUM = Total Number Of Level 2 Page Table Entry
- * </pre>
- *
- * @return Total number of l2, l3 table entry.
- */
-#define VMM_L2L3_PTE_NUM_TOTAL  (VMM_L2_PTE_NUM \
-        * VMM_L3_PTE_NUM + VMM_L2_PTE_NUM)
-/**
- * @brief Gets total number of all page table entries.
- */
-#define VMM_PTE_NUM_TOTAL  (VMM_L1_PTE_NUM                  \
-        + VMM_L1_PADDING_PTE_NUM + VMM_L2L3_PTE_NUM_TOTAL   \
-        * VMM_L1_PTE_NUM)
+
 /**
  * \defgroup VTTBR
  *
@@ -264,40 +250,45 @@
 /** @} */
 
 /*
- * Stage 2 Translation Table, look up begins at second level
- * VTTBR.BADDR[31:x]: x=14, VTCR.T0SZ = 0, 2^32 input address range,
- * VTCR.SL0 = 0(2nd), 16KB aligned base address
- * Statically allocated for now
+ * Stage 2 Translation Table, look up begins at first level
+ * VTTBR.BADDR[31:x]: x=5, VTCR.T0SZ = 0, 2^32 input address range,
+ * VTCR.SL0 = 1(1st)
+ * Every level of table takes one page from the page pool, allocated when
+ * a memory map descriptor first maps into its range.
  */
-
 static union lpaed *_vmid_ttbl[NUM_GUESTS_STATIC];
+static uint32_t _vmid_ttbl_pages[NUM_GUESTS_STATIC];
+
 /*
- * TODO: if you change the static variable, you will meet the system fault.
- * We don't konw about this issue, so we will checking this later time.
+ * Memory map descriptors of each guest, kept for the descriptors that are
+ * mapped on the first stage-2 translation fault instead of at boot.
  */
-union lpaed
-_ttbl_guest[NUM_GUESTS_STATIC][VMM_PTE_NUM_TOTAL] \
-                __attribute((__aligned__(4096)));
+static struct memmap_desc **_vmid_mdlist[NUM_GUESTS_STATIC];
+static uint32_t _vmid_lazy_descs[NUM_GUESTS_STATIC];
+static uint32_t _vmid_lazy_faults[NUM_GUESTS_STATIC];
+static uint32_t _vmid_alloc_pages[NUM_GUESTS_STATIC];
+static uint32_t _vmid_shared_pages[NUM_GUESTS_STATIC];
 
-/**
- * @brief Obtains TTBL_L3 entry.
- * Returns the address of TTBL l3 at 'index_l2' entry of L2.
- *
- * - union lpaed *TTBL_L3(union lpaed *ttbl_l2, uint32_t index_l2);
- *
+/*
+ * Cache colours of each guest, 0 if it is not coloured. The normal memory
+ * of a coloured guest is mapped page by page on first touch, with pages of
+ * its colours. A page of a fixed descriptor that is not of its colours is
+ * moved to a page of the pool that is, the fault fails if the pool has
+ * none. A guest with normal memory mapped at IPA == PA is not coloured:
+ * its devices DMA to the IPAs it hands them.
  */
-#define TTBL_L3(ttbl_l2, index_l2) \
-    (&ttbl_l2[VMM_L2_PTE_NUM + (VMM_L3_PTE_NUM * (index_l2))])
+static uint32_t _vmid_colours[NUM_GUESTS_STATIC];
+static uint32_t _vmid_colour_moves[NUM_GUESTS_STATIC];
+
+#define TTBL_TABADDR_MASK       0x000000FFFFFFF000ULL
 /**
- * @brief Obtains TTBL_L2 Entry.
- * Returns the address of TTBL l2 at 'index_l1' entry of L1.
+ * @brief Obtains the next level table of a valid table descriptor.
  *
- * - union lpaed *TTBL_L2(union lpaed *ttbl_l1, uint32_t index_l1);
+ * - union lpaed *TTBL_NEXT(union lpaed *desc);
  *
  */
-#define TTBL_L2(ttbl_l1, index_l1) \
-    (&ttbl_l1[(VMM_L1_PTE_NUM + VMM_L1_PADDING_PTE_NUM) \
-              + (VMM_L2L3_PTE_NUM_TOTAL * (index_l1))])
+#define TTBL_NEXT(desc) \
+    ((union lpaed *)((uint32_t)((desc)->bits & TTBL_TABADDR_MASK)))
 
 static union lpaed _hmm_pgtable[HMM_L1_PTE_NUM] \
                 __attribute((__aligned__(4096)));
@@ -307,52 +298,135 @@ static union lpaed _hmm_pgtable_l3[HMM_L2_PTE_NUM][HMM_L3_PTE_NUM] \
                 __attribute((__aligned__(4096)));
 
 
-/* used malloc, free, sbrk */
-union header {
-    struct {
-        union header *ptr; /* next block if on free list */
-        unsigned int size; /* size of this block */
-    } s;
-    /* force align of blocks */
-    long x;
+/**
+ * \defgroup Heap
+ *
+ * Hyp mode heap allocator.
+ * - Requests up to SLAB_MAX_SIZE are served from power-of-two size classes.
+ *   Each class carves one-page slabs into objects of its size and keeps the
+ *   slabs with free objects on a partial list.
+ * - Every CPU keeps a magazine of free objects per class, so most
+ *   allocations and frees complete without taking the class lock.
+ * - Larger requests take whole pages from the page allocator, which grows
+ *   the heap through host_memory_sbrk().
+ * - Every heap page starts with a struct heap_page. Free finds the owner of
+ *   any pointer by masking it down to its page.
+ * @{
+ */
+#define HEAP_PAGE_SIZE          0x1000
+#define HEAP_PAGE_MASK          (~(HEAP_PAGE_SIZE - 1))
+#define HEAP_PAGE_HDR_SIZE      64
+#define HEAP_PAGE_SLAB          0x534C4142  /* "SLAB" */
+#define HEAP_PAGE_LARGE         0x4C524745  /* "LRGE" */
+
+#define SLAB_MIN_SHIFT          4
+#define SLAB_MAX_SHIFT          10
+#define SLAB_MAX_SIZE           (1 << SLAB_MAX_SHIFT)
+#define SLAB_NUM_CLASSES        (SLAB_MAX_SHIFT - SLAB_MIN_SHIFT + 1)
+#define SLAB_MAGAZINE_SIZE      16
+/** @}*/
+
+struct heap_page {
+    uint32_t magic;             /* HEAP_PAGE_SLAB or HEAP_PAGE_LARGE */
+    uint32_t class;             /* size class index of a slab */
+    uint32_t npages;            /* pages of a large allocation */
+    uint32_t inuse;             /* objects handed out from a slab */
+    void *free;                 /* free objects of a slab */
+    struct heap_page *next;     /* partial slab list */
+    struct heap_page *prev;
+};
+
+struct slab_class {
+    spinlock_t lock;
+    uint32_t size;
+    uint32_t objs_per_slab;
+    struct heap_page *partial;  /* slabs with at least one free object */
+    uint32_t nr_slabs;
+    uint32_t nr_inuse;          /* objects out of slabs, magazines included */
+};
+
+struct slab_magazine {
+    uint32_t count;
+    void *objs[SLAB_MAGAZINE_SIZE];
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t hits;              /* served without the class lock */
+};
+
+/* free run of heap pages, address ordered */
+struct heap_span {
+    struct heap_span *next;
+    uint32_t npages;
 };
-/* free list block header */
 
 static uint32_t mm_break; /* break point for sbrk()  */
 static uint32_t mm_prev_break; /* old break point for sbrk() */
 static uint32_t last_valid_address; /* last mapping address */
-static union header freep_base; /* empty list to get started */
-static union header *freep; /* start of free list */
+
+static struct slab_class _slab_classes[SLAB_NUM_CLASSES];
+static struct slab_magazine _slab_magazines[NUM_CPUS][SLAB_NUM_CLASSES];
+static struct heap_span *_heap_free_spans;
+static uint32_t _heap_free_pages;
+static uint32_t _heap_large_pages;
+static spinlock_t _heap_page_lock;
 
 /**
  * @brief Initilization of heap memory region.
  *
  * Initializes the configuration variable of heap region for malloc operation.
  * - mm_break = mm_prev_break = last_valid_address = HEAD_ADDR
+ * - Empty size classes, no free pages.
  *
  * @return void
  */
 static void host_memory_heap_init(void)
 {
+    int i;
+
     mm_break = HEAP_ADDR;
     mm_prev_break = HEAP_ADDR;
     last_valid_address = HEAP_ADDR;
-    freep = 0;
+    _heap_free_spans = 0;
+    _heap_free_pages = 0;
+    _heap_large_pages = 0;
+    _heap_page_lock.lock = __ARCH_SPIN_LOCK_UNLOCKED;
+    for (i = 0; i < SLAB_NUM_CLASSES; i++) {
+        struct slab_class *sc = &_slab_classes[i];
+        sc->lock.lock = __ARCH_SPIN_LOCK_UNLOCKED;
+        sc->size = 1 << (i + SLAB_MIN_SHIFT);
+        sc->objs_per_slab = (HEAP_PAGE_SIZE - HEAP_PAGE_HDR_SIZE) / sc->size;
+        sc->partial = 0;
+        sc->nr_slabs = 0;
+        sc->nr_inuse = 0;
+    }
 }
 
 /**
- * @brief Flush the TLB
+ * @brief Flush the TLB entries of a range of the hypervisor address space.
  *
- * Invalidate entire unified TLB.
+ * Invalidates the range page by page (TLBIMVAHIS), or the whole Hyp TLB
+ * when the range is large. Guest TLB entries are not affected. One barrier
+ * sequence covers the range.
  *
+ * @param virt Virtual address.
+ * @param npages Number of pages.
  * @return void
  */
-static void host_memory_flushTLB(void)
+static void host_memory_flush_tlb_range(unsigned long virt,
+        unsigned long npages)
 {
-    /* Invalidate entire unified TLB */
-    invalidate_unified_tlb(0);
-    asm volatile("dsb");
-    asm volatile("isb");
+    unsigned long i;
+
+    virt &= ~LPAE_PAGE_MASK;
+    dsb();
+    if (npages > HMM_TLB_RANGE_MAX_PAGES)
+        invalidate_tlb_hyp_is();
+    else {
+        for (i = 0; i < npages; i++)
+            invalidate_tlb_mva_hyp_is(virt + (i << LPAE_PAGE_SHIFT));
+    }
+    dsb();
+    isb();
 }
 
 /**
@@ -402,7 +476,7 @@ static void host_memory_umap(unsigned long virt, unsigned long npages)
     union lpaed *map_table_p = host_memory_get_l3_table_entry(virt, npages);
     for (i = 0; i < npages; i++)
         lpaed_guest_stage1_disable_l3_table(&map_table_p[i]);
-    host_memory_flushTLB();
+    host_memory_flush_tlb_range(virt, npages);
 }
 #endif
 
@@ -425,7 +499,7 @@ static void host_memory_map(unsigned long phys, unsigned long virt,
     union lpaed *map_table_p = host_memory_get_l3_table_entry(virt, npages);
     for (i = 0; i < npages; i++)
         lpaed_guest_stage1_conf_l3_table(&map_table_p[i], (uint64_t)phys, 1);
-    host_memory_flushTLB();
+    host_memory_flush_tlb_range(virt, npages);
 }
 
 /**
@@ -452,6 +526,9 @@ static void *host_memory_sbrk(unsigned int incr)
             if (last_valid_address + 0x1000 > HEAP_END_ADDR) {
                 printh("%s[%d] required address is exceeded heap memory size\n",
                         __func__, __LINE__);
+                mm_break = mm_prev_break;
+                if (required_pages)
+                    host_memory_map(virt, virt, required_pages);
                 return (void *)-1;
             }
             last_valid_address += 0x1000;
@@ -463,105 +540,351 @@ static void *host_memory_sbrk(unsigned int incr)
 }
 
 /**
- * @brief Unmaps level3 table entry in virtual address.
+ * @brief Takes a run of pages from the heap.
  *
- * Obtains the level3 table entry by using host_memory_get_l3_table_entry
- * function. And disables the valid bit and table bit of the entry.
+ * First fit over the free runs returned by host_memory_heap_page_free(),
+ * otherwise the heap grows through host_memory_sbrk().
  *
- * @param virt Virtual address.
  * @param npages Number of pages.
- * @return void
+ * @return Page aligned address, 0 when the heap is exhausted.
  */
-static void host_memory_free(void *ap)
+static void *host_memory_heap_page_alloc(uint32_t npages)
 {
-    union header *bp, *p;
-    bp = (union header *)ap - 1; /* point to block header */
-    for (p = freep; !(bp > p && bp  < p->s.ptr); p = p->s.ptr) {
-        if (p >= p->s.ptr && (bp > p || bp < p->s.ptr))
-            break; /* freed block at start or end of arena */
+    struct heap_span **link;
+    struct heap_span *span;
+    void *page = 0;
+
+    spin_lock(&_heap_page_lock);
+    for (link = &_heap_free_spans; *link; link = &(*link)->next) {
+        span = *link;
+        if (span->npages < npages)
+            continue;
+        if (span->npages == npages)
+            *link = span->next;
+        else {
+            /* allocate tail end */
+            span->npages -= npages;
+            span = (struct heap_span *)((uint32_t) span
+                    + span->npages * HEAP_PAGE_SIZE);
+        }
+        _heap_free_pages -= npages;
+        page = span;
+        break;
     }
-    if (bp + bp->s.size == p->s.ptr) { /* join to upper nbr */
-        bp->s.size += p->s.ptr->s.size;
-        bp->s.ptr = p->s.ptr->s.ptr;
-    } else
-        bp->s.ptr = p->s.ptr;
-    if (p + p->s.size == bp) {      /* join to lower nbr */
-        p->s.size += bp->s.size;
-        p->s.ptr = bp->s.ptr;
-    } else
-        p->s.ptr = bp;
-    freep = p;
+    if (!page) {
+        page = host_memory_sbrk(npages * HEAP_PAGE_SIZE);
+        if (page == (void *) -1)
+            page = 0;
+    }
+    spin_unlock(&_heap_page_lock);
+
+    return page;
 }
 
 /**
- * @brief Obtains the storage from the heap memory.
+ * @brief Gives a run of pages back to the heap.
+ *
+ * Keeps the free runs address ordered and merges neighbours.
  *
- * If wanted size of block is not bigger then NALLOC value, this function
- * obtains minimally size of memory.(1024 Bytes)
- * Makes free memory area by calling free function after obtain the memory.
+ * @param page Page aligned address from host_memory_heap_page_alloc().
+ * @param npages Number of pages.
+ * @return void
+ */
+static void host_memory_heap_page_free(void *page, uint32_t npages)
+{
+    struct heap_span *bp = (struct heap_span *) page;
+    struct heap_span *prev = 0;
+    struct heap_span *p;
+
+    spin_lock(&_heap_page_lock);
+    for (p = _heap_free_spans; p && p < bp; p = p->next)
+        prev = p;
+
+    bp->npages = npages;
+    bp->next = p;
+    if (p && (uint32_t) bp + npages * HEAP_PAGE_SIZE == (uint32_t) p) {
+        /* join to upper nbr */
+        bp->npages += p->npages;
+        bp->next = p->next;
+    }
+    if (prev && (uint32_t) prev + prev->npages * HEAP_PAGE_SIZE ==
+            (uint32_t) bp) {
+        /* join to lower nbr */
+        prev->npages += bp->npages;
+        prev->next = bp->next;
+    } else if (prev)
+        prev->next = bp;
+    else
+        _heap_free_spans = bp;
+    _heap_free_pages += npages;
+    spin_unlock(&_heap_page_lock);
+}
+
+/**
+ * @brief Returns the size class index serving @size bytes.
+ */
+static inline uint32_t host_memory_slab_class(unsigned long size)
+{
+    uint32_t class = 0;
+
+    while ((1UL << (class + SLAB_MIN_SHIFT)) < size)
+        class++;
+
+    return class;
+}
+
+/**
+ * @brief Carves a new one-page slab for a size class.
  *
- * @param nu Number of units, allocate size.
- * @return Pointer of free list block header & memory area.
- *         The size of this memory is bigger than 1KB.
+ * Called with the class lock held.
  */
-static union header *morecore(unsigned int nu)
+static struct heap_page *host_memory_slab_grow(struct slab_class *sc,
+                uint32_t class)
 {
-    char *cp;
-    union header *up;
-    if (nu < NALLOC)
-        nu = NALLOC;
-    cp = host_memory_sbrk(nu * sizeof(union header));
-    if (cp == (char *) -1) /* no space at all */
+    struct heap_page *slab;
+    char *obj;
+    uint32_t i;
+
+    slab = host_memory_heap_page_alloc(1);
+    if (!slab)
         return 0;
-    up = (union header *)cp;
-    up->s.size = nu;
-    host_memory_free((void *)(up+1));
-    return freep;
+
+    slab->magic = HEAP_PAGE_SLAB;
+    slab->class = class;
+    slab->npages = 1;
+    slab->inuse = 0;
+    slab->free = 0;
+    obj = (char *) slab + HEAP_PAGE_HDR_SIZE;
+    for (i = 0; i < sc->objs_per_slab; i++, obj += sc->size) {
+        *(void **) obj = slab->free;
+        slab->free = obj;
+    }
+    slab->prev = 0;
+    slab->next = sc->partial;
+    if (sc->partial)
+        sc->partial->prev = slab;
+    sc->partial = slab;
+    sc->nr_slabs++;
+
+    return slab;
+}
+
+static inline void host_memory_slab_unlink(struct slab_class *sc,
+                struct heap_page *slab)
+{
+    if (slab->prev)
+        slab->prev->next = slab->next;
+    else
+        sc->partial = slab->next;
+    if (slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = 0;
+}
+
+/**
+ * @brief Takes one object out of the slabs of a class.
+ *
+ * Called with the class lock held.
+ */
+static void *host_memory_slab_get(struct slab_class *sc, uint32_t class)
+{
+    struct heap_page *slab = sc->partial;
+    void *obj;
+
+    if (!slab) {
+        slab = host_memory_slab_grow(sc, class);
+        if (!slab)
+            return 0;
+    }
+    obj = slab->free;
+    slab->free = *(void **) obj;
+    slab->inuse++;
+    sc->nr_inuse++;
+    if (!slab->free)
+        host_memory_slab_unlink(sc, slab);
+
+    return obj;
+}
+
+/**
+ * @brief Returns one object to its slab, releasing the slab once empty.
+ *
+ * Called with the class lock held.
+ */
+static void host_memory_slab_put(struct slab_class *sc, void *obj)
+{
+    struct heap_page *slab;
+
+    slab = (struct heap_page *)((uint32_t) obj & HEAP_PAGE_MASK);
+    if (!slab->free) {
+        /* was full, back on the partial list */
+        slab->prev = 0;
+        slab->next = sc->partial;
+        if (sc->partial)
+            sc->partial->prev = slab;
+        sc->partial = slab;
+    }
+    *(void **) obj = slab->free;
+    slab->free = obj;
+    slab->inuse--;
+    sc->nr_inuse--;
+    if (!slab->inuse && slab->next) {
+        /* keep the last partial slab of the class around */
+        host_memory_slab_unlink(sc, slab);
+        slab->magic = 0;
+        sc->nr_slabs--;
+        host_memory_heap_page_free(slab, 1);
+    }
 }
 
 /**
  * @brief Hyp mode general-purpose storage allocator.
  *
- * Obtains the storage from hyp mode heap memory.
- * - First, search free block list.
- * - Second, if free block list has no list or not enough size of list,
- *   Obtains storage from heap memory.
- * - Third, there are list has enough size, return list's pointer.
+ * - Up to SLAB_MAX_SIZE, pops an object from this CPU's magazine of the
+ *   size class, refilling half of the magazine from the slabs when empty.
+ * - Larger requests take whole pages, headed by a struct heap_page.
  *
  * @param size Size of space
  * @return Allocated space
  */
 static void *host_memory_malloc(unsigned long size)
 {
-    union header *p, *prevp;
-    unsigned int nunits;
-    nunits = (size + sizeof(union header) - 1)/sizeof(union header) + 1;
-    if (nunits < 2)
+    uint32_t cpu = smp_processor_id();
+    struct slab_magazine *mag;
+    struct slab_class *sc;
+    struct heap_page *page;
+    uint32_t class;
+    uint32_t npages;
+    void *obj;
+
+    if (!size)
         return 0;
-    prevp = freep;
-    if ((prevp) == 0) { /* no free list yet */
-        freep_base.s.ptr = freep = prevp = &freep_base;
-        freep_base.s.size = 0;
-    }
-    for (p = prevp->s.ptr; ; prevp = p, p = p->s.ptr) {
-        if (p->s.size >= nunits) { /* big enough */
-            if (p->s.size == nunits) /* exactly */
-                prevp->s.ptr = p->s.ptr;
-            else {                    /* allocate tail end */
-                p->s.size -= nunits;
-                p += p->s.size;
-                p->s.size = nunits;
-            }
-            freep = prevp;
-            return (void *)(p+1);
-        }
-        if (p == freep) {  /* wrapped around free list */
-            p = morecore(nunits);
-            if (p == 0)
-                return 0;  /* none avaliable memory left */
+
+    if (size > SLAB_MAX_SIZE) {
+        npages = (size + HEAP_PAGE_HDR_SIZE + HEAP_PAGE_SIZE - 1)
+                / HEAP_PAGE_SIZE;
+        page = host_memory_heap_page_alloc(npages);
+        if (!page)
+            return 0;
+        page->magic = HEAP_PAGE_LARGE;
+        page->npages = npages;
+        spin_lock(&_heap_page_lock);
+        _heap_large_pages += npages;
+        spin_unlock(&_heap_page_lock);
+        return (char *) page + HEAP_PAGE_HDR_SIZE;
+    }
+
+    class = host_memory_slab_class(size);
+    mag = &_slab_magazines[cpu][class];
+    mag->allocs++;
+    if (mag->count) {
+        mag->hits++;
+        return mag->objs[--mag->count];
+    }
+
+    sc = &_slab_classes[class];
+    spin_lock(&sc->lock);
+    obj = host_memory_slab_get(sc, class);
+    while (obj && mag->count < SLAB_MAGAZINE_SIZE / 2) {
+        void *extra = host_memory_slab_get(sc, class);
+        if (!extra)
+            break;
+        mag->objs[mag->count++] = extra;
+    }
+    spin_unlock(&sc->lock);
+
+    return obj;
+}
+
+/**
+ * @brief Frees storage from host_memory_malloc().
+ *
+ * Small objects go to this CPU's magazine, half of which is flushed back
+ * to the slabs when full. Large allocations return their pages.
+ *
+ * @param ap Pointer returned by host_memory_malloc().
+ * @return void
+ */
+static void host_memory_free(void *ap)
+{
+    uint32_t cpu = smp_processor_id();
+    struct heap_page *page;
+    struct slab_magazine *mag;
+    struct slab_class *sc;
+    uint32_t npages;
+
+    if (!ap)
+        return;
+
+    page = (struct heap_page *)((uint32_t) ap & HEAP_PAGE_MASK);
+    if (page->magic == HEAP_PAGE_LARGE) {
+        npages = page->npages;
+        page->magic = 0;
+        spin_lock(&_heap_page_lock);
+        _heap_large_pages -= npages;
+        spin_unlock(&_heap_page_lock);
+        host_memory_heap_page_free(page, npages);
+        return;
+    }
+    if (page->magic != HEAP_PAGE_SLAB) {
+        printh("%s: invalid pointer %x\n", __func__, (uint32_t) ap);
+        return;
+    }
+
+    mag = &_slab_magazines[cpu][page->class];
+    mag->frees++;
+    if (mag->count < SLAB_MAGAZINE_SIZE) {
+        mag->objs[mag->count++] = ap;
+        return;
+    }
+
+    sc = &_slab_classes[page->class];
+    spin_lock(&sc->lock);
+    host_memory_slab_put(sc, ap);
+    while (mag->count > SLAB_MAGAZINE_SIZE / 2)
+        host_memory_slab_put(sc, mag->objs[--mag->count]);
+    spin_unlock(&sc->lock);
+}
+
+/**
+ * @brief Prints allocation counters and fragmentation of the heap.
+ *
+ * - Per class: allocations, frees, magazine hit rate, slabs and their
+ *   utilisation (objects held in magazines count as used).
+ * - Pages: heap size, large allocations, free pages and the largest free
+ *   run, the gap between the two being external fragmentation.
+ */
+static void host_memory_heap_dump(void)
+{
+    struct heap_span *span;
+    uint32_t allocs, frees, hits, capacity;
+    uint32_t largest = 0;
+    int i, cpu;
+
+    for (i = 0; i < SLAB_NUM_CLASSES; i++) {
+        struct slab_class *sc = &_slab_classes[i];
+        allocs = frees = hits = 0;
+        for (cpu = 0; cpu < NUM_CPUS; cpu++) {
+            allocs += _slab_magazines[cpu][i].allocs;
+            frees += _slab_magazines[cpu][i].frees;
+            hits += _slab_magazines[cpu][i].hits;
         }
+        capacity = sc->nr_slabs * sc->objs_per_slab;
+        printH("slab %d: alloc:%d free:%d hit:%d%% slabs:%d used:%d/%d\n",
+                sc->size, allocs, frees, allocs ? hits * 100 / allocs : 0,
+                sc->nr_slabs, sc->nr_inuse, capacity);
     }
+
+    spin_lock(&_heap_page_lock);
+    for (span = _heap_free_spans; span; span = span->next)
+        if (span->npages > largest)
+            largest = span->npages;
+    printH("heap pages: total:%d large:%d free:%d largest free run:%d\n",
+            (mm_break - HEAP_ADDR) / HEAP_PAGE_SIZE, _heap_large_pages,
+            _heap_free_pages, largest);
+    spin_unlock(&_heap_page_lock);
 }
+
 /**
  * @brief Maps physical address of the guest to level 3 descriptors.
  *
@@ -598,72 +921,111 @@ static void guest_memory_ttbl3_map(union lpaed *ttbl3, uint64_t offset,
 }
 
 /**
- * @brief Unmap level 3 descriptors.
+ * @brief Allocates one zeroed translation table for a guest.
  *
- * Unmap descriptors of ttbl3 which is in between offset and offset + pages and
- * makes valid bit zero.
+ * @param vmid Owner of the table, for accounting.
+ * @return The table, 0 if the page pool is exhausted.
+ */
+static union lpaed *guest_memory_alloc_ttbl(vmid_t vmid)
+{
+    union lpaed *ttbl = page_zalloc(PAGE_ORDER_4K);
+
+    if (!ttbl)
+        printh("%s: no page for a translation table of vmid %d\n",
+                __func__, vmid);
+    else
+        _vmid_ttbl_pages[vmid]++;
+
+    return ttbl;
+}
+
+/**
+ * @brief Allocates a page of guest memory of the colours of the guest.
  *
- * @param *ttbl3 Level 3 translation table descriptor.
- * @param offset Offset from the level 3 table descriptor.
- *        - 0 ~ (2MB - pages * 4KB), start contiguous virtual address within
- *          level 2 block (2MB).
- *        - It is aligned L3 descriptor lock size(4KB).
- * @param pages Number of pages.
- *        - 0 ~ 512
- * @return void
+ * @return The page, not zeroed, 0 if there is none.
  */
-static void guest_memory_ttbl3_unmap(union lpaed *ttbl3, uint64_t offset,
-                uint32_t pages)
+static void *guest_memory_alloc_page(vmid_t vmid)
 {
-    int index_l3 = 0;
-    int index_l3_last = 0;
-    /* Initialize the address spaces with 'invalid' state */
-    index_l3 = offset >> LPAE_PAGE_SHIFT;
-    index_l3_last = index_l3 + pages;
-    for (; index_l3 < index_l3_last; index_l3++)
-        ttbl3[index_l3].pt.valid = 0;
+    return page_alloc_colour(_vmid_colours[vmid]);
 }
 
 /**
- * @brief Unmap ttbl2 and ttbl3 descriptors which is in target virtual
- *        address area.
+ * @brief Obtains the level 2 table of a ttbl1 descriptor, allocating it
+ *        on first use.
  *
- * Unmap descriptors of ttbl2 and ttbl3 by making valid bit to zero.
+ * A descriptor holding a 1GB block is split into 2MB blocks first, which
+ * keep its write permission.
+ *
+ * @param vmid Owner of the table.
+ * @param *ttbl1 Level 1 translation table descriptor.
+ * @return Level 2 table of the descriptor, 0 if it can not be allocated.
+ */
+static union lpaed *guest_memory_ttbl1_table(vmid_t vmid, union lpaed *ttbl1)
+{
+    union lpaed *ttbl2;
+    uint64_t pa;
+    int i;
+
+    if (ttbl1->p2m.valid && ttbl1->p2m.table)
+        return TTBL_NEXT(ttbl1);
+
+    ttbl2 = guest_memory_alloc_ttbl(vmid);
+    if (!ttbl2)
+        return 0;
+    if (ttbl1->p2m.valid) {
+        pa = ttbl1->bits & ~LPAE_BLOCK_L1_MASK & TTBL_TABADDR_MASK;
+        for (i = 0; i < VMM_L2_PTE_NUM; i++, pa += LPAE_BLOCK_L2_SIZE) {
+            lpaed_guest_stage2_map_l2_block(&ttbl2[i], pa,
+                    ttbl1->p2m.mattr);
+            ttbl2[i].p2m.write = ttbl1->p2m.write;
+            ttbl2[i].p2m.avail = ttbl1->p2m.avail;
+        }
+    }
+    lpaed_guest_stage2_conf_l1_table(ttbl1, (uint64_t)((uint32_t) ttbl2), 1);
+
+    return ttbl2;
+}
+
+/**
+ * @brief Obtains the level 3 table of a ttbl2 descriptor, allocating it
+ *        on first use.
  *
- * - First, make level 2 descriptors invalidate.
- * - Second, if lefts space which can't be covered by level 2 descriptor
- *   (to small), make level 3 descriptors invalidate.
+ * A descriptor holding a 2MB block is split into a new level 3 table of
+ * pages first, so the rest of the block stays mapped with its write
+ * permission.
  *
+ * @param vmid Owner of the table.
  * @param *ttbl2 Level 2 translation table descriptor.
- * @param va_offset Offset of the virtual address.
- *        - 0 ~ (1GB - size), start contiguous virtual address within level 1
- *          block (1GB).
- *        - It is aligned L2 descriptor lock size(2MB).
- * @param size
- *        - <= 1GB.
- *        - It is aligned page size.
- * @return void
+ * @param index_l2 Index of the descriptor.
+ * @return Level 3 table of the descriptor, 0 if it can not be allocated.
  */
-static void guest_memory_ttbl2_unmap(union lpaed *ttbl2, uint64_t va_offset,
-                uint32_t size)
+static union lpaed *guest_memory_ttbl2_table(vmid_t vmid,
+                union lpaed *ttbl2, uint32_t index_l2)
 {
-    int index_l2 = 0;
-    int index_l2_last = 0;
-    int num_blocks = 0;
-    /* Initialize the address spaces with 'invalid' state */
-    num_blocks = size >> LPAE_BLOCK_L2_SHIFT;
-    index_l2 = va_offset >> LPAE_BLOCK_L2_SHIFT;
-    index_l2_last = index_l2 + num_blocks;
+    union lpaed *ttbl3;
 
-    for (; index_l2 < index_l2_last; index_l2++)
-        ttbl2[index_l2].pt.valid = 0;
+    if (ttbl2[index_l2].p2m.valid && ttbl2[index_l2].p2m.table)
+        return TTBL_NEXT(&ttbl2[index_l2]);
 
-    size &= LPAE_BLOCK_L2_MASK;
-    if (size) {
-        /* last partial block */
-        union lpaed *ttbl3 = TTBL_L3(ttbl2, index_l2);
-        guest_memory_ttbl3_unmap(ttbl3, 0x00000000, size >> LPAE_PAGE_SHIFT);
+    ttbl3 = guest_memory_alloc_ttbl(vmid);
+    if (!ttbl3)
+        return 0;
+    if (ttbl2[index_l2].p2m.valid) {
+        uint64_t pa = ttbl2[index_l2].bits & ~LPAE_BLOCK_L2_MASK
+                & TTBL_TABADDR_MASK;
+        enum memattr mattr = ttbl2[index_l2].p2m.mattr;
+        int i;
+
+        guest_memory_ttbl3_map(ttbl3, 0, VMM_L3_PTE_NUM, pa, mattr);
+        for (i = 0; i < VMM_L3_PTE_NUM; i++) {
+            ttbl3[i].p2m.write = ttbl2[index_l2].p2m.write;
+            ttbl3[i].p2m.avail = ttbl2[index_l2].p2m.avail;
+        }
     }
+    lpaed_guest_stage2_conf_l2_table(&ttbl2[index_l2],
+            (uint64_t)((uint32_t) ttbl3), 1);
+
+    return ttbl3;
 }
 
 /**
@@ -675,14 +1037,17 @@ static void guest_memory_ttbl2_unmap(union lpaed *ttbl2, uint64_t va_offset,
  * - First, compute index of the target ttbl2 descriptor and block offset.
  * - Second, maps physical address to ttbl3 descriptors if head of block is
  *   not fits size of the ttbl2 descriptor.
- * - Third, maps left physical address to ttbl2 descriptors.
+ * - Third, maps left physical address to 2MB block descriptors of ttbl2,
+ *   or to full ttbl3 tables when the physical address is not 2MB aligned.
  * - Finally, if lefts the memory, maps it to ttbl3 descriptors.
+ * - ttbl3 tables are allocated as they are needed.
  *
+ * @param vmid Owner of the translation table.
  * @param *ttbl2 Level 2 translation table descriptor.
  * @param va_offset
  *        - 0 ~ (1GB - size), start contiguous virtual address within level 1
  *          block (1GB).
- *        - It is aligned l2 descriptor lock size(2MB).
+ *        - It is aligned page size.
  * @param pa Physical address
  * @param size Size of target memory.
  *        - <= 1GB.
@@ -690,8 +1055,9 @@ static void guest_memory_ttbl2_unmap(union lpaed *ttbl2, uint64_t va_offset,
  * @param Memory Attribute
  * @return void
  */
-static void guest_memory_ttbl2_map(union lpaed *ttbl2, uint64_t va_offset,
-                uint64_t pa, uint32_t size, enum memattr mattr)
+static void guest_memory_ttbl2_map(vmid_t vmid, union lpaed *ttbl2,
+                uint64_t va_offset, uint64_t pa, uint32_t size,
+                enum memattr mattr)
 {
     uint64_t block_offset;
     uint32_t index_l2;
@@ -713,92 +1079,119 @@ static void guest_memory_ttbl2_map(union lpaed *ttbl2, uint64_t va_offset,
         uint64_t offset;
         offset = block_offset >> LPAE_PAGE_SHIFT;
         pages = size >> LPAE_PAGE_SHIFT;
-        if (pages > VMM_L3_PTE_NUM)
-            pages = VMM_L3_PTE_NUM;
+        if (pages > VMM_L3_PTE_NUM - offset)
+            pages = VMM_L3_PTE_NUM - offset;
 
-        ttbl3 = TTBL_L3(ttbl2, index_l2);
+        ttbl3 = guest_memory_ttbl2_table(vmid, ttbl2, index_l2);
+        if (!ttbl3)
+            return;
         guest_memory_ttbl3_map(ttbl3, offset, pages, pa, mattr);
-        lpaed_guest_stage2_enable_l2_table(&ttbl2[index_l2]);
-        va_offset |= ~LPAE_BLOCK_L2_MASK;
         size -= pages * LPAE_PAGE_SIZE;
         pa += pages * LPAE_PAGE_SIZE;
         index_l2++;
     }
     /* body : n BLOCKS */
-    if (size > 0) {
-        num_blocks = size >> LPAE_BLOCK_L2_SHIFT;
-        index_l2_last = index_l2 + num_blocks;
-        printh("- index_l2_last:%d num_blocks:%d size:%d\n", index_l2_last, (uint32_t) num_blocks, size);
-        for (i = index_l2; i < index_l2_last; i++) {
-            lpaed_guest_stage2_enable_l2_table(&ttbl2[i]);
-            guest_memory_ttbl3_map(TTBL_L3(ttbl2, i), 0,
-                    VMM_L3_PTE_NUM, pa, mattr);
-            pa += LPAE_BLOCK_L2_SIZE;
-            size -= LPAE_BLOCK_L2_SIZE;
-        }
+    num_blocks = size >> LPAE_BLOCK_L2_SHIFT;
+    index_l2_last = index_l2 + num_blocks;
+    printh("- index_l2_last:%d num_blocks:%d size:%d\n", index_l2_last,
+            num_blocks, size);
+    for (i = index_l2; i < index_l2_last; i++) {
+        if (pa & LPAE_BLOCK_L2_MASK) {
+            ttbl3 = guest_memory_ttbl2_table(vmid, ttbl2, i);
+            if (!ttbl3)
+                return;
+            guest_memory_ttbl3_map(ttbl3, 0, VMM_L3_PTE_NUM, pa, mattr);
+        } else
+            lpaed_guest_stage2_map_l2_block(&ttbl2[i], pa, mattr);
+        pa += LPAE_BLOCK_L2_SIZE;
+        size -= LPAE_BLOCK_L2_SIZE;
     }
     /* tail < BLOCK */
-    if (size > 0) {
-        pages = size >> LPAE_PAGE_SHIFT;
+    pages = size >> LPAE_PAGE_SHIFT;
+    if (pages) {
         printh("- pages:%d size:%d\n", pages, size);
-        if (pages) {
-            ttbl3 = TTBL_L3(ttbl2, index_l2_last);
-            guest_memory_ttbl3_map(ttbl3, 0, pages, pa, mattr);
-            lpaed_guest_stage2_enable_l2_table(&ttbl2[index_l2_last]);
-        }
+        ttbl3 = guest_memory_ttbl2_table(vmid, ttbl2, index_l2_last);
+        if (!ttbl3)
+            return;
+        guest_memory_ttbl3_map(ttbl3, 0, pages, pa, mattr);
     }
     HVMM_TRACE_EXIT();
 }
 
 /**
- * @brief Initialize ttbl2 entries.
+ * @brief Checks whether a memory map descriptor is mapped on first touch.
  *
- * Configures ttbl2 descriptor by mapping address of ttbl3 descriptor.
- * And configure all valid bit of ttbl3 descriptors to zero.
+ * MEMMAP_PA_ALLOC descriptors always are, and so is the normal memory of
+ * a coloured guest. With _LAZY_STAGE2_ all normal memory is too, while
+ * device memory is still mapped at boot.
+ */
+static inline int guest_memory_is_lazy(vmid_t vmid, struct memmap_desc *md)
+{
+    if (md->pa == MEMMAP_PA_ALLOC)
+        return 1;
+    if (_vmid_colours[vmid] && (md->attr & 0xC))
+        return 1;
+#ifdef _LAZY_STAGE2_
+    /* MemAttr[3:2] is not zero for normal memory */
+    return (md->attr & 0xC) != 0;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * @brief Maps a memory map list that covers its whole 1GB region with a
+ *        single 1GB block.
  *
- * @param *ttbl2 Level 2 translation table descriptor.
- * @return void
+ * @param vmid Owner of the translation table.
+ * @param *ttbl1 Level 1 translation table descriptor.
+ * @param *md Memory map descriptor list of the region.
+ * @return 1 if the region was mapped by a level 1 block, 0 otherwise.
  */
-static void guest_memory_ttbl2_init_entries(union lpaed *ttbl2)
+static int guest_memory_ttbl1_map_block(vmid_t vmid, union lpaed *ttbl1,
+                struct memmap_desc *md)
 {
-    int i, j;
-    HVMM_TRACE_ENTER();
-    union lpaed *ttbl3;
-    for (i = 0; i < VMM_L2_PTE_NUM; i++) {
-        ttbl3 = TTBL_L3(ttbl2, i);
-        printh("ttbl2[%d]:%x ttbl3[]:%x\n", i, &ttbl2[i], ttbl3);
-        lpaed_guest_stage2_conf_l2_table(&ttbl2[i],
-                (uint64_t)((uint32_t) ttbl3), 0);
-        for (j = 0; j < VMM_L2_PTE_NUM; j++)
-            ttbl3[j].pt.valid = 0;
-    }
-    HVMM_TRACE_EXIT();
+    if (md[0].va != 0 || md[0].size != LPAE_BLOCK_L1_SIZE ||
+            (md[0].pa & LPAE_BLOCK_L1_MASK) || md[1].label != 0 ||
+            guest_memory_is_lazy(vmid, &md[0]))
+        return 0;
+
+    printh("ttbl1:%x 1GB block pa:%x\n", (uint32_t) ttbl1,
+            (uint32_t) md[0].pa);
+    lpaed_guest_stage2_map_l1_block(ttbl1, md[0].pa, md[0].attr);
+
+    return 1;
 }
 
 /**
  * @brief Initialize delivered ttbl2 descriptors.
  *
- * Initialize ttbl2 descriptors and unmap the descriptors.
- * Finally, map the ttbl2 descriptors by memory map descriptors.
+ * Maps the ttbl2 descriptors by memory map descriptors. The ttbl2 is
+ * allocated zeroed, all descriptors invalid, by the first descriptor that
+ * is not left to be mapped on first touch.
  *
- * @param *ttbl2 Level 2 translation table descriptor.
+ * @param vmid Owner of the translation table.
+ * @param *ttbl1 Level 1 translation table descriptor of the region.
  * @param *md Device memory map descriptor.
  * @return void
  */
-static void guest_memory_init_ttbl2(union lpaed *ttbl2, struct memmap_desc *md)
+static void guest_memory_init_ttbl2(vmid_t vmid, union lpaed *ttbl1,
+                struct memmap_desc *md)
 {
+    union lpaed *ttbl2;
     int i = 0;
     HVMM_TRACE_ENTER();
-    printh(" - ttbl2:%x\n", (uint32_t) ttbl2);
-    if (((uint64_t)((uint32_t) ttbl2)) & 0x0FFFULL)
-        printh(" - error: invalid ttbl2 address alignment\n");
 
-    /* construct l2-l3 table hirerachy with invalid pages */
-    guest_memory_ttbl2_init_entries(ttbl2);
-    guest_memory_ttbl2_unmap(ttbl2, 0x00000000, 0x40000000);
     while (md[i].label != 0) {
-        guest_memory_ttbl2_map(ttbl2, md[i].va, md[i].pa,
-                md[i].size, md[i].attr);
+        if (guest_memory_is_lazy(vmid, &md[i]))
+            _vmid_lazy_descs[vmid]++;
+        else {
+            ttbl2 = guest_memory_ttbl1_table(vmid, ttbl1);
+            if (!ttbl2)
+                break;
+            guest_memory_ttbl2_map(vmid, ttbl2, md[i].va, md[i].pa,
+                    md[i].size, md[i].attr);
+        }
         i++;
     }
     HVMM_TRACE_EXIT();
@@ -808,12 +1201,15 @@ static void guest_memory_init_ttbl2(union lpaed *ttbl2, struct memmap_desc *md)
  * @brief Configure stage-2 translation table descriptors of guest.
  *
  * Configures the translation table based on the memory descriptor list.
+ * A ttbl2 is allocated only for the 1GB regions that have descriptors
+ * mapped at boot and can not be mapped by a single level 1 block.
  *
+ * @param vmid Owner of the translation table.
  * @param *ttbl Target translation table descriptor.
  * @param *mdlist[] Memory map descriptor list.
  * @return void
  */
-static void guest_memory_init_ttbl(union lpaed *ttbl,
+static void guest_memory_init_ttbl(vmid_t vmid, union lpaed *ttbl,
             struct memmap_desc *mdlist[])
 {
     int i = 0;
@@ -822,11 +1218,8 @@ static void guest_memory_init_ttbl(union lpaed *ttbl,
         struct memmap_desc *md = mdlist[i];
         if (md[0].label == 0)
             lpaed_guest_stage2_conf_l1_table(&ttbl[i], 0, 0);
-        else {
-            lpaed_guest_stage2_conf_l1_table(&ttbl[i],
-                    (uint64_t)((uint32_t) TTBL_L2(ttbl, i)), 1);
-            guest_memory_init_ttbl2(TTBL_L2(ttbl, i), md);
-        }
+        else if (!guest_memory_ttbl1_map_block(vmid, &ttbl[i], md))
+            guest_memory_init_ttbl2(vmid, &ttbl[i], md);
         i++;
     }
     HVMM_TRACE_EXIT();
@@ -924,13 +1317,124 @@ static void guest_memory_stage2_enable(int enable)
     write_hcr(hcr);
 }
 
+/**
+ * \defgroup VMID_generation
+ *
+ * Hardware VMIDs tag the TLB entries of each guest, so a switch only loads
+ * VTTBR and stage 2 stays enabled.
+ * - A guest holds a VMID of the current generation, taken on its first
+ *   switch in the generation.
+ * - When the 8-bit VMID space runs out, a new generation starts with one
+ *   flush of all guest TLB entries, and the guests take new VMIDs on
+ *   their next switch. VMIDs live on a cpu are carried over.
+ * @{
+ */
+#define VMID_HW_BITS        8
+#define VMID_HW_MASK        ((1 << VMID_HW_BITS) - 1)
+#define VMID_GENERATION(v)  ((v) >> VMID_HW_BITS)
+/** @}*/
+
+/* generation << VMID_HW_BITS | hardware VMID, 0 if none yet */
+static uint32_t _vmid_hw[NUM_GUESTS_STATIC];
+/* _vmid_hw of the guest loaded in VTTBR of each cpu */
+static uint32_t _vmid_hw_active[NUM_CPUS];
+static uint32_t _vmid_generation = 1;
+static uint32_t _vmid_hw_next = 1;
+static uint32_t _vmid_rollovers;
+static DEFINE_SPINLOCK(_vmid_lock);
+
+#ifdef _FIQ_FASTPATH_
+/*
+ * Hardware VMID of the FIQ fast path guest, 0 while it holds none of the
+ * current generation. Live hardware VMIDs are unique, so the FIQ vector
+ * matches it against VTTBR.VMID of any cpu.
+ */
+uint32_t _fiq_fastpath_vmid_hw;
+
+/* Called with _vmid_lock held, whenever _vmid_hw changes */
+static void guest_memory_fiq_vmid_update(void)
+{
+    uint32_t hw = _vmid_hw[CFG_FIQ_FASTPATH_VMID];
+
+    if (VMID_GENERATION(hw) == _vmid_generation)
+        _fiq_fastpath_vmid_hw = hw & VMID_HW_MASK;
+    else
+        _fiq_fastpath_vmid_hw = 0;
+    dsb();
+}
+#else
+static inline void guest_memory_fiq_vmid_update(void)
+{
+}
+#endif
+
+/**
+ * @brief Starts a new VMID generation.
+ *
+ * Guests running on a cpu keep their hardware VMID in the new generation,
+ * the others lose theirs. All guest TLB entries of every cpu are flushed
+ * once. Called with _vmid_lock held.
+ */
+static void guest_memory_vmid_rollover(void)
+{
+    uint32_t cpu;
+    vmid_t vmid;
+
+    _vmid_generation++;
+    _vmid_hw_next = 1;
+    _vmid_rollovers++;
+    for (vmid = 0; vmid < NUM_GUESTS_STATIC; vmid++) {
+        for (cpu = 0; cpu < NUM_CPUS; cpu++) {
+            if (_vmid_hw_active[cpu] && _vmid_hw_active[cpu] == _vmid_hw[vmid])
+                break;
+        }
+        if (cpu == NUM_CPUS)
+            continue;
+        _vmid_hw[vmid] = (_vmid_generation << VMID_HW_BITS) |
+                (_vmid_hw[vmid] & VMID_HW_MASK);
+        _vmid_hw_active[cpu] = _vmid_hw[vmid];
+    }
+    guest_memory_fiq_vmid_update();
+    dsb();
+    invalidate_tlb_nsnh_is();
+    dsb();
+    isb();
+}
+
+/**
+ * @brief Takes a hardware VMID of the current generation.
+ *
+ * VMIDs carried over a rollover by running guests are skipped. Called with
+ * _vmid_lock held.
+ *
+ * @return generation << VMID_HW_BITS | hardware VMID.
+ */
+static uint32_t guest_memory_vmid_alloc(void)
+{
+    uint32_t hw;
+    uint32_t cpu;
+
+    do {
+        if (_vmid_hw_next > VMID_HW_MASK)
+            guest_memory_vmid_rollover();
+        hw = _vmid_hw_next++;
+        for (cpu = 0; cpu < NUM_CPUS; cpu++) {
+            if (_vmid_hw_active[cpu] &&
+                    (_vmid_hw_active[cpu] & VMID_HW_MASK) == hw)
+                break;
+        }
+    } while (cpu != NUM_CPUS);
+
+    return (_vmid_generation << VMID_HW_BITS) | hw;
+}
+
 /**
  * @brief Changes the stage-2 translation table base address by configuring
  *        VTTBR.
  *
  * Configures Virtualization Translation Table Base Register(VTTBR) to change
- * the guest. Change vmid and base address from received vmid and ttbl
- * address.
+ * the guest. VTTBR.VMID is the hardware VMID the guest holds, VTTBR.BADDR
+ * the received ttbl address.
  *
  * @param vmid Received vmid.
  * @param ttbl Level 1 translation table of the guest.
@@ -940,26 +1444,14 @@ static hvmm_status_t guest_memory_set_vmid_ttbl(vmid_t vmid, union lpaed *ttbl)
 {
     uint64_t vttbr;
     /*
-     * VTTBR.VMID = vmid
+     * VTTBR.VMID = hardware vmid
      * VTTBR.BADDR = ttbl
      */
-    vttbr = read_vttbr();
-#if 0 /* ignore message due to flood log message */
-    uart_print("current vttbr:");
-    uart_print_hex64(vttbr);
-    uart_print("\n\r");
-#endif
-    vttbr &= ~(VTTBR_VMID_MASK);
-    vttbr |= ((uint64_t)vmid << VTTBR_VMID_SHIFT) & VTTBR_VMID_MASK;
-    vttbr &= ~(VTTBR_BADDR_MASK);
+    vttbr = ((uint64_t)(_vmid_hw[vmid] & VMID_HW_MASK) << VTTBR_VMID_SHIFT) &
+            VTTBR_VMID_MASK;
     vttbr |= (uint32_t) ttbl & VTTBR_BADDR_MASK;
     write_vttbr(vttbr);
-    vttbr = read_vttbr();
-#if 0 /* ignore message due to flood log message */
-    uart_print("changed vttbr:");
-    uart_print_hex64(vttbr);
-    uart_print("\n\r");
-#endif
+
     return HVMM_STATUS_SUCCESS;
 }
 
@@ -1165,6 +1657,7 @@ static int memory_enable(void)
  * Partition 1: 0x40000000 ~ 0x7FFFFFFF - Unused     - ATTR_IDX_UNCACHED
  * Partition 2: 0x80000000 ~ 0xBFFFFFFF - Guest      - ATTR_IDX_UNCACHED
  * Partition 3: 0xC0000000 ~ 0xFFFFFFFF - Hypervisor
+ *                                      - Heap and page pool
  *                                      - Level2 and level3 translation table
  * </pre>
  *
@@ -1228,6 +1721,11 @@ static void host_memory_init(void)
             if (pa >= HEAP_ADDR && pa < HEAP_ADDR + HEAP_SIZE) {
                 _hmm_pgtable_l3[i][j] =
                         lpaed_host_l3_table(pa, ATTR_IDX_WRITEALLOC, 0);
+            } else if (pa >= CFG_PAGE_POOL_BASE &&
+                    pa < CFG_PAGE_POOL_BASE + CFG_PAGE_POOL_SIZE) {
+                /* Page pool, always mapped */
+                _hmm_pgtable_l3[i][j] =
+                        lpaed_host_l3_table(pa, ATTR_IDX_WRITEALLOC, 1);
             } else {
                 _hmm_pgtable_l3[i][j] =
                         lpaed_host_l3_table(pa, ATTR_IDX_UNCACHED, 1);
@@ -1244,6 +1742,32 @@ static void host_memory_init(void)
         _hmm_pgtable[i].pt.valid = 0;
 }
 
+/**
+ * @brief Leaves a guest uncoloured if normal memory of it is mapped at
+ *        IPA == PA, moving its pages would break the DMA of its devices.
+ */
+static void guest_memory_colour_check(vmid_t vmid)
+{
+    struct memmap_desc **mdlist = _vmid_mdlist[vmid];
+    struct memmap_desc *md;
+    uint32_t i;
+
+    if (!_vmid_colours[vmid])
+        return;
+
+    for (i = 0; mdlist[i]; i++) {
+        for (md = mdlist[i]; md->label; md++) {
+            if (md->pa == MEMMAP_PA_ALLOC || !(md->attr & 0xC) ||
+                    md->pa != ((uint64_t) i << LPAE_BLOCK_L1_SHIFT) + md->va)
+                continue;
+            printh("vmid %d: RAM at IPA == PA %x, not coloured\n", vmid,
+                    (uint32_t) md->pa);
+            _vmid_colours[vmid] = 0;
+            return;
+        }
+    }
+}
+
 /**
  * @brief Initializes the virtual mode(guest mode) memory management
  * stage-2 translation.
@@ -1268,15 +1792,23 @@ static void guest_memory_init(struct memmap_desc **guest0_map,
 
     HVMM_TRACE_ENTER();
 
-    if (!cpu) {
-        for (i = 0; i < NUM_GUESTS_STATIC; i++)
-            _vmid_ttbl[i] = &_ttbl_guest[i][0];
-        guest_memory_init_ttbl(&_ttbl_guest[0][0], guest0_map);
-        guest_memory_init_ttbl(&_ttbl_guest[1][0], guest1_map);
-    } else {
-        guest_memory_init_ttbl(&_ttbl_guest[2][0], guest0_map);
-        guest_memory_init_ttbl(&_ttbl_guest[3][0], guest1_map);
-    }
+    /* cpu0 runs guest 0 and 1, the secondary cpu guest 2 and 3 */
+    i = cpu ? 2 : 0;
+#ifdef _CACHE_COLOUR_
+    _vmid_colours[i] = cpu ? CFG_GUEST2_COLOURS : CFG_GUEST0_COLOURS;
+    _vmid_colours[i + 1] = cpu ? CFG_GUEST3_COLOURS : CFG_GUEST1_COLOURS;
+#endif
+    _vmid_mdlist[i] = guest0_map;
+    guest_memory_colour_check(i);
+    _vmid_ttbl[i] = guest_memory_alloc_ttbl(i);
+    if (_vmid_ttbl[i])
+        guest_memory_init_ttbl(i, _vmid_ttbl[i], guest0_map);
+    i++;
+    _vmid_mdlist[i] = guest1_map;
+    guest_memory_colour_check(i);
+    _vmid_ttbl[i] = guest_memory_alloc_ttbl(i);
+    if (_vmid_ttbl[i])
+        guest_memory_init_ttbl(i, _vmid_ttbl[i], guest1_map);
 
     HVMM_TRACE_EXIT();
 }
@@ -1305,9 +1837,11 @@ static void guest_memory_init(struct memmap_desc **guest0_map,
  *   - Writes the _hmm_pgtable value to base address bits.
  *   - \ref HTTBR
  * - Enable MMU and D-cache in HSCTLR.
- * - Initialize heap area.
+ * - Initialize heap area and the page pool.
+ * - Generate translation tables of the guests from the page pool.
  *
- * @return HVMM_STATUS_SUCCESS, Always success.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_UNKNOWN_ERROR if the page pool
+ *         can not be initialized.
  */
 static int memory_hw_init(struct memmap_desc **guest0,
             struct memmap_desc **guest1)
@@ -1321,8 +1855,6 @@ static int memory_hw_init(struct memmap_desc **guest0,
 //    uart_print("\n\r");
     printH("mmu : %x\n", mmu);
 
-    guest_memory_init(guest0, guest1);
-
     guest_memory_init_mmu();
 
     if (!cpu)
@@ -1330,15 +1862,1747 @@ static int memory_hw_init(struct memmap_desc **guest0,
 
     memory_enable();
 
-    uart_print("[memory] memory_init: exit\n\r");
     if (!cpu) {
         uart_print("[memory] host_memory_heap_init\n\r");
         host_memory_heap_init();
+        if (page_init())
+            return HVMM_STATUS_UNKNOWN_ERROR;
     }
     uart_print("[memory] host_memory_heap_init exit\n\r");
+
+    /* Guest translation tables come from the page pool */
+    guest_memory_init(guest0, guest1);
+
+    uart_print("[memory] memory_init: exit\n\r");
     return HVMM_STATUS_SUCCESS;
 }
 
+/**
+ * @brief Returns the descriptor mapping a guest address, at any level.
+ *
+ * @param vmid Guest.
+ * @param ipa Intermediate physical address.
+ * @return The valid page or block descriptor, 0 if not mapped.
+ */
+static union lpaed *guest_memory_leaf(vmid_t vmid, uint32_t ipa)
+{
+    union lpaed *desc = &_vmid_ttbl[vmid][ipa >> LPAE_BLOCK_L1_SHIFT];
+
+    if (!desc->p2m.valid)
+        return 0;
+    if (!desc->p2m.table)
+        return desc;
+    desc = &TTBL_NEXT(desc)[(ipa & LPAE_BLOCK_L1_MASK) >> LPAE_BLOCK_L2_SHIFT];
+    if (!desc->p2m.valid)
+        return 0;
+    if (!desc->p2m.table)
+        return desc;
+    desc = &TTBL_NEXT(desc)[(ipa >> LPAE_PAGE_SHIFT) & (VMM_L3_PTE_NUM - 1)];
+
+    return desc->p2m.valid ? desc : 0;
+}
+
+/**
+ * @brief Returns the level 3 descriptor mapping a guest page.
+ *
+ * 1GB and 2MB blocks around the page are split into pages first. A block
+ * taken from the page pool is split there too, so its pages can be freed
+ * one by one.
+ *
+ * @param vmid Guest.
+ * @param ipa Intermediate physical address of the page.
+ * @return The descriptor, 0 if the page is not mapped by the guest.
+ */
+static union lpaed *guest_memory_pte(vmid_t vmid, uint32_t ipa)
+{
+    union lpaed *ttbl1 = &_vmid_ttbl[vmid][ipa >> LPAE_BLOCK_L1_SHIFT];
+    union lpaed *ttbl2;
+    union lpaed *ttbl3;
+    uint32_t index_l2 = (ipa & LPAE_BLOCK_L1_MASK) >> LPAE_BLOCK_L2_SHIFT;
+    uint32_t block;
+
+    if (!ttbl1->p2m.valid)
+        return 0;
+    ttbl2 = guest_memory_ttbl1_table(vmid, ttbl1);
+    if (!ttbl2 || !ttbl2[index_l2].p2m.valid)
+        return 0;
+    if (ttbl2[index_l2].p2m.table)
+        ttbl3 = TTBL_NEXT(&ttbl2[index_l2]);
+    else {
+        block = ttbl2[index_l2].bits & ~LPAE_BLOCK_L2_MASK & TTBL_TABADDR_MASK;
+        ttbl3 = guest_memory_ttbl2_table(vmid, ttbl2, index_l2);
+        if (!ttbl3)
+            return 0;
+        if (page_in_pool(block))
+            page_split((void *) block, PAGE_ORDER_2M);
+    }
+
+    return &ttbl3[(ipa >> LPAE_PAGE_SHIFT) & (VMM_L3_PTE_NUM - 1)];
+}
+
+/*
+ * Serialises changes of the guest stage-2 tables after boot: faults on
+ * any cpu and the background scanner.
+ */
+static DEFINE_SPINLOCK(_stage2_lock);
+
+/* Guests whose stage-2 TLB entries are stale, under _stage2_lock */
+static uint32_t _stage2_tlb_pending;
+
+/**
+ * @brief Marks the stage-2 TLB entries of a guest stale.
+ *
+ * Several descriptors of several guests can be changed before a single
+ * guest_memory_tlb_sync().
+ */
+static inline void guest_memory_tlb_defer(vmid_t vmid)
+{
+    _stage2_tlb_pending |= 1 << vmid;
+}
+
+/**
+ * @brief Invalidates the TLB entries of the guests marked stale.
+ *
+ * ARMv7 has no invalidate by IPA, so each guest is invalidated by VMID
+ * (TLBIALLIS with its VMID loaded in VTTBR). Entries of other guests and
+ * of the hypervisor survive. One barrier sequence covers the batch.
+ */
+static void guest_memory_tlb_sync(void)
+{
+    uint64_t vttbr;
+    vmid_t vmid;
+
+    if (!_stage2_tlb_pending)
+        return;
+
+    spin_lock(&_vmid_lock);
+    dsb();
+    vttbr = read_vttbr();
+    for (vmid = 0; vmid < NUM_GUESTS_STATIC; vmid++) {
+        if (!(_stage2_tlb_pending & (1 << vmid)))
+            continue;
+        /* a guest without a VMID of this generation has no TLB entries */
+        if (VMID_GENERATION(_vmid_hw[vmid]) != _vmid_generation)
+            continue;
+        guest_memory_set_vmid_ttbl(vmid, _vmid_ttbl[vmid]);
+        isb();
+        invalidate_tlb_vmid_is();
+    }
+    write_vttbr(vttbr);
+    dsb();
+    isb();
+    _stage2_tlb_pending = 0;
+    spin_unlock(&_vmid_lock);
+}
+
+/**
+ * \defgroup Dirty_log
+ *
+ * Dirty page logging of guest RAM, for incremental snapshots.
+ * - Writable normal memory is write protected and marked with
+ *   P2M_SW_DIRTY_WP in the software bits of its descriptor.
+ * - The first write to a page takes a stage-2 permission fault, which
+ *   sets the bit of the page in the dirty bitmap of the guest and makes
+ *   the page writable again. Blocks are split down to the page.
+ * - memory_hw_dirty_collect() hands the bitmap out and protects the
+ *   guest again for the next round.
+ * @{
+ */
+#define P2M_SW_DIRTY_WP     0x1
+#define P2M_SW_COW          0x2     /**< read-only mapping of a cloned frame */
+#define P2M_SW_SHARED       0x4     /**< memory_hw_share(), not guest RAM */
+#define P2M_SW_BALLOON      0x8     /**< invalid, page held by the balloon */
+/** @}*/
+
+static uint32_t *_dirty_bitmap[NUM_GUESTS_STATIC];
+static uint32_t _dirty_npages[NUM_GUESTS_STATIC];
+static uint32_t _dirty_faults[NUM_GUESTS_STATIC];
+static uint32_t _dirty_rounds[NUM_GUESTS_STATIC];
+
+static void guest_memory_dirty_mark(vmid_t vmid, uint32_t ipa, uint32_t size)
+{
+    uint32_t page = ipa >> LPAE_PAGE_SHIFT;
+    uint32_t end = page + (size >> LPAE_PAGE_SHIFT);
+
+    if (end > _dirty_npages[vmid])
+        end = _dirty_npages[vmid];
+    for (; page < end; page++)
+        _dirty_bitmap[vmid][page >> 5] |= 1 << (page & 31);
+}
+
+static void guest_memory_dirty_protect_desc(union lpaed *desc, int protect)
+{
+    if (protect) {
+        /* normal memory only, devices and channels are not snapshotted */
+        if (desc->p2m.write && (desc->p2m.mattr & 0xC) &&
+                !(desc->p2m.avail & P2M_SW_SHARED)) {
+            desc->p2m.write = 0;
+            desc->p2m.avail |= P2M_SW_DIRTY_WP;
+        }
+    } else if (desc->p2m.avail & P2M_SW_DIRTY_WP) {
+        desc->p2m.write = 1;
+        desc->p2m.avail &= ~P2M_SW_DIRTY_WP;
+    }
+}
+
+/**
+ * @brief Write protects all RAM of a guest for dirty logging, or lifts
+ *        the protection.
+ *
+ * The TLB of the guest is marked stale.
+ */
+static void guest_memory_dirty_protect(vmid_t vmid, int protect)
+{
+    union lpaed *ttbl1 = _vmid_ttbl[vmid];
+    union lpaed *ttbl2;
+    union lpaed *ttbl3;
+    int i, j, k;
+
+    for (i = 0; i < VMM_L1_PTE_NUM; i++) {
+        if (!ttbl1[i].p2m.valid)
+            continue;
+        if (!ttbl1[i].p2m.table) {
+            guest_memory_dirty_protect_desc(&ttbl1[i], protect);
+            continue;
+        }
+        ttbl2 = TTBL_NEXT(&ttbl1[i]);
+        for (j = 0; j < VMM_L2_PTE_NUM; j++) {
+            if (!ttbl2[j].p2m.valid)
+                continue;
+            if (!ttbl2[j].p2m.table) {
+                guest_memory_dirty_protect_desc(&ttbl2[j], protect);
+                continue;
+            }
+            ttbl3 = TTBL_NEXT(&ttbl2[j]);
+            for (k = 0; k < VMM_L3_PTE_NUM; k++) {
+                if (ttbl3[k].p2m.valid)
+                    guest_memory_dirty_protect_desc(&ttbl3[k], protect);
+            }
+        }
+    }
+    guest_memory_tlb_defer(vmid);
+}
+
+/**
+ * \defgroup Snapshot
+ *
+ * In-memory snapshot of guest RAM, copy before write.
+ * - memory_hw_snapshot() write protects the guest like dirty logging.
+ * - Before a page of the guest changes for the first time, its content is
+ *   copied to a frame of the page pool. Ranges mapped after the snapshot
+ *   are only recorded.
+ * - memory_hw_rollback() unmaps the ranges mapped since, copies the saved
+ *   pages back and protects the guest again. The snapshot stays valid for
+ *   further rollbacks.
+ * @{
+ */
+#define SNAP_HASH_SIZE      256
+#define SNAP_HASH_MASK      (SNAP_HASH_SIZE - 1)
+/** @}*/
+
+struct snap_page {
+    uint32_t ipa;
+    uint32_t frame;             /* saved content, 0 for a range mapped since */
+    uint32_t size;
+    struct snap_page *next;
+};
+
+static struct snap_page *_snap_hash[NUM_GUESTS_STATIC][SNAP_HASH_SIZE];
+static struct snap_page *_snap_mapped[NUM_GUESTS_STATIC];
+static uint32_t _snap_active[NUM_GUESTS_STATIC];
+static uint32_t _snap_pages[NUM_GUESTS_STATIC];
+static uint32_t _snap_rollbacks[NUM_GUESTS_STATIC];
+
+static inline uint32_t snap_hash(uint32_t ipa)
+{
+    return (ipa >> LPAE_PAGE_SHIFT) & SNAP_HASH_MASK;
+}
+
+/**
+ * @brief Saves a guest page before it changes for the first time since
+ *        the snapshot.
+ *
+ * @param pa Frame mapped at ipa.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_BUSY if out of memory.
+ */
+static hvmm_status_t guest_memory_snap_save(vmid_t vmid, uint32_t ipa,
+        uint32_t pa)
+{
+    struct snap_page *snap;
+    void *frame;
+
+    if (!_snap_active[vmid])
+        return HVMM_STATUS_SUCCESS;
+
+    ipa &= ~LPAE_PAGE_MASK;
+    for (snap = _snap_hash[vmid][snap_hash(ipa)]; snap; snap = snap->next) {
+        if (snap->ipa == ipa)
+            return HVMM_STATUS_SUCCESS;
+    }
+
+    snap = host_memory_malloc(sizeof(struct snap_page));
+    frame = page_alloc(PAGE_ORDER_4K);
+    if (!snap || !frame) {
+        printh("%s: vmid %d out of memory at %x\n", __func__, vmid, ipa);
+        if (snap)
+            host_memory_free(snap);
+        if (frame)
+            page_free(frame, PAGE_ORDER_4K);
+        return HVMM_STATUS_BUSY;
+    }
+    memcpy(frame, (void *) pa, LPAE_PAGE_SIZE);
+    snap->ipa = ipa;
+    snap->frame = (uint32_t) frame;
+    snap->size = LPAE_PAGE_SIZE;
+    snap->next = _snap_hash[vmid][snap_hash(ipa)];
+    _snap_hash[vmid][snap_hash(ipa)] = snap;
+    _snap_pages[vmid]++;
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Records a range that was not mapped at the snapshot.
+ */
+static void guest_memory_snap_mapped(vmid_t vmid, uint32_t ipa, uint32_t size)
+{
+    struct snap_page *snap;
+
+    if (!_snap_active[vmid])
+        return;
+
+    snap = host_memory_malloc(sizeof(struct snap_page));
+    if (!snap) {
+        printh("%s: vmid %d range %x not recorded\n", __func__, vmid, ipa);
+        return;
+    }
+    snap->ipa = ipa;
+    snap->frame = 0;
+    snap->size = size;
+    snap->next = _snap_mapped[vmid];
+    _snap_mapped[vmid] = snap;
+}
+
+/**
+ * @brief Resolves a write to a page protected for dirty logging or a
+ *        snapshot.
+ *
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if the page is not
+ *         protected, HVMM_STATUS_BUSY if a block can not be split or the
+ *         page not saved.
+ */
+static hvmm_status_t guest_memory_dirty_fault(vmid_t vmid, uint32_t ipa)
+{
+    union lpaed *desc = guest_memory_leaf(vmid, ipa);
+
+    if (!desc || !(desc->p2m.avail & P2M_SW_DIRTY_WP))
+        return HVMM_STATUS_NOT_FOUND;
+
+    /* both may have stopped since, then the whole block is unprotected */
+    if (_dirty_bitmap[vmid] || _snap_active[vmid]) {
+        desc = guest_memory_pte(vmid, ipa);
+        if (!desc)
+            return HVMM_STATUS_BUSY;
+    }
+    if (guest_memory_snap_save(vmid, ipa, desc->bits & TTBL_TABADDR_MASK))
+        return HVMM_STATUS_BUSY;
+    if (_dirty_bitmap[vmid]) {
+        guest_memory_dirty_mark(vmid, ipa & ~LPAE_PAGE_MASK, LPAE_PAGE_SIZE);
+        _dirty_faults[vmid]++;
+    }
+    guest_memory_dirty_protect_desc(desc, 0);
+    guest_memory_tlb_defer(vmid);
+    guest_memory_tlb_sync();
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * \defgroup Guest_clone
+ *
+ * Copy-on-write sharing of guest RAM between a guest and its clones.
+ * - memory_hw_clone() maps the RAM of a guest into another one, read-only
+ *   and flagged P2M_SW_COW in both. 2MB blocks stay blocks.
+ * - Frames mapped more than once are counted per 2MB chunk of physical
+ *   memory, a frame without count has a single mapping.
+ * - A write to a shared frame takes a stage-2 permission fault, which
+ *   gives the writer a private copy from the page pool. The last mapping
+ *   just becomes writable again.
+ * @{
+ */
+#define COW_HASH_SIZE       64
+#define COW_HASH_MASK       (COW_HASH_SIZE - 1)
+/** @}*/
+
+struct cow_chunk {
+    uint32_t base;                  /* 2MB aligned physical address */
+    uint32_t shared;                /* frames with a count */
+    uint8_t refs[VMM_L3_PTE_NUM];   /* mappings per frame, 0 if one */
+    struct cow_chunk *next;
+};
+
+static struct cow_chunk *_cow_hash[COW_HASH_SIZE];
+static uint32_t _cow_shared;
+static uint32_t _cow_clones;
+static uint32_t _cow_faults[NUM_GUESTS_STATIC];
+static uint32_t _cow_copies[NUM_GUESTS_STATIC];
+
+static struct cow_chunk *cow_find(uint32_t pa, int create)
+{
+    uint32_t base = pa & ~LPAE_BLOCK_L2_MASK;
+    struct cow_chunk **link = &_cow_hash[(base >> LPAE_BLOCK_L2_SHIFT) &
+            COW_HASH_MASK];
+    struct cow_chunk *chunk;
+
+    for (chunk = *link; chunk; chunk = chunk->next) {
+        if (chunk->base == base)
+            return chunk;
+    }
+    if (!create)
+        return 0;
+
+    chunk = host_memory_malloc(sizeof(struct cow_chunk));
+    if (!chunk)
+        return 0;
+    memset(chunk, 0, sizeof(struct cow_chunk));
+    chunk->base = base;
+    chunk->next = *link;
+    *link = chunk;
+
+    return chunk;
+}
+
+static void cow_free(struct cow_chunk *chunk)
+{
+    struct cow_chunk **link = &_cow_hash[(chunk->base >> LPAE_BLOCK_L2_SHIFT)
+            & COW_HASH_MASK];
+
+    for (; *link; link = &(*link)->next) {
+        if (*link == chunk) {
+            *link = chunk->next;
+            break;
+        }
+    }
+    host_memory_free(chunk);
+}
+
+static inline uint32_t cow_index(uint32_t pa)
+{
+    return (pa & LPAE_BLOCK_L2_MASK) >> LPAE_PAGE_SHIFT;
+}
+
+/**
+ * @brief Counts one more mapping of each frame of a range.
+ *
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_BUSY if out of memory.
+ */
+static hvmm_status_t cow_get(uint32_t pa, uint32_t size)
+{
+    struct cow_chunk *chunk = cow_find(pa, 1);
+    uint32_t i = cow_index(pa);
+    uint32_t end = i + (size >> LPAE_PAGE_SHIFT);
+
+    if (!chunk)
+        return HVMM_STATUS_BUSY;
+    for (; i < end; i++) {
+        if (!chunk->refs[i]) {
+            chunk->refs[i] = 2;
+            chunk->shared++;
+            _cow_shared++;
+        } else
+            chunk->refs[i]++;
+    }
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Drops a mapping of a frame.
+ *
+ * @return 1 if other mappings still hold the frame.
+ */
+static int cow_put(uint32_t pa)
+{
+    struct cow_chunk *chunk = cow_find(pa, 0);
+    uint32_t i = cow_index(pa);
+
+    if (!chunk || !chunk->refs[i])
+        return 0;
+    if (--chunk->refs[i] == 1) {
+        chunk->refs[i] = 0;
+        _cow_shared--;
+        if (!--chunk->shared)
+            cow_free(chunk);
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Resolves a write to a frame shared with a clone.
+ *
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if the page is not
+ *         shared with a clone, HVMM_STATUS_BUSY if out of memory.
+ */
+static hvmm_status_t guest_memory_cow_fault(vmid_t vmid, uint32_t ipa)
+{
+    union lpaed *pte = guest_memory_leaf(vmid, ipa);
+    struct cow_chunk *chunk;
+    uint32_t pa;
+    void *copy;
+
+    if (!pte || !(pte->p2m.avail & P2M_SW_COW))
+        return HVMM_STATUS_NOT_FOUND;
+    pte = guest_memory_pte(vmid, ipa);
+    if (!pte)
+        return HVMM_STATUS_BUSY;
+    pa = pte->bits & TTBL_TABADDR_MASK;
+    if (guest_memory_snap_save(vmid, ipa, pa))
+        return HVMM_STATUS_BUSY;
+
+    chunk = cow_find(pa, 0);
+    if (chunk && chunk->refs[cow_index(pa)]) {
+        copy = guest_memory_alloc_page(vmid);
+        if (!copy) {
+            printh("%s: vmid %d out of memory at %x\n", __func__, vmid, ipa);
+            return HVMM_STATUS_BUSY;
+        }
+        memcpy(copy, (void *) pa, LPAE_PAGE_SIZE);
+        lpaed_guest_stage2_map_page(pte, (uint32_t) copy, pte->p2m.mattr);
+        cow_put(pa);
+        _vmid_alloc_pages[vmid]++;
+        _cow_copies[vmid]++;
+    } else
+        pte->p2m.write = 1;
+    pte->p2m.avail &= ~P2M_SW_COW;
+    guest_memory_tlb_defer(vmid);
+    guest_memory_tlb_sync();
+    _cow_faults[vmid]++;
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+#ifdef _PAGE_DEDUP_
+/**
+ * \defgroup Page_dedup
+ *
+ * Content based sharing of guest pages allocated from the page pool.
+ * Carve-out guest RAM is never looked at, its frames cannot be given back,
+ * so only MEMMAP_PA_ALLOC memory and copy-on-write copies are shared.
+ * - A scanner hashes a few guest pages per hypervisor tick.
+ * - A page whose hash matches a shared (stable) frame, or a page seen
+ *   earlier in the same pass (unstable), is compared byte by byte while
+ *   write protected. Identical pages are mapped read-only to one frame and
+ *   the duplicate frame goes back to the page pool.
+ * - A write to a shared page takes a stage-2 permission fault, which gives
+ *   the guest a private copy.
+ * - Unstable nodes are dropped at the end of each pass, since their pages
+ *   stayed writable and may have changed.
+ * @{
+ */
+#define DEDUP_HASH_SIZE     256
+#define DEDUP_HASH_MASK     (DEDUP_HASH_SIZE - 1)
+/** @}*/
+
+struct dedup_node {
+    uint32_t hash;                  /* content hash */
+    uint32_t pa;                    /* frame holding the content */
+    uint32_t refs;                  /* mappings of a stable frame, 0 if unstable */
+    vmid_t vmid;                    /* page of an unstable node */
+    uint32_t ipa;
+    struct dedup_node *next;        /* content hash chain */
+    struct dedup_node *pa_next;     /* stable frame chain */
+};
+
+struct dedup_stat {
+    uint32_t scanned;
+    uint32_t passes;
+    uint32_t shared;                /* stable frames */
+    uint32_t sharing;               /* frames saved by sharing */
+    uint32_t merged;
+    uint32_t unmerged;
+};
+
+static struct dedup_node *_dedup_hash[DEDUP_HASH_SIZE];
+static struct dedup_node *_dedup_stable[DEDUP_HASH_SIZE];
+static struct dedup_stat _dedup_stat;
+static vmid_t _dedup_vmid;
+static uint64_t _dedup_ipa;
+
+static inline uint32_t dedup_pa_hash(uint32_t pa)
+{
+    return (pa >> LPAE_PAGE_SHIFT) & DEDUP_HASH_MASK;
+}
+
+static uint32_t dedup_hash_page(uint32_t pa)
+{
+    uint32_t *word = (uint32_t *) pa;
+    uint32_t hash = 0x811C9DC5;
+    int i;
+
+    for (i = 0; i < LPAE_PAGE_SIZE / sizeof(uint32_t); i++)
+        hash = (hash ^ word[i]) * 0x01000193;
+
+    return hash;
+}
+
+static struct dedup_node *dedup_find_stable(uint32_t pa)
+{
+    struct dedup_node *node = _dedup_stable[dedup_pa_hash(pa)];
+
+    while (node && node->pa != pa)
+        node = node->pa_next;
+
+    return node;
+}
+
+static void dedup_unlink(struct dedup_node *node)
+{
+    struct dedup_node **link;
+
+    for (link = &_dedup_hash[node->hash & DEDUP_HASH_MASK]; *link;
+            link = &(*link)->next) {
+        if (*link == node) {
+            *link = node->next;
+            break;
+        }
+    }
+    if (!node->refs)
+        return;
+    for (link = &_dedup_stable[dedup_pa_hash(node->pa)]; *link;
+            link = &(*link)->pa_next) {
+        if (*link == node) {
+            *link = node->pa_next;
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Write protects a guest page and compares it with a frame.
+ *
+ * The frame of an unstable node is write protected as well, a stable
+ * frame is read-only already. Both stay read-only if they are identical.
+ *
+ * @param node Node of the frame.
+ * @param tpte Mapping of the unstable frame, 0 for a stable frame.
+ * @return 1 if identical.
+ */
+static int dedup_protect_compare(vmid_t vmid, union lpaed *pte,
+        struct dedup_node *node, union lpaed *tpte)
+{
+    uint32_t pa = pte->bits & TTBL_TABADDR_MASK;
+
+    pte->p2m.write = 0;
+    guest_memory_tlb_defer(vmid);
+    if (tpte) {
+        tpte->p2m.write = 0;
+        guest_memory_tlb_defer(node->vmid);
+    }
+    guest_memory_tlb_sync();
+    if (!memcmp((void *) pa, (void *) node->pa, LPAE_PAGE_SIZE))
+        return 1;
+    pte->p2m.write = 1;
+    guest_memory_tlb_defer(vmid);
+    if (tpte) {
+        tpte->p2m.write = 1;
+        guest_memory_tlb_defer(node->vmid);
+    }
+    guest_memory_tlb_sync();
+
+    return 0;
+}
+
+/**
+ * @brief Tries to map a guest page to the frame of a node.
+ *
+ * @return 1 if the page is shared now and its frame was freed.
+ */
+static int dedup_merge(vmid_t vmid, uint32_t ipa, uint32_t pa,
+        struct dedup_node *node)
+{
+    union lpaed *pte;
+    union lpaed *tpte = 0;
+
+    /* cheap check before splitting any block */
+    if (memcmp((void *) pa, (void *) node->pa, LPAE_PAGE_SIZE))
+        return 0;
+
+    pte = guest_memory_pte(vmid, ipa);
+    if (!pte)
+        return 0;
+    if (!node->refs) {
+        /* the page of an unstable node may have been remapped since */
+        tpte = guest_memory_pte(node->vmid, node->ipa);
+        if (!tpte || !tpte->p2m.valid || !tpte->p2m.write ||
+                (tpte->bits & TTBL_TABADDR_MASK) != node->pa)
+            return 0;
+    }
+    if (!dedup_protect_compare(vmid, pte, node, tpte))
+        return 0;
+
+    lpaed_guest_stage2_map_page(pte, node->pa, pte->p2m.mattr);
+    pte->p2m.write = 0;
+    guest_memory_tlb_defer(vmid);
+    guest_memory_tlb_sync();
+    page_free((void *) pa, PAGE_ORDER_4K);
+
+    if (!node->refs) {
+        node->refs = 1;
+        node->pa_next = _dedup_stable[dedup_pa_hash(node->pa)];
+        _dedup_stable[dedup_pa_hash(node->pa)] = node;
+        _dedup_stat.shared++;
+    }
+    node->refs++;
+    _dedup_stat.sharing++;
+    _dedup_stat.merged++;
+
+    return 1;
+}
+
+/**
+ * @brief Looks one guest page up against the shared and unstable pages.
+ */
+static void dedup_page(vmid_t vmid, uint32_t ipa, uint32_t pa)
+{
+    uint32_t hash = dedup_hash_page(pa);
+    struct dedup_node *node;
+
+    for (node = _dedup_hash[hash & DEDUP_HASH_MASK]; node;
+            node = node->next) {
+        if (node->hash != hash || node->pa == pa)
+            continue;
+        if (dedup_merge(vmid, ipa, pa, node))
+            return;
+    }
+
+    node = host_memory_malloc(sizeof(struct dedup_node));
+    if (!node)
+        return;
+    node->hash = hash;
+    node->pa = pa;
+    node->refs = 0;
+    node->vmid = vmid;
+    node->ipa = ipa;
+    node->pa_next = 0;
+    node->next = _dedup_hash[hash & DEDUP_HASH_MASK];
+    _dedup_hash[hash & DEDUP_HASH_MASK] = node;
+}
+
+/**
+ * @brief Drops the unstable nodes at the end of a pass.
+ */
+static void dedup_end_pass(void)
+{
+    struct dedup_node **link;
+    struct dedup_node *node;
+    int i;
+
+    for (i = 0; i < DEDUP_HASH_SIZE; i++) {
+        link = &_dedup_hash[i];
+        while ((node = *link)) {
+            if (node->refs)
+                link = &node->next;
+            else {
+                *link = node->next;
+                host_memory_free(node);
+            }
+        }
+    }
+    _dedup_stat.passes++;
+}
+
+/**
+ * @brief Looks up the guest mapping at the scanner cursor.
+ *
+ * @param *pa Frame of the page if it is a candidate for sharing: normal,
+ *        writable memory of the page pool. 0 otherwise.
+ * @return Bytes of IPA space the lookup covered.
+ */
+static uint32_t dedup_walk(vmid_t vmid, uint32_t ipa, uint32_t *pa)
+{
+    union lpaed *desc = &_vmid_ttbl[vmid][ipa >> LPAE_BLOCK_L1_SHIFT];
+    uint32_t base;
+
+    *pa = 0;
+    if (!desc->p2m.valid || !desc->p2m.table)
+        return LPAE_BLOCK_L1_SIZE - (ipa & LPAE_BLOCK_L1_MASK);
+    desc = &TTBL_NEXT(desc)[(ipa & LPAE_BLOCK_L1_MASK) >> LPAE_BLOCK_L2_SHIFT];
+    if (!desc->p2m.valid)
+        return LPAE_BLOCK_L2_SIZE - (ipa & LPAE_BLOCK_L2_MASK);
+    if (desc->p2m.table) {
+        desc = &TTBL_NEXT(desc)[(ipa >> LPAE_PAGE_SHIFT) &
+                (VMM_L3_PTE_NUM - 1)];
+        if (!desc->p2m.valid)
+            return LPAE_PAGE_SIZE;
+        base = desc->bits & TTBL_TABADDR_MASK;
+    } else {
+        base = desc->bits & ~LPAE_BLOCK_L2_MASK & TTBL_TABADDR_MASK;
+        if (!page_in_pool(base))
+            return LPAE_BLOCK_L2_SIZE - (ipa & LPAE_BLOCK_L2_MASK);
+        base += ipa & LPAE_BLOCK_L2_MASK & ~LPAE_PAGE_MASK;
+    }
+    if (page_in_pool(base) && desc->p2m.write && (desc->p2m.mattr & 0xC) &&
+            !(desc->p2m.avail & P2M_SW_SHARED))
+        *pa = base;
+
+    return LPAE_PAGE_SIZE;
+}
+
+/**
+ * @brief Scanner of the page sharing, run from the hypervisor tick.
+ *
+ * @param pages Number of lookups, a lookup covers one page or skips an
+ *        unmapped or foreign 2MB/1GB range.
+ * @return HVMM_STATUS_SUCCESS only.
+ */
+static hvmm_status_t memory_hw_scan(uint32_t pages)
+{
+    uint32_t pa;
+
+    spin_lock(&_stage2_lock);
+    while (pages--) {
+        /*
+         * coloured guests share no frame with other guests, guests without
+         * pool frames have nothing to share
+         */
+        if (_dedup_ipa >= 0x100000000ULL || !_vmid_ttbl[_dedup_vmid] ||
+                _vmid_colours[_dedup_vmid] ||
+                !_vmid_alloc_pages[_dedup_vmid]) {
+            _dedup_ipa = 0;
+            if (++_dedup_vmid >= NUM_GUESTS_STATIC) {
+                _dedup_vmid = 0;
+                dedup_end_pass();
+            }
+            continue;
+        }
+        _dedup_ipa += dedup_walk(_dedup_vmid, (uint32_t) _dedup_ipa, &pa);
+        if (pa) {
+            _dedup_stat.scanned++;
+            dedup_page(_dedup_vmid, (uint32_t) _dedup_ipa - LPAE_PAGE_SIZE,
+                    pa);
+        }
+    }
+    spin_unlock(&_stage2_lock);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Breaks the sharing of a page on a write, copy on write.
+ *
+ * The last mapping of a shared frame just becomes writable again.
+ *
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if the page is not
+ *         shared, HVMM_STATUS_BUSY if there is no page for the copy.
+ */
+static hvmm_status_t memory_dedup_cow(vmid_t vmid, uint32_t ipa)
+{
+    struct dedup_node *node;
+    union lpaed *pte;
+    uint32_t pa;
+    void *copy;
+
+    pte = guest_memory_pte(vmid, ipa);
+    if (!pte || !pte->p2m.valid)
+        return HVMM_STATUS_NOT_FOUND;
+    pa = pte->bits & TTBL_TABADDR_MASK;
+    node = dedup_find_stable(pa);
+    if (!node)
+        return HVMM_STATUS_NOT_FOUND;
+    if (guest_memory_snap_save(vmid, ipa, pa))
+        return HVMM_STATUS_BUSY;
+
+    if (node->refs > 1) {
+        copy = guest_memory_alloc_page(vmid);
+        if (!copy)
+            return HVMM_STATUS_BUSY;
+        memcpy(copy, (void *) pa, LPAE_PAGE_SIZE);
+        lpaed_guest_stage2_map_page(pte, (uint32_t) copy, pte->p2m.mattr);
+        node->refs--;
+        _dedup_stat.sharing--;
+    }
+    if (node->refs == 1 && (pte->bits & TTBL_TABADDR_MASK) == pa) {
+        pte->p2m.write = 1;
+        dedup_unlink(node);
+        host_memory_free(node);
+        _dedup_stat.shared--;
+    }
+    guest_memory_tlb_defer(vmid);
+    guest_memory_tlb_sync();
+    _dedup_stat.unmerged++;
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Drops a mapping of a frame that is given up by a guest.
+ *
+ * @return 1 if the frame is still shared by other mappings and must not
+ *         be freed.
+ */
+static int memory_dedup_release(uint32_t pa)
+{
+    struct dedup_node *node = dedup_find_stable(pa);
+
+    if (!node)
+        return 0;
+    if (node->refs > 1) {
+        node->refs--;
+        _dedup_stat.sharing--;
+        return 1;
+    }
+    dedup_unlink(node);
+    host_memory_free(node);
+    _dedup_stat.shared--;
+
+    return 0;
+}
+
+static void memory_dedup_dump(void)
+{
+    printH("dedup: passes:%d scanned:%d shared:%d sharing:%d merged:%d "
+            "unmerged:%d\n", _dedup_stat.passes, _dedup_stat.scanned,
+            _dedup_stat.shared, _dedup_stat.sharing, _dedup_stat.merged,
+            _dedup_stat.unmerged);
+}
+#endif
+
+/**
+ * @brief Drops a mapping of a frame that a guest no longer maps.
+ *
+ * The frame goes back to the page pool if it came from there and no
+ * other guest maps it.
+ */
+static void guest_memory_put_frame(vmid_t vmid, uint32_t pa)
+{
+    int shared = cow_put(pa);
+
+    if (!page_in_pool(pa))
+        return;
+    if (_vmid_alloc_pages[vmid])
+        _vmid_alloc_pages[vmid]--;
+    if (shared)
+        return;
+#ifdef _PAGE_DEDUP_
+    if (memory_dedup_release(pa))
+        return;
+#endif
+    page_free((void *) pa, PAGE_ORDER_4K);
+}
+
+/**
+ * @brief Finds the descriptor, left unmapped at boot, of a guest page.
+ *
+ * @return The descriptor, 0 if the page is not lazily mapped memory.
+ */
+static struct memmap_desc *guest_memory_lazy_desc(vmid_t vmid, uint32_t ipa)
+{
+    struct memmap_desc **mdlist;
+    struct memmap_desc *md;
+    uint32_t index_l1 = ipa >> LPAE_BLOCK_L1_SHIFT;
+    uint32_t offset = ipa & LPAE_BLOCK_L1_MASK;
+    uint32_t i;
+
+    if (vmid >= NUM_GUESTS_STATIC || !_vmid_lazy_descs[vmid])
+        return 0;
+
+    mdlist = _vmid_mdlist[vmid];
+    for (i = 0; i < index_l1 && mdlist[i]; i++)
+        ;
+    if (!mdlist[i])
+        return 0;
+    for (md = mdlist[i]; md->label; md++) {
+        if (guest_memory_is_lazy(vmid, md) && offset >= md->va &&
+                offset - md->va < md->size)
+            return md;
+    }
+
+    return 0;
+}
+
+/* A page given up by memory_hw_release() and not reclaimed yet */
+static int guest_memory_ballooned(union lpaed *ttbl2, uint32_t offset)
+{
+    union lpaed *desc = &ttbl2[offset >> LPAE_BLOCK_L2_SHIFT];
+
+    if (!desc->p2m.valid || !desc->p2m.table)
+        return 0;
+    desc = &TTBL_NEXT(desc)[(offset >> LPAE_PAGE_SHIFT) &
+            (VMM_L3_PTE_NUM - 1)];
+
+    return !desc->p2m.valid && (desc->p2m.avail & P2M_SW_BALLOON);
+}
+
+/**
+ * @brief Maps guest memory on a stage-2 translation fault.
+ *
+ * Looks the faulting IPA up in the memory map descriptors that were left
+ * unmapped at boot, and maps the 2MB block around it when the descriptor
+ * covers the whole block, the 4KB page otherwise. MEMMAP_PA_ALLOC
+ * descriptors are backed by zeroed memory from the page pool.
+ *
+ * @param vmid Guest that faulted.
+ * @param ipa Faulting intermediate physical address.
+ * @param *map_ipa Start of the range mapped.
+ * @param *map_size Size of the range mapped.
+ * A page the guest gave up to its balloon is not backed again before
+ * the guest takes it back with memory_hw_reclaim(), the balloon still
+ * counts it.
+ *
+ * @return HVMM_STATUS_SUCCESS if mapped, HVMM_STATUS_NOT_FOUND if no such
+ *         descriptor, HVMM_STATUS_BUSY if out of memory,
+ *         HVMM_STATUS_BAD_ACCESS if the page is in the balloon.
+ */
+static hvmm_status_t memory_hw_lazy_fault(vmid_t vmid, uint32_t ipa,
+        uint32_t *map_ipa, uint32_t *map_size)
+{
+    struct memmap_desc *md = guest_memory_lazy_desc(vmid, ipa);
+    union lpaed *ttbl2;
+    uint32_t index_l1 = ipa >> LPAE_BLOCK_L1_SHIFT;
+    uint32_t offset = ipa & LPAE_BLOCK_L1_MASK;
+    uint32_t va, size;
+    uint64_t pa;
+    void *page = 0;
+
+    if (!md)
+        return HVMM_STATUS_NOT_FOUND;
+
+    ttbl2 = guest_memory_ttbl1_table(vmid, &_vmid_ttbl[vmid][index_l1]);
+    if (!ttbl2)
+        return HVMM_STATUS_BUSY;
+    if (guest_memory_ballooned(ttbl2, offset)) {
+        printh("%s: vmid %d touched %x, held by its balloon\n", __func__,
+                vmid, ipa);
+        return HVMM_STATUS_BAD_ACCESS;
+    }
+
+    /*
+     * A 2MB block if the descriptor covers it and no page is mapped yet.
+     * A block holds pages of every colour.
+     */
+    va = offset & ~LPAE_BLOCK_L2_MASK;
+    size = LPAE_BLOCK_L2_SIZE;
+    if (_vmid_colours[vmid] || va < md->va || va + size > md->va + md->size ||
+            ttbl2[va >> LPAE_BLOCK_L2_SHIFT].p2m.valid ||
+            (md->pa != MEMMAP_PA_ALLOC &&
+             ((md->pa + (va - md->va)) & LPAE_BLOCK_L2_MASK))) {
+        va = offset & ~LPAE_PAGE_MASK;
+        size = LPAE_PAGE_SIZE;
+    }
+
+    if (md->pa == MEMMAP_PA_ALLOC) {
+        if (size == LPAE_BLOCK_L2_SIZE)
+            page = page_zalloc(PAGE_ORDER_2M);
+        if (!page) {
+            va = offset & ~LPAE_PAGE_MASK;
+            size = LPAE_PAGE_SIZE;
+            page = guest_memory_alloc_page(vmid);
+            if (page)
+                memset(page, 0, LPAE_PAGE_SIZE);
+        }
+        if (!page) {
+            printh("%s: vmid %d out of memory at %x\n", __func__, vmid, ipa);
+            return HVMM_STATUS_BUSY;
+        }
+        pa = (uint32_t) page;
+        _vmid_alloc_pages[vmid] += size >> LPAE_PAGE_SHIFT;
+    } else {
+        pa = md->pa + (va - md->va);
+        /* move the content to a page of the colours of the guest */
+        if (_vmid_colours[vmid] && (md->attr & 0xC) &&
+                !(_vmid_colours[vmid] & (1 << page_colour(pa)))) {
+            page = guest_memory_alloc_page(vmid);
+            if (!page) {
+                printh("%s: vmid %d no page of its colours at %x\n",
+                        __func__, vmid, ipa);
+                return HVMM_STATUS_BUSY;
+            }
+            memcpy(page, (void *)(uint32_t) pa, LPAE_PAGE_SIZE);
+            pa = (uint32_t) page;
+            _vmid_alloc_pages[vmid]++;
+            _vmid_colour_moves[vmid]++;
+        }
+    }
+
+    guest_memory_ttbl2_map(vmid, ttbl2, va, pa, size, md->attr);
+    dsb();
+    _vmid_lazy_faults[vmid]++;
+    *map_ipa = (index_l1 << LPAE_BLOCK_L1_SHIFT) | va;
+    *map_size = size;
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Resolves a stage-2 fault of a guest.
+ *
+ * Translation faults map lazily backed memory. Write permission faults
+ * log dirty pages, or break the sharing of deduplicated or cloned pages. Pages
+ * that become writable while dirty logging is on are marked dirty.
+ *
+ * @param vmid Guest that faulted.
+ * @param ipa Faulting intermediate physical address.
+ * @param flags MEMORY_FAULT_WRITE, MEMORY_FAULT_PERMISSION.
+ * @return HVMM_STATUS_SUCCESS if the guest can retry the access.
+ */
+static hvmm_status_t memory_hw_fault(vmid_t vmid, uint32_t ipa,
+        uint32_t flags)
+{
+    hvmm_status_t ret = HVMM_STATUS_NOT_FOUND;
+    uint32_t map_ipa = ipa & ~LPAE_PAGE_MASK;
+    uint32_t map_size = LPAE_PAGE_SIZE;
+
+    if (vmid >= NUM_GUESTS_STATIC)
+        return HVMM_STATUS_NOT_FOUND;
+
+    spin_lock(&_stage2_lock);
+    if (!(flags & MEMORY_FAULT_PERMISSION)) {
+        ret = memory_hw_lazy_fault(vmid, ipa, &map_ipa, &map_size);
+        if (ret == HVMM_STATUS_SUCCESS)
+            guest_memory_snap_mapped(vmid, map_ipa, map_size);
+    } else if (flags & MEMORY_FAULT_WRITE) {
+        ret = guest_memory_dirty_fault(vmid, ipa);
+#ifdef _PAGE_DEDUP_
+        if (ret == HVMM_STATUS_NOT_FOUND)
+            ret = memory_dedup_cow(vmid, ipa);
+#endif
+        if (ret == HVMM_STATUS_NOT_FOUND)
+            ret = guest_memory_cow_fault(vmid, ipa);
+    }
+    if (ret == HVMM_STATUS_SUCCESS && _dirty_bitmap[vmid])
+        guest_memory_dirty_mark(vmid, map_ipa, map_size);
+    spin_unlock(&_stage2_lock);
+
+    return ret;
+}
+
+/**
+ * @brief Returns the end of the normal memory of a guest in IPA space.
+ */
+static uint64_t guest_memory_ram_end(vmid_t vmid)
+{
+    struct memmap_desc **mdlist = _vmid_mdlist[vmid];
+    struct memmap_desc *md;
+    uint64_t end = 0;
+    uint64_t md_end;
+    int i;
+
+    for (i = 0; i < VMM_L1_PTE_NUM && mdlist[i]; i++) {
+        for (md = mdlist[i]; md->label; md++) {
+            md_end = ((uint64_t) i << LPAE_BLOCK_L1_SHIFT) + md->va +
+                    md->size;
+            if ((md->attr & 0xC) && md_end > end)
+                end = md_end;
+        }
+    }
+
+    return end;
+}
+
+/**
+ * @brief Starts or stops dirty page logging of a guest.
+ *
+ * Starting allocates a zeroed dirty bitmap covering the normal memory of
+ * the guest and write protects it. Stopping lifts the protection and
+ * frees the bitmap.
+ *
+ * @param vmid Guest.
+ * @param enable 1 to start, 0 to stop.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_BUSY if there is no memory
+ *         for the bitmap.
+ */
+static hvmm_status_t memory_hw_dirty_log(vmid_t vmid, uint32_t enable)
+{
+    hvmm_status_t ret = HVMM_STATUS_SUCCESS;
+    uint32_t npages;
+    uint32_t *bitmap = 0;
+
+    if (vmid >= NUM_GUESTS_STATIC || !_vmid_ttbl[vmid])
+        return HVMM_STATUS_NOT_FOUND;
+
+    if (enable) {
+        npages = guest_memory_ram_end(vmid) >> LPAE_PAGE_SHIFT;
+        bitmap = host_memory_malloc(((npages + 31) >> 5) * sizeof(uint32_t));
+        if (!bitmap)
+            return HVMM_STATUS_BUSY;
+        memset(bitmap, 0, ((npages + 31) >> 5) * sizeof(uint32_t));
+    }
+
+    spin_lock(&_stage2_lock);
+    if (enable && _dirty_bitmap[vmid]) {
+        /* already logging */
+        spin_unlock(&_stage2_lock);
+        host_memory_free(bitmap);
+        return HVMM_STATUS_SUCCESS;
+    }
+    if (!enable) {
+        bitmap = _dirty_bitmap[vmid];
+        npages = 0;
+    }
+    _dirty_bitmap[vmid] = enable ? bitmap : 0;
+    _dirty_npages[vmid] = npages;
+    _dirty_faults[vmid] = 0;
+    _dirty_rounds[vmid] = 0;
+    if (enable || !_snap_active[vmid])
+        guest_memory_dirty_protect(vmid, enable);
+    guest_memory_tlb_sync();
+    spin_unlock(&_stage2_lock);
+
+    if (!enable && bitmap)
+        host_memory_free(bitmap);
+
+    return ret;
+}
+
+/**
+ * @brief Hands out the pages a guest wrote since the last collection and
+ *        starts a new round.
+ *
+ * The guest is write protected again before the bitmap is taken, so no
+ * write falls between two rounds.
+ *
+ * @param vmid Guest.
+ * @param bitmap Receives one bit per IPA page, from IPA 0.
+ * @param pages Number of pages the bitmap holds, pages past the RAM of the
+ *        guest are left clear.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if the guest is not
+ *         logging.
+ */
+static hvmm_status_t memory_hw_dirty_collect(vmid_t vmid, uint32_t *bitmap,
+        uint32_t pages)
+{
+    uint32_t words = (pages + 31) >> 5;
+    uint32_t log_words;
+    uint32_t i;
+
+    if (vmid >= NUM_GUESTS_STATIC)
+        return HVMM_STATUS_NOT_FOUND;
+
+    spin_lock(&_stage2_lock);
+    if (!_dirty_bitmap[vmid]) {
+        spin_unlock(&_stage2_lock);
+        return HVMM_STATUS_NOT_FOUND;
+    }
+    guest_memory_dirty_protect(vmid, 1);
+    guest_memory_tlb_sync();
+    log_words = (_dirty_npages[vmid] + 31) >> 5;
+    for (i = 0; i < words; i++) {
+        bitmap[i] = i < log_words ? _dirty_bitmap[vmid][i] : 0;
+        if (i < log_words)
+            _dirty_bitmap[vmid][i] = 0;
+    }
+    if (pages & 31)
+        bitmap[words - 1] &= (1 << (pages & 31)) - 1;
+    _dirty_rounds[vmid]++;
+    spin_unlock(&_stage2_lock);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Unmaps a guest page, and returns its frame to the page pool if
+ *        it came from there and is not shared.
+ *
+ * @param release Refuse frames that are not from the page pool, and save
+ *        the page for a snapshot first.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if the page is not
+ *         mapped, HVMM_STATUS_UNSUPPORTED_FEATURE if it is not backed by
+ *         the page pool or is shared with other guests,
+ *         HVMM_STATUS_BUSY if out of memory.
+ */
+static hvmm_status_t guest_memory_unmap_page(vmid_t vmid, uint32_t ipa,
+        uint32_t release)
+{
+    union lpaed *pte = guest_memory_leaf(vmid, ipa);
+    uint32_t pa;
+    int pool;
+
+    if (!pte)
+        return HVMM_STATUS_NOT_FOUND;
+    if (pte->p2m.avail & P2M_SW_SHARED)
+        return HVMM_STATUS_UNSUPPORTED_FEATURE;
+    pool = page_in_pool(pte->bits & TTBL_TABADDR_MASK);
+    if (release && !pool)
+        return HVMM_STATUS_UNSUPPORTED_FEATURE;
+    pte = guest_memory_pte(vmid, ipa);
+    if (!pte)
+        return HVMM_STATUS_BUSY;
+    pa = pte->bits & TTBL_TABADDR_MASK;
+    if (release && guest_memory_snap_save(vmid, ipa, pa))
+        return HVMM_STATUS_BUSY;
+
+    pte->bits = 0;
+    guest_memory_tlb_defer(vmid);
+    guest_memory_tlb_sync();
+    guest_memory_put_frame(vmid, pa);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Returns the level 3 descriptor of a guest page that is not
+ *        mapped, allocating the tables down to it.
+ */
+static union lpaed *guest_memory_unmapped_pte(vmid_t vmid, uint32_t ipa)
+{
+    union lpaed *ttbl2, *ttbl3;
+    uint32_t index_l2 = (ipa & LPAE_BLOCK_L1_MASK) >> LPAE_BLOCK_L2_SHIFT;
+
+    ttbl2 = guest_memory_ttbl1_table(vmid,
+            &_vmid_ttbl[vmid][ipa >> LPAE_BLOCK_L1_SHIFT]);
+    if (!ttbl2)
+        return 0;
+    ttbl3 = guest_memory_ttbl2_table(vmid, ttbl2, index_l2);
+    if (!ttbl3)
+        return 0;
+
+    return &ttbl3[(ipa >> LPAE_PAGE_SHIFT) & (VMM_L3_PTE_NUM - 1)];
+}
+
+/**
+ * @brief Unmaps a guest page and returns its frame to the page pool.
+ *
+ * Only frames of the page pool can be given back. A page of
+ * MEMMAP_PA_ALLOC memory the guest never touched has no frame yet and is
+ * given up as it is. The page is marked P2M_SW_BALLOON until
+ * memory_hw_reclaim(), touching it faults until then. Once reclaimed it
+ * is backed again by memory_hw_lazy_fault() when the guest touches it.
+ *
+ * @param vmid Guest giving the page up.
+ * @param ipa Intermediate physical address of the page.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if the page is not
+ *         mapped, HVMM_STATUS_UNSUPPORTED_FEATURE if it is not backed by
+ *         the page pool or is shared with other guests,
+ *         HVMM_STATUS_BAD_ACCESS if it was given up already,
+ *         HVMM_STATUS_BUSY if out of memory.
+ */
+static hvmm_status_t memory_hw_release(vmid_t vmid, uint32_t ipa)
+{
+    struct memmap_desc *md;
+    union lpaed *pte;
+    hvmm_status_t ret;
+
+    if (vmid >= NUM_GUESTS_STATIC || !_vmid_ttbl[vmid])
+        return HVMM_STATUS_NOT_FOUND;
+
+    spin_lock(&_stage2_lock);
+    ret = guest_memory_unmap_page(vmid, ipa, 1);
+    if (ret == HVMM_STATUS_NOT_FOUND) {
+        md = guest_memory_lazy_desc(vmid, ipa);
+        if (md && md->pa == MEMMAP_PA_ALLOC)
+            ret = HVMM_STATUS_SUCCESS;
+    }
+    if (ret == HVMM_STATUS_SUCCESS) {
+        pte = guest_memory_unmapped_pte(vmid, ipa);
+        if (!pte)
+            ret = HVMM_STATUS_BUSY;
+        else if (pte->p2m.avail & P2M_SW_BALLOON)
+            ret = HVMM_STATUS_BAD_ACCESS;
+        else
+            pte->p2m.avail = P2M_SW_BALLOON;
+    }
+    spin_unlock(&_stage2_lock);
+
+    return ret;
+}
+
+/**
+ * @brief Takes back a guest page given up by memory_hw_release().
+ *
+ * @param vmid Guest taking the page back.
+ * @param ipa Intermediate physical address of the page.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if no such guest,
+ *         HVMM_STATUS_BAD_ACCESS if the page was not given up.
+ */
+static hvmm_status_t memory_hw_reclaim(vmid_t vmid, uint32_t ipa)
+{
+    hvmm_status_t ret = HVMM_STATUS_BAD_ACCESS;
+    union lpaed *desc;
+
+    if (vmid >= NUM_GUESTS_STATIC || !_vmid_ttbl[vmid])
+        return HVMM_STATUS_NOT_FOUND;
+
+    spin_lock(&_stage2_lock);
+    desc = &_vmid_ttbl[vmid][ipa >> LPAE_BLOCK_L1_SHIFT];
+    if (desc->p2m.valid && desc->p2m.table) {
+        desc = &TTBL_NEXT(desc)[(ipa & LPAE_BLOCK_L1_MASK) >>
+                LPAE_BLOCK_L2_SHIFT];
+        if (desc->p2m.valid && desc->p2m.table) {
+            desc = &TTBL_NEXT(desc)[(ipa >> LPAE_PAGE_SHIFT) &
+                    (VMM_L3_PTE_NUM - 1)];
+            if (!desc->p2m.valid && (desc->p2m.avail & P2M_SW_BALLOON)) {
+                desc->bits = 0;
+                ret = HVMM_STATUS_SUCCESS;
+            }
+        }
+    }
+    spin_unlock(&_stage2_lock);
+
+    return ret;
+}
+
+/**
+ * @brief Maps memory of the hypervisor into a guest.
+ *
+ * The range is mapped page by page as cacheable normal memory and flagged
+ * P2M_SW_SHARED: it is never given back to the page pool by the guest,
+ * merged, cloned or part of a snapshot.
+ *
+ * @param vmid Guest.
+ * @param ipa Intermediate physical address, page aligned, the range must
+ *        not be mapped already and stay within 1GB.
+ * @param pa Physical address, page aligned.
+ * @param size Size of the range, page aligned.
+ * @param write 0 to map the range read-only and not executable.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if no such guest,
+ *         HVMM_STATUS_BAD_ACCESS if the range is not valid,
+ *         HVMM_STATUS_BUSY if out of memory.
+ */
+static hvmm_status_t guest_memory_share(vmid_t vmid, uint32_t ipa,
+        uint32_t pa, uint32_t size, uint32_t write)
+{
+    hvmm_status_t ret = HVMM_STATUS_SUCCESS;
+    union lpaed *ttbl2, *ttbl3;
+    uint32_t offset = ipa & LPAE_BLOCK_L1_MASK;
+    uint32_t i;
+
+    if (vmid >= NUM_GUESTS_STATIC || !_vmid_ttbl[vmid])
+        return HVMM_STATUS_NOT_FOUND;
+    if (!size || ((ipa | pa | size) & LPAE_PAGE_MASK) ||
+            size > LPAE_BLOCK_L1_SIZE - offset)
+        return HVMM_STATUS_BAD_ACCESS;
+
+    spin_lock(&_stage2_lock);
+    for (i = 0; i < size; i += LPAE_PAGE_SIZE) {
+        if (guest_memory_leaf(vmid, ipa + i)) {
+            ret = HVMM_STATUS_BAD_ACCESS;
+            break;
+        }
+    }
+    ttbl2 = guest_memory_ttbl1_table(vmid,
+            &_vmid_ttbl[vmid][ipa >> LPAE_BLOCK_L1_SHIFT]);
+    if (!ret && !ttbl2)
+        ret = HVMM_STATUS_BUSY;
+    for (i = 0; !ret && i < size; i += LPAE_PAGE_SIZE) {
+        ttbl3 = guest_memory_ttbl2_table(vmid, ttbl2,
+                (offset + i) >> LPAE_BLOCK_L2_SHIFT);
+        if (!ttbl3) {
+            ret = HVMM_STATUS_BUSY;
+            break;
+        }
+        ttbl3 += ((offset + i) >> LPAE_PAGE_SHIFT) & (VMM_L3_PTE_NUM - 1);
+        lpaed_guest_stage2_map_page(ttbl3, pa + i,
+                MEMATTR_NORMAL_OWB | MEMATTR_NORMAL_IWB);
+        ttbl3->p2m.avail |= P2M_SW_SHARED;
+        if (!write) {
+            ttbl3->p2m.write = 0;
+            ttbl3->p2m.xn = 1;
+        }
+        _vmid_shared_pages[vmid]++;
+    }
+    dsb();
+    guest_memory_tlb_defer(vmid);
+    guest_memory_tlb_sync();
+    spin_unlock(&_stage2_lock);
+
+    return ret;
+}
+
+/**
+ * @brief Maps memory of the hypervisor into a guest, to be shared with
+ *        other guests.
+ */
+static hvmm_status_t memory_hw_share(vmid_t vmid, uint32_t ipa, uint32_t pa,
+        uint32_t size)
+{
+    return guest_memory_share(vmid, ipa, pa, size, 1);
+}
+
+/**
+ * @brief Maps memory of the hypervisor read-only into a guest, for the
+ *        shadow registers of a vdev. Guest writes are not resolved by
+ *        memory_hw_fault().
+ */
+static hvmm_status_t memory_hw_share_ro(vmid_t vmid, uint32_t ipa,
+        uint32_t pa, uint32_t size)
+{
+    return guest_memory_share(vmid, ipa, pa, size, 0);
+}
+
+/**
+ * @brief Drops the snapshot of a guest, freeing the saved pages.
+ */
+static void guest_memory_snap_drop(vmid_t vmid)
+{
+    struct snap_page *snap;
+    int i;
+
+    for (i = 0; i < SNAP_HASH_SIZE; i++) {
+        while ((snap = _snap_hash[vmid][i])) {
+            _snap_hash[vmid][i] = snap->next;
+            page_free((void *) snap->frame, PAGE_ORDER_4K);
+            host_memory_free(snap);
+        }
+    }
+    while ((snap = _snap_mapped[vmid])) {
+        _snap_mapped[vmid] = snap->next;
+        host_memory_free(snap);
+    }
+    _snap_pages[vmid] = 0;
+}
+
+/**
+ * @brief Takes a snapshot of the RAM of a guest, or drops it.
+ *
+ * A new snapshot replaces the previous one. Nothing is copied yet, pages
+ * are saved as the guest changes them.
+ *
+ * @param vmid Guest, not running.
+ * @param enable 1 to take a snapshot, 0 to drop it.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if no such guest.
+ */
+static hvmm_status_t memory_hw_snapshot(vmid_t vmid, uint32_t enable)
+{
+    if (vmid >= NUM_GUESTS_STATIC || !_vmid_ttbl[vmid])
+        return HVMM_STATUS_NOT_FOUND;
+
+    spin_lock(&_stage2_lock);
+    guest_memory_snap_drop(vmid);
+    _snap_active[vmid] = enable;
+    _snap_rollbacks[vmid] = 0;
+    if (enable || !_dirty_bitmap[vmid])
+        guest_memory_dirty_protect(vmid, enable);
+    guest_memory_tlb_sync();
+    spin_unlock(&_stage2_lock);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Brings the RAM of a guest back to its snapshot.
+ *
+ * - Ranges mapped since the snapshot are unmapped, their frames go back
+ *   to the page pool.
+ * - Saved pages are copied back. A page given up since is mapped again,
+ *   a shared page gets a private copy first.
+ * - The guest is protected again, the saved pages stay for the next
+ *   rollback.
+ *
+ * @param vmid Guest, not running.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if there is no
+ *         snapshot, HVMM_STATUS_BUSY if out of memory.
+ */
+static hvmm_status_t memory_hw_rollback(vmid_t vmid)
+{
+    hvmm_status_t ret = HVMM_STATUS_SUCCESS;
+    struct snap_page *snap;
+    union lpaed *pte;
+    uint32_t map_ipa, map_size;
+    uint32_t ipa;
+    int i;
+
+    if (vmid >= NUM_GUESTS_STATIC)
+        return HVMM_STATUS_NOT_FOUND;
+
+    spin_lock(&_stage2_lock);
+    if (!_snap_active[vmid]) {
+        spin_unlock(&_stage2_lock);
+        return HVMM_STATUS_NOT_FOUND;
+    }
+
+    while ((snap = _snap_mapped[vmid])) {
+        _snap_mapped[vmid] = snap->next;
+        for (ipa = snap->ipa; ipa - snap->ipa < snap->size;
+                ipa += LPAE_PAGE_SIZE)
+            guest_memory_unmap_page(vmid, ipa, 0);
+        if (_dirty_bitmap[vmid])
+            guest_memory_dirty_mark(vmid, snap->ipa, snap->size);
+        host_memory_free(snap);
+    }
+
+    for (i = 0; i < SNAP_HASH_SIZE; i++) {
+        for (snap = _snap_hash[vmid][i]; snap; snap = snap->next) {
+            if (!guest_memory_leaf(vmid, snap->ipa))
+                memory_hw_lazy_fault(vmid, snap->ipa, &map_ipa, &map_size);
+#ifdef _PAGE_DEDUP_
+            pte = guest_memory_leaf(vmid, snap->ipa);
+            if (pte && dedup_find_stable(pte->bits & TTBL_TABADDR_MASK))
+                memory_dedup_cow(vmid, snap->ipa);
+#endif
+            guest_memory_cow_fault(vmid, snap->ipa);
+            pte = guest_memory_pte(vmid, snap->ipa);
+            if (!pte || !pte->p2m.valid) {
+                ret = HVMM_STATUS_BUSY;
+                continue;
+            }
+            memcpy((void *)(uint32_t)(pte->bits & TTBL_TABADDR_MASK),
+                    (void *) snap->frame, LPAE_PAGE_SIZE);
+            if (_dirty_bitmap[vmid])
+                guest_memory_dirty_mark(vmid, snap->ipa, LPAE_PAGE_SIZE);
+        }
+    }
+
+    guest_memory_dirty_protect(vmid, 1);
+    guest_memory_tlb_sync();
+    _snap_rollbacks[vmid]++;
+    spin_unlock(&_stage2_lock);
+
+    return ret;
+}
+
+/**
+ * @brief Drops what a descriptor of a clone maps before it is replaced.
+ *
+ * @param size LPAE_BLOCK_L2_SIZE for a level 2 descriptor, which may hold
+ *        a level 3 table, LPAE_PAGE_SIZE for a level 3 descriptor.
+ */
+static void guest_memory_clone_put(vmid_t vmid, union lpaed *desc,
+        uint32_t size)
+{
+    union lpaed *ttbl3;
+    uint32_t pa;
+    int i;
+
+    if (!desc->p2m.valid)
+        return;
+    if (size == LPAE_BLOCK_L2_SIZE && desc->p2m.table) {
+        ttbl3 = TTBL_NEXT(desc);
+        for (i = 0; i < VMM_L3_PTE_NUM; i++)
+            guest_memory_clone_put(vmid, &ttbl3[i], LPAE_PAGE_SIZE);
+        page_free(ttbl3, PAGE_ORDER_4K);
+        _vmid_ttbl_pages[vmid]--;
+    } else {
+        pa = desc->bits & TTBL_TABADDR_MASK;
+        if (size == LPAE_BLOCK_L2_SIZE)
+            page_split((void *) pa, PAGE_ORDER_2M);
+        for (i = 0; i < size; i += LPAE_PAGE_SIZE)
+            guest_memory_put_frame(vmid, pa + i);
+    }
+    desc->bits = 0;
+}
+
+/**
+ * @brief Shares a page or 2MB block of a guest with its clone.
+ *
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_BUSY if out of memory.
+ */
+static hvmm_status_t guest_memory_clone_desc(vmid_t dst, union lpaed *ddesc,
+        union lpaed *sdesc, uint32_t ipa, uint32_t size)
+{
+    uint32_t pa = sdesc->bits & TTBL_TABADDR_MASK;
+#ifdef _PAGE_DEDUP_
+    struct dedup_node *node;
+#endif
+
+    /* devices and channels keep the mapping of the clone */
+    if (!(sdesc->p2m.mattr & 0xC) || (sdesc->p2m.avail & P2M_SW_SHARED))
+        return HVMM_STATUS_SUCCESS;
+
+    guest_memory_clone_put(dst, ddesc, size);
+#ifdef _PAGE_DEDUP_
+    node = size == LPAE_PAGE_SIZE ? dedup_find_stable(pa) : 0;
+    if (node) {
+        /* read-only already, a write unmerges it */
+        node->refs++;
+        _dedup_stat.sharing++;
+        ddesc->bits = sdesc->bits;
+        return HVMM_STATUS_SUCCESS;
+    }
+#endif
+    if (cow_get(pa, size))
+        return HVMM_STATUS_BUSY;
+    sdesc->p2m.write = 0;
+    sdesc->p2m.avail = (sdesc->p2m.avail & ~P2M_SW_DIRTY_WP) | P2M_SW_COW;
+    ddesc->bits = sdesc->bits;
+    if (_dirty_bitmap[dst])
+        guest_memory_dirty_mark(dst, ipa, size);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Makes a guest a copy-on-write clone of the RAM of another.
+ *
+ * Every normal memory page or 2MB block the source maps replaces what the
+ * clone maps at the same address, shared read-only by both. The previous
+ * frames of the clone go back to the page pool, and its snapshot is
+ * dropped. Device mappings and unmapped ranges of the source are left
+ * alone, both guests should have the same memory map.
+ *
+ * @param dst Clone, not running.
+ * @param src Template guest, not running.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if no such guest,
+ *         HVMM_STATUS_UNSUPPORTED_FEATURE if their cache colours differ,
+ *         HVMM_STATUS_BUSY if out of memory. The clone is then partly
+ *         cloned, and must be cloned again.
+ */
+static hvmm_status_t memory_hw_clone(vmid_t dst, vmid_t src)
+{
+    hvmm_status_t ret = HVMM_STATUS_SUCCESS;
+    union lpaed *s2, *s3;
+    union lpaed *d2, *d3;
+    uint32_t ipa, block;
+    int i, j, k;
+
+    if (dst >= NUM_GUESTS_STATIC || src >= NUM_GUESTS_STATIC ||
+            dst == src || !_vmid_ttbl[dst] || !_vmid_ttbl[src])
+        return HVMM_STATUS_NOT_FOUND;
+    /* frames of other colours would be shared until written */
+    if (_vmid_colours[dst] != _vmid_colours[src])
+        return HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    spin_lock(&_stage2_lock);
+    guest_memory_snap_drop(dst);
+    _snap_active[dst] = 0;
+
+    for (i = 0; i < VMM_L1_PTE_NUM && !ret; i++) {
+        if (!_vmid_ttbl[src][i].p2m.valid)
+            continue;
+        s2 = guest_memory_ttbl1_table(src, &_vmid_ttbl[src][i]);
+        d2 = guest_memory_ttbl1_table(dst, &_vmid_ttbl[dst][i]);
+        if (!s2 || !d2) {
+            ret = HVMM_STATUS_BUSY;
+            break;
+        }
+        for (j = 0; j < VMM_L2_PTE_NUM && !ret; j++) {
+            ipa = ((uint32_t) i << LPAE_BLOCK_L1_SHIFT) |
+                    (j << LPAE_BLOCK_L2_SHIFT);
+            if (!s2[j].p2m.valid)
+                continue;
+            if (!s2[j].p2m.table) {
+                ret = guest_memory_clone_desc(dst, &d2[j], &s2[j], ipa,
+                        LPAE_BLOCK_L2_SIZE);
+                continue;
+            }
+            /* pages of a block the clone still maps can be freed one by one */
+            block = d2[j].bits & ~LPAE_BLOCK_L2_MASK & TTBL_TABADDR_MASK;
+            if (d2[j].p2m.valid && !d2[j].p2m.table)
+                page_split((void *) block, PAGE_ORDER_2M);
+            d3 = guest_memory_ttbl2_table(dst, d2, j);
+            if (!d3) {
+                ret = HVMM_STATUS_BUSY;
+                break;
+            }
+            s3 = TTBL_NEXT(&s2[j]);
+            for (k = 0; k < VMM_L3_PTE_NUM && !ret; k++) {
+                if (s3[k].p2m.valid)
+                    ret = guest_memory_clone_desc(dst, &d3[k], &s3[k],
+                            ipa | (k << LPAE_PAGE_SHIFT), LPAE_PAGE_SIZE);
+            }
+        }
+    }
+
+    guest_memory_tlb_defer(src);
+    guest_memory_tlb_defer(dst);
+    guest_memory_tlb_sync();
+    if (!ret)
+        _cow_clones++;
+    spin_unlock(&_stage2_lock);
+
+    return ret;
+}
+
 static void *memory_hw_alloc(unsigned long size)
 {
     return host_memory_malloc(size);
@@ -1350,47 +3614,112 @@ static void memory_hw_free(void *ap)
 }
 
 /**
- * @brief Stops stage-2 translation by disabling mmu.
+ * @brief Leaves the stage-2 translation of the current guest.
  *
- * We assume VTCR has been configured and initialized in the memory
- * management module.
- * - Disables stage-2 translation by HCR.vm = 0.
+ * Stage 2 stays enabled across switches, TLB entries are tagged by VMID.
+ * Nothing to save.
  */
 static hvmm_status_t memory_hw_save(void)
 {
-    /*
-     * We assume VTCR has been configured and initialized
-     * in the memory management module
-     */
-    /* Disable Stage 2 Translation: HCR.VM = 0 */
-    guest_memory_stage2_enable(0);
-
     return HVMM_STATUS_SUCCESS;
 }
 
 /**
- * @brief Restores translation table for the next guest and enable stage-2 mmu.
+ * @brief Restores translation table for the next guest.
  *
- * - Chagne stage-2 translation table and vmid.
- * - Eanbles stage-2 MMU.
+ * - Takes a VMID of the current generation if the guest has none.
+ * - Changes stage-2 translation table and vmid, VTTBR only.
+ * - Enables stage-2 MMU on the first switch of the cpu.
  *
- * @param guest Context of the next guest.
+ * @param vmid Next guest.
  */
 static hvmm_status_t memory_hw_restore(vmid_t vmid)
 {
-    /*
-     * Restore Translation Table for the next guest and
-     * Enable Stage 2 Translation
-     */
+    uint32_t cpu = smp_processor_id();
+
+    spin_lock(&_vmid_lock);
+    if (VMID_GENERATION(_vmid_hw[vmid]) != _vmid_generation) {
+        _vmid_hw[vmid] = guest_memory_vmid_alloc();
+        guest_memory_fiq_vmid_update();
+    }
+    _vmid_hw_active[cpu] = _vmid_hw[vmid];
     guest_memory_set_vmid_ttbl(vmid, _vmid_ttbl[vmid]);
+    spin_unlock(&_vmid_lock);
+    isb();
+
+    if (!(read_hcr() & HCR_VM))
+        guest_memory_stage2_enable(1);
 
-    guest_memory_stage2_enable(1);
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Gives a guest a new VMID.
+ *
+ * For a guest that starts a new lifetime: TLB entries of its old VMID can
+ * never match again, without a flush. The old VMID is not reused before
+ * the next rollover.
+ *
+ * @param vmid Guest.
+ * @return HVMM_STATUS_SUCCESS only.
+ */
+static hvmm_status_t memory_hw_renew_vmid(vmid_t vmid)
+{
+    uint32_t cpu = smp_processor_id();
+    uint32_t old;
+
+    spin_lock(&_vmid_lock);
+    old = _vmid_hw[vmid];
+    _vmid_hw[vmid] = guest_memory_vmid_alloc();
+    guest_memory_fiq_vmid_update();
+    if (old && _vmid_hw_active[cpu] == old) {
+        _vmid_hw_active[cpu] = _vmid_hw[vmid];
+        guest_memory_set_vmid_ttbl(vmid, _vmid_ttbl[vmid]);
+        isb();
+    }
+    spin_unlock(&_vmid_lock);
 
     return HVMM_STATUS_SUCCESS;
 }
 
 static hvmm_status_t memory_hw_dump(void)
 {
+    int i;
+
+    host_memory_heap_dump();
+    page_dump();
+    for (i = 0; i < NUM_GUESTS_STATIC; i++)
+        printH("vmid %d: stage-2 table pages:%d faults:%d pool pages:%d"
+                " shared pages:%d\n", i, _vmid_ttbl_pages[i],
+                _vmid_lazy_faults[i], _vmid_alloc_pages[i],
+                _vmid_shared_pages[i]);
+    for (i = 0; i < NUM_GUESTS_STATIC; i++) {
+        if (_dirty_bitmap[i])
+            printH("vmid %d: dirty log pages:%d faults:%d rounds:%d\n", i,
+                    _dirty_npages[i], _dirty_faults[i], _dirty_rounds[i]);
+    }
+    for (i = 0; i < NUM_GUESTS_STATIC; i++) {
+        if (_snap_active[i])
+            printH("vmid %d: snapshot pages:%d rollbacks:%d\n", i,
+                    _snap_pages[i], _snap_rollbacks[i]);
+    }
+    for (i = 0; i < NUM_GUESTS_STATIC; i++) {
+        if (_vmid_colours[i])
+            printH("vmid %d: colours:%x moved:%d\n", i,
+                    _vmid_colours[i], _vmid_colour_moves[i]);
+    }
+    for (i = 0; i < NUM_GUESTS_STATIC; i++) {
+        if (_cow_faults[i])
+            printH("vmid %d: cow faults:%d copies:%d\n", i, _cow_faults[i],
+                    _cow_copies[i]);
+    }
+    printH("clones:%d cow shared frames:%d\n", _cow_clones, _cow_shared);
+    printH("vmid generation:%d rollovers:%d\n", _vmid_generation,
+            _vmid_rollovers);
+#ifdef _PAGE_DEDUP_
+    memory_dedup_dump();
+#endif
+
     return HVMM_STATUS_SUCCESS;
 }
 
@@ -1401,6 +3730,20 @@ struct memory_ops _memory_ops = {
     .save = memory_hw_save,
     .restore = memory_hw_restore,
     .dump = memory_hw_dump,
+    .fault = memory_hw_fault,
+#ifdef _PAGE_DEDUP_
+    .scan = memory_hw_scan,
+#endif
+    .release = memory_hw_release,
+    .reclaim = memory_hw_reclaim,
+    .renew_vmid = memory_hw_renew_vmid,
+    .dirty_log = memory_hw_dirty_log,
+    .dirty_collect = memory_hw_dirty_collect,
+    .snapshot = memory_hw_snapshot,
+    .rollback = memory_hw_rollback,
+    .clone = memory_hw_clone,
+    .share = memory_hw_share,
+    .share_ro = memory_hw_share_ro,
 };
 
 struct memory_module _memory_module = {
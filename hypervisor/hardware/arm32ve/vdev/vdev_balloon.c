@@ -0,0 +1,252 @@
+#include <k-hypervisor-config.h>
+#include <vdev.h>
+#include <memory.h>
+#include <page.h>
+#define DEBUG
+#include <log/print.h>
+
+/**
+ * \defgroup Balloon_registers
+ *
+ * Memory balloon device, one register window per guest.
+ * - TARGET: pages the hypervisor asks the guest to hold in the balloon.
+ * - ACTUAL: pages held in the balloon.
+ * - INFLATE: the guest writes the IPA of a page it gives up. The page is
+ *   unmapped and its frame goes back to the page pool.
+ * - DEFLATE: the guest writes the IPA of a page it takes back, which must
+ *   be in the balloon. The page is backed by a new zeroed frame when the
+ *   guest touches it.
+ * - STATUS: hvmm_status_t of the last inflate or deflate, 0 on success.
+ * @{
+ */
+#define BALLOON_BASE_ADDR       0x3FE00000
+#define BALLOON_TARGET          0x00
+#define BALLOON_ACTUAL          0x04
+#define BALLOON_INFLATE         0x08
+#define BALLOON_DEFLATE         0x0C
+#define BALLOON_STATUS          0x10
+/** @}*/
+
+struct vdev_balloon_regs {
+    uint32_t target;
+    uint32_t actual;
+    uint32_t status;
+    uint32_t floor;             /* target set by vdev_execute() */
+};
+
+static struct vdev_memory_map _vdev_balloon_info = {
+   .base = BALLOON_BASE_ADDR,
+   .size = 0x1000,
+};
+
+static struct vdev_balloon_regs _balloon_regs[NUM_GUESTS_STATIC];
+static struct vdev_balloon_regs _balloon_snapshot[NUM_GUESTS_STATIC];
+
+/**
+ * @brief Moves the target of a guest with the free frames of the page pool.
+ *
+ * Frames given up by one guest back the memory other guests fault in.
+ * Below CFG_BALLOON_LOW_PAGES free frames the guest is asked for the
+ * missing ones, above CFG_BALLOON_HIGH_PAGES it gets the excess back,
+ * down to the target set by vdev_execute().
+ */
+static void vdev_balloon_policy(struct vdev_balloon_regs *regs)
+{
+    struct page_stat stat;
+    uint32_t excess;
+
+    page_get_stat(&stat);
+    if (stat.free < CFG_BALLOON_LOW_PAGES)
+        regs->target = regs->actual + CFG_BALLOON_LOW_PAGES - stat.free;
+    else if (stat.free > CFG_BALLOON_HIGH_PAGES &&
+            regs->target > regs->floor) {
+        excess = stat.free - CFG_BALLOON_HIGH_PAGES;
+        if (excess > regs->target - regs->floor)
+            excess = regs->target - regs->floor;
+        regs->target -= excess;
+    }
+    if (regs->target < regs->floor)
+        regs->target = regs->floor;
+}
+
+static hvmm_status_t vdev_balloon_access_handler(uint32_t write,
+        uint32_t offset, uint32_t *pvalue, enum vdev_access_size access_size)
+{
+    vmid_t vmid = guest_current_vmid();
+    struct vdev_balloon_regs *regs = &_balloon_regs[vmid];
+
+    if (access_size != VDEV_ACCESS_WORD)
+        return HVMM_STATUS_BAD_ACCESS;
+
+    if (!write) {
+        /* READ */
+        switch (offset) {
+        case BALLOON_TARGET:
+            vdev_balloon_policy(regs);
+            *pvalue = regs->target;
+            break;
+        case BALLOON_ACTUAL:
+            *pvalue = regs->actual;
+            break;
+        case BALLOON_STATUS:
+            *pvalue = regs->status;
+            break;
+        default:
+            *pvalue = 0;
+            break;
+        }
+    } else {
+        /* WRITE */
+        switch (offset) {
+        case BALLOON_INFLATE:
+            regs->status = memory_release(vmid, *pvalue & ~0xFFF);
+            if (regs->status == HVMM_STATUS_SUCCESS)
+                regs->actual++;
+            break;
+        case BALLOON_DEFLATE:
+            regs->status = memory_reclaim(vmid, *pvalue & ~0xFFF);
+            if (regs->status == HVMM_STATUS_SUCCESS && regs->actual)
+                regs->actual--;
+            break;
+        default:
+            break;
+        }
+    }
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static int32_t vdev_balloon_read(struct arch_vdev_trigger_info *info,
+                        struct arch_regs *regs)
+{
+    uint32_t offset = info->fipa - _vdev_balloon_info.base;
+
+    return vdev_balloon_access_handler(0, offset, info->value, info->sas);
+}
+
+static int32_t vdev_balloon_write(struct arch_vdev_trigger_info *info,
+                        struct arch_regs *regs)
+{
+    uint32_t offset = info->fipa - _vdev_balloon_info.base;
+
+    return vdev_balloon_access_handler(1, offset, info->value, info->sas);
+}
+
+static int32_t vdev_balloon_post(struct arch_vdev_trigger_info *info,
+                        struct arch_regs *regs)
+{
+    uint8_t isize = 4;
+
+    if (regs->cpsr & 0x20) /* Thumb */
+        isize = 2;
+
+    regs->pc += isize;
+
+    return 0;
+}
+
+/**
+ * @brief Sets the number of pages a guest is asked to hold in its balloon.
+ *
+ * The guest driver polls the TARGET register and inflates or deflates its
+ * balloon to match it. vdev_balloon_policy() may ask for more.
+ *
+ * @param type vmid of the guest.
+ * @param data Target in pages.
+ */
+static hvmm_status_t vdev_balloon_execute(int level, int num, int type,
+        int data)
+{
+    if (type < 0 || type >= NUM_GUESTS_STATIC)
+        return HVMM_STATUS_BAD_ACCESS;
+
+    _balloon_regs[type].target = data;
+    _balloon_regs[type].floor = data;
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_balloon_dump(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_GUESTS_STATIC; i++)
+        printH("balloon vmid %d: target:%d actual:%d status:%x\n", i,
+                _balloon_regs[i].target, _balloon_regs[i].actual,
+                _balloon_regs[i].status);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_balloon_snapshot(vmid_t vmid)
+{
+    _balloon_snapshot[vmid] = _balloon_regs[vmid];
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_balloon_rollback(vmid_t vmid)
+{
+    _balloon_regs[vmid] = _balloon_snapshot[vmid];
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_balloon_clone(vmid_t dst, vmid_t src)
+{
+    /* the clone maps what the template maps, its balloon too */
+    _balloon_regs[dst] = _balloon_regs[src];
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_balloon_reset(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_GUESTS_STATIC; i++) {
+        _balloon_regs[i].target = 0;
+        _balloon_regs[i].actual = 0;
+        _balloon_regs[i].status = HVMM_STATUS_SUCCESS;
+        _balloon_regs[i].floor = 0;
+    }
+    printH("vdev init:'%s'\n", __func__);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+struct vdev_ops _vdev_balloon_ops = {
+    .init = vdev_balloon_reset,
+    .read = vdev_balloon_read,
+    .write = vdev_balloon_write,
+    .post = vdev_balloon_post,
+    .snapshot = vdev_balloon_snapshot,
+    .rollback = vdev_balloon_rollback,
+    .clone = vdev_balloon_clone,
+    .dump = vdev_balloon_dump,
+    .execute = vdev_balloon_execute,
+};
+
+struct vdev_module _vdev_balloon_module = {
+    .name = "K-Hypervisor vDevice Balloon Module",
+    .author = "Kookmin Univ.",
+    .ops = &_vdev_balloon_ops,
+    .tag = VDEV_TAG_BALLOON,
+    .mmio = &_vdev_balloon_info,
+};
+
+hvmm_status_t vdev_balloon_init()
+{
+    hvmm_status_t result = HVMM_STATUS_BUSY;
+
+    result = vdev_register(VDEV_LEVEL_LOW, &_vdev_balloon_module);
+    if (result == HVMM_STATUS_SUCCESS)
+        printH("vdev registered:'%s'\n", _vdev_balloon_module.name);
+    else {
+        printH("%s: Unable to register vdev:'%s' code=%x\n",
+                __func__, _vdev_balloon_module.name, result);
+    }
+
+    return result;
+}
+vdev_module_low_init(vdev_balloon_init);
@@ -0,0 +1,164 @@
+#include <vdev.h>
+#include <memory.h>
+#include <page.h>
+#include <interrupt.h>
+#include <shm_channel.h>
+#define DEBUG
+#include <log/print.h>
+
+/**
+ * \defgroup Channel
+ *
+ * Inter-VM channels, see shm_channel.h for the layout.
+ * - The memory of a channel comes from the page pool and is mapped into
+ *   both of its guests when the cpu running them initializes its vdevs.
+ * - Messages never pass through the hypervisor, only the doorbell does:
+ *   a producer publishes a batch and rings once.
+ * @{
+ */
+#define CHANNEL_ORDER       6       /* SHM_CHANNEL_SIZE in pages */
+/** @}*/
+
+struct channel {
+    vmid_t vmid[2];
+    struct shm_channel_header *shm;
+    uint32_t doorbells[2];          /* rung by end n */
+};
+
+/* Channel n links the two guests of a core */
+static struct channel _channels[] = {
+    { .vmid = { 0, 1 } },
+    { .vmid = { 2, 3 } },
+};
+
+#define NUM_CHANNELS    (sizeof(_channels) / sizeof(_channels[0]))
+
+static hvmm_status_t vdev_channel_setup(uint32_t id)
+{
+    struct channel *ch = &_channels[id];
+    uint32_t ipa = SHM_CHANNEL_IPA + id * SHM_CHANNEL_SIZE;
+    hvmm_status_t ret;
+    int end;
+
+    if (ch->shm)
+        return HVMM_STATUS_SUCCESS;
+
+    ch->shm = page_zalloc(CHANNEL_ORDER);
+    if (!ch->shm)
+        return HVMM_STATUS_BUSY;
+    ch->shm->magic = SHM_CHANNEL_MAGIC;
+    ch->shm->id = id;
+    ch->shm->vmid[0] = ch->vmid[0];
+    ch->shm->vmid[1] = ch->vmid[1];
+    ch->shm->slots = SHM_CHANNEL_SLOTS;
+    ch->shm->slot_size = SHM_CHANNEL_SLOT_SIZE;
+
+    for (end = 0; end < 2; end++) {
+        ret = memory_share_ro(ch->vmid[end], ipa, (uint32_t) ch->shm,
+                SHM_CHANNEL_HEADER_SIZE);
+        if (ret == HVMM_STATUS_SUCCESS)
+            ret = memory_share(ch->vmid[end], ipa + SHM_CHANNEL_HEADER_SIZE,
+                    (uint32_t) ch->shm + SHM_CHANNEL_HEADER_SIZE,
+                    SHM_CHANNEL_SIZE - SHM_CHANNEL_HEADER_SIZE);
+        if (ret != HVMM_STATUS_SUCCESS) {
+            printH("channel %d: vmid %d can not map %x, code=%x\n", id,
+                    ch->vmid[end], ipa, ret);
+            return ret;
+        }
+    }
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Doorbell hypercall, r0 holds the channel id and gets the status.
+ */
+static int32_t vdev_channel_write(struct arch_vdev_trigger_info *info,
+                        struct arch_regs *regs)
+{
+    vmid_t vmid = guest_current_vmid();
+    uint32_t id = regs->gpr[0];
+    struct channel *ch;
+    int end;
+
+    regs->gpr[0] = HVMM_STATUS_BAD_ACCESS;
+    if (id >= NUM_CHANNELS || !_channels[id].shm)
+        return 0;
+
+    ch = &_channels[id];
+    if (ch->vmid[0] == vmid)
+        end = 0;
+    else if (ch->vmid[1] == vmid)
+        end = 1;
+    else
+        return 0;
+
+    ch->doorbells[end]++;
+    regs->gpr[0] = interrupt_guest_local_raise(ch->vmid[!end],
+            SHM_CHANNEL_LOCAL_IRQ);
+
+    return 0;
+}
+
+static hvmm_status_t vdev_channel_dump(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_CHANNELS; i++) {
+        if (_channels[i].shm)
+            printH("channel %d: vmid %d<->%d shm:%x doorbells:%d/%d\n", i,
+                    _channels[i].vmid[0], _channels[i].vmid[1],
+                    (uint32_t) _channels[i].shm, _channels[i].doorbells[0],
+                    _channels[i].doorbells[1]);
+    }
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_channel_reset(void)
+{
+    vmid_t first = guest_first_vmid();
+    vmid_t last = guest_last_vmid();
+    int i;
+
+    for (i = 0; i < NUM_CHANNELS; i++) {
+        if (_channels[i].vmid[0] < first || _channels[i].vmid[0] > last ||
+                _channels[i].vmid[1] < first || _channels[i].vmid[1] > last)
+            continue;
+        if (_channels[i].vmid[1] >= NUM_GUESTS_STATIC)
+            continue;
+        vdev_channel_setup(i);
+    }
+    printH("vdev init:'%s'\n", __func__);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+struct vdev_ops _vdev_channel_ops = {
+    .init = vdev_channel_reset,
+    .write = vdev_channel_write,
+    .dump = vdev_channel_dump,
+};
+
+struct vdev_module _vdev_channel_module = {
+    .name = "K-Hypervisor vDevice Channel Module",
+    .author = "Kookmin Univ.",
+    .ops = &_vdev_channel_ops,
+    .hvc = SHM_CHANNEL_HVC,
+};
+
+hvmm_status_t vdev_channel_init()
+{
+    hvmm_status_t result = HVMM_STATUS_BUSY;
+
+    result = vdev_register(VDEV_LEVEL_MIDDLE, &_vdev_channel_module);
+    if (result == HVMM_STATUS_SUCCESS)
+        printh("vdev registered:'%s'\n", _vdev_channel_module.name);
+    else {
+        printh("%s: Unable to register vdev:'%s' code=%x\n",
+                __func__, _vdev_channel_module.name, result);
+    }
+
+    return result;
+}
+vdev_module_middle_init(vdev_channel_init);
@@ -1,4 +1,6 @@
-#include <vdev.h>
+#include <vdev_reg.h>
+#include <asm_io.h>
+#include <stddef.h>
 #define DEBUG
 #include <log/print.h>
 
@@ -43,10 +45,6 @@ struct cpu_interface_regs {
     uint32_t GICC_DIR; /* 0x1000  Deactivate Interrupt Register */
 };
 
-struct cpu_interface_handler_entry {
-    uint32_t offset;
-    vdev_callback_t handler;
-};
 static struct cpu_interface_regs ci_regs[NUM_GUESTS_STATIC];
 
 static struct vdev_memory_map _vdev_cpu_interface_info = {
@@ -54,180 +52,48 @@ static struct vdev_memory_map _vdev_cpu_interface_info = {
    .size = 1000,
 };
 
-static hvmm_status_t handler_null(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-	printH("cpu interface handler_null\n");
-	return HVMM_STATUS_BAD_ACCESS;
-}
-static hvmm_status_t handler_F(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-	return HVMM_STATUS_BAD_ACCESS;
-}
-static hvmm_status_t handler_E(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-	return HVMM_STATUS_BAD_ACCESS;
-}
-static hvmm_status_t handler_D(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-	return HVMM_STATUS_BAD_ACCESS;
-}
-static hvmm_status_t handler_2(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-	return HVMM_STATUS_BAD_ACCESS;
-}
-static hvmm_status_t handler_1(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
+/* Ends the interrupt the guest took, then deactivates it */
+static hvmm_status_t vdev_cpu_interface_eoi(vmid_t vmid, uint32_t n,
+        uint32_t *reg, uint32_t value, uint32_t mask)
 {
-	return HVMM_STATUS_BAD_ACCESS;
+    ci_regs[0].GICC_IAR = 0x000003FF;
+    putl(value, CPU_INTERFACE_BASE_ADDR + GIC_OFFSET_GICC_DIR);
+
+    return HVMM_STATUS_SUCCESS;
 }
 
-static hvmm_status_t handler_0(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-	/* CTLR, PMR, BPR, IAR */
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    vmid_t vmid = guest_current_vmid();
-    struct cpu_interface_regs *regs = &ci_regs[vmid];
-    uint32_t woffset = offset / 4;
-    switch (woffset) {
-    case GIC_OFFSET_GICC_CTLR: /* RW */
-        if (write)
-            regs->GICC_CTLR = *pvalue;
-        else
-            *pvalue = regs->GICC_CTLR;
-        result = HVMM_STATUS_SUCCESS;
-        break;
-    case GIC_OFFSET_GICC_PMR: /* RO */
-        if (write) {
-            regs->GICC_PMR = *pvalue;
-        } else
-        	*pvalue = regs->GICC_PMR;
-
-        result = HVMM_STATUS_SUCCESS;
-        break;
-    case GIC_OFFSET_GICC_BPR: /* RO */
-        if (write) {
-            regs->GICC_BPR = *pvalue;
-        } else
-        	*pvalue = regs->GICC_BPR;
-        result = HVMM_STATUS_SUCCESS;
-        break;
-    case GIC_OFFSET_GICC_IAR:
-        if (write) {
-            regs->GICC_IAR = *pvalue;
-        } else
-        	*pvalue = regs->GICC_IAR;
-        result = HVMM_STATUS_SUCCESS;
-    	break;
-//    default: { /* RW GICD_IGROUPR */
-//        int igroup = woffset - GICD_IGROUPR;
-//        if (igroup >= 0 && igroup < VGICD_NUM_IGROUPR) {
-//            if (write)
-//                regs->IGROUPR[igroup] = *pvalue;
-//            else
-//                *pvalue = regs->IGROUPR[igroup];
-//
-//            result = HVMM_STATUS_SUCCESS;
-//        }
-//    }
-//        break;
-    }
-    if (result != HVMM_STATUS_SUCCESS)
-        printH("vgicd: invalid access offset:%x write:%d\n", offset,
-                write);
+/*
+ * The guest sees the hardware cpu interface, but for the interrupt it
+ * acknowledges: IAR reads what the hypervisor injected.
+ */
+static const struct vdev_reg _cpu_interface_regs[] = {
+    { GIC_OFFSET_GICC_CTLR, 3, VDEV_REG_PASS, VDEV_ACCESS_BYTE },
+    { GIC_OFFSET_GICC_IAR, 1, VDEV_REG_R | VDEV_REG_HW_W, VDEV_ACCESS_BYTE,
+      offsetof(struct cpu_interface_regs, GICC_IAR) },
+    { GIC_OFFSET_GICC_EOIR, 1, VDEV_REG_PASS, VDEV_ACCESS_BYTE, 0, 0,
+      vdev_cpu_interface_eoi },
+    { GIC_OFFSET_GICC_RPR, 245, VDEV_REG_PASS, VDEV_ACCESS_BYTE },
+};
 
-    return result;
-}
-static struct cpu_interface_handler_entry _ci_handler_map[0x10] = {
-/* 0x00 ~ 0x0F */
-{ 0x00, handler_0 }, /* CTLR, PMR, BPR, IAR */
-{ 0x01, handler_1 }, /* EOIR, RPR, HPPIR, ABPR */
-{ 0x02, handler_2 }, /* AIAR, AEOIR, AHPPIR */
-{ 0x03, handler_null},
-{ 0x04, handler_null},
-{ 0x05, handler_null},
-{ 0x06, handler_null},
-{ 0x07, handler_null},
-{ 0x08, handler_null},
-{ 0x09, handler_null},
-{ 0x0A, handler_null},
-{ 0x0B, handler_null},
-{ 0x0C, handler_null},
-{ 0x0D, handler_D}, /* APRN */
-{ 0x0E, handler_E }, /* NSAPRN */
-{ 0x0F, handler_F }, /* IIDR */
-//{ 0x0F, handler_F }, /* IIDR */
+static uint8_t _cpu_interface_index[1000 / 4];
+
+static struct vdev_regmap _cpu_interface_map = {
+    .regs = _cpu_interface_regs,
+    .nregs = sizeof(_cpu_interface_regs) / sizeof(_cpu_interface_regs[0]),
+    .size = 1000,
+    .hw_base = CPU_INTERFACE_BASE_ADDR,
+    .state = (uint8_t *) &ci_regs[0],
+    .stride = 0,        /* one guest takes the interrupts */
+    .index = _cpu_interface_index,
 };
-//static hvmm_status_t vdev_cpu_interface_access_handler(uint32_t write, uint32_t offset,
-//        uint32_t *pvalue, enum vdev_access_size access_size)
-//{
-//    printH("%s: %s offset:%x value:%x access_size : %d\n", __func__,
-//            write ? "write" : "read", offset,
-//            write ? *pvalue : (uint32_t) pvalue, access_size);
-//    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-//
-//
-//    // DIR
-//
-//    uint8_t offsetidx = (uint8_t) ((offset & 0xF0) >> 4);
-//    printH("offset_idx : %d\n", offsetidx);
-//    result = _ci_handler_map[offsetidx].handler(write, offset, pvalue,
-//            access_size);
-//
-//    return result;
-//}
 
 static hvmm_status_t vdev_cpu_interface_access_handler(uint32_t write, uint32_t offset,
         uint32_t *pvalue, enum vdev_access_size access_size)
 {
-
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    unsigned int vmid = guest_current_vmid();
-    volatile int *addr;
-    addr = (CPU_INTERFACE_BASE_ADDR + offset);
-    volatile int *daddr = (CPU_INTERFACE_BASE_ADDR + GIC_OFFSET_GICC_DIR);
-    if (offset == 20)
-    	printH("iar = %d\n", *addr & 0x03ff);
-    if (offset == 24)
-    	printH("eoi = %d\n", *addr & 0x03ff);
-    if (!write) {
-        /* READ */
-    	*pvalue =  (uint32_t) (*((volatile unsigned int*) (CPU_INTERFACE_BASE_ADDR + offset)));
-
-//        if (offset == 20)
-//        	*pvalue = 34;
-        if (offset == 0x0C) {
-        	*pvalue = ci_regs[0].GICC_IAR;
-        	printH("READ 0x0C: GICC_IAR %x\n", *pvalue);
-        }
-//    	printH("1111111111111 %x\n", *pvalue);
-       } else {
-        /* WRITE */
-        	if (offset == 0x10) {
-//        		ci_regs[0].GICC_IAR = -1;
-        		printH("WRITE 0x10: ci_regs[0].GICC_IAR = -1  %x\n", *pvalue);
-
-        		ci_regs[0].GICC_IAR = 0x000003FF ;
-        		*daddr = *pvalue;
-                int *dir = 0x2c001000;
-//                *dir = *pvalue;
-
-        	}
-    	*addr = *pvalue;
-
-    }
-    printH("%s: %s offset:%x value:%x\n", __func__,
-            write ? "write" : "read", offset,
-            write ? *pvalue : *pvalue);
-//    printH("AAAAAAAAAAAAAA %x\n", *addr);
-    result = HVMM_STATUS_SUCCESS;
-    return result;
+    return vdev_regmap_access(&_cpu_interface_map, write, offset, pvalue,
+            access_size);
 }
+
 static hvmm_status_t vdev_cpu_interface_read(struct arch_vdev_trigger_info *info,
                         struct arch_regs *regs)
 {
@@ -257,34 +123,21 @@ static int32_t vdev_cpu_interface_post(struct arch_vdev_trigger_info *info,
     return 0;
 }
 
-static int32_t vdev_cpu_interface_check(struct arch_vdev_trigger_info *info,
-                        struct arch_regs *regs)
-{
-    uint32_t offset = info->fipa - _vdev_cpu_interface_info.base;
-
-    if (info->fipa >= _vdev_cpu_interface_info.base &&
-        offset < _vdev_cpu_interface_info.size)
-        return 0;
-    /**
-     * Find vdev using tag.  Hard coding.
-     */
-    if( !regs ) {
-    	return 55;
-    }
-    return VDEV_NOT_FOUND;
-}
 
 
 
 
 static hvmm_status_t vdev_cpu_interface_reset(void)
 {
-
-
-    printH("vdev init:'%s'\n", __func__);
+    hvmm_status_t result;
     int j = 0;
     int i = 0;
 
+    printH("vdev init:'%s'\n", __func__);
+    result = vdev_regmap_init(&_cpu_interface_map);
+    if (result != HVMM_STATUS_SUCCESS)
+        return result;
+
     for (i = 0; i < NUM_GUESTS_STATIC; i++) {
 
     	ci_regs[i].GICC_CTLR =
@@ -382,7 +235,6 @@ static hvmm_status_t vdev_cpu_interface_execute(int level, int num, int type, in
 
 struct vdev_ops _vdev_cpu_interface_ops = {
     .init = vdev_cpu_interface_reset,
-    .check = vdev_cpu_interface_check,
     .read = vdev_cpu_interface_read,
     .write = vdev_cpu_interface_write,
     .post = vdev_cpu_interface_post,
@@ -393,7 +245,8 @@ struct vdev_module _vdev_cpu_interface_module = {
     .name = "K-Hypervisor vDevice cpu_interface Module",
     .author = "Kookmin Univ.",
     .ops = &_vdev_cpu_interface_ops,
-    .tag = 55,
+    .tag = VDEV_TAG_CPU_INTERFACE,
+    .mmio = &_vdev_cpu_interface_info,
 };
 
 hvmm_status_t vdev_cpu_interface()
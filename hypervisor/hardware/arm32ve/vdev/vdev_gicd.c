@@ -1,7 +1,8 @@
 #include <gic.h>
 #include <gic_regs.h>
-#include <vdev.h>
+#include <vdev_reg.h>
 #include <asm-arm_inline.h>
+#include <stddef.h>
 
 #define DEBUG
 #include <log/print.h>
@@ -71,115 +72,14 @@ struct gicd_regs {
 /* 0xFD0 ~ 0xFFC RO Cortex-A15 PIDRn, CIDRn */
 };
 
-struct gicd_handler_entry {
-    uint32_t offset;
-    vdev_callback_t handler;
-};
-
-static hvmm_status_t
-handler_000(uint32_t write, uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size);
-static hvmm_status_t
-handler_ISCENABLER(uint32_t write, uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size);
-static hvmm_status_t
-handler_ISCPENDR(uint32_t write, uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size);
-static hvmm_status_t
-handler_ISCACTIVER(uint32_t write, uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size);
-static hvmm_status_t
-handler_IPRIORITYR(uint32_t write, uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size);
-static hvmm_status_t
-handler_ITARGETSR(uint32_t write, uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size);
-static hvmm_status_t
-handler_ICFGR(uint32_t write, uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size);
-static hvmm_status_t
-handler_PPISPISR_CA15(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size);
-static hvmm_status_t
-handler_NSACR(uint32_t write, uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size);
-static hvmm_status_t
-handler_F00(uint32_t write, uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size);
-
 static struct vdev_memory_map _vdev_gicd_info = { .base =
         CFG_GIC_BASE_PA | GIC_OFFSET_GICD, .size = 4096, };
 static struct gicd_regs _regs[NUM_GUESTS_STATIC];
-
-static struct gicd_handler_entry _handler_map[0x10] = {
-/* 0x00 ~ 0x0F */
-{ 0x00, handler_000 }, /* CTLR, TYPER, IIDR, IGROUPR */
-{ 0x01, handler_ISCENABLER }, /* ISENABLER, ICENABLER */
-{ 0x02, handler_ISCPENDR }, /* ISPENDR, ICPENDR */
-{ 0x03, handler_ISCACTIVER }, /* ISACTIVER */
-{ 0x04, handler_IPRIORITYR }, /* IPRIORITYR */
-{ 0x05, handler_IPRIORITYR }, { 0x06, handler_IPRIORITYR }, { 0x07,
-        handler_IPRIORITYR }, { 0x08, handler_ITARGETSR }, /* ITARGETSR */
-{ 0x09, handler_ITARGETSR }, { 0x0A, handler_ITARGETSR }, { 0x0B,
-        handler_ITARGETSR }, { 0x0C, handler_ICFGR }, /* ICFGR */
-{ 0x0D, handler_PPISPISR_CA15 }, /* PPISPISR */
-{ 0x0E, handler_NSACR }, /* NSACR */
-{ 0x0F, handler_F00 }, /* SGIR, CPENDSGIR, SPENDGIR, ICPIDR2 */
-};
+static struct gicd_regs _regs_snapshot[NUM_GUESTS_STATIC];
 
 /* old status */
 static uint32_t old_vgicd_status[NUM_GUESTS_STATIC][NUM_STATUS_WORDS] = { { 0, }, };
-
-static hvmm_status_t handler_000(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-    /* CTLR;              0x000 RW*/
-    /* TYPER;             RO*/
-    /* IIDR;              RO*/
-    /* IGROUPR[32];       0x080 ~ 0x0FF */
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    vmid_t vmid = guest_current_vmid();
-    struct gicd_regs *regs = &_regs[vmid];
-    uint32_t woffset = offset / 4;
-    switch (woffset) {
-    case GICD_CTLR: /* RW */
-        if (write)
-            regs->CTLR = *pvalue;
-        else
-            *pvalue = regs->CTLR;
-        result = HVMM_STATUS_SUCCESS;
-        break;
-    case GICD_TYPER: /* RO */
-        if (write == 0) {
-            *pvalue = regs->TYPER;
-            result = HVMM_STATUS_SUCCESS;
-        }
-        break;
-    case GICD_IIDR: /* RO */
-        if (write == 0) {
-            *pvalue = regs->IIDR;
-            result = HVMM_STATUS_SUCCESS;
-        }
-        break;
-    default: { /* RW GICD_IGROUPR */
-        int igroup = woffset - GICD_IGROUPR;
-        if (igroup >= 0 && igroup < VGICD_NUM_IGROUPR) {
-            if (write)
-                regs->IGROUPR[igroup] = *pvalue;
-            else
-                *pvalue = regs->IGROUPR[igroup];
-
-            result = HVMM_STATUS_SUCCESS;
-        }
-    }
-        break;
-    }
-    if (result != HVMM_STATUS_SUCCESS)
-        printH("vgicd: invalid access offset:%x write:%d\n", offset,
-                write);
-
-    return result;
-}
+static uint32_t old_vgicd_snapshot[NUM_GUESTS_STATIC][NUM_STATUS_WORDS];
 
 static void vgicd_changed_istatus(vmid_t vmid, uint32_t istatus,
         uint8_t word_offset)
@@ -218,267 +118,97 @@ static void vgicd_changed_istatus(vmid_t vmid, uint32_t istatus,
     old_vgicd_status[vmid][word_offset] = istatus;
 }
 
-static hvmm_status_t handler_ISCENABLER(uint32_t write,
-        uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size)
+static hvmm_status_t vgicd_set_enable(vmid_t vmid, uint32_t n,
+        uint32_t *reg, uint32_t value, uint32_t mask)
 {
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    vmid_t vmid = guest_current_vmid();
-    struct gicd_regs *regs = &_regs[vmid];
-    uint32_t *preg_s;
-    uint32_t *preg_c;
-    if (write && *pvalue == 0) {
-        /* Writes 0 -> Has no effect. */
-        result = HVMM_STATUS_SUCCESS;
-        return result;
-    }
-    preg_s = &(regs->ISCENABLER[(offset >> 2) - GICD_ISENABLER]);
-    preg_c = &(regs->ISCENABLER[(offset >> 2) - GICD_ICENABLER]);
-    if (access_size == VDEV_ACCESS_WORD) {
-        if ((offset >> 2) < (GICD_ISENABLER + VGICD_NUM_IENABLER)) {
-            /* ISENABLER */
-            if (write) {
-                *preg_s |= *pvalue;
-                vgicd_changed_istatus(vmid, *preg_s,
-                        (offset >> 2) - GICD_ISENABLER);
-            } else
-                *pvalue = *preg_s;
-
-            result = HVMM_STATUS_SUCCESS;
-        } else if ((offset >> 2) >= GICD_ICENABLER
-                && (offset >> 2)
-                        < (GICD_ICENABLER + VGICD_NUM_IENABLER)) {
-            /* ICENABLER */
-            if (write) {
-                *preg_c &= ~(*pvalue);
-                vgicd_changed_istatus(vmid, *preg_c,
-                        (offset >> 2) - GICD_ICENABLER);
-            } else
-                *pvalue = *preg_c;
-
-            result = HVMM_STATUS_SUCCESS;
-        }
-    } else if (access_size == VDEV_ACCESS_HWORD) {
-        if ((offset >> 2) < (GICD_ISENABLER + VGICD_NUM_IENABLER)) {
-            uint16_t *preg_s16 = (uint16_t *) preg_s;
-            preg_s16 += (offset & 0x3) >> 1;
-            if (write) {
-                *preg_s16 |= (uint16_t) (*pvalue & 0xFFFF);
-                vgicd_changed_istatus(vmid, *preg_s,
-                        (offset >> 2) - GICD_ISENABLER);
-            } else
-                *pvalue = (uint32_t) *preg_s16;
-
-            result = HVMM_STATUS_SUCCESS;
-        } else if ((offset >> 2) >= GICD_ICENABLER
-                && (offset >> 2)
-                        < (GICD_ICENABLER + VGICD_NUM_IENABLER)) {
-            uint16_t *preg_c16 = (uint16_t *) preg_c;
-            preg_c16 += (offset & 0x3) >> 1;
-            if (write) {
-                *preg_c16 &= ~((uint16_t) (*pvalue & 0xFFFF));
-                vgicd_changed_istatus(vmid, *preg_c,
-                        (offset >> 2) - GICD_ICENABLER);
-            } else
-                *pvalue = (uint32_t) *preg_c16;
-
-            result = HVMM_STATUS_SUCCESS;
-        }
-    } else if (access_size == VDEV_ACCESS_BYTE) {
-        if ((offset >> 2) < (GICD_ISENABLER + VGICD_NUM_IENABLER)) {
-            uint8_t *preg_s8 = (uint8_t *) preg_s;
-            preg_s8 += (offset & 0x3);
-            if (write) {
-                *preg_s8 |= (uint8_t) (*pvalue & 0xFF);
-                vgicd_changed_istatus(vmid, *preg_s,
-                        (offset >> 2) - GICD_ISENABLER);
-            } else
-                *pvalue = (uint32_t) *preg_s8;
-
-            result = HVMM_STATUS_SUCCESS;
-        } else if ((offset >> 2) >= GICD_ICENABLER
-                && (offset >> 2)
-                        < (GICD_ICENABLER + VGICD_NUM_IENABLER)) {
-            uint8_t *preg_c8 = (uint8_t *) preg_c;
-            preg_c8 += (offset & 0x3);
-            if (write) {
-                *preg_c8 &= ~((uint8_t) (*pvalue & 0xFF));
-                vgicd_changed_istatus(vmid, *preg_c,
-                        (offset >> 2) - GICD_ICENABLER);
-            } else
-                *pvalue = (uint32_t) *preg_c8;
-
-            result = HVMM_STATUS_SUCCESS;
-        }
-    }
-    return result;
-}
+    *reg |= value;
+    vgicd_changed_istatus(vmid, *reg, n);
 
-static hvmm_status_t handler_ISCPENDR(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    vmid_t vmid = guest_current_vmid();
-    struct gicd_regs *regs = &_regs[vmid];
-    uint32_t *preg_s;
-    uint32_t *preg_c;
-    preg_s = &(regs->ISCPENDR[(offset >> 2) - GICD_ISPENDR]);
-    preg_c = &(regs->ISCPENDR[(offset >> 2) - GICD_ICPENDR]);
-    offset >>= 2;
-    if (access_size == VDEV_ACCESS_WORD) {
-        if ((offset >> 2) < (GICD_ISPENDR + VGICD_NUM_IENABLER)) {
-            /* ISPEND */
-            if (write)
-                *preg_s |= *pvalue;
-            else
-                *pvalue = *preg_s;
-            result = HVMM_STATUS_SUCCESS;
-        } else if ((offset >> 2) >= GICD_ICPENDR
-                && (offset >> 2)
-                        < (GICD_ICPENDR + VGICD_NUM_IENABLER)) {
-            /* ICPEND */
-            if (write)
-                *preg_c &= ~(*pvalue);
-            else
-                *pvalue = *preg_c;
-            result = HVMM_STATUS_SUCCESS;
-        }
-    }
-    printh("vgicd:%s: not implemented\n", __func__);
-    return result;
+    return HVMM_STATUS_SUCCESS;
 }
 
-static hvmm_status_t handler_ISCACTIVER(uint32_t write,
-        uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size)
+static hvmm_status_t vgicd_clear_enable(vmid_t vmid, uint32_t n,
+        uint32_t *reg, uint32_t value, uint32_t mask)
 {
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    printh("vgicd:%s: not implemented\n", __func__);
-    return result;
-}
+    *reg &= ~value;
+    vgicd_changed_istatus(vmid, *reg, n);
 
-static hvmm_status_t handler_IPRIORITYR(uint32_t write,
-        uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size)
-{
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    vmid_t vmid;
-    struct gicd_regs *regs;
-    uint32_t *preg;
-    vmid = guest_current_vmid();
-    regs = &_regs[vmid];
-    /* FIXME: Support 8/16/32bit access */
-    offset >>= 2;
-    preg = &(regs->IPRIORITYR[offset - GICD_IPRIORITYR]);
-    if (write)
-        *preg = *pvalue;
-    else
-        *pvalue = *preg;
-
-    result = HVMM_STATUS_SUCCESS;
-    return result;
+    return HVMM_STATUS_SUCCESS;
 }
 
-static hvmm_status_t handler_ITARGETSR(uint32_t write,
-        uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size)
+static hvmm_status_t vgicd_set_pending(vmid_t vmid, uint32_t n,
+        uint32_t *reg, uint32_t value, uint32_t mask)
 {
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    vmid_t vmid;
-    struct gicd_regs *regs;
-    uint32_t *preg;
-    vmid = guest_current_vmid();
-    regs = &_regs[vmid];
-    preg = &(regs->ITARGETSR[(offset >> 2) - GICD_ITARGETSR]);
-    if (access_size == VDEV_ACCESS_WORD) {
-        offset >>= 2;
-        if (write) {
-            if (offset > (GICD_ITARGETSR + 7)) {
-                /* RO: ITARGETSR0 ~ 7 */
-                *preg = *pvalue;
-            }
-        } else {
-            *pvalue = *preg;
-        }
-    } else if (access_size == VDEV_ACCESS_HWORD) {
-        uint16_t *preg16 = (uint16_t *) preg;
-        preg16 += (offset & 0x3) >> 1;
-        if (write) {
-            if ((offset >> 2) > (GICD_ITARGETSR + 7))
-                *preg16 = (uint16_t) (*pvalue & 0xFFFF);
-        } else
-            *pvalue = (uint32_t) *preg16;
-    } else if (access_size == VDEV_ACCESS_BYTE) {
-        uint8_t *preg8 = (uint8_t *) preg;
-        preg8 += (offset & 0x3);
-        if (write) {
-            if ((offset >> 2) > (GICD_ITARGETSR + 7))
-                *preg8 = (uint8_t) (*pvalue & 0xFF);
-        } else
-            *pvalue = (uint32_t) *preg8;
-    }
-    result = HVMM_STATUS_SUCCESS;
-    return result;
-}
+    *reg |= value;
 
-static hvmm_status_t handler_ICFGR(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    vmid_t vmid;
-    struct gicd_regs *regs;
-    uint32_t *preg;
-    vmid = guest_current_vmid();
-    regs = &_regs[vmid];
-    /* FIXME: Support 8/16/32bit access */
-    offset >>= 2;
-    preg = &(regs->ICFGR[offset - GICD_ICFGR]);
-    if (write)
-        *preg = *pvalue;
-    else
-        *pvalue = *preg;
-    result = HVMM_STATUS_SUCCESS;
-    return result;
+    return HVMM_STATUS_SUCCESS;
 }
 
-static hvmm_status_t handler_PPISPISR_CA15(uint32_t write,
-        uint32_t offset, uint32_t *pvalue,
-        enum vdev_access_size access_size)
+static hvmm_status_t vgicd_clear_pending(vmid_t vmid, uint32_t n,
+        uint32_t *reg, uint32_t value, uint32_t mask)
 {
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    printh("vgicd:%s: not implemented\n", __func__);
-    return result;
-}
+    *reg &= ~value;
 
-static hvmm_status_t handler_NSACR(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    printh("vgicd:%s: not implemented\n", __func__);
-    return result;
+    return HVMM_STATUS_SUCCESS;
 }
 
-static hvmm_status_t handler_F00(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    printh("vgicd:%s: not implemented\n", __func__);
-    return result;
-}
+#define GICD_REG(off, n, flags, size, field, write) \
+    { off, n, (flags) | VDEV_REG_RESET_HW, size, \
+      offsetof(struct gicd_regs, field), 0, write }
+
+/*
+ * Registers of a guest, all loaded from the distributor at reset. The set
+ * and clear registers of a pair share their storage, only the set one
+ * loads it, the clear one is VDEV_REG_NO_RESET. ACTIVER, PPISPISR, NSACR
+ * and SGIR are not emulated.
+ */
+static const struct vdev_reg _gicd_regs[] = {
+    GICD_REG(GICD_OFFSET_CTLR, 1, VDEV_REG_RW, VDEV_ACCESS_WORD, CTLR, 0),
+    GICD_REG(GICD_OFFSET_TYPER, 1, VDEV_REG_RO, VDEV_ACCESS_WORD, TYPER, 0),
+    GICD_REG(GICD_OFFSET_IIDR, 1, VDEV_REG_RO, VDEV_ACCESS_WORD, IIDR, 0),
+    GICD_REG(GICD_OFFSET_IGROUPR, VGICD_NUM_IGROUPR, VDEV_REG_RW,
+            VDEV_ACCESS_WORD, IGROUPR, 0),
+    GICD_REG(GICD_OFFSET_ISENABLER, VGICE_NUM_ISCENABLER, VDEV_REG_R,
+            VDEV_ACCESS_BYTE, ISCENABLER, vgicd_set_enable),
+    { GICD_OFFSET_ICENABLER, VGICE_NUM_ISCENABLER,
+      VDEV_REG_R | VDEV_REG_NO_RESET, VDEV_ACCESS_BYTE,
+      offsetof(struct gicd_regs, ISCENABLER), 0,
+      vgicd_clear_enable },
+    GICD_REG(GICD_OFFSET_ISPENDR, VGICE_NUM_ISCPENDR, VDEV_REG_R,
+            VDEV_ACCESS_BYTE, ISCPENDR, vgicd_set_pending),
+    { GICD_OFFSET_ICPENDR, VGICE_NUM_ISCPENDR,
+      VDEV_REG_R | VDEV_REG_NO_RESET, VDEV_ACCESS_BYTE,
+      offsetof(struct gicd_regs, ISCPENDR), 0,
+      vgicd_clear_pending },
+    GICD_REG(GICD_OFFSET_IPRIORITYR, VGICE_NUM_IPRIORITYR, VDEV_REG_RW,
+            VDEV_ACCESS_BYTE, IPRIORITYR, 0),
+    /* ITARGETSR0 ~ 7 are RO */
+    GICD_REG(GICD_OFFSET_ITARGETSR, 8, VDEV_REG_RO, VDEV_ACCESS_BYTE,
+            ITARGETSR, 0),
+    GICD_REG(GICD_OFFSET_ITARGETSR + 8 * 4, VGICE_NUM_ITARGETSR - 8,
+            VDEV_REG_RW, VDEV_ACCESS_BYTE, ITARGETSR[8], 0),
+    GICD_REG(GICD_OFFSET_ICFGR, VGICE_NUM_ICFGR, VDEV_REG_RW,
+            VDEV_ACCESS_BYTE, ICFGR, 0),
+};
+
+static uint8_t _gicd_index[4096 / 4];
+
+static struct vdev_regmap _gicd_map = {
+    .regs = _gicd_regs,
+    .nregs = sizeof(_gicd_regs) / sizeof(_gicd_regs[0]),
+    .size = 4096,
+    .hw_base = CFG_GIC_BASE_PA + GIC_OFFSET_GICD,
+    .state = (uint8_t *) _regs,
+    .stride = sizeof(struct gicd_regs),
+    .index = _gicd_index,
+};
 
 static hvmm_status_t vdev_gicd_access_handler(uint32_t write,
         uint32_t offset, uint32_t *pvalue,
         enum vdev_access_size access_size)
 {
-    printH("%s: %s offset:%x value:%x access_size : %d\n", __func__,
-            write ? "write" : "read", offset,
-            write ? *pvalue : (uint32_t) pvalue, access_size);
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    uint8_t offsetidx = (uint8_t) ((offset & 0xF00) >> 8);
-    printh("offset_idx : %d\n", offsetidx);
-    result = _handler_map[offsetidx].handler(write, offset, pvalue,
+    return vdev_regmap_access(&_gicd_map, write, offset, pvalue,
             access_size);
-    return result;
 }
 
 static int32_t vdev_gicd_read(struct arch_vdev_trigger_info *info,
@@ -509,136 +239,87 @@ static int32_t vdev_gicd_post(struct arch_vdev_trigger_info *info,
     return 0;
 }
 
-static int32_t vdev_gicd_check(struct arch_vdev_trigger_info *info,
-        struct arch_regs *regs)
-{
-    uint32_t offset = info->fipa - _vdev_gicd_info.base;
-
-    if (info->fipa >= _vdev_gicd_info.base
-            && offset < _vdev_gicd_info.size)
-        return 0;
-    return VDEV_NOT_FOUND;
-}
-
 static hvmm_status_t vdev_gicd_reset_values(void)
 {
-    hvmm_status_t result = HVMM_STATUS_SUCCESS;
-    int i;
+    hvmm_status_t result;
+    int i, j;
 
     printh("vdev init:'%s'\n", __func__);
 
+    result = vdev_regmap_init(&_gicd_map);
+    if (result != HVMM_STATUS_SUCCESS)
+        return result;
+
     for (i = 0; i < NUM_GUESTS_STATIC; i++) {
         /*
          * ITARGETS[0~ 7], CPU Targets are set to 0,
          * due to current single-core support design
          */
-        int j = 0;
-        uint32_t inc_address = 0x00000000;
-
-        _regs[i].CTLR =
-                (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                        + GIC_OFFSET_GICD)));
-        _regs[i].TYPER =
-                (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                        + GIC_OFFSET_GICD + GICD_OFFSET_TYPER)));
-        _regs[i].IIDR =
-                (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                        + GIC_OFFSET_GICD + 0x8)));
+        vdev_regmap_reset(&_gicd_map, i);
         printH("vdev init:'%s' vmid:%d, gicd TYPER:%x\n", __func__, i,
                 _regs[i].TYPER);
         printH("vdev init:'%s' vmid:%d, gicd IIDR:%x\n", __func__, i,
                 _regs[i].IIDR);
-        for (j = 0; j < VGICD_NUM_IGROUPR; j++) {
-            _regs[i].IGROUPR[j] =
-                    (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                            + GIC_OFFSET_GICD + inc_address)));
-            inc_address += 0x00000004;
+        for (j = 0; j < VGICE_NUM_ISCENABLER; j++)
+            old_vgicd_status[i][j] = _regs[i].ISCENABLER[j];
+        vdev_regmap_sync(&_gicd_map, i);
+    }
+#ifdef _VDEV_SHADOW_
+    /* the guests of this cpu read the distributor without trapping */
+    for (i = guest_first_vmid(); i <= guest_last_vmid(); i++) {
+        if (vdev_regmap_shadow(&_gicd_map, i, _vdev_gicd_info.base) !=
+                HVMM_STATUS_SUCCESS)
+            printh("vgicd: no shadow page for vmid %d\n", i);
+    }
+#endif
 
-        }
+    return result;
+}
 
-        inc_address = 0x00000000;
-        for (j = 0; j < VGICE_NUM_ISCENABLER; j++) {
-            _regs[i].ISCENABLER[j] =
-                    (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                            + GIC_OFFSET_GICD + GICD_OFFSET_ICENABLER
-                            + inc_address)));
-            old_vgicd_status[i][(inc_address) >> 2] =
-                    _regs[i].ISCENABLER[j];
-            inc_address += 0x00000004;
-        }
-        inc_address = 0x00000000;
-        for (j = 0; j < VGICE_NUM_ISCPENDR; j++) {
-            _regs[i].ISCPENDR[j] =
-                    (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                            + GIC_OFFSET_GICD + GICD_OFFSET_ICPENDR
-                            + inc_address)));
-            inc_address += 0x00000004;
-        }
-        inc_address = 0x00000000;
-        for (j = 0; j < VGICE_NUM_ISCACTIVER; j++) {
-            _regs[i].ISCACTIVER[j] =
-                    (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                            + GIC_OFFSET_GICD + GICD_OFFSET_ISCACTIVER
-                            + inc_address)));
-
-            inc_address += 0x00000004;
-        }
+static hvmm_status_t vdev_gicd_snapshot(vmid_t vmid)
+{
+    int i;
 
-        inc_address = 0x00000000;
+    _regs_snapshot[vmid] = _regs[vmid];
+    for (i = 0; i < NUM_STATUS_WORDS; i++)
+        old_vgicd_snapshot[vmid][i] = old_vgicd_status[vmid][i];
 
-        for (j = 0; j < VGICE_NUM_IPRIORITYR; j++) {
-            _regs[i].IPRIORITYR[j] =
-                    (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                            + GIC_OFFSET_GICD + GICD_OFFSET_IPRIORITYR
-                            + inc_address)));
+    return HVMM_STATUS_SUCCESS;
+}
 
-            inc_address += 0x00000004;
-        }
+static hvmm_status_t vdev_gicd_rollback(vmid_t vmid)
+{
+    int i;
 
-        inc_address = 0x00000000;
-        for (j = 0; j < VGICE_NUM_ITARGETSR; j++) {
-            _regs[i].ITARGETSR[j] =
-                    (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                            + GIC_OFFSET_GICD + GICD_OFFSET_ITARGETSR
-                            + inc_address)));
-            inc_address += 0x00000004;
-        }
+    _regs[vmid] = _regs_snapshot[vmid];
+    for (i = 0; i < NUM_STATUS_WORDS; i++)
+        old_vgicd_status[vmid][i] = old_vgicd_snapshot[vmid][i];
+    vdev_regmap_sync(&_gicd_map, vmid);
 
-        inc_address = 0x00000000;
-        for (j = 0; j < VGICE_NUM_ICFGR; j++) {
-            _regs[i].ICFGR[j] =
-                    (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                            + GIC_OFFSET_GICD + GICD_OFFSET_ICFGR
-                            + inc_address)));
-            inc_address += 0x00000004;
-        }
+    return HVMM_STATUS_SUCCESS;
+}
 
-        _regs[i].SGIR =
-                (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                        + GIC_OFFSET_GICD + 0xF00)));
-
-        inc_address = 0x00000000;
-        for (j = 0; j < VGICE_NUM_CPENDSGIR; j++) {
-            _regs[i].CPENDSGIR[j] =
-                    (uint32_t) (*((volatile unsigned int*) (CFG_GIC_BASE_PA
-                            + GIC_OFFSET_GICD + GICD_OFFSET_CPENDGIR
-                            + inc_address)));
-            inc_address += 0x00000004;
-        }
+static hvmm_status_t vdev_gicd_clone(vmid_t dst, vmid_t src)
+{
+    int i;
 
-        inc_address = 0x00000000;
-    }
+    _regs[dst] = _regs[src];
+    for (i = 0; i < NUM_STATUS_WORDS; i++)
+        old_vgicd_status[dst][i] = old_vgicd_status[src][i];
+    vdev_regmap_sync(&_gicd_map, dst);
 
-    return result;
+    return HVMM_STATUS_SUCCESS;
 }
 
 struct vdev_ops _vdev_gicd_ops = { .init = vdev_gicd_reset_values,
-        .check = vdev_gicd_check, .read = vdev_gicd_read, .write =
-                vdev_gicd_write, .post = vdev_gicd_post, };
+        .read = vdev_gicd_read, .write =
+                vdev_gicd_write, .post = vdev_gicd_post,
+        .snapshot = vdev_gicd_snapshot, .rollback = vdev_gicd_rollback,
+        .clone = vdev_gicd_clone, };
 
 struct vdev_module _vdev_gicd_module = { .name =
         "K-Hypervisor vDevice GICD Module", .author = "Kookmin Univ.",
-        .ops = &_vdev_gicd_ops, };
+        .ops = &_vdev_gicd_ops, .mmio = &_vdev_gicd_info, };
 
 hvmm_status_t vdev_gicd_init()
 {
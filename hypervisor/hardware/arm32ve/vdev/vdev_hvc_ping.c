@@ -10,15 +10,6 @@ static int32_t vdev_hvc_ping_write(struct arch_vdev_trigger_info *info,
     return 0;
 }
 
-static int32_t vdev_hvc_ping_check(struct arch_vdev_trigger_info *info,
-                        struct arch_regs *regs)
-{
-    if ((info->iss & 0xFFFF) == 0xFFFE)
-        return 0;
-
-    return VDEV_NOT_FOUND;
-}
-
 static hvmm_status_t vdev_hvc_ping_reset(void)
 {
     return HVMM_STATUS_SUCCESS;
@@ -26,7 +17,6 @@ static hvmm_status_t vdev_hvc_ping_reset(void)
 
 struct vdev_ops _vdev_hvc_ping_ops = {
     .init = vdev_hvc_ping_reset,
-    .check = vdev_hvc_ping_check,
     .write = vdev_hvc_ping_write,
 };
 
@@ -34,6 +24,7 @@ struct vdev_module _vdev_hvc_ping_module = {
     .name = "K-Hypervisor vDevice HVC Ping Module",
     .author = "Kookmin Univ.",
     .ops = &_vdev_hvc_ping_ops,
+    .hvc = 0xFFFE,
 };
 
 hvmm_status_t vdev_hvc_ping_init()
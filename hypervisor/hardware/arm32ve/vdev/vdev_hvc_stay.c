@@ -10,15 +10,6 @@ static int32_t vdev_hvc_stay_write(struct arch_vdev_trigger_info *info,
     return 0;
 }
 
-static int32_t vdev_hvc_stay_check(struct arch_vdev_trigger_info *info,
-                        struct arch_regs *regs)
-{
-    if ((info->iss & 0xFFFF) == 0xFFFF)
-        return 0;
-
-    return VDEV_NOT_FOUND;
-}
-
 static hvmm_status_t vdev_hvc_stay_reset_values(void)
 {
     return HVMM_STATUS_SUCCESS;
@@ -26,7 +17,6 @@ static hvmm_status_t vdev_hvc_stay_reset_values(void)
 
 struct vdev_ops _vdev_hvc_stay_ops = {
     .init = vdev_hvc_stay_reset_values,
-    .check = vdev_hvc_stay_check,
     .write = vdev_hvc_stay_write,
 };
 
@@ -34,6 +24,7 @@ struct vdev_module _vdev_hvc_stay_module = {
     .name = "K-Hypervisor vDevice HVC Stay Module",
     .author = "Kookmin Univ.",
     .ops = &_vdev_hvc_stay_ops,
+    .hvc = 0xFFFF,
 };
 
 hvmm_status_t vdev_hvc_stay_init()
@@ -10,15 +10,6 @@ static int32_t vdev_hvc_yield_write(struct arch_vdev_trigger_info *info,
     return 0;
 }
 
-static int32_t vdev_hvc_yield_check(struct arch_vdev_trigger_info *info,
-                        struct arch_regs *regs)
-{
-    if ((info->iss & 0xFFFF) == 0xFFFD)
-        return 0;
-
-    return VDEV_NOT_FOUND;
-}
-
 static hvmm_status_t vdev_hvc_yield_reset_values(void)
 {
     return HVMM_STATUS_SUCCESS;
@@ -26,7 +17,6 @@ static hvmm_status_t vdev_hvc_yield_reset_values(void)
 
 struct vdev_ops _vdev_hvc_yield_ops = {
     .init = vdev_hvc_yield_reset_values,
-    .check = vdev_hvc_yield_check,
     .write = vdev_hvc_yield_write,
 };
 
@@ -34,6 +24,7 @@ struct vdev_module _vdev_hvc_yield_module = {
     .name = "K-Hypervisor vDevice HVC Yield Module",
     .author = "Kookmin Univ.",
     .ops = &_vdev_hvc_yield_ops,
+    .hvc = 0xFFFD,
 };
 
 hvmm_status_t vdev_hvc_yield_init()
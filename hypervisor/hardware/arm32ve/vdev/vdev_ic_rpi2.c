@@ -1,4 +1,6 @@
-#include <vdev.h>
+#include <vdev_reg.h>
+#include <interrupt.h>
+#include <stddef.h>
 #define DEBUG
 #include <log/print.h>
 
@@ -36,227 +38,182 @@ struct ic_rpi2_regs {
 
 };
 
-struct ic_rpi2_handler_entry {
-    uint32_t offset;
-    vdev_callback_t handler;
-};
 #define PENDING_MAX 20
+/*
+ * The guest accesses and the interrupt path work on the registers the
+ * device is loaded with, ci_regs keeps those of each guest while another
+ * one has the device, see vdev_save(). Interrupts are queued for a guest
+ * that is not running, the queues are not switched.
+ */
+static struct ic_rpi2_regs ci_loaded;
 static struct ic_rpi2_regs ci_regs[NUM_GUESTS_STATIC];
-static struct ic_rpi2_regs ci_pending_regs[PENDING_MAX];
-static int countPending = 0;
+static struct ic_rpi2_regs ci_pending_regs[NUM_GUESTS_STATIC][PENDING_MAX];
+static int countPending[NUM_GUESTS_STATIC];
+
+/* Interrupt controller state of a guest at its checkpoint */
+struct ic_rpi2_snapshot {
+    struct ic_rpi2_regs regs;
+    struct ic_rpi2_regs pending[PENDING_MAX];
+    int count;
+};
+
+static struct ic_rpi2_snapshot _ic_rpi2_snapshot[NUM_GUESTS_STATIC];
+
+extern struct vdev_module _vdev_ic_rpi2_module;
 
 static struct vdev_memory_map _vdev_ic_rpi2_info = {
    .base = IC_RPI2_BASE_ADDR,
    .size = 0x00001000,
 };
 
-static hvmm_status_t handler_null(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-	printH("cpu interface handler_null\n");
-	return HVMM_STATUS_BAD_ACCESS;
-}
-static hvmm_status_t handler_F(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-	return HVMM_STATUS_BAD_ACCESS;
-}
-static hvmm_status_t handler_E(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
-{
-	return HVMM_STATUS_BAD_ACCESS;
-}
-static hvmm_status_t handler_D(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
+#ifdef _FIQ_FASTPATH_
+#define IC_FIQ_ENABLE               0x80
+
+/*
+ * FIQ control belongs to the fast path guest. It routes
+ * CFG_FIQ_FASTPATH_SOURCE to FIQ once its FIQ handler is installed, and
+ * ends a FIQ by routing it again. Nothing else may be routed.
+ */
+static hvmm_status_t vdev_ic_rpi2_fiq_control(vmid_t vmid, uint32_t n,
+        uint32_t *reg, uint32_t value, uint32_t mask)
 {
-	return HVMM_STATUS_BAD_ACCESS;
+    if (vmid != CFG_FIQ_FASTPATH_VMID ||
+            (value && value != (IC_FIQ_ENABLE | CFG_FIQ_FASTPATH_SOURCE))) {
+        printh("vdev_ic_rpi2: vmid %d may not route %x to FIQ\n", vmid,
+                value);
+        return HVMM_STATUS_BAD_ACCESS;
+    }
+
+    *((volatile uint32_t *) (IC_RPI2_BASE_ADDR + IC_OFFSET_FIQ_CONTROL)) =
+            value;
+    if (value)
+        interrupt_fiq_fastpath_eoi();
+
+    return HVMM_STATUS_SUCCESS;
 }
-static hvmm_status_t handler_2(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
+
+#define IC_RPI2_FIQ_CONTROL_FLAGS   VDEV_REG_R
+#else
+#define vdev_ic_rpi2_fiq_control    0
+#define IC_RPI2_FIQ_CONTROL_FLAGS   (VDEV_REG_R | VDEV_REG_HW_W)
+#endif
+
+/* Board sources forwarded to guest 0, and their enable bits */
+struct ic_rpi2_source {
+    uint32_t irq;
+    uint32_t enable;        /* offset of the enable register */
+    uint32_t disable;       /* offset of the disable register */
+    uint32_t bit;
+};
+
+static const struct ic_rpi2_source _ic_rpi2_sources[] = {
+    { 65, IC_OFFSET_ENABLE_BASIC_IRQS, IC_OFFSET_DISABLE_BASIC_IRQS, 0x2 },
+    { 66, IC_OFFSET_ENABLE_BASIC_IRQS, IC_OFFSET_DISABLE_BASIC_IRQS, 0x4 },
+    { 9999, IC_OFFSET_ENABLE_IRQS2, IC_OFFSET_DISABLE_IRQS2, 0x02000000 },
+};
+
+#define IC_RPI2_NUM_SOURCES \
+    (sizeof(_ic_rpi2_sources) / sizeof(_ic_rpi2_sources[0]))
+
+/*
+ * Sources held disabled by mask(), and those of them the guest has
+ * enabled, bit n for _ic_rpi2_sources[n].
+ */
+static uint32_t _ic_rpi2_masked;
+static uint32_t _ic_rpi2_wanted;
+
+static void vdev_ic_rpi2_hw_write(uint32_t offset, uint32_t value)
 {
-	return HVMM_STATUS_BAD_ACCESS;
+    *((volatile uint32_t *) (IC_RPI2_BASE_ADDR + offset)) = value;
 }
-static hvmm_status_t handler_1(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
+
+/*
+ * The hypervisor disables a source when it forwards it, the guest enabling
+ * it again is its EOI. A source held by mask() stays disabled.
+ */
+static hvmm_status_t vdev_ic_rpi2_enable(vmid_t vmid, uint32_t n,
+        uint32_t *reg, uint32_t value, uint32_t mask)
 {
-	return HVMM_STATUS_BAD_ACCESS;
-}
+    uint32_t offset = IC_OFFSET_ENABLE_IRQS1 + n * 4;
+    const struct ic_rpi2_source *src;
+    uint32_t i;
+
+    for (i = 0; i < IC_RPI2_NUM_SOURCES; i++) {
+        src = &_ic_rpi2_sources[i];
+        if (src->enable == offset && (value & src->bit))
+            interrupt_guest_eoi(vmid, src->irq);
+    }
+    for (i = 0; i < IC_RPI2_NUM_SOURCES; i++) {
+        src = &_ic_rpi2_sources[i];
+        if (src->enable != offset || !(value & src->bit) ||
+                !(_ic_rpi2_masked & (1 << i)))
+            continue;
+        _ic_rpi2_wanted |= 1 << i;
+        value &= ~src->bit;
+    }
+    /* the enable registers only set bits, the other bytes write 0 */
+    vdev_ic_rpi2_hw_write(offset, value);
 
+    return HVMM_STATUS_SUCCESS;
+}
 
-static hvmm_status_t handler_0(uint32_t write, uint32_t offset,
-        uint32_t *pvalue, enum vdev_access_size access_size)
+/* A held source the guest disables stays so once released */
+static hvmm_status_t vdev_ic_rpi2_disable(vmid_t vmid, uint32_t n,
+        uint32_t *reg, uint32_t value, uint32_t mask)
 {
-	/* CTLR, PMR, BPR, IAR */
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-//    vmid_t vmid = guest_current_vmid();
-//    struct ic_rpi2_regs *regs = &ci_regs[vmid];
-//    uint32_t woffset = offset / 4;
-//    switch (woffset) {
-//    case IC_OFFSET_BASEIC_PENDING: /* RW */
-//        if (write)
-//            regs->GICC_CTLR = *pvalue;
-//        else
-//            *pvalue = regs->GICC_CTLR;
-//        result = HVMM_STATUS_SUCCESS;
-//        break;
-//    case GIC_OFFSET_GICC_PMR: /* RO */
-//        if (write) {
-//            regs->GICC_PMR = *pvalue;
-//        } else
-//        	*pvalue = regs->GICC_PMR;
-//
-//        result = HVMM_STATUS_SUCCESS;
-//        break;
-//    case GIC_OFFSET_GICC_BPR: /* RO */
-//        if (write) {
-//            regs->GICC_BPR = *pvalue;
-//        } else
-//        	*pvalue = regs->GICC_BPR;
-//        result = HVMM_STATUS_SUCCESS;
-//        break;
-//    case GIC_OFFSET_GICC_IAR:
-//        if (write) {
-//            regs->GICC_IAR = *pvalue;
-//        } else
-//        	*pvalue = regs->GICC_IAR;
-//        result = HVMM_STATUS_SUCCESS;
-//    	break;
-////    default: { /* RW GICD_IGROUPR */
-////        int igroup = woffset - GICD_IGROUPR;
-////        if (igroup >= 0 && igroup < VGICD_NUM_IGROUPR) {
-////            if (write)
-////                regs->IGROUPR[igroup] = *pvalue;
-////            else
-////                *pvalue = regs->IGROUPR[igroup];
-////
-////            result = HVMM_STATUS_SUCCESS;
-////        }
-////    }
-////        break;
-//    }
-//    if (result != HVMM_STATUS_SUCCESS)
-//        printH("vgicd: invalid access offset:%x write:%d\n", offset,
-//                write);
+    uint32_t offset = IC_OFFSET_DISABLE_IRQS1 + n * 4;
+    uint32_t i;
 
-    return result;
+    for (i = 0; i < IC_RPI2_NUM_SOURCES; i++) {
+        if (_ic_rpi2_sources[i].disable == offset &&
+                (value & _ic_rpi2_sources[i].bit))
+            _ic_rpi2_wanted &= ~(1 << i);
+    }
+
+    return HVMM_STATUS_SUCCESS;
 }
-static struct ic_rpi2_handler_entry _ci_handler_map[0x10] = {
-/* 0x00 ~ 0x0F */
-{ 0x00, handler_0 }, /* CTLR, PMR, BPR, IAR */
-{ 0x01, handler_1 }, /* EOIR, RPR, HPPIR, ABPR */
-{ 0x02, handler_2 }, /* AIAR, AEOIR, AHPPIR */
-{ 0x03, handler_null},
-{ 0x04, handler_null},
-{ 0x05, handler_null},
-{ 0x06, handler_null},
-{ 0x07, handler_null},
-{ 0x08, handler_null},
-{ 0x09, handler_null},
-{ 0x0A, handler_null},
-{ 0x0B, handler_null},
-{ 0x0C, handler_null},
-{ 0x0D, handler_D}, /* APRN */
-{ 0x0E, handler_E }, /* NSAPRN */
-{ 0x0F, handler_F }, /* IIDR */
-//{ 0x0F, handler_F }, /* IIDR */
-};
-//static hvmm_status_t vdev_ic_rpi2_access_handler(uint32_t write, uint32_t offset,
-//        uint32_t *pvalue, enum vdev_access_size access_size)
-//{
-//    printH("%s: %s offset:%x value:%x access_size : %d\n", __func__,
-//            write ? "write" : "read", offset,
-//            write ? *pvalue : (uint32_t) pvalue, access_size);
-//    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-//
-//
-//    // DIR
-//
-//    uint8_t offsetidx = (uint8_t) ((offset & 0xF0) >> 4);
-//    printH("offset_idx : %d\n", offsetidx);
-//    result = _ci_handler_map[offsetidx].handler(write, offset, pvalue,
-//            access_size);
-//
-//    return result;
-//}
 
+/*
+ * The guest reads the pending and enable registers the hypervisor loaded
+ * for the interrupt it delivers, everything else is the hardware. Its
+ * enables go through vdev_ic_rpi2_enable().
+ */
+static const struct vdev_reg _ic_rpi2_regs[] = {
+    { 0x000, 0x80, VDEV_REG_PASS, VDEV_ACCESS_BYTE },
+    { IC_OFFSET_BASEIC_PENDING, 3, VDEV_REG_R | VDEV_REG_HW_W,
+      VDEV_ACCESS_BYTE, offsetof(struct ic_rpi2_regs, IC_BASEIC_PENDING) },
+    { IC_OFFSET_FIQ_CONTROL, 1, IC_RPI2_FIQ_CONTROL_FLAGS,
+      VDEV_ACCESS_BYTE, offsetof(struct ic_rpi2_regs, IC_FIQ_CONTROL), 0,
+      vdev_ic_rpi2_fiq_control },
+    { IC_OFFSET_ENABLE_IRQS1, 3, VDEV_REG_R, VDEV_ACCESS_BYTE,
+      offsetof(struct ic_rpi2_regs, IC_ENABLE_IRQS1), 0,
+      vdev_ic_rpi2_enable },
+    { IC_OFFSET_DISABLE_IRQS1, 3, VDEV_REG_R | VDEV_REG_HW_W,
+      VDEV_ACCESS_BYTE, offsetof(struct ic_rpi2_regs, IC_DISABLE_IRQS1), 0,
+      vdev_ic_rpi2_disable },
+    { IC_OFFSET_DISABLE_BASIC_IRQS + 4, 886, VDEV_REG_PASS,
+      VDEV_ACCESS_BYTE },
+};
 
-#define IC_OFFSET_BASEIC_PENDING	0x200
-#define IC_OFFSET_PENDING1			0x204
-#define IC_OFFSET_PENDING2			0x208
-#define IC_OFFSET_FIQ_CONTROL		0x20c
-#define IC_OFFSET_ENABLE_IRQS1		0x210
-#define IC_OFFSET_ENABLE_IRQS2		0x214
-#define IC_OFFSET_ENABLE_BASIC_IRQS	0x218
-#define IC_OFFSET_DISABLE_IRQS1		0x21c
-#define IC_OFFSET_DISABLE_IRQS2		0x220
-#define IC_OFFSET_DISABLE_BASIC_IRQS	0x224
+static uint8_t _ic_rpi2_index[0x1000 / 4];
 
-int isFirst = 0;
+static struct vdev_regmap _ic_rpi2_map = {
+    .regs = _ic_rpi2_regs,
+    .nregs = sizeof(_ic_rpi2_regs) / sizeof(_ic_rpi2_regs[0]),
+    .size = 0x1000,
+    .hw_base = IC_RPI2_BASE_ADDR,
+    .state = (uint8_t *) &ci_loaded,
+    .stride = 0,        /* switched by save and restore */
+    .index = _ic_rpi2_index,
+};
 
 static hvmm_status_t vdev_ic_rpi2_access_handler(uint32_t write, uint32_t offset,
         uint32_t *pvalue, enum vdev_access_size access_size)
 {
-
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    unsigned int vmid = guest_current_vmid();
-    volatile int *addr = (IC_RPI2_BASE_ADDR + offset);
-//    volatile int *daddr = (IC_RPI2_BASE_ADDR + GIC_OFFSET_GICC_DIR);
-//    if (offset == 20)
-//    	printH("iar = %d\n", *addr & 0x03ff);
-//    if (offset == 24)
-
-    if (!write) {
-        /* READ */
-    	if(offset == IC_OFFSET_BASEIC_PENDING)
-    	{
-    		*pvalue = ci_regs[0].IC_BASEIC_PENDING;
-    	} else if (offset == IC_OFFSET_PENDING1) {
-    		*pvalue = ci_regs[0].IC_PENDING1;
-
-		} else if (offset == IC_OFFSET_PENDING2) {
-			*pvalue = ci_regs[0].IC_PENDING2;
-		} else if (offset == IC_OFFSET_FIQ_CONTROL) {
-			*pvalue = ci_regs[0].IC_FIQ_CONTROL;
-		} else if (offset == IC_OFFSET_ENABLE_IRQS1) {
-			*pvalue = ci_regs[0].IC_ENABLE_IRQS1;
-		} else if (offset == IC_OFFSET_ENABLE_IRQS2) {
-			*pvalue = ci_regs[0].IC_ENABLE_IRQS2;
-		} else if (offset == IC_OFFSET_ENABLE_BASIC_IRQS) {
-			*pvalue = ci_regs[0].IC_ENABLE_BASIC_IRQS;
-		} else if (offset == IC_OFFSET_DISABLE_IRQS1) {
-			*pvalue = ci_regs[0].IC_DISABLE_IRQS1;
-		} else if (offset == IC_OFFSET_DISABLE_IRQS2) {
-			*pvalue = ci_regs[0].IC_DISABLE_IRQS2;
-		} else if (offset == IC_OFFSET_DISABLE_BASIC_IRQS) {
-			*pvalue = ci_regs[0].IC_DISABLE_BASIC_IRQS;
-		} else
-			*pvalue =  (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR + offset)));
-
-//    	printH("1111111111111 %x\n", *pvalue);
-       } else {
-    	    /* WRITE */
-//    	   if ( (offset == IC_OFFSET_ENABLE_IRQS2) && (0x02000000 == *pvalue) && (isFirst==1))
-//    		   ;
-//    	   else if ( (offset == IC_OFFSET_ENABLE_IRQS2) && (0x02000000 == *pvalue) && (isFirst==0)) {
-//    		   *addr = *pvalue;
-//    		   isFirst = 1 ;
-//    	   }
-//    	   else
-    		   *addr = *pvalue;
-//    		   *addr = *pvalue;
-//    		   *addr = *pvalue;
-
-    		    if(0x02000000 != *pvalue)
-    		    	printH("%s: %s offset:%x value:%x\n", __func__,
-    		            write ? "write" : "read", offset,
-    		            write ? *pvalue : *pvalue);
-       }
-//    printH("access size : %d\n", access_size);
-
-//    printH("AAAAAAAAAAAAAA %x\n", *addr);
-    	result = HVMM_STATUS_SUCCESS;
-    return result;
+    return vdev_regmap_access(&_ic_rpi2_map, write, offset, pvalue,
+            access_size);
 }
+
 static hvmm_status_t vdev_ic_rpi2_read(struct arch_vdev_trigger_info *info,
                         struct arch_regs *regs)
 {
@@ -286,333 +243,255 @@ static int32_t vdev_ic_rpi2_post(struct arch_vdev_trigger_info *info,
     return 0;
 }
 
-static int32_t vdev_ic_rpi2_check(struct arch_vdev_trigger_info *info,
-                        struct arch_regs *regs)
+/* Loads the pending and enable registers from the hardware */
+static void vdev_ic_rpi2_load(struct ic_rpi2_regs *regs)
 {
-    uint32_t offset = info->fipa - _vdev_ic_rpi2_info.base;
+    volatile uint32_t *base = (volatile uint32_t *) IC_RPI2_BASE_ADDR;
+
+    regs->IC_BASEIC_PENDING = base[IC_OFFSET_BASEIC_PENDING / 4];
+    regs->IC_PENDING1 = base[IC_OFFSET_PENDING1 / 4];
+    regs->IC_PENDING2 = base[IC_OFFSET_PENDING2 / 4];
+    regs->IC_FIQ_CONTROL = base[IC_OFFSET_FIQ_CONTROL / 4];
+    regs->IC_ENABLE_IRQS1 = base[IC_OFFSET_ENABLE_IRQS1 / 4];
+    regs->IC_ENABLE_IRQS2 = base[IC_OFFSET_ENABLE_IRQS2 / 4];
+    regs->IC_ENABLE_BASIC_IRQS = base[IC_OFFSET_ENABLE_BASIC_IRQS / 4];
+    regs->IC_DISABLE_IRQS1 = base[IC_OFFSET_DISABLE_IRQS1 / 4];
+    regs->IC_DISABLE_IRQS2 = base[IC_OFFSET_DISABLE_IRQS2 / 4];
+    regs->IC_DISABLE_BASIC_IRQS = base[IC_OFFSET_DISABLE_BASIC_IRQS / 4];
+}
+
+static hvmm_status_t vdev_ic_rpi2_reset(void)
+{
+    hvmm_status_t result;
+    int i;
+
+    printH("vdev init:'%s'\n", __func__);
+    result = vdev_regmap_init(&_ic_rpi2_map);
+    if (result != HVMM_STATUS_SUCCESS)
+        return result;
 
-    if (info->fipa >= _vdev_ic_rpi2_info.base &&
-        offset < _vdev_ic_rpi2_info.size)
-        return 0;
-    /**
-     * Find vdev using tag.  Hard coding.
-     */
-    if( !regs ) {
-    	return 66;
+    for (i = 0; i < NUM_GUESTS_STATIC; i++) {
+        vdev_ic_rpi2_load(&ci_regs[i]);
+        countPending[i] = 0;
     }
-    return VDEV_NOT_FOUND;
-}
 
+    return HVMM_STATUS_SUCCESS;
+}
 
+/**
+ * @brief Sets a pending register of the guest.
+ *
+ * @param bank 0 for basic pending, 1 and 2 for pending 1 and 2.
+ */
+static hvmm_status_t vdev_ic_rpi2_inject(uint32_t bank, uint32_t bits)
+{
+    vdev_load(&_vdev_ic_rpi2_module);
+    switch (bank) {
+    case 0:
+        ci_loaded.IC_BASEIC_PENDING = bits;
+        break;
+    case 1:
+        ci_loaded.IC_PENDING1 = bits;
+        break;
+    case 2:
+        ci_loaded.IC_PENDING2 = bits;
+        break;
+    default:
+        return HVMM_STATUS_BAD_ACCESS;
+    }
 
+    return HVMM_STATUS_SUCCESS;
+}
 
+static hvmm_status_t vdev_ic_rpi2_sync(void)
+{
+    vdev_load(&_vdev_ic_rpi2_module);
+    vdev_ic_rpi2_load(&ci_loaded);
 
+    return HVMM_STATUS_SUCCESS;
+}
 
-static hvmm_status_t vdev_ic_rpi2_reset(void)
+/**
+ * @brief Queues an interrupt taken while the guest could not be entered,
+ * with the registers it has to see when it is delivered.
+ */
+static hvmm_status_t vdev_ic_rpi2_pend(vmid_t vmid, uint32_t irq)
 {
+    struct ic_rpi2_regs *regs;
 
+    if (vmid >= NUM_GUESTS_STATIC)
+        return HVMM_STATUS_BAD_ACCESS;
+    if (countPending[vmid] >= PENDING_MAX) {
+        printH("Pending MAX\n");
+        return HVMM_STATUS_BUSY;
+    }
 
-    printH("vdev init:'%s'\n", __func__);
-    int j = 0;
-    int i = 0;
-
-    for (i = 0; i < 1; i++) {
-
-    	ci_regs[i].IC_BASEIC_PENDING =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_BASEIC_PENDING)));
-    	ci_regs[i].IC_PENDING1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_PENDING1)));
-
-    	ci_regs[i].IC_PENDING2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_PENDING2)));
-
-    	ci_regs[i].IC_FIQ_CONTROL =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_FIQ_CONTROL)));
-    	ci_regs[i].IC_ENABLE_IRQS1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_IRQS1)));
-    	ci_regs[i].IC_ENABLE_IRQS2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_IRQS2)));
-    	ci_regs[i].IC_ENABLE_BASIC_IRQS =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_BASIC_IRQS)));
-    	ci_regs[i].IC_DISABLE_IRQS1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_IRQS1)));
-
-    	ci_regs[i].IC_DISABLE_IRQS2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_IRQS2)));
-    	ci_regs[i].IC_DISABLE_BASIC_IRQS =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_BASIC_IRQS)));
-
-//    	static struct ic_rpi2_regs ci_pending_regs[PENDING_MAX];
-//    	static int countPending = 0;
+    regs = &ci_pending_regs[vmid][countPending[vmid]];
+    vdev_ic_rpi2_load(regs);
+    regs->intNumber = irq;
+    if (irq == 65)
+        regs->IC_BASEIC_PENDING = 0x2;
+    else if (irq == 66)
+        regs->IC_BASEIC_PENDING = 0x4;
+    else if (irq == 9999)
+        regs->IC_BASEIC_PENDING = 0x80000;
+    countPending[vmid]++;
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Delivers the last queued interrupt to the registers of the guest,
+ * the running one.
+ */
+static hvmm_status_t vdev_ic_rpi2_pop_pending(vmid_t vmid)
+{
+    if (vmid >= NUM_GUESTS_STATIC || countPending[vmid] < 1) {
+        printH("pending is null\n");
+        return HVMM_STATUS_BAD_ACCESS;
     }
-    for (i = 0; i < PENDING_MAX ; i++) {
-
-    	ci_pending_regs[i].IC_BASEIC_PENDING =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_BASEIC_PENDING)));
-    	ci_pending_regs[i].IC_PENDING1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_PENDING1)));
-
-    	ci_pending_regs[i].IC_PENDING2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_PENDING2)));
-
-    	ci_pending_regs[i].IC_FIQ_CONTROL =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_FIQ_CONTROL)));
-    	ci_pending_regs[i].IC_ENABLE_IRQS1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_IRQS1)));
-    	ci_pending_regs[i].IC_ENABLE_IRQS2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_IRQS2)));
-    	ci_pending_regs[i].IC_ENABLE_BASIC_IRQS =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_BASIC_IRQS)));
-    	ci_pending_regs[i].IC_DISABLE_IRQS1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_IRQS1)));
-
-    	ci_pending_regs[i].IC_DISABLE_IRQS2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_IRQS2)));
-    	ci_pending_regs[i].IC_DISABLE_BASIC_IRQS =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_BASIC_IRQS)));
-
-//    	static struct ic_rpi2_regs ci_pending_regs[PENDING_MAX];
-//    	static int countPending = 0;
+
+    vdev_load(&_vdev_ic_rpi2_module);
+    countPending[vmid]--;
+    ci_loaded = ci_pending_regs[vmid][countPending[vmid]];
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static uint32_t vdev_ic_rpi2_num_pending(vmid_t vmid)
+{
+    return vmid < NUM_GUESTS_STATIC ? countPending[vmid] : 0;
+}
+
+static const struct ic_rpi2_source *vdev_ic_rpi2_source(uint32_t irq,
+        uint32_t *n)
+{
+    for (*n = 0; *n < IC_RPI2_NUM_SOURCES; (*n)++) {
+        if (_ic_rpi2_sources[*n].irq == irq)
+            return &_ic_rpi2_sources[*n];
     }
 
+    return 0;
+}
+
+/**
+ * @brief Holds a forwarded source disabled, for the rate limiter.
+ *
+ * The source was enabled when it fired, it is enabled again on release
+ * unless the guest disables it meanwhile.
+ */
+static hvmm_status_t vdev_ic_rpi2_mask(uint32_t irq)
+{
+    const struct ic_rpi2_source *src;
+    uint32_t n;
+
+    src = vdev_ic_rpi2_source(irq, &n);
+    if (!src)
+        return HVMM_STATUS_NOT_FOUND;
+    _ic_rpi2_masked |= 1 << n;
+    _ic_rpi2_wanted |= 1 << n;
+    vdev_ic_rpi2_hw_write(src->disable, src->bit);
+
     return HVMM_STATUS_SUCCESS;
 }
 
-static hvmm_status_t vdev_ic_rpi2_execute(int level, int num, int type, int irq)
+/**
+ * @brief Releases a source held by vdev_ic_rpi2_mask().
+ */
+static hvmm_status_t vdev_ic_rpi2_unmask(uint32_t irq)
 {
-	volatile int *addr;
-	hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-
-//	 printH("vdev_ic_rpi2_execute: irq: %d, type : %d\n", irq, type);
-	if (type == 0) { // EOI
-		ci_regs[0].IC_BASEIC_PENDING = irq;
-	    return HVMM_STATUS_SUCCESS;
-
-	} else if (type == 1) {  // inject
-
-		ci_regs[0].IC_PENDING1 = irq;
-//		printH("vdev_ic_rpi2_execute, IC_PENDING1 inject-ok: irq: %d\n", irq);
-
-
-	} else if (type == 2) {
-		ci_regs[0].IC_PENDING2 = irq;
-//		printH("vdev_ic_rpi2_execute, IC_PENDING2 inject-ok: irq: %d\n", irq);
-
-
-	} else if (type == 3) { //all coply
-//		printH("All Copy IC_pri2\n");
-
-    	ci_regs[0].IC_BASEIC_PENDING =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_BASEIC_PENDING)));
-    	ci_regs[0].IC_PENDING1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_PENDING1)));
-
-    	ci_regs[0].IC_PENDING2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_PENDING2)));
-
-    	ci_regs[0].IC_FIQ_CONTROL =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_FIQ_CONTROL)));
-    	ci_regs[0].IC_ENABLE_IRQS1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_IRQS1)));
-    	ci_regs[0].IC_ENABLE_IRQS2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_IRQS2)));
-    	ci_regs[0].IC_ENABLE_BASIC_IRQS =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_BASIC_IRQS)));
-    	ci_regs[0].IC_DISABLE_IRQS1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_IRQS1)));
-
-    	ci_regs[0].IC_DISABLE_IRQS2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_IRQS2)));
-    	ci_regs[0].IC_DISABLE_BASIC_IRQS =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_BASIC_IRQS)));
-
-		return HVMM_STATUS_SUCCESS;
-	}
-	else if (type == 4) { //all coply
-	//		printH("All Copy IC_pri2\n");
-//			* (int*) 40000060 = 0x110;
-
-	    	ci_regs[0].IC_BASEIC_PENDING = 0x80000 ;// 0x02000000;//0x80000; //uart
-
-	    	ci_regs[0].IC_PENDING1 =
-	                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-	                        + IC_OFFSET_PENDING1)));
-
-	    	ci_regs[0].IC_PENDING2 =
-	                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-	                        + IC_OFFSET_PENDING2)));
-
-	    	ci_regs[0].IC_FIQ_CONTROL =
-	                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-	                        + IC_OFFSET_FIQ_CONTROL)));
-	    	ci_regs[0].IC_ENABLE_IRQS1 =
-	                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-	                        + IC_OFFSET_ENABLE_IRQS1)));
-	    	ci_regs[0].IC_ENABLE_IRQS2 =
-	                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-	                        + IC_OFFSET_ENABLE_IRQS2)));
-	    	ci_regs[0].IC_ENABLE_BASIC_IRQS =
-	                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-	                        + IC_OFFSET_ENABLE_BASIC_IRQS)));
-	    	ci_regs[0].IC_DISABLE_IRQS1 =
-	                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-	                        + IC_OFFSET_DISABLE_IRQS1)));
-
-	    	ci_regs[0].IC_DISABLE_IRQS2 =
-	                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-	                        + IC_OFFSET_DISABLE_IRQS2)));
-	    	ci_regs[0].IC_DISABLE_BASIC_IRQS =
-	                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-	                        + IC_OFFSET_DISABLE_BASIC_IRQS)));
-
-
-//
-//	    	if(irq == 65)
-//	    		*((int*)0x3F00B224) = 0x2;
-//	    	if(irq == 66 )
-//	    		 *((int*)0x3F00B224) = 0x4;
-//	    	if(irq == 9999)
-//	    		*((int*)0x3F00B220) = 0x02000000;
-		}
-	//add pending irq
-	else if (type == 5) {
-		if (countPending > PENDING_MAX)
-		{
-			printH("Pending MAX\n");
-			return HVMM_STATUS_SUCCESS;
-		}
-
-//		printH("inject : %d\n", ci_pending_regs[countPending].intNumber);
-		ci_pending_regs[countPending].intNumber = irq;
-
-		if(irq == 65)
-			ci_pending_regs[countPending].IC_BASEIC_PENDING = 0x2;
-		else if(irq == 66)
-			ci_pending_regs[countPending].IC_BASEIC_PENDING = 0x4;
-		else if(irq == 9999)
-			ci_pending_regs[countPending].IC_BASEIC_PENDING = 0x80000;
-		else {
-			ci_pending_regs[countPending].IC_BASEIC_PENDING =
-					(uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-					                        + IC_OFFSET_BASEIC_PENDING)));
-		}
-
-		ci_pending_regs[countPending].IC_PENDING1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_PENDING1)));
-
-		ci_pending_regs[countPending].IC_PENDING2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_PENDING2)));
-
-		ci_pending_regs[countPending].IC_FIQ_CONTROL =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_FIQ_CONTROL)));
-		ci_pending_regs[countPending].IC_ENABLE_IRQS1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_IRQS1)));
-		ci_pending_regs[countPending].IC_ENABLE_IRQS2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_IRQS2)));
-		ci_pending_regs[countPending].IC_ENABLE_BASIC_IRQS =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_ENABLE_BASIC_IRQS)));
-		ci_pending_regs[countPending].IC_DISABLE_IRQS1 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_IRQS1)));
-
-		ci_pending_regs[countPending].IC_DISABLE_IRQS2 =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_IRQS2)));
-		ci_pending_regs[countPending].IC_DISABLE_BASIC_IRQS =
-                (uint32_t) (*((volatile unsigned int*) (IC_RPI2_BASE_ADDR
-                        + IC_OFFSET_DISABLE_BASIC_IRQS)));
-		countPending++;
-
-		return HVMM_STATUS_SUCCESS;
-	} else if (type == 6) {
-		if(countPending < 1) {
-			printH("pending is null\n");
-			return HVMM_STATUS_BAD_ACCESS;
-		}
-		countPending--;
-//		printH("Copy Pending IC register :%d\n", ci_pending_regs[countPending].intNumber);
-    	ci_regs[0].IC_BASEIC_PENDING = ci_pending_regs[countPending].IC_BASEIC_PENDING;
-    	ci_regs[0].IC_PENDING1 = ci_pending_regs[countPending].IC_PENDING1;
-    	ci_regs[0].IC_PENDING2 = ci_pending_regs[countPending].IC_PENDING2;
-    	ci_regs[0].IC_FIQ_CONTROL = ci_pending_regs[countPending].IC_FIQ_CONTROL;
-    	ci_regs[0].IC_ENABLE_IRQS1 = ci_pending_regs[countPending].IC_ENABLE_IRQS1;
-    	ci_regs[0].IC_ENABLE_IRQS2 =ci_pending_regs[countPending].IC_ENABLE_IRQS2;
-    	ci_regs[0].IC_ENABLE_BASIC_IRQS = ci_pending_regs[countPending].IC_ENABLE_BASIC_IRQS;
-    	ci_regs[0].IC_DISABLE_IRQS1 = ci_pending_regs[countPending].IC_DISABLE_IRQS1;
-    	ci_regs[0].IC_DISABLE_IRQS2 = ci_pending_regs[countPending].IC_DISABLE_IRQS2;
-    	ci_regs[0].IC_DISABLE_BASIC_IRQS = ci_pending_regs[countPending].IC_DISABLE_BASIC_IRQS;
-
-
-//    	printH("IC_BASEIC_PENDING:%x\n",ci_regs[0].IC_BASEIC_PENDING );
-//    	printH("IC_PENDING1:%x\n",ci_regs[0].IC_PENDING1);
-//    	printH("IC_PENDING2:%x\n",ci_regs[0].IC_PENDING2);
-//    	printH("IC_FIQ_CONTROL:%x\n",ci_regs[0].IC_FIQ_CONTROL);
-//    	printH("IC_ENABLE_IRQS1:%x\n",ci_regs[0].IC_ENABLE_IRQS1);
-//    	printH("IC_ENABLE_IRQS2:%x\n",ci_regs[0].IC_ENABLE_IRQS2);
-//    	printH("IC_ENABLE_BASIC_IRQS:%x\n",ci_regs[0].IC_ENABLE_BASIC_IRQS);
-//    	printH("IC_DISABLE_IRQS1:%x\n",ci_regs[0].IC_DISABLE_IRQS1);
-//    	printH("IC_DISABLE_IRQS2:%x\n",ci_regs[0].IC_DISABLE_IRQS2);
-//    	printH("IC_DISABLE_BASIC_IRQS:%x\n",ci_regs[0].IC_DISABLE_BASIC_IRQS);
-
-
-
-    	return HVMM_STATUS_SUCCESS;
-	} else if (type == 7) {
-		return countPending;
-	}
-	return HVMM_STATUS_SUCCESS;
+    const struct ic_rpi2_source *src;
+    uint32_t n;
+
+    src = vdev_ic_rpi2_source(irq, &n);
+    if (!src)
+        return HVMM_STATUS_NOT_FOUND;
+    if (_ic_rpi2_wanted & (1 << n))
+        vdev_ic_rpi2_hw_write(src->enable, src->bit);
+    _ic_rpi2_masked &= ~(1 << n);
+    _ic_rpi2_wanted &= ~(1 << n);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_ic_rpi2_save(vmid_t vmid)
+{
+    ci_regs[vmid] = ci_loaded;
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_ic_rpi2_restore(vmid_t vmid)
+{
+    ci_loaded = ci_regs[vmid];
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/* The guest is switched out, its registers were saved */
+static hvmm_status_t vdev_ic_rpi2_snapshot(vmid_t vmid)
+{
+    struct ic_rpi2_snapshot *snap = &_ic_rpi2_snapshot[vmid];
+    int i;
+
+    snap->regs = ci_regs[vmid];
+    for (i = 0; i < countPending[vmid]; i++)
+        snap->pending[i] = ci_pending_regs[vmid][i];
+    snap->count = countPending[vmid];
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_ic_rpi2_rollback(vmid_t vmid)
+{
+    struct ic_rpi2_snapshot *snap = &_ic_rpi2_snapshot[vmid];
+    int i;
+
+    ci_regs[vmid] = snap->regs;
+    for (i = 0; i < snap->count; i++)
+        ci_pending_regs[vmid][i] = snap->pending[i];
+    countPending[vmid] = snap->count;
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_ic_rpi2_clone(vmid_t dst, vmid_t src)
+{
+    /* interrupts queued for the template were taken by the template */
+    ci_regs[dst] = ci_regs[src];
+
+    return HVMM_STATUS_SUCCESS;
 }
 
 struct vdev_ops _vdev_ic_rpi2_ops = {
     .init = vdev_ic_rpi2_reset,
-    .check = vdev_ic_rpi2_check,
     .read = vdev_ic_rpi2_read,
     .write = vdev_ic_rpi2_write,
     .post = vdev_ic_rpi2_post,
-    .execute = vdev_ic_rpi2_execute,
+    .save = vdev_ic_rpi2_save,
+    .restore = vdev_ic_rpi2_restore,
+    .snapshot = vdev_ic_rpi2_snapshot,
+    .rollback = vdev_ic_rpi2_rollback,
+    .clone = vdev_ic_rpi2_clone,
+};
+
+struct vdev_irq_ops _vdev_ic_rpi2_irq_ops = {
+    .inject = vdev_ic_rpi2_inject,
+    .sync = vdev_ic_rpi2_sync,
+    .pend = vdev_ic_rpi2_pend,
+    .pop_pending = vdev_ic_rpi2_pop_pending,
+    .num_pending = vdev_ic_rpi2_num_pending,
+    .mask = vdev_ic_rpi2_mask,
+    .unmask = vdev_ic_rpi2_unmask,
 };
 
 struct vdev_module _vdev_ic_rpi2_module = {
     .name = "K-Hypervisor vDevice Interrupt Controller RPI2 Module",
     .author = "Kookmin Univ.",
     .ops = &_vdev_ic_rpi2_ops,
-    .tag = 66,
+    .tag = VDEV_TAG_IC,
+    .mmio = &_vdev_ic_rpi2_info,
+    .irq = &_vdev_ic_rpi2_irq_ops,
 };
 
 hvmm_status_t vdev_ic_rpi2()
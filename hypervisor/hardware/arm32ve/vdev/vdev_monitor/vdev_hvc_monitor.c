@@ -111,15 +111,6 @@ static int32_t vdev_hvc_monitor_write(struct arch_vdev_trigger_info *info,
     return 0;
 }
 
-static int32_t vdev_hvc_monitor_check(struct arch_vdev_trigger_info *info,
-                        struct arch_regs *regs)
-{
-    if ((info->iss & 0xFFFF) == 0xFFFC)
-        return 0;
-
-    return VDEV_NOT_FOUND;
-}
-
 static hvmm_status_t vdev_hvc_monitor_reset(void)
 {
     return HVMM_STATUS_SUCCESS;
@@ -127,7 +118,6 @@ static hvmm_status_t vdev_hvc_monitor_reset(void)
 
 struct vdev_ops _vdev_hvc_monitor_ops = {
     .init = vdev_hvc_monitor_reset,
-    .check = vdev_hvc_monitor_check,
     .write = vdev_hvc_monitor_write,
 };
 
@@ -135,6 +125,7 @@ struct vdev_module _vdev_hvc_monitor_module = {
     .name = "K-Hypervisor vDevice HVC dynamic instrumentation trap Module",
     .author = "Kookmin Univ.",
     .ops = &_vdev_hvc_monitor_ops,
+    .hvc = 0xFFFC,
 };
 
 hvmm_status_t vdev_hvc_monitor_init()
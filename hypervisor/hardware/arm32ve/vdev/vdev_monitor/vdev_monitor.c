@@ -38,9 +38,16 @@ static monitor_handler_t _monitor_handler[] = {
     monitor_register,                   /* offset : 0x0a */
     monitor_stop,                       /* offset : 0x0b */
     monitor_write_memory,               /* offset : 0x0c */
-    monitor_check_status                /* offset : 0x0d */
+    monitor_check_status,               /* offset : 0x0d */
+    monitor_dirty_log,                  /* offset : 0x0e */
+    monitor_dirty_collect,              /* offset : 0x0f */
+    monitor_checkpoint,                 /* offset : 0x10 */
+    monitor_clone                       /* offset : 0x11, SMP builds */
 };
 
+#define MONITOR_NUM_HANDLERS \
+    (sizeof(_monitor_handler) / sizeof(_monitor_handler[0]))
+
 static hvmm_status_t vdev_monitor_access_handler(uint32_t write,
         uint32_t offset, uint32_t *pvalue, enum vdev_access_size access_size)
 {
@@ -56,7 +63,7 @@ static hvmm_status_t vdev_monitor_access_handler(uint32_t write,
     printh("%s: %s offset:%d value:%x\n", __func__,
             write ? "write" : "read", offset,
             write ? *pvalue : (uint32_t) pvalue);
-    if (_monitor_handler[index])
+    if (index < MONITOR_NUM_HANDLERS && _monitor_handler[index])
         result = _monitor_handler[index](mvmid, *pvalue);
     return result;
 }
@@ -90,18 +97,6 @@ static int32_t vdev_monitor_post(struct arch_vdev_trigger_info *info,
     return 0;
 }
 
-static int32_t vdev_monitor_check(struct arch_vdev_trigger_info *info,
-                        struct arch_regs *regs)
-{
-    uint32_t offset = info->fipa - _vdev_monitor_info.base;
-
-    if (info->fipa >= _vdev_monitor_info.base &&
-        offset < _vdev_monitor_info.size)
-        return 0;
-
-    return VDEV_NOT_FOUND;
-}
-
 static hvmm_status_t vdev_monitor_reset(void)
 {
     printh("vdev init:'%s'\n", __func__);
@@ -115,7 +110,6 @@ static hvmm_status_t vdev_monitor_reset(void)
 
 struct vdev_ops _vdev_monitor_ops = {
     .init = vdev_monitor_reset,
-    .check = vdev_monitor_check,
     .read = vdev_monitor_read,
     .write = vdev_monitor_write,
     .post = vdev_monitor_post,
@@ -125,6 +119,7 @@ struct vdev_module _vdev_monitor_module = {
     .name = "K-Hypervisor vDevice monitoring Module",
     .author = "Kookmin Univ.",
     .ops = &_vdev_monitor_ops,
+    .mmio = &_vdev_monitor_info,
 };
 
 hvmm_status_t vdev_monitor_init()
@@ -15,8 +15,12 @@ static struct vdev_memory_map _vdev_sample_info = {
    .size = 0x10000,
 };
 
+/* Registers the device is loaded with, sregs keeps those of each guest */
+static struct vdev__local_base_regs sregs_loaded;
 static struct vdev__local_base_regs sregs[NUM_GUESTS_STATIC];
 
+extern struct vdev_module _vdev_sample_module;
+
 static hvmm_status_t vdev_sample_access_handler(uint32_t write, uint32_t offset,
         uint32_t *pvalue, enum vdev_access_size access_size)
 {
@@ -29,10 +33,10 @@ static hvmm_status_t vdev_sample_access_handler(uint32_t write, uint32_t offset,
 
         case 0x60:
 
-        	*pvalue = sregs[0].irq_pending0;
+        	*pvalue = sregs_loaded.irq_pending0;
 //        	printH("send:%x\n",  sregs[0].irq_pending0);
         	*(int*)(SAMPLE_BASE_ADDR + offset) = 0;
-        	sregs[0].irq_pending0 = 0;
+        	sregs_loaded.irq_pending0 = 0;
 
         	break;
         default:
@@ -96,60 +100,33 @@ static int32_t vdev_sample_post(struct arch_vdev_trigger_info *info,
 }
 
 
-static hvmm_status_t vdev_ic_rpi2_execute(int level, int num, int type, int data)
+/**
+ * @brief Sets the core 0 pending register of the running guest, bank 0
+ * only.
+ */
+static hvmm_status_t vdev_sample_inject(uint32_t bank, uint32_t bits)
 {
-	volatile int *addr;
-	hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-
-//	 printH("vdev_ic_rpi2_execute: irq: %d, type : %d\n", irq, type);
-	if (type == 0) { // EOI
-
-	    return HVMM_STATUS_SUCCESS;
-
-	} else if (type == 1) {  // inject
-
-//		printH("rev :%x\n", data);
-		sregs[0].irq_pending0 = data;//0x8;//data;
-//		printH("vdev_ic_rpi2_execute, IC_PENDING1 inject-ok: irq: %d\n", irq);
-
-
-	} else if (type == 2) {
-
-//		printH("vdev_ic_rpi2_execute, IC_PENDING2 inject-ok: irq: %d\n", irq);
-
-
-	} else if (type == 3) { //all coply
-//		printH("All Copy IC_pri2\n");
-
+    if (bank)
+        return HVMM_STATUS_BAD_ACCESS;
 
-		return HVMM_STATUS_SUCCESS;
-	}
-	else if (type == 4) { //all coply
-	//		printH("All Copy IC_pri2\n");
+    vdev_load(&_vdev_sample_module);
+    sregs_loaded.irq_pending0 = bits;
 
-			return HVMM_STATUS_SUCCESS;
-		}
-	return HVMM_STATUS_SUCCESS;
+    return HVMM_STATUS_SUCCESS;
 }
 
-static int32_t vdev_sample_check(struct arch_vdev_trigger_info *info,
-                        struct arch_regs *regs)
+static hvmm_status_t vdev_sample_save(vmid_t vmid)
 {
-    uint32_t offset = info->fipa - _vdev_sample_info.base;
+    sregs[vmid] = sregs_loaded;
 
-//    printH("dev_smaple_check_info fipa : %x\n", info->fipa);
-    if (info->fipa >= _vdev_sample_info.base &&
-        offset < _vdev_sample_info.size)
-        return 0;
+    return HVMM_STATUS_SUCCESS;
+}
 
-    /**
-     * Find vdev using tag.  Hard coding.
-     */
-    if( !regs ) {
-    	return 77;
-    }
+static hvmm_status_t vdev_sample_restore(vmid_t vmid)
+{
+    sregs_loaded = sregs[vmid];
 
-    return VDEV_NOT_FOUND;
+    return HVMM_STATUS_SUCCESS;
 }
 
 static hvmm_status_t vdev_sample_reset(void)
@@ -160,18 +137,24 @@ static hvmm_status_t vdev_sample_reset(void)
 
 struct vdev_ops _vdev_sample_ops = {
     .init = vdev_sample_reset,
-    .check = vdev_sample_check,
     .read = vdev_sample_read,
     .write = vdev_sample_write,
     .post = vdev_sample_post,
-    .execute = vdev_ic_rpi2_execute,
+    .save = vdev_sample_save,
+    .restore = vdev_sample_restore,
+};
+
+struct vdev_irq_ops _vdev_sample_irq_ops = {
+    .inject = vdev_sample_inject,
 };
 
 struct vdev_module _vdev_sample_module = {
     .name = "K-Hypervisor vDevice Sample Module",
     .author = "Kookmin Univ.",
     .ops = &_vdev_sample_ops,
-    .tag = 77,
+    .tag = VDEV_TAG_LOCAL_IC,
+    .mmio = &_vdev_sample_info,
+    .irq = &_vdev_sample_irq_ops,
 };
 
 hvmm_status_t vdev_sample_init()
@@ -1,4 +1,5 @@
-#include <vdev.h>
+#include <vdev_reg.h>
+#include <stddef.h>
 #define DEBUG
 #include <log/print.h>
 #include <timer.h>
@@ -19,42 +20,42 @@ static struct vdev_memory_map _vdev_timer_info = {
 
 static struct vdev_vtimer_regs vtimer_regs[NUM_GUESTS_STATIC];
 static int _timer_status[NUM_GUESTS_STATIC] = {0, };
+static struct vdev_vtimer_regs _vtimer_snapshot[NUM_GUESTS_STATIC];
 
 static void vtimer_changed_status(vmid_t vmid, uint32_t status)
 {
     _timer_status[vmid] = status;
 }
 
+static hvmm_status_t vtimer_write_mask(vmid_t vmid, uint32_t n,
+        uint32_t *reg, uint32_t value, uint32_t mask)
+{
+    vtimer_changed_status(vmid, *reg);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static const struct vdev_reg _vtimer_regs[] = {
+    { 0x0, 1, VDEV_REG_RW, VDEV_ACCESS_BYTE,
+      offsetof(struct vdev_vtimer_regs, vtimer_mask), 0, vtimer_write_mask },
+};
+
+static uint8_t _vtimer_index[sizeof(struct vdev_vtimer_regs) / 4];
+
+static struct vdev_regmap _vtimer_map = {
+    .regs = _vtimer_regs,
+    .nregs = sizeof(_vtimer_regs) / sizeof(_vtimer_regs[0]),
+    .size = sizeof(struct vdev_vtimer_regs),
+    .state = (uint8_t *) vtimer_regs,
+    .stride = sizeof(struct vdev_vtimer_regs),
+    .index = _vtimer_index,
+};
+
 static hvmm_status_t vdev_vtimer_access_handler(uint32_t write,
         uint32_t offset, uint32_t *pvalue, enum vdev_access_size access_size)
 {
-    printH("%s: %s offset:%d value:%x\n", __func__,
-            write ? "write" : "read",
-            offset, write ? *pvalue : (uint32_t) pvalue);
-    hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
-    unsigned int vmid = guest_current_vmid();
-    if (!write) {
-        /* READ */
-        switch (offset) {
-        case 0x0:
-            *pvalue = vtimer_regs[vmid].vtimer_mask;
-            result = HVMM_STATUS_SUCCESS;
-            break;
-        }
-    } else {
-        /* WRITE */
-        switch (offset) {
-        case 0x0:
-            vtimer_regs[vmid].vtimer_mask = *pvalue;
-            vtimer_changed_status(vmid, *pvalue);
-
-            result = HVMM_STATUS_SUCCESS;
-                break;
-                while(1)
-                		;
-        }
-    }
-    return result;
+    return vdev_regmap_access(&_vtimer_map, write, offset, pvalue,
+            access_size);
 }
 
 static int32_t vdev_vtimer_read(struct arch_vdev_trigger_info *info,
@@ -86,17 +87,6 @@ static int32_t vdev_vtimer_post(struct arch_vdev_trigger_info *info,
     return 0;
 }
 
-static int32_t vdev_vtimer_check(struct arch_vdev_trigger_info *info,
-                        struct arch_regs *regs)
-{
-    uint32_t offset = info->fipa - _vdev_timer_info.base;
-
-    if (info->fipa >= _vdev_timer_info.base &&
-        offset < _vdev_timer_info.size)
-        return 0;
-    return VDEV_NOT_FOUND;
-}
-
 void callback_timer(void *pdata)
 {
     vmid_t vmid = guest_current_vmid();
@@ -123,21 +113,60 @@ static hvmm_status_t vdev_vtimer_reset(void)
 
     timer_set(&timer, GUEST_TIMER);
 
+    if (vdev_regmap_init(&_vtimer_map) != HVMM_STATUS_SUCCESS)
+        return HVMM_STATUS_BAD_ACCESS;
+#ifdef _VDEV_SHADOW_
+    /* guests poll the mask, only its writes trap */
+    for (i = guest_first_vmid(); i <= guest_last_vmid(); i++) {
+        if (vdev_regmap_shadow(&_vtimer_map, i, _vdev_timer_info.base) !=
+                HVMM_STATUS_SUCCESS)
+            printh("vtimer: no shadow page for vmid %d\n", i);
+    }
+#endif
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_vtimer_snapshot(vmid_t vmid)
+{
+    _vtimer_snapshot[vmid] = vtimer_regs[vmid];
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_vtimer_rollback(vmid_t vmid)
+{
+    vtimer_regs[vmid] = _vtimer_snapshot[vmid];
+    vtimer_changed_status(vmid, vtimer_regs[vmid].vtimer_mask);
+    vdev_regmap_sync(&_vtimer_map, vmid);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static hvmm_status_t vdev_vtimer_clone(vmid_t dst, vmid_t src)
+{
+    vtimer_regs[dst] = vtimer_regs[src];
+    vtimer_changed_status(dst, vtimer_regs[dst].vtimer_mask);
+    vdev_regmap_sync(&_vtimer_map, dst);
+
     return HVMM_STATUS_SUCCESS;
 }
 
 struct vdev_ops _vdev_hvc_vtimer_ops = {
     .init = vdev_vtimer_reset,
-    .check = vdev_vtimer_check,
     .read = vdev_vtimer_read,
     .write = vdev_vtimer_write,
     .post = vdev_vtimer_post,
+    .snapshot = vdev_vtimer_snapshot,
+    .rollback = vdev_vtimer_rollback,
+    .clone = vdev_vtimer_clone,
 };
 
 struct vdev_module _vdev_hvc_vtimer_module = {
     .name = "K-Hypervisor vDevice vTimer Module",
     .author = "Kookmin Univ.",
     .ops = &_vdev_hvc_vtimer_ops,
+    .mmio = &_vdev_timer_info,
 };
 
 hvmm_status_t vdev_vtimer_init()
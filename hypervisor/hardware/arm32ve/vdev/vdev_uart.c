@@ -101,39 +101,21 @@ static int32_t vdev_uart_post(struct arch_vdev_trigger_info *info,
 }
 
 
-static hvmm_status_t vdev_ic_rpi2_execute(int level, int num, int type, int data)
+/* Guest accesses go through to the uart only while enabled */
+static hvmm_status_t vdev_uart_enable(void)
 {
-	volatile int *addr;
-	hvmm_status_t result = HVMM_STATUS_BAD_ACCESS;
+    isBmGuest = 1;
+    printH("::Khypervisor: Enable bmguest uart..\n");
 
-	isBmGuest++;
-
-	if(isBmGuest % 2 == 0)
-		printH("::Khypervisor: Disable bmguest uart..\n");
-	else
-		printH("::Khypervisor: Enable bmguest uart..\n");
-
-	return HVMM_STATUS_SUCCESS;
+    return HVMM_STATUS_SUCCESS;
 }
 
-static int32_t vdev_uart_check(struct arch_vdev_trigger_info *info,
-                        struct arch_regs *regs)
+static hvmm_status_t vdev_uart_disable(void)
 {
-    uint32_t offset = info->fipa - _vdev_uart_info.base;
+    isBmGuest = 0;
+    printH("::Khypervisor: Disable bmguest uart..\n");
 
-//    printH("dev_smaple_check_info fipa : %x\n", info->fipa);
-    if (info->fipa >= _vdev_uart_info.base &&
-        offset < _vdev_uart_info.size)
-        return 0;
-
-    /**
-     * Find vdev using tag.  Hard coding.
-     */
-    if( !regs ) {
-    	return 83;
-    }
-
-    return VDEV_NOT_FOUND;
+    return HVMM_STATUS_SUCCESS;
 }
 
 static hvmm_status_t vdev_uart_reset(void)
@@ -144,18 +126,19 @@ static hvmm_status_t vdev_uart_reset(void)
 
 struct vdev_ops _vdev_uart_ops = {
     .init = vdev_uart_reset,
-    .check = vdev_uart_check,
     .read = vdev_uart_read,
     .write = vdev_uart_write,
     .post = vdev_uart_post,
-    .execute = vdev_ic_rpi2_execute,
+    .enable = vdev_uart_enable,
+    .disable = vdev_uart_disable,
 };
 
 struct vdev_module _vdev_uart_module = {
     .name = "K-Hypervisor vDevice uart Module",
     .author = "Kookmin Univ.",
     .ops = &_vdev_uart_ops,
-    .tag = 83,
+    .tag = VDEV_TAG_UART,
+    .mmio = &_vdev_uart_info,
 };
 
 hvmm_status_t vdev_uart_init()
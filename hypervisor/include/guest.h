@@ -121,6 +121,9 @@ hvmm_status_t guest_init();
 struct guest_struct get_guest(uint32_t guest_num);
 struct guest_struct* get_guest_pointer(uint32_t guest_num);
 void reboot_guest(vmid_t vmid, uint32_t pc, struct arch_regs **regs);
+hvmm_status_t guest_checkpoint(vmid_t vmid);
+hvmm_status_t guest_rollback(vmid_t vmid);
+hvmm_status_t guest_clone(vmid_t dst, vmid_t src);
 void set_manually_select_vmid(vmid_t vmid);
 void clean_manually_select_vmid(void);
 hvmm_status_t perform_switch(struct arch_regs *regs, vmid_t next_vmid);
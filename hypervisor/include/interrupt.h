@@ -11,6 +11,13 @@
 #define INJECT_SW 0
 #define INJECT_HW 1
 
+#define VIRQ_RATELIMIT_OFF 0
+
+/** Empty slot in the virqmap hash indexes */
+#define VIRQMAP_SLOT_EMPTY  0xFFFF
+/** Hash indexes are kept at most half full, must be a power of two */
+#define VIRQMAP_HASH_SIZE   (CFG_VIRQMAP_ENTRIES * 2)
+
 /**
  * @breif   Saves a mapping information to find a virq for injection.
  *
@@ -22,11 +29,28 @@ struct virqmap_entry {
     uint32_t enabled;   /**< virqmap enabled flag */
     uint32_t virq;      /**< Virtual interrupt nubmer */
     uint32_t pirq;      /**< Pysical interrupt nubmer */
+    uint32_t pending;   /**< virq injected and not yet EOIed by the guest */
+    uint32_t masked;    /**< pirq masked by the rate limiter */
+    uint32_t budget;    /**< injections allowed per period, 0: unlimited */
+    uint32_t tokens;    /**< injections left in the current period */
+    uint64_t refill_at; /**< counter value at which tokens are refilled */
+    uint32_t coalesced; /**< assertions merged into a pending virq */
+    uint32_t throttled; /**< times the pirq was masked for lack of tokens */
 };
 
+/**
+ * @brief   Compact per-guest virq map.
+ *
+ * Only the mapped interrupts are stored in map[], declared through
+ * interrupt_virqmap_declare(). Lookups by pirq and by virq go through
+ * two small hash indexes into map[].
+ */
 struct guest_virqmap {
     vmid_t vmid;
-    struct virqmap_entry map[MAX_IRQS];
+    uint32_t num_entries;
+    struct virqmap_entry map[CFG_VIRQMAP_ENTRIES];
+    uint16_t pirq_hash[VIRQMAP_HASH_SIZE];  /**< pirq -> map[] index */
+    uint16_t virq_hash[VIRQMAP_HASH_SIZE];  /**< virq -> map[] index */
 };
 
 typedef void (*interrupt_handler_t)(int irq, void *regs, void *pdata);
@@ -47,6 +71,9 @@ struct interrupt_ops {
     /** End of interrupt */
     hvmm_status_t (*end)(uint32_t);
 
+    /** Deactivate an interrupt already priority dropped */
+    hvmm_status_t (*deactivate)(uint32_t);
+
     /** Inject to guest */
     hvmm_status_t (*inject)(vmid_t, uint32_t, uint32_t, uint8_t);
 
@@ -56,6 +83,15 @@ struct interrupt_ops {
     /** Restore interrupt state */
     hvmm_status_t (*restore)(vmid_t vmid);
 
+    /** Keep a copy of the saved interrupt state */
+    hvmm_status_t (*snapshot)(vmid_t vmid);
+
+    /** Bring the saved interrupt state back to the copy */
+    hvmm_status_t (*rollback)(vmid_t vmid);
+
+    /** Copy the saved interrupt state of a guest to a clone */
+    hvmm_status_t (*clone)(vmid_t dst, vmid_t src);
+
     /** Dump state of the interrupt */
     hvmm_status_t (*dump)(void);
 };
@@ -106,20 +142,79 @@ extern struct interrupt_module _interrupt_module;
  *          otherwise returns "unknown error"
  */
 hvmm_status_t interrupt_init(struct guest_virqmap *virqmap);
+
+/**
+ * @brief   Binds the virtual devices the interrupt path drives, once they
+ *          are registered by vdev_init().
+ */
+hvmm_status_t interrupt_vdev_init(void);
+
+/**
+ * @brief   Clears a guest virq map before its mappings are declared.
+ */
+void interrupt_virqmap_init(struct guest_virqmap *virqmap);
+
+/**
+ * @brief   Maps @pirq to @virq in a guest virq map.
+ * @return  HVMM_STATUS_BUSY when the map already holds
+ *          CFG_VIRQMAP_ENTRIES mappings.
+ */
+hvmm_status_t interrupt_virqmap_declare(struct guest_virqmap *virqmap,
+                uint32_t pirq, uint32_t virq);
 hvmm_status_t interrupt_request(uint32_t irq, interrupt_handler_t handler);
 hvmm_status_t interrupt_host_enable(uint32_t irq);
 hvmm_status_t interrupt_host_disable(uint32_t irq);
 hvmm_status_t interrupt_host_configure(uint32_t irq);
 hvmm_status_t interrupt_guest_inject(vmid_t vmid, uint32_t virq, uint32_t pirq,
                 uint8_t hw);
+hvmm_status_t interrupt_guest_local_raise(vmid_t vmid, uint32_t bits);
 hvmm_status_t interrupt_guest_enable(vmid_t vmid, uint32_t irq);
 hvmm_status_t interrupt_guest_disable(vmid_t vmid, uint32_t irq);
 hvmm_status_t interrupt_save(vmid_t vmid);
 hvmm_status_t interrupt_restore(vmid_t vmid);
+hvmm_status_t interrupt_snapshot(vmid_t vmid);
+hvmm_status_t interrupt_rollback(vmid_t vmid);
+hvmm_status_t interrupt_clone(vmid_t dst, vmid_t src);
 void interrupt_service_routine(int irq, void *current_regs, void *pdata);
 const int32_t interrupt_check_guest_irq(uint32_t pirq);
 const uint32_t interrupt_pirq_to_virq(vmid_t vmid, uint32_t pirq);
 const uint32_t interrupt_virq_to_pirq(vmid_t vmid, uint32_t virq);
 const uint32_t interrupt_pirq_to_enabled_virq(vmid_t vmid, uint32_t pirq);
 
+/**
+ * @brief   Sets the token-bucket budget of a guest's interrupt source.
+ *
+ * At most @budget injections of @pirq reach the guest per
+ * CFG_VIRQ_RATELIMIT_PERIOD_US. Once the budget is spent, the pirq is
+ * masked at the host until it refills. VIRQ_RATELIMIT_OFF disables it.
+ */
+hvmm_status_t interrupt_guest_ratelimit(vmid_t vmid, uint32_t pirq,
+                uint32_t budget);
+
+/**
+ * @brief   Completes a virq injected for @pirq.
+ *
+ * Called when the guest EOIs the virq, from the vGIC maintenance
+ * interrupt or, on the RPi2, when the guest enables the source again in
+ * the vIC. Clears the coalescing state and unmasks the pirq if the rate
+ * limiter has tokens left.
+ */
+hvmm_status_t interrupt_guest_eoi(vmid_t vmid, uint32_t pirq);
+
+/**
+ * @brief   Refills expired budgets and unmasks the throttled sources.
+ *
+ * Called from the scheduler tick.
+ */
+void interrupt_guest_ratelimit_refill(void);
+
+#ifdef _FIQ_FASTPATH_
+/**
+ * @brief   Retires the virtual FIQ raised by hyp_vector_fiq.
+ *
+ * Called when the real-time guest re-arms the FIQ control register.
+ */
+void interrupt_fiq_fastpath_eoi(void);
+#endif
+
 #endif
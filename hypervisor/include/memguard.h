@@ -0,0 +1,31 @@
+#ifndef __MEMGUARD_H__
+#define __MEMGUARD_H__
+
+#include <hvmm_types.h>
+#include "arch_types.h"
+
+/** Budget of an unregulated guest */
+#define MEMGUARD_BUDGET_OFF     0
+
+/**
+ * @brief Memory bandwidth regulation statistics of a guest.
+ */
+struct memguard_stat {
+    uint32_t budget;        /* events per period, 0 unregulated */
+    uint32_t used;          /* events in the current period */
+    uint32_t throttled;     /* budget exhausted in the current period */
+    uint32_t throttles;     /* periods the budget ran out */
+    uint32_t periods;
+};
+
+hvmm_status_t memguard_init(void);
+hvmm_status_t memguard_set_budget(vmid_t vmid, uint32_t budget);
+void memguard_save(vmid_t vmid);
+void memguard_restore(vmid_t vmid);
+void memguard_overflow(void);
+void memguard_period(void);
+int memguard_throttled(vmid_t vmid);
+void memguard_get_stat(vmid_t vmid, struct memguard_stat *stat);
+void memguard_dump(void);
+
+#endif
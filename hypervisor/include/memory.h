@@ -20,13 +20,25 @@ enum memattr {
     MEMATTR_NORMAL_IWB = 0x3,
 };
 
+/**
+ * @brief Physical address of a memory map descriptor whose memory is
+ * allocated from the page pool as the guest first touches it.
+ */
+#define MEMMAP_PA_ALLOC     0xFFFFFFFFFFFFFFFFULL
+
+/**
+ * @brief Flags of a stage-2 fault given to memory_fault().
+ */
+#define MEMORY_FAULT_WRITE          (1 << 0)    /* write access */
+#define MEMORY_FAULT_PERMISSION     (1 << 1)    /* permission, not translation */
+
 /**
  * @brief Memory map descriptor.
  *
  * Memory map information descriptor.
  * - label Name of the descriptor.
  * - va Intermediate physical address(IPA).
- * - pa Physical address.
+ * - pa Physical address, or MEMMAP_PA_ALLOC.
  * - size Size of this memory area.
  * - attr Memory attribute value.
  */
@@ -56,6 +68,45 @@ struct memory_ops {
 
     /** Dump state of the memory */
     hvmm_status_t (*dump)(void);
+
+    /** Resolve a stage-2 fault of a guest */
+    hvmm_status_t (*fault)(vmid_t vmid, uint32_t ipa, uint32_t flags);
+
+    /** Scan guest memory in the background, a few pages per call */
+    hvmm_status_t (*scan)(uint32_t pages);
+
+    /** Give a guest page back to the page pool */
+    hvmm_status_t (*release)(vmid_t vmid, uint32_t ipa);
+
+    /** Take back a guest page given to the page pool */
+    hvmm_status_t (*reclaim)(vmid_t vmid, uint32_t ipa);
+
+    /** Give a guest a new VMID for a new lifetime */
+    hvmm_status_t (*renew_vmid)(vmid_t vmid);
+
+    /** Start or stop dirty page logging of a guest */
+    hvmm_status_t (*dirty_log)(vmid_t vmid, uint32_t enable);
+
+    /** Take the dirty pages of a guest and start a new round */
+    hvmm_status_t (*dirty_collect)(vmid_t vmid, uint32_t *bitmap,
+            uint32_t pages);
+
+    /** Take or drop the snapshot of the RAM of a guest */
+    hvmm_status_t (*snapshot)(vmid_t vmid, uint32_t enable);
+
+    /** Bring the RAM of a guest back to its snapshot */
+    hvmm_status_t (*rollback)(vmid_t vmid);
+
+    /** Share the RAM of a guest copy-on-write with a clone */
+    hvmm_status_t (*clone)(vmid_t dst, vmid_t src);
+
+    /** Map memory of the hypervisor into a guest, shared between guests */
+    hvmm_status_t (*share)(vmid_t vmid, uint32_t ipa, uint32_t pa,
+            uint32_t size);
+
+    /** Map memory of the hypervisor read-only into a guest */
+    hvmm_status_t (*share_ro)(vmid_t vmid, uint32_t ipa, uint32_t pa,
+            uint32_t size);
 };
 
 struct memory_module {
@@ -95,6 +146,21 @@ void memory_free(void *ap);
 void *memory_alloc(unsigned long size);
 hvmm_status_t memory_save(void);
 hvmm_status_t memory_restore(vmid_t vmid);
+hvmm_status_t memory_fault(vmid_t vmid, uint32_t ipa, uint32_t flags);
+hvmm_status_t memory_scan(uint32_t pages);
+hvmm_status_t memory_release(vmid_t vmid, uint32_t ipa);
+hvmm_status_t memory_reclaim(vmid_t vmid, uint32_t ipa);
+hvmm_status_t memory_renew_vmid(vmid_t vmid);
+hvmm_status_t memory_dirty_log(vmid_t vmid, uint32_t enable);
+hvmm_status_t memory_dirty_collect(vmid_t vmid, uint32_t *bitmap,
+        uint32_t pages);
+hvmm_status_t memory_snapshot(vmid_t vmid, uint32_t enable);
+hvmm_status_t memory_rollback(vmid_t vmid);
+hvmm_status_t memory_clone(vmid_t dst, vmid_t src);
+hvmm_status_t memory_share(vmid_t vmid, uint32_t ipa, uint32_t pa,
+        uint32_t size);
+hvmm_status_t memory_share_ro(vmid_t vmid, uint32_t ipa, uint32_t pa,
+        uint32_t size);
 hvmm_status_t memory_init(struct memmap_desc **guest0,
                     struct memmap_desc **guest1);
 
@@ -16,6 +16,7 @@
 #define MEMORY 2
 #define REGISTER 3
 #define BREAK 4
+#define DIRTY 5
 
 #define NOTFOUND 0
 #define FOUND 1
@@ -109,4 +110,8 @@ hvmm_status_t monitor_reboot(struct monitor_vmid *mvmid, uint32_t va);
 hvmm_status_t monitor_init(void);
 hvmm_status_t monitor_recovery(struct monitor_vmid *mvmid, uint32_t va);
 hvmm_status_t monitor_check_status(struct monitor_vmid *mvmid, uint32_t va);
+hvmm_status_t monitor_dirty_log(struct monitor_vmid *mvmid, uint32_t va);
+hvmm_status_t monitor_dirty_collect(struct monitor_vmid *mvmid, uint32_t va);
+hvmm_status_t monitor_checkpoint(struct monitor_vmid *mvmid, uint32_t va);
+hvmm_status_t monitor_clone(struct monitor_vmid *mvmid, uint32_t va);
 #endif
@@ -0,0 +1,39 @@
+#ifndef __PAGE_H__
+#define __PAGE_H__
+
+#include <hvmm_types.h>
+#include "arch_types.h"
+
+#define PAGE_SHIFT          12
+#define PAGE_SIZE           (1 << PAGE_SHIFT)
+#define PAGE_MASK           (~(PAGE_SIZE - 1))
+
+/** Block orders, a block of order n is 2^n pages */
+#define PAGE_ORDER_4K       0
+#define PAGE_ORDER_2M       9
+#define PAGE_MAX_ORDER      PAGE_ORDER_2M
+
+/**
+ * @brief Page frame allocator statistics.
+ */
+struct page_stat {
+    uint32_t total;         /* pages in the pool */
+    uint32_t free;          /* free pages */
+    uint32_t free_blocks[PAGE_MAX_ORDER + 1];
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failures;
+};
+
+hvmm_status_t page_init(void);
+void *page_alloc(uint32_t order);
+void *page_zalloc(uint32_t order);
+void *page_alloc_colour(uint32_t colours);
+uint32_t page_colour(uint32_t addr);
+void page_free(void *addr, uint32_t order);
+void page_split(void *addr, uint32_t order);
+int page_in_pool(uint32_t addr);
+void page_get_stat(struct page_stat *stat);
+void page_dump(void);
+
+#endif
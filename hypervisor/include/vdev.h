@@ -21,6 +21,31 @@ enum vdev_level {
 #define VDEV_ERROR -1
 #define VDEV_NOT_FOUND -1
 
+/**
+ * @brief Tags of the devices the hypervisor itself drives, looked up once
+ * by vdev_get_tag().
+ */
+enum vdev_tag {
+    VDEV_TAG_NONE = 0,
+    VDEV_TAG_CPU_INTERFACE = 55,
+    VDEV_TAG_IC = 66,               /* RPi2 interrupt controller */
+    VDEV_TAG_LOCAL_IC = 77,         /* RPi2 core local interrupts */
+    VDEV_TAG_UART = 83,
+    VDEV_TAG_BALLOON = 88,
+};
+
+/**
+ * \defgroup Vdev_hvc
+ *
+ * Hypercalls served by a vdev, hvc #VDEV_HVC_BASE up to hvc #0xFFFF.
+ * The immediate indexes the hypercall table directly.
+ * @{
+ */
+#define VDEV_HVC_BASE   0xFFF0
+#define VDEV_HVC_MAX    16
+#define VDEV_HVC_NONE   0
+/** @}*/
+
 struct arch_vdev_trigger_info {
     /** Exception Class */
     uint32_t ec;
@@ -44,6 +69,14 @@ struct vdev_memory_map {
     unsigned int size;
 };
 
+/**
+ * @brief MMIO dispatch cache statistics of a cpu.
+ */
+struct vdev_cache_stat {
+    uint32_t hits;
+    uint32_t misses;        /* range searches, found or not */
+};
+
 typedef int (*initcall_t)(void);
 
 extern initcall_t __vdev_module_high_start[];
@@ -90,12 +123,24 @@ struct vdev_ops {
     /** Post for remain on the job */
     hvmm_status_t (*post)(struct arch_vdev_trigger_info *, struct arch_regs *);
 
-    /** Save virtual device state */
+    /**
+     * Save virtual device state. A device implementing save or restore
+     * keeps per-guest state and is switched for the guests accessing it.
+     */
     hvmm_status_t (*save)(vmid_t vmid);
 
-    /** Restore virtual device state */
+    /** Restore virtual device state, also before the first access */
     hvmm_status_t (*restore)(vmid_t vmid);
 
+    /** Keep a copy of the virtual device state of a guest */
+    hvmm_status_t (*snapshot)(vmid_t vmid);
+
+    /** Bring the virtual device state of a guest back to the copy */
+    hvmm_status_t (*rollback)(vmid_t vmid);
+
+    /** Copy the virtual device state of a guest to a clone */
+    hvmm_status_t (*clone)(vmid_t dst, vmid_t src);
+
     /** Dump state of the vdev */
     hvmm_status_t (*dump)(void);
 
@@ -103,8 +148,36 @@ struct vdev_ops {
     hvmm_status_t (*execute)(int level, int num, int type, int data);
 };
 
+/**
+ * @brief Operations of a virtual interrupt controller, called by the
+ * interrupt path of the hypervisor.
+ */
+struct vdev_irq_ops {
+    /** Set pending register \a bank of the guest */
+    hvmm_status_t (*inject)(uint32_t bank, uint32_t bits);
+
+    /** Load the guest registers from the hardware */
+    hvmm_status_t (*sync)(void);
+
+    /** Queue an interrupt guest \a vmid can not take yet */
+    hvmm_status_t (*pend)(vmid_t vmid, uint32_t irq);
+
+    /** Load the registers of the running guest \a vmid for its last
+     *  queued interrupt */
+    hvmm_status_t (*pop_pending)(vmid_t vmid);
+
+    /** Number of interrupts queued for guest \a vmid */
+    uint32_t (*num_pending)(vmid_t vmid);
+
+    /** Hold source \a irq disabled, whatever the guest enables */
+    hvmm_status_t (*mask)(uint32_t irq);
+
+    /** Release source \a irq held by mask() and enable it */
+    hvmm_status_t (*unmask)(uint32_t irq);
+};
+
 struct vdev_module {
-    /** tag must be initialized to HAL_TAG */
+    /** enum vdev_tag, VDEV_TAG_NONE if the device is not looked up */
     uint32_t tag;
 
     /**
@@ -130,6 +203,20 @@ struct vdev_module {
     /** Virtual Device Operation */
     struct vdev_ops *ops;
 
+    /**
+     * IPA range trapped by the device. Faults in it are dispatched by
+     * address, check() is then only used for other triggers and tags.
+     */
+    struct vdev_memory_map *mmio;
+
+    /**
+     * HVC immediate served by the device, VDEV_HVC_NONE if none. The
+     * hypercall is dispatched to write() without check().
+     */
+    uint32_t hvc;
+
+    /** Interrupt controller operations, if the device is one */
+    struct vdev_irq_ops *irq;
 };
 
 hvmm_status_t vdev_register(int level, struct vdev_module *module);
@@ -141,10 +228,21 @@ int32_t vdev_write(int level, int num, struct arch_vdev_trigger_info *info,
             struct arch_regs *regs);
 hvmm_status_t vdev_post(int level, int num, struct arch_vdev_trigger_info *info,
             struct arch_regs *regs);
+int32_t vdev_mmio(int level, struct arch_vdev_trigger_info *info,
+        struct arch_regs *regs, uint32_t write);
+void vdev_load(struct vdev_module *module);
 hvmm_status_t vdev_save(vmid_t vmid);
 hvmm_status_t vdev_restore(vmid_t vmid);
+hvmm_status_t vdev_snapshot(vmid_t vmid);
+hvmm_status_t vdev_rollback(vmid_t vmid);
+hvmm_status_t vdev_clone(vmid_t dst, vmid_t src);
 hvmm_status_t vdev_init(void);
 int32_t vdev_execute(int level, int num, int type, int data);
 int32_t vdev_find_tag(int level, int tag);
+struct vdev_module *vdev_get_tag(int level, uint32_t tag);
+int32_t vdev_hvc(uint32_t imm, struct arch_vdev_trigger_info *info,
+        struct arch_regs *regs);
+void vdev_cache_get_stat(uint32_t cpu, struct vdev_cache_stat *stat);
+void vdev_cache_dump(void);
 
 #endif /* __VDEV_H_ */
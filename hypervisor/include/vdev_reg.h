@@ -0,0 +1,83 @@
+#ifndef __VDEV_REG_H__
+#define __VDEV_REG_H__
+
+#include <vdev.h>
+
+/**
+ * \defgroup Vdev_reg_flags
+ *
+ * Where the accesses to a register go.
+ * - VDEV_REG_R, VDEV_REG_W: the backing storage of the guest.
+ * - VDEV_REG_HW_R, VDEV_REG_HW_W: the hardware register at the same offset.
+ * - A read without a read target returns 0, a write without a write
+ *   target only reaches the write callback, if any.
+ * - VDEV_REG_RESET_HW: the reset value is read from the hardware.
+ * - VDEV_REG_NO_RESET: the storage is left alone at reset, for a bank
+ *   sharing the storage of another one that loads it.
+ * - A register with VDEV_REG_R or VDEV_REG_W has backing storage.
+ * @{
+ */
+#define VDEV_REG_R          0x01
+#define VDEV_REG_W          0x02
+#define VDEV_REG_HW_R       0x04
+#define VDEV_REG_HW_W       0x08
+#define VDEV_REG_RESET_HW   0x10
+#define VDEV_REG_NO_RESET   0x20
+
+#define VDEV_REG_RW         (VDEV_REG_R | VDEV_REG_W)
+#define VDEV_REG_RO         VDEV_REG_R
+#define VDEV_REG_PASS       (VDEV_REG_HW_R | VDEV_REG_HW_W)
+/** @}*/
+
+/**
+ * @brief Side effect of a write, called once the write reached its
+ * targets.
+ *
+ * @param n Register of the bank, 0 for the first.
+ * @param reg Backing storage of the register for the guest.
+ * @param value Written value, shifted to the bytes of the access.
+ * @param mask Bytes of the access.
+ */
+typedef hvmm_status_t (*vdev_reg_write_t)(vmid_t vmid, uint32_t n,
+        uint32_t *reg, uint32_t value, uint32_t mask);
+
+/**
+ * @brief A bank of count 32-bit registers.
+ */
+struct vdev_reg {
+    uint16_t offset;            /* of the first register */
+    uint16_t count;
+    uint8_t flags;              /* VDEV_REG_* */
+    uint8_t size;               /* narrowest access, enum vdev_access_size */
+    uint16_t field;             /* backing storage of the first register */
+    uint32_t reset;
+    vdev_reg_write_t write;
+};
+
+/**
+ * @brief Register map of a device, served by vdev_regmap_access().
+ *
+ * With a shadow page, the guest reads the registers from a read-only
+ * image of the window mapped at its IPA, only writes trap. Callbacks
+ * changing other registers than their own call vdev_regmap_sync().
+ */
+struct vdev_regmap {
+    const struct vdev_reg *regs;
+    uint32_t nregs;             /* at most 255 */
+    uint32_t size;              /* of the register window in bytes */
+    uint32_t hw_base;           /* for VDEV_REG_HW_* and VDEV_REG_RESET_HW */
+    uint8_t *state;             /* backing storage of guest 0 */
+    uint32_t stride;            /* backing storage per guest, 0 if shared */
+    uint8_t *index;             /* size / 4 entries, bank number + 1 */
+    uint32_t *shadow[NUM_GUESTS_STATIC];    /* set by vdev_regmap_shadow() */
+};
+
+hvmm_status_t vdev_regmap_init(struct vdev_regmap *map);
+void vdev_regmap_reset(struct vdev_regmap *map, vmid_t vmid);
+hvmm_status_t vdev_regmap_access(struct vdev_regmap *map, uint32_t write,
+        uint32_t offset, uint32_t *pvalue, enum vdev_access_size size);
+hvmm_status_t vdev_regmap_shadow(struct vdev_regmap *map, vmid_t vmid,
+        uint32_t ipa);
+void vdev_regmap_sync(struct vdev_regmap *map, vmid_t vmid);
+
+#endif
@@ -4,8 +4,11 @@
 #include <hvmm_trace.h>
 #include <log/uart_print.h>
 #include <interrupt.h>
+#include <memory.h>
 #include <smp.h>
+#include <memguard.h>
 #include <guest.h>
+#include <vdev.h>
 
 
 #define VIRQ_MIN_VALID_PIRQ 16
@@ -14,24 +17,134 @@
 #define VALID_PIRQ(pirq) \
     (pirq >= VIRQ_MIN_VALID_PIRQ && pirq < VIRQ_NUM_MAX_PIRQS)
 
+#define VIRQ_RATELIMIT_PERIOD \
+    ((uint64_t) CFG_VIRQ_RATELIMIT_PERIOD_US * COUNT_PER_USEC)
+#define VIRQ_NUM_MAX_THROTTLED  32
+
+#define VIRQMAP_HASH_MASK       (VIRQMAP_HASH_SIZE - 1)
 
 static struct interrupt_ops *_guest_ops;
 static struct interrupt_ops *_host_ops;
 
 static struct guest_virqmap *_guest_virqmap;
 
+/**< Devices the interrupt path drives, bound by interrupt_vdev_init() */
+static struct vdev_irq_ops _vdev_irq_none;
+static struct vdev_irq_ops *_vic = &_vdev_irq_none;
+static struct vdev_irq_ops *_vlocal_ic = &_vdev_irq_none;
+static struct vdev_module *_vuart;
+static int _vuart_enabled = 1;
+/**< Local interrupt bits raised for a guest, delivered at its next tick */
+static uint32_t _vlocal_raised[NUM_GUESTS_STATIC];
+
 /**< IRQ handler */
 static interrupt_handler_t _host_ppi_handlers[NUM_CPUS][MAX_PPI_IRQS];
 static interrupt_handler_t _host_spi_handlers[MAX_IRQS];
 
+/**< Sources masked by the rate limiter, waiting for a refill */
+static struct virqmap_entry *_throttled[VIRQ_NUM_MAX_THROTTLED];
+static uint32_t _num_throttled;
+
+#ifdef _FIQ_FASTPATH_
+/**< Set by hyp_vector_fiq when the real-time guest was not running */
+uint32_t _fiq_fastpath_pending;
+#endif
+
+/**
+ * @brief   Looks up @irq in one of the virqmap hash indexes.
+ *
+ * Open addressing with linear probing, @by_virq selects which irq
+ * number of the entry the index is keyed by.
+ */
+static struct virqmap_entry *virqmap_lookup(struct guest_virqmap *virqmap,
+                const uint16_t *hash, uint32_t irq, uint8_t by_virq)
+{
+    uint32_t slot = irq & VIRQMAP_HASH_MASK;
+    uint32_t probe;
+    struct virqmap_entry *entry;
+
+    for (probe = 0; probe < VIRQMAP_HASH_SIZE; probe++) {
+        if (hash[slot] == VIRQMAP_SLOT_EMPTY)
+            break;
+        entry = &virqmap->map[hash[slot]];
+        if ((by_virq ? entry->virq : entry->pirq) == irq)
+            return entry;
+        slot = (slot + 1) & VIRQMAP_HASH_MASK;
+    }
+
+    return 0;
+}
+
+static void virqmap_hash_insert(uint16_t *hash, uint32_t irq, uint16_t index)
+{
+    uint32_t slot = irq & VIRQMAP_HASH_MASK;
+
+    while (hash[slot] != VIRQMAP_SLOT_EMPTY)
+        slot = (slot + 1) & VIRQMAP_HASH_MASK;
+    hash[slot] = index;
+}
+
+static inline struct virqmap_entry *virqmap_find_pirq(vmid_t vmid,
+                uint32_t pirq)
+{
+    struct guest_virqmap *virqmap = &_guest_virqmap[vmid];
+
+    return virqmap_lookup(virqmap, virqmap->pirq_hash, pirq, 0);
+}
+
+static inline struct virqmap_entry *virqmap_find_virq(vmid_t vmid,
+                uint32_t virq)
+{
+    struct guest_virqmap *virqmap = &_guest_virqmap[vmid];
+
+    return virqmap_lookup(virqmap, virqmap->virq_hash, virq, 1);
+}
+
+void interrupt_virqmap_init(struct guest_virqmap *virqmap)
+{
+    int i;
+
+    virqmap->num_entries = 0;
+    for (i = 0; i < VIRQMAP_HASH_SIZE; i++) {
+        virqmap->pirq_hash[i] = VIRQMAP_SLOT_EMPTY;
+        virqmap->virq_hash[i] = VIRQMAP_SLOT_EMPTY;
+    }
+}
+
+hvmm_status_t interrupt_virqmap_declare(struct guest_virqmap *virqmap,
+                uint32_t pirq, uint32_t virq)
+{
+    struct virqmap_entry *entry;
+    uint16_t index;
+
+    if (virqmap_lookup(virqmap, virqmap->pirq_hash, pirq, 0) ||
+            virqmap_lookup(virqmap, virqmap->virq_hash, virq, 1)) {
+        printh("virqmap: pirq %d or virq %d already mapped\n", pirq, virq);
+        return HVMM_STATUS_BAD_ACCESS;
+    }
+    if (virqmap->num_entries >= CFG_VIRQMAP_ENTRIES) {
+        printh("virqmap: no room for pirq %d, raise CFG_VIRQMAP_ENTRIES\n",
+                pirq);
+        return HVMM_STATUS_BUSY;
+    }
+
+    index = virqmap->num_entries++;
+    entry = &virqmap->map[index];
+    entry->enabled = GUEST_IRQ_DISABLE;
+    entry->pirq = pirq;
+    entry->virq = virq;
+    virqmap_hash_insert(virqmap->pirq_hash, pirq, index);
+    virqmap_hash_insert(virqmap->virq_hash, virq, index);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
 const int32_t interrupt_check_guest_irq(uint32_t pirq)
 {
     int i;
-    struct virqmap_entry *map;
 
     for (i = 0; i < NUM_GUESTS_STATIC; i++) {
-        map = _guest_virqmap[i].map;
-        if (map[pirq].virq != VIRQ_INVALID)
+        if (virqmap_find_pirq(i, pirq))
             return GUEST_IRQ;
     }
 
@@ -40,41 +153,213 @@ const int32_t interrupt_check_guest_irq(uint32_t pirq)
 
 const uint32_t interrupt_pirq_to_virq(vmid_t vmid, uint32_t pirq)
 {
-    struct virqmap_entry *map = _guest_virqmap[vmid].map;
+    struct virqmap_entry *entry = virqmap_find_pirq(vmid, pirq);
 
-    return map[pirq].virq;
+    return entry ? entry->virq : VIRQ_INVALID;
 }
 
 const uint32_t interrupt_virq_to_pirq(vmid_t vmid, uint32_t virq)
 {
-    struct virqmap_entry *map = _guest_virqmap[vmid].map;
+    struct virqmap_entry *entry = virqmap_find_virq(vmid, virq);
 
-    return map[virq].pirq;
+    return entry ? entry->pirq : PIRQ_INVALID;
 }
 
 const uint32_t interrupt_pirq_to_enabled_virq(vmid_t vmid, uint32_t pirq)
 {
     uint32_t virq = VIRQ_INVALID;
-    struct virqmap_entry *map = _guest_virqmap[vmid].map;
+    struct virqmap_entry *entry = virqmap_find_pirq(vmid, pirq);
 
-    if (map[pirq].enabled)
-        virq = map[pirq].virq;
+    if (entry && entry->enabled)
+        virq = entry->virq;
 
     return virq;
 }
 
+/*
+ * A vIC that owns the enables of its sources, as on the RPi2, holds a
+ * throttled source disabled itself, else the host controller masks it.
+ */
+static void virq_source_disable(uint32_t pirq)
+{
+    if (_vic->mask)
+        _vic->mask(pirq);
+    else
+        interrupt_host_disable(pirq);
+}
+
+static void virq_source_enable(uint32_t pirq)
+{
+    if (_vic->unmask)
+        _vic->unmask(pirq);
+    else
+        interrupt_host_enable(pirq);
+}
+
+static void virq_ratelimit_refill(struct virqmap_entry *entry, uint64_t now)
+{
+    if (entry->budget == VIRQ_RATELIMIT_OFF || now < entry->refill_at)
+        return;
+
+    entry->tokens = entry->budget;
+    entry->refill_at = now + VIRQ_RATELIMIT_PERIOD;
+}
+
+static void virq_ratelimit_unmask(struct virqmap_entry *entry)
+{
+    if (!entry->masked || entry->pending)
+        return;
+    if (entry->budget != VIRQ_RATELIMIT_OFF && !entry->tokens)
+        return;
+
+    entry->masked = 0;
+    virq_source_enable(entry->pirq);
+}
+
+static void virq_ratelimit_mask(struct virqmap_entry *entry)
+{
+    if (entry->masked)
+        return;
+    if (_num_throttled >= VIRQ_NUM_MAX_THROTTLED) {
+        printh("virq: throttle list full, pirq %d left unmasked\n",
+                entry->pirq);
+        return;
+    }
+
+    virq_source_disable(entry->pirq);
+    entry->masked = 1;
+    entry->throttled++;
+    _throttled[_num_throttled++] = entry;
+}
+
+/*
+ * A guest irq is only priority dropped when taken, the guest EOI of the
+ * virq deactivates it. An assertion not queued to the guest is
+ * deactivated here, nobody else would.
+ */
+static void virq_drop(struct virqmap_entry *entry)
+{
+    /* host_interrupt_deactivate() */
+    if (_host_ops->deactivate)
+        _host_ops->deactivate(entry->pirq);
+}
+
+/*
+ * Coalescing and rate limit of an assertion of a guest source.
+ * HVMM_STATUS_IGNORED: the guest has not EOIed the previous assertion
+ * yet, HVMM_STATUS_BUSY: no token left, the source is masked.
+ */
+static hvmm_status_t virq_admit(struct virqmap_entry *entry)
+{
+    if (entry->pending) {
+        entry->coalesced++;
+        return HVMM_STATUS_IGNORED;
+    }
+    if (entry->budget != VIRQ_RATELIMIT_OFF) {
+        virq_ratelimit_refill(entry, read_cntpct());
+        if (!entry->tokens) {
+            virq_ratelimit_mask(entry);
+            return HVMM_STATUS_BUSY;
+        }
+    }
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/* only a delivered virq is EOIed, and spends a token */
+static void virq_account(struct virqmap_entry *entry)
+{
+    if (entry->budget != VIRQ_RATELIMIT_OFF)
+        entry->tokens--;
+    entry->pending = 1;
+}
+
 hvmm_status_t interrupt_guest_inject(vmid_t vmid, uint32_t virq, uint32_t pirq,
                 uint8_t hw)
 {
     hvmm_status_t ret = HVMM_STATUS_UNKNOWN_ERROR;
+    struct virqmap_entry *entry;
+
+    entry = hw == INJECT_HW ? virqmap_find_pirq(vmid, pirq) : 0;
+    if (entry) {
+        ret = virq_admit(entry);
+        if (ret != HVMM_STATUS_SUCCESS) {
+            virq_drop(entry);
+            /* a merged assertion is served by the pending virq */
+            return ret == HVMM_STATUS_IGNORED ? HVMM_STATUS_SUCCESS : ret;
+        }
+    }
 
     /* guest_interrupt_inject() */
     if (_guest_ops->inject)
         ret = _guest_ops->inject(vmid, virq, pirq, hw);
 
+    if (!entry)
+        return ret;
+    if (ret != HVMM_STATUS_SUCCESS) {
+        virq_drop(entry);
+        return ret;
+    }
+    virq_account(entry);
+
     return ret;
 }
 
+hvmm_status_t interrupt_guest_eoi(vmid_t vmid, uint32_t pirq)
+{
+    struct virqmap_entry *entry = virqmap_find_pirq(vmid, pirq);
+
+    if (!entry)
+        return HVMM_STATUS_BAD_ACCESS;
+
+    entry->pending = 0;
+    if (entry->masked) {
+        virq_ratelimit_refill(entry, read_cntpct());
+        virq_ratelimit_unmask(entry);
+    }
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+hvmm_status_t interrupt_guest_ratelimit(vmid_t vmid, uint32_t pirq,
+                uint32_t budget)
+{
+    struct virqmap_entry *entry;
+
+    if (vmid >= NUM_GUESTS_STATIC)
+        return HVMM_STATUS_BAD_ACCESS;
+
+    entry = virqmap_find_pirq(vmid, pirq);
+    if (!entry)
+        return HVMM_STATUS_BAD_ACCESS;
+
+    entry->budget = budget;
+    entry->tokens = budget;
+    entry->refill_at = read_cntpct() + VIRQ_RATELIMIT_PERIOD;
+    virq_ratelimit_unmask(entry);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+void interrupt_guest_ratelimit_refill(void)
+{
+    uint64_t now = read_cntpct();
+    uint32_t i = 0;
+    struct virqmap_entry *entry;
+
+    while (i < _num_throttled) {
+        entry = _throttled[i];
+        virq_ratelimit_refill(entry, now);
+        virq_ratelimit_unmask(entry);
+        if (entry->masked) {
+            i++;
+            continue;
+        }
+        /* unmasked: drop it from the list */
+        _throttled[i] = _throttled[--_num_throttled];
+    }
+}
+
 hvmm_status_t interrupt_request(uint32_t irq, interrupt_handler_t handler)
 {
     uint32_t cpu = smp_processor_id();
@@ -124,9 +409,12 @@ hvmm_status_t interrupt_host_configure(uint32_t irq)
 hvmm_status_t interrupt_guest_enable(vmid_t vmid, uint32_t irq)
 {
     hvmm_status_t ret = HVMM_STATUS_UNKNOWN_ERROR;
-    struct virqmap_entry *map = _guest_virqmap[vmid].map;
+    struct virqmap_entry *entry = virqmap_find_pirq(vmid, irq);
 
-    map[irq].enabled = GUEST_IRQ_ENABLE;
+    if (entry) {
+        entry->enabled = GUEST_IRQ_ENABLE;
+        ret = HVMM_STATUS_SUCCESS;
+    }
 
     return ret;
 }
@@ -134,9 +422,12 @@ hvmm_status_t interrupt_guest_enable(vmid_t vmid, uint32_t irq)
 hvmm_status_t interrupt_guest_disable(vmid_t vmid, uint32_t irq)
 {
     hvmm_status_t ret = HVMM_STATUS_UNKNOWN_ERROR;
-    struct virqmap_entry *map = _guest_virqmap[vmid].map;
+    struct virqmap_entry *entry = virqmap_find_pirq(vmid, irq);
 
-    map[irq].enabled = GUEST_IRQ_DISABLE;
+    if (entry) {
+        entry->enabled = GUEST_IRQ_DISABLE;
+        ret = HVMM_STATUS_SUCCESS;
+    }
 
     return ret;
 }
@@ -250,12 +541,77 @@ static void context_copy_regs(struct arch_regs *regs_dst,
     for (i = 0; i < ARCH_REGS_NUM_GPR; i++)
         regs_dst->gpr[i] = regs_src->gpr[i];
 }
+/**
+ * @brief Raises local interrupts of a guest on its virtual local interrupt
+ * controller.
+ *
+ * The guest takes them in its IRQ vector on its next virtual timer tick,
+ * the way queued interrupts are delivered.
+ *
+ * @param bits Core 0 pending bits.
+ * @return HVMM_STATUS_NOT_FOUND if no local interrupt controller is bound.
+ */
+hvmm_status_t interrupt_guest_local_raise(vmid_t vmid, uint32_t bits)
+{
+    if (vmid >= NUM_GUESTS_STATIC)
+        return HVMM_STATUS_BAD_ACCESS;
+    if (!_vlocal_ic->inject)
+        return HVMM_STATUS_NOT_FOUND;
+
+    _vlocal_raised[vmid] |= bits;
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Binds the virtual interrupt controllers and the uart the interrupt
+ * path drives. Called once the virtual devices are registered.
+ *
+ * @return HVMM_STATUS_NOT_FOUND if the platform lacks one of them, the
+ * interrupt path then leaves it alone.
+ */
+hvmm_status_t interrupt_vdev_init(void)
+{
+    struct vdev_module *vdev;
+    hvmm_status_t ret = HVMM_STATUS_SUCCESS;
+
+    vdev = vdev_get_tag(VDEV_LEVEL_LOW, VDEV_TAG_IC);
+    if (vdev && vdev->irq)
+        _vic = vdev->irq;
+    else
+        ret = HVMM_STATUS_NOT_FOUND;
+
+    vdev = vdev_get_tag(VDEV_LEVEL_LOW, VDEV_TAG_LOCAL_IC);
+    if (vdev && vdev->irq)
+        _vlocal_ic = vdev->irq;
+    else
+        ret = HVMM_STATUS_NOT_FOUND;
+
+    _vuart = vdev_get_tag(VDEV_LEVEL_LOW, VDEV_TAG_UART);
+    if (!_vuart)
+        ret = HVMM_STATUS_NOT_FOUND;
+
+    return ret;
+}
+
+/* GPIO 17 button, lets the bare-metal guest reach the uart or not */
+static void interrupt_vuart_toggle(void)
+{
+    if (!_vuart)
+        return;
+
+    _vuart_enabled = !_vuart_enabled;
+    if (_vuart_enabled && _vuart->ops->enable)
+        _vuart->ops->enable();
+    else if (!_vuart_enabled && _vuart->ops->disable)
+        _vuart->ops->disable();
+}
+
 static struct guest_struct *target;
 void changeGuestMode(int irq, void *current_regs)
 {
 	struct arch_regs *regs = (struct arch_regs *)current_regs;
     int i = 0;
-    int ci = -1;
 	hvmm_status_t ret = HVMM_STATUS_SUCCESS;
 //    guest_hw_dump_extern(0x4, current_regs);
 //    printH("enter changeGuest mode IRQ : %d\n", irq);
@@ -266,7 +622,6 @@ void changeGuestMode(int irq, void *current_regs)
     else
     	printH("target is null : %d\n", irq);
 
-    ci  = vdev_find_tag(0, 66);
 //    if (vdev_execute(0, ci, 2, 0) != 0x000003FF) {
 //    	printH("iar is not 0x000003FF : \n");
 //    	return;
@@ -588,18 +943,68 @@ void timerReset2(void){
 int isUart = 0;
 int isButtonUp = 0;
 #define GPLEV0 0x3F200034
+
+/*
+ * Board interrupts all go to guest 0 through the vIC. The source is
+ * disabled when an assertion is forwarded, the guest enabling it again
+ * is its EOI, see the vIC enable registers.
+ */
+static void interrupt_board_disable(uint32_t irq)
+{
+    if (irq == 65)
+        *((volatile uint32_t *) 0x3F00B224) = 0x2;
+    else if (irq == 66)
+        *((volatile uint32_t *) 0x3F00B224) = 0x4;
+    else if (irq == 9999)
+        *((volatile uint32_t *) 0x3F00B220) = 0x02000000;
+}
+
+/* Coalescing and rate limit of a board source, counts it if admitted */
+static hvmm_status_t interrupt_board_admit(uint32_t irq)
+{
+    struct virqmap_entry *entry = virqmap_find_pirq(0, irq);
+    hvmm_status_t ret;
+
+    if (!entry)
+        return HVMM_STATUS_SUCCESS;
+    ret = virq_admit(entry);
+    if (ret == HVMM_STATUS_SUCCESS)
+        virq_account(entry);
+
+    return ret;
+}
+
+/* Queues a board interrupt taken while guest 0 can not be entered */
+static void interrupt_board_forward(uint32_t irq)
+{
+    struct virqmap_entry *entry = virqmap_find_pirq(0, irq);
+
+    if (!_vic->pend || (entry && virq_admit(entry) != HVMM_STATUS_SUCCESS))
+        return;
+    if (_vic->pend(0, irq) != HVMM_STATUS_SUCCESS)
+        return;
+    /* queued twice, as the port always did */
+    _vic->pend(0, irq);
+    if (entry)
+        virq_account(entry);
+}
+
 void interrupt_service_routine(int irq, void *current_regs, void *pdata)
 {
     struct arch_regs *regs = (struct arch_regs *)current_regs;
     uint32_t vmid =  guest_current_vmid();
     uint32_t cpu = smp_processor_id();
     uint32_t rx = 0;
-    int ci, cr, ui, ra ;
-
-
+    int cr, ra ;
 
+#ifdef _MEMGUARD_
+    /* Ahead of the pass-through below, PMU overflows belong to hyp */
+    if (irq == CFG_MEMGUARD_PMU_IRQ) {
+        memguard_overflow();
+        return;
+    }
+#endif
 
-    ci  = vdev_find_tag(0, 66);
 //	printH("irq:%d, c: %d, pc:%x, cpsr:%x, vid=%d\n", irq, c, regs->pc, regs->cpsr, vmid);
 //    (regs->cpsr & 0x1F) != 0x13)
 //    if(((regs->cpsr & 0x1F) != 0x10) && ((regs->cpsr & 0x1F) != 0x1f) || (vmid != 0) ) {  // not user mode, s
@@ -609,51 +1014,53 @@ void interrupt_service_routine(int irq, void *current_regs, void *pdata)
 //			printH("irq:%d, c: %d, pc:%x, cpsr:%x, vid=%d\n", irq, c, regs->pc, regs->cpsr, vmid);
 			timerReset2();
 
-			if(irq == 65)
-				*((int*)0x3F00B224) = 0x2;
-			if(irq == 66 )
-				 *((int*)0x3F00B224) = 0x4;
-			if(irq == 9999)
-				*((int*)0x3F00B220) = 0x02000000;
-
-
-			 vdev_execute(0, ci, 5, irq );
-			 vdev_execute(0, ci, 5, irq );
-			 return;
+			interrupt_board_disable(irq);
+			/* queued for guest 0, it takes the board interrupts */
+			interrupt_board_forward(irq);
+			return;
 		} else if ( (vmid==0) && ((regs->cpsr & 0x1F) != 0x13) && ((regs->cpsr & 0x1F) != 0x10) && ((regs->cpsr & 0x1F) != 0x1f)) {
 			timerReset2();
 //			printH("c: %d, pc:%x, cpsr:%x, vid=%d\n", c, regs->pc, regs->cpsr, vmid);
 
-			if(irq == 65)
-				*((int*)0x3F00B224) = 0x2;
-			if(irq == 66 )
-				 *((int*)0x3F00B224) = 0x4;
-			if(irq == 9999)
-				*((int*)0x3F00B220) = 0x02000000;
-			 vdev_execute(0, ci, 5, irq );
-			 vdev_execute(0, ci, 5, irq );
-			 return;
+			interrupt_board_disable(irq);
+			interrupt_board_forward(irq);
+			return;
 		}
 //    }
 
-    cr = vdev_execute(0, ci, 7, -5);
+    cr = _vic->num_pending ? _vic->num_pending(vmid) : 0;
     if(cr > 0 && (vmid==0) && (irq == 99) ){   // pendding check
 //    	printH("IRQ execute pending:%d\n", cr);
 //    	printH("e irq:%d, c: %d, pc:%x, cpsr:%x, vid=%d\n", irq, c, regs->pc, regs->cpsr, vmid);
-    	vdev_execute(0, ci, 6, irq );
+    	_vic->pop_pending(vmid);
 //    	timerReset();
 
-    	ci  = vdev_find_tag(0, 77);
-        vdev_execute(0, ci, 1, 0x110 );
+    	if (_vlocal_ic->inject)
+    	    _vlocal_ic->inject(0, 0x110);
         timerReset2();
 		changeGuestMode(irq, regs);
 		return;
     }
 
+    if (irq == 99 && vmid < NUM_GUESTS_STATIC && _vlocal_raised[vmid]) {
+        _vlocal_ic->inject(0, _vlocal_raised[vmid]);
+        _vlocal_raised[vmid] = 0;
+        timerReset2();
+        changeGuestMode(irq, regs);
+        return;
+    }
+
     if( irq == 98) // hyper
     {
 
     	timerReset();
+    	interrupt_guest_ratelimit_refill();
+#ifdef _PAGE_DEDUP_
+    	memory_scan(CFG_PAGE_DEDUP_SCAN_PAGES);
+#endif
+#ifdef _MEMGUARD_
+    	memguard_period();
+#endif
     	if( _guest_module.ops->init)
     		guest_switchto(sched_policy_determ_next(), 0);
 //    	printH("irq: 98\n");
@@ -661,9 +1068,14 @@ void interrupt_service_routine(int irq, void *current_regs, void *pdata)
     }
 
 
+    /* guest 0 runs, it takes a board interrupt right away if admitted */
+    if (vmid == 0 && interrupt_board_admit(irq) != HVMM_STATUS_SUCCESS) {
+        interrupt_board_disable(irq);
+        return;
+    }
+
     if (irq == 99 ) // vtimer
     {
-    	int ci;
         c++;
 //        if( guest_current_vmid()!=0)
 //        {
@@ -681,8 +1093,7 @@ void interrupt_service_routine(int irq, void *current_regs, void *pdata)
         } else {
 
         	if( isButtonUp == 1) {
-				ui  = vdev_find_tag(0, 83); // vuart;
-				vdev_execute(0, ui, 0, 0 );
+				interrupt_vuart_toggle();
 				isButtonUp = 0;
         	}
 
@@ -696,10 +1107,10 @@ void interrupt_service_routine(int irq, void *current_regs, void *pdata)
     		    		guest_switchto(sched_policy_determ_next(), 0);
 
     		if (c > 100 && vmid ==0){
-    		       	 ci  = vdev_find_tag(0, 77);
     		//       	 printH("aaaaaaaaaa\n");
     		//        	 vdev_execute(0, ci, 1, (*((volatile unsigned int*) (0x40000060))) | 0x100 );
-    		       	 vdev_execute(0, ci, 1, 0x08);
+    		       	 if (_vlocal_ic->inject)
+    		       	     _vlocal_ic->inject(0, 0x08);
     		       	 timerReset2();
     		   		changeGuestMode(99, regs);
     		}
@@ -718,24 +1129,20 @@ void interrupt_service_routine(int irq, void *current_regs, void *pdata)
 
     } else if(irq == 65 && vmid == 0){
 
-			int ci  = vdev_find_tag(0, 77);
-
-			 vdev_execute(0, ci, 1, 0x110 );
-
-			 ci  = vdev_find_tag(0, 66);
-			 vdev_execute(0, ci, 3, -5 );
+			 if (_vlocal_ic->inject)
+			     _vlocal_ic->inject(0, 0x110);
+			 if (_vic->sync)
+			     _vic->sync();
 			 *((int*)0x3F00B224) = 0x2;
 
 			changeGuestMode(irq, regs);
 
     } else if(irq == 66 && vmid == 0){
 //    	printH("!!!!!!!!!!!!!!!!!!!!!!!!!!! IRQ : %d\n", irq);
-		int ci  = vdev_find_tag(0, 77);
-
-		 vdev_execute(0, ci, 1, 0x100 );
-
-		 ci  = vdev_find_tag(0, 66);
-		 vdev_execute(0, ci, 3, -5 );
+		 if (_vlocal_ic->inject)
+		     _vlocal_ic->inject(0, 0x100);
+		 if (_vic->sync)
+		     _vic->sync();
 		 *((int*)0x3F00B224) = 0x4;
 
 //		 timerReset2();
@@ -745,12 +1152,14 @@ void interrupt_service_routine(int irq, void *current_regs, void *pdata)
     		isUart =  1;
 //    	printH("!!!!!!!!!!!!!!!!!!!!!!!!!!! IRQ : %d\n", irq);
 
-		int ci  = vdev_find_tag(0, 77);
 	//        	 vdev_execute(0, ci, 1, (*((volatile unsigned int*) (0x40000060))) | 0x100 );
-		 vdev_execute(0, ci, 1, 0x110 );
-		 ci  = vdev_find_tag(0, 66);
-//		 vdev_execute(0, ci, 3, -5 );
-		 vdev_execute(0, ci, 4, -5 );
+		 if (_vlocal_ic->inject)
+		     _vlocal_ic->inject(0, 0x110);
+		 /* uart, a basic pending source */
+		 if (_vic->sync && _vic->inject) {
+		     _vic->sync();
+		     _vic->inject(0, 0x80000);
+		 }
 		 *((int*)0x3F00B220) = 0x02000000;
 
 //		 timerReset2();
@@ -887,10 +1296,51 @@ void interrupt_service_routine(int irq, void *current_regs, void *pdata)
         printh("interrupt:no pending irq:%x\n", irq);
 }
 
+#ifdef _FIQ_FASTPATH_
+void interrupt_fiq_fastpath_eoi(void)
+{
+    write_hcr(read_hcr() & ~HCR_VF);
+    _fiq_fastpath_pending = 0;
+}
+
+static void interrupt_fiq_fastpath_save(vmid_t vmid)
+{
+    uint32_t hcr = read_hcr();
+
+    if (vmid != CFG_FIQ_FASTPATH_VMID || !(hcr & HCR_VF))
+        return;
+    /* Not taken yet, raise it again when the guest is back */
+    _fiq_fastpath_pending = 1;
+    write_hcr(hcr & ~HCR_VF);
+}
+
+static void interrupt_fiq_fastpath_restore(vmid_t vmid)
+{
+    if (vmid != CFG_FIQ_FASTPATH_VMID || !_fiq_fastpath_pending)
+        return;
+    _fiq_fastpath_pending = 0;
+    write_hcr(read_hcr() | HCR_VF);
+}
+
+/*
+ * Nothing is routed to FIQ before the fast path guest installed its
+ * handler, it routes the source through the vIC FIQ control then.
+ */
+static void interrupt_fiq_fastpath_init(void)
+{
+    _fiq_fastpath_pending = 0;
+    *((volatile uint32_t *) CFG_FIQ_FASTPATH_CONTROL) = 0;
+}
+#endif
+
 hvmm_status_t interrupt_save(vmid_t vmid)
 {
     hvmm_status_t ret = HVMM_STATUS_UNKNOWN_ERROR;
 
+#ifdef _FIQ_FASTPATH_
+    interrupt_fiq_fastpath_save(vmid);
+#endif
+
     /* guest_interrupt_save() */
     if (_guest_ops->save)
         ret = _guest_ops->save(vmid);
@@ -902,6 +1352,10 @@ hvmm_status_t interrupt_restore(vmid_t vmid)
 {
     hvmm_status_t ret = HVMM_STATUS_UNKNOWN_ERROR;
 
+#ifdef _FIQ_FASTPATH_
+    interrupt_fiq_fastpath_restore(vmid);
+#endif
+
     /* guest_interrupt_restore() */
     if (_guest_ops->restore)
         ret = _guest_ops->restore(vmid);
@@ -909,6 +1363,71 @@ hvmm_status_t interrupt_restore(vmid_t vmid)
     return ret;
 }
 
+/**
+ * @brief Keeps a copy of the saved interrupt state of a guest that is
+ *        not running.
+ */
+hvmm_status_t interrupt_snapshot(vmid_t vmid)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* guest_interrupt_snapshot() */
+    if (_guest_ops->snapshot)
+        ret = _guest_ops->snapshot(vmid);
+
+    return ret;
+}
+
+/**
+ * @brief Brings the saved interrupt state of a guest back to its copy.
+ */
+hvmm_status_t interrupt_rollback(vmid_t vmid)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* guest_interrupt_rollback() */
+    if (_guest_ops->rollback)
+        ret = _guest_ops->rollback(vmid);
+
+    return ret;
+}
+
+/**
+ * @brief Copies the saved interrupt state of a guest to its clone, both
+ *        not running.
+ */
+hvmm_status_t interrupt_clone(vmid_t dst, vmid_t src)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* guest_interrupt_clone() */
+    if (_guest_ops->clone)
+        ret = _guest_ops->clone(dst, src);
+
+    return ret;
+}
+
+static void interrupt_guest_ratelimit_init(void)
+{
+    int i;
+    uint32_t j;
+    struct virqmap_entry *map;
+
+    for (i = 0; i < NUM_GUESTS_STATIC; i++) {
+        map = _guest_virqmap[i].map;
+        for (j = 0; j < _guest_virqmap[i].num_entries; j++) {
+            map[j].pending = 0;
+            map[j].masked = 0;
+            map[j].coalesced = 0;
+            map[j].throttled = 0;
+            map[j].budget = CFG_VIRQ_RATELIMIT_BUDGET;
+            map[j].tokens = CFG_VIRQ_RATELIMIT_BUDGET;
+            map[j].refill_at = 0;
+        }
+    }
+    _num_throttled = 0;
+}
+
 hvmm_status_t interrupt_init(struct guest_virqmap *virqmap)
 {
     hvmm_status_t ret = HVMM_STATUS_UNKNOWN_ERROR;
@@ -919,6 +1438,10 @@ hvmm_status_t interrupt_init(struct guest_virqmap *virqmap)
         _guest_ops = _interrupt_module.guest_ops;
 
         _guest_virqmap = virqmap;
+        interrupt_guest_ratelimit_init();
+#ifdef _FIQ_FASTPATH_
+        interrupt_fiq_fastpath_init();
+#endif
     }
 
     /* host_interrupt_init() */
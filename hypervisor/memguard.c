@@ -0,0 +1,331 @@
+#include <k-hypervisor-config.h>
+#include <memguard.h>
+#include <guest.h>
+#include <interrupt.h>
+#include <armv7_p15.h>
+#include <asm_io.h>
+#include <log/print.h>
+#include <smp.h>
+
+/**
+ * \defgroup Memguard
+ *
+ * Memory bandwidth regulation of the guests sharing a core.
+ * - The last PMU counter is taken from the guests (HDCR.HPMN) and counts
+ *   CFG_MEMGUARD_EVENT, L2 refills by default, in non-hyp modes only.
+ * - A regulated guest may cause budget events per period. On a switch
+ *   the counter of the outgoing guest is accumulated and the counter is
+ *   preset so that it overflows when the incoming guest runs out.
+ * - The overflow interrupt throttles the guest, the scheduler leaves it
+ *   out until memguard_period() starts the next period.
+ * - The counters below HPMN, the cycle counter and their controls belong
+ *   to the guests, they are switched with the guest.
+ * @{
+ */
+#define MEMGUARD_COUNTER_BIT    (1 << _memguard_counter)
+#define MEMGUARD_GUEST_BITS     ((MEMGUARD_COUNTER_BIT - 1) | PMCNT_CCNT)
+/** @}*/
+
+/**
+ * @brief PMU registers of a guest.
+ */
+struct memguard_pmu {
+    uint32_t pmcr;
+    uint32_t cntenset;
+    uint32_t intenset;
+    uint32_t ovsr;
+    uint32_t userenr;
+    uint32_t ccntr;
+    uint32_t evtyper[PMCR_N_MASK];
+    uint32_t evcntr[PMCR_N_MASK];
+};
+
+static struct memguard_pmu _memguard_pmu[NUM_GUESTS_STATIC];
+
+static struct memguard_stat _memguard[NUM_GUESTS_STATIC];
+/* Counter value the running guest started from, -(budget - used) */
+static uint32_t _memguard_preset[NUM_GUESTS_STATIC];
+static uint32_t _memguard_counter;
+static uint32_t _memguard_ticks[NUM_CPUS];
+
+static const uint32_t _memguard_budget[4] = {
+    CFG_GUEST0_MEMGUARD_BUDGET,
+    CFG_GUEST1_MEMGUARD_BUDGET,
+    CFG_GUEST2_MEMGUARD_BUDGET,
+    CFG_GUEST3_MEMGUARD_BUDGET,
+};
+
+static inline int memguard_regulated(vmid_t vmid)
+{
+    return vmid < NUM_GUESTS_STATIC &&
+            _memguard[vmid].budget != MEMGUARD_BUDGET_OFF;
+}
+
+static void memguard_stop(void)
+{
+    write_pmselr(_memguard_counter);
+    write_pmcntenclr(MEMGUARD_COUNTER_BIT);
+    write_pmintenclr(MEMGUARD_COUNTER_BIT);
+}
+
+static void memguard_throttle(vmid_t vmid)
+{
+    struct memguard_stat *stat = &_memguard[vmid];
+
+    stat->used = stat->budget;
+    if (stat->throttled)
+        return;
+
+    stat->throttled = 1;
+    stat->throttles++;
+    printh("memguard: vmid %d throttled\n", vmid);
+}
+
+/**
+ * @brief Reserves the hyp counter and sets the budgets of the guests of
+ * the calling core.
+ *
+ * @return HVMM_STATUS_UNSUPPORTED_FEATURE if the core has no PMU counter.
+ */
+hvmm_status_t memguard_init(void)
+{
+    uint32_t cpu = smp_processor_id();
+    uint32_t num = (read_pmcr() >> PMCR_N_SHIFT) & PMCR_N_MASK;
+    uint32_t hdcr;
+    vmid_t vmid;
+
+    if (!num) {
+        printH("memguard: no PMU counter\n");
+        return HVMM_STATUS_UNSUPPORTED_FEATURE;
+    }
+
+    _memguard_counter = num - 1;
+    hdcr = read_hdcr() & ~HDCR_HPMN_MASK;
+    write_hdcr(hdcr | _memguard_counter | HDCR_HPME);
+
+    memguard_stop();
+    write_pmovsr(MEMGUARD_COUNTER_BIT);
+    /* NSH clear: hyp mode accesses are not billed to the guest */
+    write_pmxevtyper(CFG_MEMGUARD_EVENT);
+
+#if CFG_MEMGUARD_PMU_ROUTE
+    writel(1 << cpu, CFG_MEMGUARD_PMU_ROUTE);
+#endif
+    interrupt_host_enable(CFG_MEMGUARD_PMU_IRQ);
+
+    for (vmid = guest_first_vmid(); vmid <= guest_last_vmid(); vmid++)
+        memguard_set_budget(vmid, _memguard_budget[vmid]);
+    _memguard_ticks[cpu] = 0;
+
+    printH("memguard: counter %d, event %x\n", _memguard_counter,
+            CFG_MEMGUARD_EVENT);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Sets the events a guest may cause per period.
+ *
+ * Takes effect the next time the guest is switched in.
+ *
+ * @param budget Events per period, MEMGUARD_BUDGET_OFF to unregulate.
+ */
+hvmm_status_t memguard_set_budget(vmid_t vmid, uint32_t budget)
+{
+    if (vmid >= NUM_GUESTS_STATIC)
+        return HVMM_STATUS_BAD_ACCESS;
+
+    _memguard[vmid].budget = budget;
+    _memguard[vmid].used = 0;
+    _memguard[vmid].throttled = 0;
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/* Stops the counters of the outgoing guest and keeps them */
+static void memguard_pmu_save(vmid_t vmid)
+{
+    struct memguard_pmu *pmu = &_memguard_pmu[vmid];
+    uint32_t n;
+
+    pmu->cntenset = read_pmcntenset() & MEMGUARD_GUEST_BITS;
+    write_pmcntenclr(MEMGUARD_GUEST_BITS);
+    pmu->pmcr = read_pmcr() & PMCR_MODE_MASK;
+    pmu->intenset = read_pmintenset() & MEMGUARD_GUEST_BITS;
+    pmu->ovsr = read_pmovsr() & MEMGUARD_GUEST_BITS;
+    pmu->userenr = read_pmuserenr();
+    pmu->ccntr = read_pmccntr();
+    for (n = 0; n < _memguard_counter; n++) {
+        write_pmselr(n);
+        pmu->evtyper[n] = read_pmxevtyper();
+        pmu->evcntr[n] = read_pmxevcntr();
+    }
+}
+
+/* Loads the counters of the incoming guest, enabled last */
+static void memguard_pmu_restore(vmid_t vmid)
+{
+    struct memguard_pmu *pmu = &_memguard_pmu[vmid];
+    uint32_t n;
+
+    write_pmcntenclr(MEMGUARD_GUEST_BITS);
+    for (n = 0; n < _memguard_counter; n++) {
+        write_pmselr(n);
+        write_pmxevtyper(pmu->evtyper[n]);
+        write_pmxevcntr(pmu->evcntr[n]);
+    }
+    write_pmccntr(pmu->ccntr);
+    write_pmuserenr(pmu->userenr);
+    write_pmovsr(MEMGUARD_GUEST_BITS);
+    write_pmovsset(pmu->ovsr);
+    write_pmintenclr(MEMGUARD_GUEST_BITS & ~pmu->intenset);
+    write_pmintenset(pmu->intenset);
+    /* P and C reset the counters, they were kept as the guest left them */
+    write_pmcr(pmu->pmcr & ~(PMCR_P | PMCR_C));
+    write_pmcntenset(pmu->cntenset);
+}
+
+/* Stops the counter and bills what the guest used */
+static void memguard_bill(vmid_t vmid)
+{
+    uint32_t count;
+
+    if (!memguard_regulated(vmid))
+        return;
+
+    write_pmselr(_memguard_counter);
+    if (!(read_pmcntenset() & MEMGUARD_COUNTER_BIT))
+        return;
+
+    count = read_pmxevcntr();
+    memguard_stop();
+    if (read_pmovsr() & MEMGUARD_COUNTER_BIT) {
+        /* overflowed on the way out, before the interrupt was taken */
+        write_pmovsr(MEMGUARD_COUNTER_BIT);
+        memguard_throttle(vmid);
+        return;
+    }
+
+    _memguard[vmid].used += count - _memguard_preset[vmid];
+}
+
+/*
+ * Arms the counter to overflow when the guest has used up the rest of its
+ * budget. A throttled guest only runs when every guest of the core is
+ * throttled and is not counted then.
+ */
+static void memguard_arm(vmid_t vmid)
+{
+    struct memguard_stat *stat;
+
+    if (!memguard_regulated(vmid))
+        return;
+
+    stat = &_memguard[vmid];
+    if (stat->throttled)
+        return;
+    if (stat->used >= stat->budget) {
+        memguard_throttle(vmid);
+        return;
+    }
+
+    _memguard_preset[vmid] = -(stat->budget - stat->used);
+    write_pmselr(_memguard_counter);
+    write_pmovsr(MEMGUARD_COUNTER_BIT);
+    write_pmxevcntr(_memguard_preset[vmid]);
+    write_pmintenset(MEMGUARD_COUNTER_BIT);
+    write_pmcntenset(MEMGUARD_COUNTER_BIT);
+}
+
+/**
+ * @brief Bills what the outgoing guest used and keeps its PMU registers.
+ */
+void memguard_save(vmid_t vmid)
+{
+    if (vmid >= NUM_GUESTS_STATIC)
+        return;
+
+    memguard_bill(vmid);
+    memguard_pmu_save(vmid);
+}
+
+/**
+ * @brief Loads the PMU registers of the incoming guest and arms the
+ * counter for the rest of its budget.
+ */
+void memguard_restore(vmid_t vmid)
+{
+    if (vmid >= NUM_GUESTS_STATIC)
+        return;
+
+    memguard_pmu_restore(vmid);
+    memguard_arm(vmid);
+}
+
+/**
+ * @brief PMU overflow interrupt, the current guest ran out of budget.
+ *
+ * The switch is performed at trap exit like a scheduler tick.
+ */
+void memguard_overflow(void)
+{
+    vmid_t vmid = guest_current_vmid();
+
+    if (!(read_pmovsr() & MEMGUARD_COUNTER_BIT))
+        return;
+
+    memguard_stop();
+    write_pmovsr(MEMGUARD_COUNTER_BIT);
+    if (!memguard_regulated(vmid))
+        return;
+
+    memguard_throttle(vmid);
+    guest_switchto(sched_policy_determ_next(), 0);
+}
+
+/**
+ * @brief Hypervisor tick, starts a new period every
+ * CFG_MEMGUARD_PERIOD_TICKS ticks and releases the throttled guests.
+ */
+void memguard_period(void)
+{
+    uint32_t cpu = smp_processor_id();
+    vmid_t current = guest_current_vmid();
+    vmid_t vmid;
+
+    if (++_memguard_ticks[cpu] < CFG_MEMGUARD_PERIOD_TICKS)
+        return;
+    _memguard_ticks[cpu] = 0;
+
+    memguard_bill(current);
+    for (vmid = guest_first_vmid(); vmid <= guest_last_vmid(); vmid++) {
+        if (!memguard_regulated(vmid))
+            continue;
+        _memguard[vmid].used = 0;
+        _memguard[vmid].throttled = 0;
+        _memguard[vmid].periods++;
+    }
+    memguard_arm(current);
+}
+
+int memguard_throttled(vmid_t vmid)
+{
+    return memguard_regulated(vmid) && _memguard[vmid].throttled;
+}
+
+void memguard_get_stat(vmid_t vmid, struct memguard_stat *stat)
+{
+    if (vmid < NUM_GUESTS_STATIC)
+        *stat = _memguard[vmid];
+}
+
+void memguard_dump(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_GUESTS_STATIC; i++)
+        printH("memguard vmid %d: budget:%d used:%d throttled:%d"
+                " throttles:%d periods:%d\n", i, _memguard[i].budget,
+                _memguard[i].used, _memguard[i].throttled,
+                _memguard[i].throttles, _memguard[i].periods);
+}
@@ -64,6 +64,256 @@ hvmm_status_t memory_restore(vmid_t vmid)
     return ret;
 }
 
+/**
+ * @brief Resolves a stage-2 fault of a guest.
+ *
+ * @param vmid Guest that faulted.
+ * @param ipa Faulting intermediate physical address.
+ * @param flags MEMORY_FAULT_WRITE, MEMORY_FAULT_PERMISSION.
+ * @return HVMM_STATUS_SUCCESS if the address is mapped now and the access
+ *         can be retried, HVMM_STATUS_NOT_FOUND if the guest has no memory
+ *         there.
+ */
+hvmm_status_t memory_fault(vmid_t vmid, uint32_t ipa, uint32_t flags)
+{
+    hvmm_status_t ret = HVMM_STATUS_NOT_FOUND;
+
+    /* memory_hw_fault */
+    if (_memory_ops->fault)
+        ret = _memory_ops->fault(vmid, ipa, flags);
+
+    return ret;
+}
+
+/**
+ * @brief Runs the background scanner of guest memory for a few pages.
+ *
+ * Called from the hypervisor tick.
+ *
+ * @param pages Number of pages to look at.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_UNSUPPORTED_FEATURE if there
+ *         is no scanner.
+ */
+hvmm_status_t memory_scan(uint32_t pages)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* memory_hw_scan */
+    if (_memory_ops->scan)
+        ret = _memory_ops->scan(pages);
+
+    return ret;
+}
+
+/**
+ * @brief Unmaps a guest page and returns its frame to the page pool.
+ *
+ * The page is backed by a new frame the next time the guest touches it.
+ *
+ * @param vmid Guest giving the page up.
+ * @param ipa Intermediate physical address of the page.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if the page is not
+ *         mapped, HVMM_STATUS_UNSUPPORTED_FEATURE if it is not backed by
+ *         the page pool, HVMM_STATUS_BAD_ACCESS if it was given up already.
+ */
+hvmm_status_t memory_release(vmid_t vmid, uint32_t ipa)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* memory_hw_release */
+    if (_memory_ops->release)
+        ret = _memory_ops->release(vmid, ipa);
+
+    return ret;
+}
+
+/**
+ * @brief Takes back a guest page given up by memory_release().
+ *
+ * @param vmid Guest taking the page back.
+ * @param ipa Intermediate physical address of the page.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_BAD_ACCESS if the page was not
+ *         given up.
+ */
+hvmm_status_t memory_reclaim(vmid_t vmid, uint32_t ipa)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* memory_hw_reclaim */
+    if (_memory_ops->reclaim)
+        ret = _memory_ops->reclaim(vmid, ipa);
+
+    return ret;
+}
+
+/**
+ * @brief Gives a guest a new VMID.
+ *
+ * Used when a guest starts a new lifetime, so TLB entries of the previous
+ * one never match again.
+ *
+ * @param vmid Guest.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_UNSUPPORTED_FEATURE if VMIDs
+ *         are fixed.
+ */
+hvmm_status_t memory_renew_vmid(vmid_t vmid)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* memory_hw_renew_vmid */
+    if (_memory_ops->renew_vmid)
+        ret = _memory_ops->renew_vmid(vmid);
+
+    return ret;
+}
+
+/**
+ * @brief Starts or stops dirty page logging of a guest.
+ *
+ * While logging, the first write to each page of guest RAM is recorded.
+ *
+ * @param vmid Guest.
+ * @param enable 1 to start, 0 to stop.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_UNSUPPORTED_FEATURE if there
+ *         is no dirty logging.
+ */
+hvmm_status_t memory_dirty_log(vmid_t vmid, uint32_t enable)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* memory_hw_dirty_log */
+    if (_memory_ops->dirty_log)
+        ret = _memory_ops->dirty_log(vmid, enable);
+
+    return ret;
+}
+
+/**
+ * @brief Takes the pages a guest wrote since the last collection.
+ *
+ * @param vmid Guest.
+ * @param bitmap Receives one bit per IPA page, from IPA 0.
+ * @param pages Number of pages the bitmap holds.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if the guest is not
+ *         logging.
+ */
+hvmm_status_t memory_dirty_collect(vmid_t vmid, uint32_t *bitmap,
+        uint32_t pages)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* memory_hw_dirty_collect */
+    if (_memory_ops->dirty_collect)
+        ret = _memory_ops->dirty_collect(vmid, bitmap, pages);
+
+    return ret;
+}
+
+/**
+ * @brief Takes a snapshot of the RAM of a guest, or drops it.
+ *
+ * Pages are saved as the guest changes them, a new snapshot replaces
+ * the previous one.
+ *
+ * @param vmid Guest, not running.
+ * @param enable 1 to take a snapshot, 0 to drop it.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if no such guest.
+ */
+hvmm_status_t memory_snapshot(vmid_t vmid, uint32_t enable)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* memory_hw_snapshot */
+    if (_memory_ops->snapshot)
+        ret = _memory_ops->snapshot(vmid, enable);
+
+    return ret;
+}
+
+/**
+ * @brief Brings the RAM of a guest back to its snapshot.
+ *
+ * @param vmid Guest, not running.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if there is no
+ *         snapshot, HVMM_STATUS_BUSY if out of memory.
+ */
+hvmm_status_t memory_rollback(vmid_t vmid)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* memory_hw_rollback */
+    if (_memory_ops->rollback)
+        ret = _memory_ops->rollback(vmid);
+
+    return ret;
+}
+
+/**
+ * @brief Makes a guest a copy-on-write clone of the RAM of another.
+ *
+ * @param dst Clone, not running.
+ * @param src Template guest, not running.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_NOT_FOUND if no such guest,
+ *         HVMM_STATUS_BUSY if out of memory.
+ */
+hvmm_status_t memory_clone(vmid_t dst, vmid_t src)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* memory_hw_clone */
+    if (_memory_ops->clone)
+        ret = _memory_ops->clone(dst, src);
+
+    return ret;
+}
+
+/**
+ * @brief Maps memory of the hypervisor into a guest, to be shared with
+ *        other guests.
+ *
+ * @param vmid Guest.
+ * @param ipa Intermediate physical address, page aligned and not mapped.
+ * @param pa Physical address, page aligned.
+ * @param size Size in bytes, page aligned.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_BAD_ACCESS if the range is not
+ *         valid, HVMM_STATUS_BUSY if out of memory.
+ */
+hvmm_status_t memory_share(vmid_t vmid, uint32_t ipa, uint32_t pa,
+        uint32_t size)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* memory_hw_share */
+    if (_memory_ops->share)
+        ret = _memory_ops->share(vmid, ipa, pa, size);
+
+    return ret;
+}
+
+/**
+ * @brief Maps memory of the hypervisor read-only into a guest. A guest
+ *        write takes a stage-2 permission fault that memory_fault() does
+ *        not resolve, it goes to the vdev of the range.
+ *
+ * @param vmid Guest.
+ * @param ipa Intermediate physical address, page aligned and not mapped.
+ * @param pa Physical address, page aligned.
+ * @param size Size in bytes, page aligned.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_BAD_ACCESS if the range is not
+ *         valid, HVMM_STATUS_BUSY if out of memory.
+ */
+hvmm_status_t memory_share_ro(vmid_t vmid, uint32_t ipa, uint32_t pa,
+        uint32_t size)
+{
+    hvmm_status_t ret = HVMM_STATUS_UNSUPPORTED_FEATURE;
+
+    /* memory_hw_share_ro */
+    if (_memory_ops->share_ro)
+        ret = _memory_ops->share_ro(vmid, ipa, pa, size);
+
+    return ret;
+}
+
 hvmm_status_t memory_init(struct memmap_desc **guest0,
                 struct memmap_desc **guest1)
 {
@@ -12,9 +12,13 @@
 #include <armv7_p15.h>
 #include <guest.h>
 #include <asm-arm_inline.h>
+#include <memory.h>
 
 #define DEMO
 
+/* Pages of the dirty bitmap handed to the monitor guest, 1GB of IPA */
+#define MONITOR_DIRTY_PAGES_MAX     0x40000
+
 static uint32_t inst[NUM_GUESTS_STATIC][NUM_DI][NUM_INST];
 
 /*
@@ -307,6 +311,77 @@ hvmm_status_t monitor_dump_guest_memory(struct monitor_vmid *mvmid, uint32_t va)
     return HVMM_STATUS_SUCCESS;
 }
 
+/**
+ * @brief Starts (va != 0) or stops (va == 0) dirty page logging of the
+ *        target guest.
+ */
+hvmm_status_t monitor_dirty_log(struct monitor_vmid *mvmid, uint32_t va)
+{
+    return memory_dirty_log(mvmid->vmid_target, va ? 1 : 0);
+}
+
+/**
+ * @brief Hands the pages the target guest wrote since the last collection
+ *        to the monitor guest.
+ *
+ * The bitmap of data->memory_range pages from IPA 0, one bit per page, is
+ * written at SHARED_DUMP_ADDRESS.
+ */
+hvmm_status_t monitor_dirty_collect(struct monitor_vmid *mvmid, uint32_t va)
+{
+    struct monitoring_data *data;
+    uint32_t pages;
+    hvmm_status_t ret;
+
+    flush_cache((unsigned long)SHARED_ADDRESS, sizeof(struct monitoring_data));
+    data = (struct monitoring_data *)(SHARED_ADDRESS);
+    pages = data->memory_range;
+    if (!pages || pages > MONITOR_DIRTY_PAGES_MAX)
+        return HVMM_STATUS_BAD_ACCESS;
+
+    ret = memory_dirty_collect(mvmid->vmid_target,
+            (uint32_t *)SHARED_DUMP_ADDRESS, pages);
+    if (ret != HVMM_STATUS_SUCCESS)
+        return ret;
+
+    data->type = DIRTY;
+    flush_cache((unsigned long)SHARED_DUMP_ADDRESS, (pages + 7) / 8);
+    flush_cache((unsigned long)SHARED_ADDRESS, sizeof(struct monitoring_data));
+    monitor_notify_guest(MONITOR_GUEST_VMID);
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Takes the checkpoint monitor_reboot() resumes the target guest
+ *        from.
+ *
+ * The monitor guest sends it once the target booted, while the target is
+ * switched out.
+ */
+hvmm_status_t monitor_checkpoint(struct monitor_vmid *mvmid, uint32_t va)
+{
+    return guest_checkpoint(mvmid->vmid_target);
+}
+
+/**
+ * @brief Makes guest va a clone of the target guest, both switched out.
+ *
+ * Needs a guest slot besides the monitor guest and the target, there is
+ * none with the two guests of a non-SMP build.
+ */
+hvmm_status_t monitor_clone(struct monitor_vmid *mvmid, uint32_t va)
+{
+#if NUM_GUESTS_STATIC > 2
+    return guest_clone(va, mvmid->vmid_target);
+#else
+    printh("monitor: clone needs a free guest slot, NUM_GUESTS_STATIC %d\n",
+            NUM_GUESTS_STATIC);
+
+    return HVMM_STATUS_UNSUPPORTED_FEATURE;
+#endif
+}
+
 hvmm_status_t monitor_stop(struct monitor_vmid *mvmid, uint32_t va)
 {
     hvmm_status_t ret = HVMM_STATUS_SUCCESS;
@@ -336,6 +411,10 @@ hvmm_status_t monitor_reboot_guest(struct monitor_vmid *mvmid)
 
     monitor_clean_all_guest(mvmid, 0);
 
+    /* resume from the last checkpoint rather than booting again */
+    if (guest_rollback(mvmid->vmid_target) == HVMM_STATUS_SUCCESS)
+        return ret;
+
     /* TODO there is dependency target board problem*/
     /* reboot_guest(mvmid, 0xB0000000, 0); */
     reboot_guest(mvmid->vmid_target, 0x70000000, 0);
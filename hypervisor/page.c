@@ -0,0 +1,333 @@
+#include <k-hypervisor-config.h>
+#include <page.h>
+#include <arch_types.h>
+#include <log/print.h>
+#include <log/string.h>
+#include <smp.h>
+
+/**
+ * \defgroup Page_frame
+ *
+ * Binary buddy allocator over the physical page pool
+ * [CFG_PAGE_POOL_BASE, CFG_PAGE_POOL_BASE + CFG_PAGE_POOL_SIZE).
+ * - Serves naturally aligned blocks of 2^order pages, from 4KB up to 2MB,
+ *   for translation tables, guest RAM and virtual device buffers.
+ * - Free blocks are kept on one list per order, linked through the blocks
+ *   themselves, so the pool must be mapped in the hyp stage-1 table.
+ * - One byte per frame records the order of the block it heads and
+ *   whether that block is free, which is all the buddy merge needs.
+ *   Frames inside a block read PAGE_FRAME_NONE.
+ * @{
+ */
+#define PAGE_POOL_FRAMES    (CFG_PAGE_POOL_SIZE >> PAGE_SHIFT)
+#define PAGE_FRAME_FREE     0x80
+#define PAGE_FRAME_ORDER    0x7F
+#define PAGE_FRAME_NONE     PAGE_FRAME_ORDER    /* not the head of a block */
+/** @}*/
+
+struct page_block {
+    struct page_block *next;
+    struct page_block *prev;
+};
+
+static struct page_block *_page_free_list[PAGE_MAX_ORDER + 1];
+static uint8_t _page_frame[PAGE_POOL_FRAMES];
+static struct page_stat _page_stat;
+static DEFINE_SPINLOCK(_page_lock);
+
+static inline uint32_t page_to_frame(void *addr)
+{
+    return ((uint32_t) addr - CFG_PAGE_POOL_BASE) >> PAGE_SHIFT;
+}
+
+static inline struct page_block *frame_to_page(uint32_t frame)
+{
+    return (struct page_block *)(CFG_PAGE_POOL_BASE + (frame << PAGE_SHIFT));
+}
+
+static void page_list_add(struct page_block *block, uint32_t order)
+{
+    block->prev = 0;
+    block->next = _page_free_list[order];
+    if (block->next)
+        block->next->prev = block;
+    _page_free_list[order] = block;
+    _page_frame[page_to_frame(block)] = PAGE_FRAME_FREE | order;
+    _page_stat.free_blocks[order]++;
+}
+
+static void page_list_del(struct page_block *block, uint32_t order)
+{
+    if (block->prev)
+        block->prev->next = block->next;
+    else
+        _page_free_list[order] = block->next;
+    if (block->next)
+        block->next->prev = block->prev;
+    _page_frame[page_to_frame(block)] = order;
+    _page_stat.free_blocks[order]--;
+}
+
+/**
+ * @brief Allocates a naturally aligned block of 2^order pages.
+ *
+ * Takes the smallest free block of at least @order and splits it, handing
+ * the upper halves back to the lower order lists.
+ *
+ * @param order Block order, PAGE_ORDER_4K ~ PAGE_MAX_ORDER.
+ * @return Physical address of the block, 0 if the pool is exhausted.
+ */
+void *page_alloc(uint32_t order)
+{
+    struct page_block *block = 0;
+    uint32_t cur;
+
+    if (order > PAGE_MAX_ORDER)
+        return 0;
+
+    spin_lock(&_page_lock);
+    for (cur = order; cur <= PAGE_MAX_ORDER; cur++) {
+        block = _page_free_list[cur];
+        if (block)
+            break;
+    }
+    if (!block) {
+        _page_stat.failures++;
+        spin_unlock(&_page_lock);
+        return 0;
+    }
+    page_list_del(block, cur);
+    while (cur > order) {
+        cur--;
+        page_list_add(frame_to_page(page_to_frame(block) + (1 << cur)), cur);
+    }
+    _page_frame[page_to_frame(block)] = order;
+    _page_stat.free -= 1 << order;
+    _page_stat.allocs++;
+    spin_unlock(&_page_lock);
+
+    return block;
+}
+
+/**
+ * @brief Returns the cache colour of a physical page.
+ *
+ * Pages of the same colour compete for the same sets of the shared L2
+ * cache, CFG_CACHE_COLOURS is its way size in pages.
+ */
+uint32_t page_colour(uint32_t addr)
+{
+    return (addr >> PAGE_SHIFT) & (CFG_CACHE_COLOURS - 1);
+}
+
+/**
+ * @brief Allocates one page of one of the given cache colours.
+ *
+ * Takes the first free block, smallest order first, that holds a page of
+ * a wanted colour, and splits it down to that page.
+ *
+ * @param colours Bit n allows colour n, 0 allows any colour.
+ * @return Physical address of the page, 0 if there is no such page.
+ */
+void *page_alloc_colour(uint32_t colours)
+{
+    struct page_block *block = 0;
+    uint32_t cur, frame, target, half, i;
+
+    if (!colours)
+        return page_alloc(PAGE_ORDER_4K);
+
+    spin_lock(&_page_lock);
+    for (cur = 0; cur <= PAGE_MAX_ORDER; cur++) {
+        for (block = _page_free_list[cur]; block; block = block->next) {
+            for (i = 0; i < (1 << cur) && i < CFG_CACHE_COLOURS; i++) {
+                if (colours & (1 << page_colour((uint32_t) block +
+                                (i << PAGE_SHIFT))))
+                    break;
+            }
+            if (i < (1 << cur) && i < CFG_CACHE_COLOURS)
+                break;
+        }
+        if (block)
+            break;
+    }
+    if (!block) {
+        _page_stat.failures++;
+        spin_unlock(&_page_lock);
+        return 0;
+    }
+    page_list_del(block, cur);
+    frame = page_to_frame(block);
+    target = frame + i;
+    while (cur > 0) {
+        cur--;
+        half = 1 << cur;
+        if (target - frame >= half) {
+            page_list_add(frame_to_page(frame), cur);
+            frame += half;
+        } else
+            page_list_add(frame_to_page(frame + half), cur);
+    }
+    _page_frame[frame] = PAGE_ORDER_4K;
+    _page_stat.free--;
+    _page_stat.allocs++;
+    spin_unlock(&_page_lock);
+
+    return frame_to_page(frame);
+}
+
+/**
+ * @brief Allocates a block of 2^order pages filled with zero.
+ *
+ * Translation tables must start out with every descriptor invalid.
+ */
+void *page_zalloc(uint32_t order)
+{
+    void *addr = page_alloc(order);
+
+    if (addr)
+        memset(addr, 0, PAGE_SIZE << order);
+
+    return addr;
+}
+
+/**
+ * @brief Frees a block from page_alloc(), merging it with its free buddies.
+ *
+ * @param addr Address returned by page_alloc().
+ * @param order The order it was allocated with.
+ * @return void
+ */
+void page_free(void *addr, uint32_t order)
+{
+    uint32_t frame, buddy;
+
+    if (!addr)
+        return;
+    if (!page_in_pool((uint32_t) addr) ||
+            ((uint32_t) addr & ~PAGE_MASK) || order > PAGE_MAX_ORDER) {
+        printh("%s: invalid block %x order %d\n", __func__,
+                (uint32_t) addr, order);
+        return;
+    }
+
+    spin_lock(&_page_lock);
+    frame = page_to_frame(addr);
+    if (_page_frame[frame] != order) {
+        printh("%s: %x is not an allocated block of order %d\n", __func__,
+                (uint32_t) addr, order);
+        spin_unlock(&_page_lock);
+        return;
+    }
+    _page_stat.free += 1 << order;
+    _page_stat.frees++;
+    while (order < PAGE_MAX_ORDER) {
+        buddy = frame ^ (1 << order);
+        if (buddy >= PAGE_POOL_FRAMES ||
+                _page_frame[buddy] != (PAGE_FRAME_FREE | order))
+            break;
+        page_list_del(frame_to_page(buddy), order);
+        _page_frame[buddy] = PAGE_FRAME_NONE;
+        _page_frame[frame] = PAGE_FRAME_NONE;
+        frame &= ~(1 << order);
+        order++;
+    }
+    page_list_add(frame_to_page(frame), order);
+    spin_unlock(&_page_lock);
+}
+
+/**
+ * @brief Splits an allocated block into blocks of one page.
+ *
+ * Lets the pages of a block be freed one by one, e.g. when a 2MB block
+ * of guest memory is partly given back.
+ *
+ * @param addr Address returned by page_alloc().
+ * @param order The order it was allocated with.
+ * @return void
+ */
+void page_split(void *addr, uint32_t order)
+{
+    uint32_t frame, i;
+
+    if (!page_in_pool((uint32_t) addr) || order > PAGE_MAX_ORDER)
+        return;
+
+    spin_lock(&_page_lock);
+    frame = page_to_frame(addr);
+    if (_page_frame[frame] == order) {
+        for (i = 0; i < (1 << order); i++)
+            _page_frame[frame + i] = PAGE_ORDER_4K;
+        _page_stat.allocs += (1 << order) - 1;
+    }
+    spin_unlock(&_page_lock);
+}
+
+/**
+ * @brief Checks whether an address belongs to the page pool.
+ */
+int page_in_pool(uint32_t addr)
+{
+    return addr >= CFG_PAGE_POOL_BASE &&
+            addr - CFG_PAGE_POOL_BASE < CFG_PAGE_POOL_SIZE;
+}
+
+void page_get_stat(struct page_stat *stat)
+{
+    spin_lock(&_page_lock);
+    *stat = _page_stat;
+    spin_unlock(&_page_lock);
+}
+
+/**
+ * @brief Prints free blocks per order of the page pool.
+ */
+void page_dump(void)
+{
+    struct page_stat stat;
+    int order;
+
+    page_get_stat(&stat);
+    printH("page pool %x: total:%d free:%d alloc:%d free:%d fail:%d\n",
+            CFG_PAGE_POOL_BASE, stat.total, stat.free, stat.allocs,
+            stat.frees, stat.failures);
+    for (order = 0; order <= PAGE_MAX_ORDER; order++)
+        printH("  order %d: %d free blocks\n", order,
+                stat.free_blocks[order]);
+}
+
+/**
+ * @brief Puts the whole page pool on the free lists.
+ *
+ * CFG_PAGE_POOL_BASE must be aligned to the largest block, 2MB. A tail
+ * shorter than 2MB is split into the largest blocks that fit.
+ *
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_BAD_ACCESS if the pool is
+ *         misaligned.
+ */
+hvmm_status_t page_init(void)
+{
+    uint32_t frame = 0;
+    int order;
+
+    if (CFG_PAGE_POOL_BASE & ((PAGE_SIZE << PAGE_MAX_ORDER) - 1)) {
+        printh("page pool %x is not 2MB aligned\n", CFG_PAGE_POOL_BASE);
+        return HVMM_STATUS_BAD_ACCESS;
+    }
+
+    memset(&_page_stat, 0, sizeof(_page_stat));
+    for (order = 0; order <= PAGE_MAX_ORDER; order++)
+        _page_free_list[order] = 0;
+    memset(_page_frame, PAGE_FRAME_NONE, sizeof(_page_frame));
+
+    for (order = PAGE_MAX_ORDER; order >= 0; order--) {
+        while (frame + (1 << order) <= PAGE_POOL_FRAMES) {
+            page_list_add(frame_to_page(frame), order);
+            frame += 1 << order;
+        }
+    }
+    _page_stat.total = PAGE_POOL_FRAMES;
+    _page_stat.free = PAGE_POOL_FRAMES;
+
+    return HVMM_STATUS_SUCCESS;
+}
@@ -9,6 +9,182 @@
 static struct vdev_module *_vdev_module[VDEV_LEVEL_MAX][MAX_VDEV];
 static int _vdev_size[VDEV_LEVEL_MAX];
 
+/* Devices serving hvc #(VDEV_HVC_BASE + n) */
+static struct vdev_module *_vdev_hvc[VDEV_HVC_MAX];
+
+/**
+ * \brief Devices with per-guest state, the ones implementing save() or
+ * restore(). Only these are switched, and only for the guests using them.
+ * - A device is loaded for a guest once restored for it, at switch in if
+ *   the guest used it before, else on its first access. It is saved at
+ *   switch out.
+ * - Bit n of the masks is _vdev_stateful[n].
+ */
+#define MAX_VDEV_STATEFUL   32
+
+static struct vdev_module *_vdev_stateful[MAX_VDEV_STATEFUL];
+static int _vdev_nstateful;
+/* Index in _vdev_stateful plus one, 0 for a device without state */
+static uint8_t _vdev_state[VDEV_LEVEL_MAX][MAX_VDEV];
+static uint8_t _vdev_hvc_state[VDEV_HVC_MAX];
+static uint32_t _vdev_loaded[NUM_GUESTS_STATIC];
+static uint32_t _vdev_used[NUM_GUESTS_STATIC];
+
+static void vdev_touch(uint8_t state)
+{
+    vmid_t vmid = guest_current_vmid();
+    uint32_t bit;
+    struct vdev_module *vdev;
+
+    if (!state || vmid >= NUM_GUESTS_STATIC)
+        return;
+
+    bit = 1 << (state - 1);
+    if (_vdev_loaded[vmid] & bit)
+        return;
+
+    vdev = _vdev_stateful[state - 1];
+    if (vdev->ops->restore && vdev->ops->restore(vmid))
+        printh("vdev : restore error, name : %s\n", vdev->name);
+    _vdev_loaded[vmid] |= bit;
+    _vdev_used[vmid] |= bit;
+}
+
+/**
+ * \brief MMIO ranges of the devices of each level, sorted by base and
+ * not overlapping, looked up by binary search on the fault IPA.
+ */
+struct vdev_range {
+    uint32_t base;
+    uint32_t last;
+    int32_t num;
+};
+
+static struct vdev_range _vdev_ranges[VDEV_LEVEL_MAX][MAX_VDEV];
+static int _vdev_nranges[VDEV_LEVEL_MAX];
+
+static hvmm_status_t vdev_range_add(int level, int32_t num,
+        struct vdev_memory_map *mmio)
+{
+    struct vdev_range *ranges = _vdev_ranges[level];
+    uint32_t last = mmio->base + mmio->size - 1;
+    int i;
+
+    if (!mmio->size || last < mmio->base)
+        return HVMM_STATUS_BAD_ACCESS;
+
+    for (i = _vdev_nranges[level]; i > 0 && ranges[i - 1].base > last; i--)
+        ranges[i] = ranges[i - 1];
+    if (i > 0 && ranges[i - 1].last >= mmio->base) {
+        /* overlaps the previous range, undo the shift */
+        for (; i < _vdev_nranges[level]; i++)
+            ranges[i] = ranges[i + 1];
+        return HVMM_STATUS_BAD_ACCESS;
+    }
+    ranges[i].base = mmio->base;
+    ranges[i].last = last;
+    ranges[i].num = num;
+    _vdev_nranges[level]++;
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+static struct vdev_range *vdev_range_find(int level, uint32_t ipa)
+{
+    struct vdev_range *ranges = _vdev_ranges[level];
+    int lo = 0;
+    int hi = _vdev_nranges[level];
+    int mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (ipa < ranges[mid].base)
+            hi = mid;
+        else if (ipa > ranges[mid].last)
+            lo = mid + 1;
+        else
+            return &ranges[mid];
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Last dispatched MMIO ranges of each cpu, direct mapped by the IPA
+ * page. An entry holds the operations of the device the range resolved to,
+ * a hit calls them without the range search nor the module table. An entry
+ * is only taken when the fault IPA is inside the range it was filled for.
+ */
+#define VDEV_CACHE_ENTRIES  4       /* power of two */
+#define VDEV_CACHE_INDEX(ipa)   (((ipa) >> 12) & (VDEV_CACHE_ENTRIES - 1))
+
+struct vdev_cache {
+    int level;
+    uint32_t base;
+    uint32_t last;
+    struct vdev_ops *ops;       /* 0 if the entry is empty */
+    uint8_t state;
+};
+
+static struct vdev_cache _vdev_cache[NUM_CPUS][VDEV_CACHE_ENTRIES];
+static struct vdev_cache_stat _vdev_cache_stat[NUM_CPUS];
+
+/* Resolves the device of a fault IPA, 0 if no range holds it */
+static struct vdev_cache *vdev_cache_find(int level, uint32_t ipa)
+{
+    uint32_t cpu = smp_processor_id();
+    struct vdev_cache *entry = &_vdev_cache[cpu][VDEV_CACHE_INDEX(ipa)];
+    struct vdev_range *range;
+    struct vdev_module *vdev;
+
+    if (entry->ops && entry->level == level && ipa >= entry->base &&
+            ipa <= entry->last) {
+        _vdev_cache_stat[cpu].hits++;
+        return entry;
+    }
+    _vdev_cache_stat[cpu].misses++;
+
+    range = vdev_range_find(level, ipa);
+    if (!range)
+        return 0;
+    vdev = _vdev_module[level][range->num];
+    if (!vdev || !vdev->ops)
+        return 0;
+
+    entry->level = level;
+    entry->base = range->base;
+    entry->last = range->last;
+    entry->ops = vdev->ops;
+    entry->state = _vdev_state[level][range->num];
+
+    return entry;
+}
+
+/* Ranges move when a device is registered */
+static void vdev_cache_flush(void)
+{
+    int i, j;
+
+    for (i = 0; i < NUM_CPUS; i++)
+        for (j = 0; j < VDEV_CACHE_ENTRIES; j++)
+            _vdev_cache[i][j].ops = 0;
+}
+
+void vdev_cache_get_stat(uint32_t cpu, struct vdev_cache_stat *stat)
+{
+    if (cpu < NUM_CPUS)
+        *stat = _vdev_cache_stat[cpu];
+}
+
+void vdev_cache_dump(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_CPUS; i++)
+        printH("vdev cache cpu %d: hits:%d misses:%d\n", i,
+                _vdev_cache_stat[i].hits, _vdev_cache_stat[i].misses);
+}
+
 /**
  * \brief Register the virtual deivce \a module. Level \a level is
  * composed of three types(high, middle and low priority). This function
@@ -24,6 +200,37 @@ hvmm_status_t vdev_register(int level, struct vdev_module *module)
 
     for (i = 0; i < MAX_VDEV; i++) {
         if (!_vdev_module[level][i]) {
+            if (module->hvc != VDEV_HVC_NONE &&
+                    (module->hvc < VDEV_HVC_BASE ||
+                     module->hvc >= VDEV_HVC_BASE + VDEV_HVC_MAX ||
+                     _vdev_hvc[module->hvc - VDEV_HVC_BASE] ||
+                     !module->ops->write)) {
+                printh("vdev : '%s' hvc %x is out of range or taken\n",
+                        module->name, module->hvc);
+                return HVMM_STATUS_BAD_ACCESS;
+            }
+            if ((module->ops->save || module->ops->restore) &&
+                    _vdev_nstateful == MAX_VDEV_STATEFUL) {
+                printh("vdev : '%s' has state, max %d full\n",
+                        module->name, MAX_VDEV_STATEFUL);
+                return HVMM_STATUS_BUSY;
+            }
+            if (module->mmio && vdev_range_add(level, i, module->mmio)) {
+                printh("vdev : '%s' range %x-%x is empty or taken\n",
+                        module->name, module->mmio->base,
+                        module->mmio->base + module->mmio->size);
+                return HVMM_STATUS_BAD_ACCESS;
+            }
+            vdev_cache_flush();
+            if (module->ops->save || module->ops->restore) {
+                _vdev_stateful[_vdev_nstateful++] = module;
+                _vdev_state[level][i] = _vdev_nstateful;
+            }
+            if (module->hvc != VDEV_HVC_NONE) {
+                _vdev_hvc[module->hvc - VDEV_HVC_BASE] = module;
+                _vdev_hvc_state[module->hvc - VDEV_HVC_BASE] =
+                        _vdev_state[level][i];
+            }
             _vdev_module[level][i] = module;
             result = HVMM_STATUS_SUCCESS;
             break;
@@ -42,6 +249,9 @@ hvmm_status_t vdev_register(int level, struct vdev_module *module)
  * \brief Lookup the virtual deivce address, using the archtecture specific
  * information \a info and current archtecture specific register \a regs.
  *
+ * The fault IPA is looked up in the MMIO ranges in O(log n). Only the
+ * devices without a range are asked through check().
+ *
  * \retval virtual device number
  * \retval -1 This is an internal error.
  */
@@ -51,6 +261,11 @@ int32_t vdev_find(int level, struct arch_vdev_trigger_info *info,
     int32_t i;
     int32_t vdev_num = VDEV_NOT_FOUND;
     struct vdev_module *vdev;
+    struct vdev_range *range;
+
+    range = vdev_range_find(level, info->fipa);
+    if (range)
+        return range->num;
 
     for (i = 0; i < _vdev_size[level]; i++) {
         vdev = _vdev_module[level][i];
@@ -64,7 +279,7 @@ int32_t vdev_find(int level, struct arch_vdev_trigger_info *info,
                     level, i);
             break;
         }
-        if (!vdev->ops->check)
+        if (vdev->mmio || !vdev->ops->check)
             continue;
         if (!vdev->ops->check(info, regs)) {
             vdev_num = i;
@@ -75,33 +290,101 @@ int32_t vdev_find(int level, struct arch_vdev_trigger_info *info,
     return vdev_num;
 }
 
+/**
+ * @brief Serves a guest access to a virtual device and completes it.
+ *
+ * A fault in an MMIO range goes through the dispatch cache of the cpu,
+ * other devices through vdev_find().
+ *
+ * @param write Non zero for a write access.
+ * @return Return value of the read() or write() of the device, negative
+ * on error, VDEV_NOT_FOUND if no device serves the access.
+ */
+int32_t vdev_mmio(int level, struct arch_vdev_trigger_info *info,
+        struct arch_regs *regs, uint32_t write)
+{
+    struct vdev_cache *entry;
+    int32_t num;
+    int32_t ret;
+
+    entry = vdev_cache_find(level, info->fipa);
+    if (!entry) {
+        num = vdev_find(level, info, regs);
+        if (num < 0)
+            return VDEV_NOT_FOUND;
+        ret = write ? vdev_write(level, num, info, regs) :
+                vdev_read(level, num, info, regs);
+        if (ret >= 0)
+            vdev_post(level, num, info, regs);
+        return ret;
+    }
+
+    vdev_touch(entry->state);
+    ret = 0;
+    if (write && entry->ops->write)
+        ret = entry->ops->write(info, regs);
+    else if (!write && entry->ops->read)
+        ret = entry->ops->read(info, regs);
+    if (ret >= 0 && entry->ops->post)
+        entry->ops->post(info, regs);
+
+    return ret;
+}
+
+/**
+ * @brief Looks up the number of the device tagged \a tag.
+ *
+ * A linear scan, resolve it once and keep the result.
+ */
 int32_t vdev_find_tag(int level, int tag)
 {
     int32_t i;
-    int32_t vdev_num = VDEV_NOT_FOUND;
-    struct vdev_module *vdev;
-//    printH("vdev_find_tag\n");
+
     for (i = 0; i < _vdev_size[level]; i++) {
-        vdev = _vdev_module[level][i];
-        if (!vdev) {
-            printh("vdev : Could not get module, level : %d, i : %d\n",
-                    level, i);
-            break;
-        }
-        if (!vdev->ops) {
-            printh("vdev : Could not get operation, level : %d, i : %d\n",
-                    level, i);
-            break;
-        }
-        if (!vdev->ops->check)
-            continue;
-        if (tag == vdev->ops->check(0, 0)) {
-            vdev_num = i;
-            break;
-        }
+        if (_vdev_module[level][i] && _vdev_module[level][i]->tag == tag)
+            return i;
     }
 
-    return vdev_num;
+    return VDEV_NOT_FOUND;
+}
+
+/**
+ * @brief Returns the device tagged \a tag, 0 if none.
+ *
+ * Meant to be called once at init, the caller then keeps the handle and
+ * calls the operations of the device directly.
+ */
+struct vdev_module *vdev_get_tag(int level, uint32_t tag)
+{
+    int32_t num = vdev_find_tag(level, tag);
+
+    if (num == VDEV_NOT_FOUND)
+        return 0;
+
+    return _vdev_module[level][num];
+}
+
+/**
+ * @brief Serves hvc #imm, the immediate indexes the hypercall table.
+ *
+ * @return Return value of the write() of the device, VDEV_NOT_FOUND if no
+ * device serves the immediate.
+ */
+int32_t vdev_hvc(uint32_t imm, struct arch_vdev_trigger_info *info,
+        struct arch_regs *regs)
+{
+    struct vdev_module *vdev;
+
+    imm -= VDEV_HVC_BASE;
+    if (imm >= VDEV_HVC_MAX)
+        return VDEV_NOT_FOUND;
+
+    vdev = _vdev_hvc[imm];
+    if (!vdev)
+        return VDEV_NOT_FOUND;
+    vdev_touch(_vdev_hvc_state[imm]);
+
+    return vdev->ops->write(info, regs);
 }
 
 int32_t vdev_execute(int level, int num, int type, int data)
@@ -147,6 +430,7 @@ int32_t vdev_read(int level, int num, struct arch_vdev_trigger_info *info,
         return VDEV_ERROR;
     }
 
+    vdev_touch(_vdev_state[level][num]);
     if (vdev->ops->read)
         size = vdev->ops->read(info, regs);
 
@@ -171,6 +455,7 @@ int32_t vdev_write(int level, int num, struct arch_vdev_trigger_info *info,
         return VDEV_ERROR;
     }
 
+    vdev_touch(_vdev_state[level][num]);
     if (vdev->ops->write)
         size = vdev->ops->write(info, regs);
 
@@ -201,22 +486,103 @@ hvmm_status_t vdev_post(int level, int num, struct arch_vdev_trigger_info *info,
     return result;
 }
 
+/**
+ * @brief Loads a device with state for the running guest, before the
+ * hypervisor changes the state other than on an access of the guest.
+ */
+void vdev_load(struct vdev_module *module)
+{
+    int i;
+
+    for (i = 0; i < _vdev_nstateful; i++) {
+        if (_vdev_stateful[i] == module) {
+            vdev_touch(i + 1);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Saves the devices loaded for the outgoing guest.
+ */
 hvmm_status_t vdev_save(vmid_t vmid)
+{
+    int i;
+    uint32_t loaded;
+    struct vdev_module *vdev;
+    hvmm_status_t result;
+
+    if (vmid >= NUM_GUESTS_STATIC)
+        return HVMM_STATUS_SUCCESS;
+
+    loaded = _vdev_loaded[vmid];
+    _vdev_loaded[vmid] = 0;
+    for (i = 0; loaded; i++, loaded >>= 1) {
+        vdev = _vdev_stateful[i];
+        if (!(loaded & 1) || !vdev->ops->save)
+            continue;
+
+        result = vdev->ops->save(vmid);
+        if (result) {
+            printh("vdev : save error, name : %s\n", vdev->name);
+            return result;
+        }
+    }
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Restores the devices the incoming guest used before, the others
+ * are restored on their first access.
+ */
+hvmm_status_t vdev_restore(vmid_t vmid)
+{
+    int i;
+    uint32_t used;
+    struct vdev_module *vdev;
+    hvmm_status_t result;
+
+    if (vmid >= NUM_GUESTS_STATIC)
+        return HVMM_STATUS_SUCCESS;
+
+    used = _vdev_used[vmid];
+    _vdev_loaded[vmid] = used;
+    for (i = 0; used; i++, used >>= 1) {
+        vdev = _vdev_stateful[i];
+        if (!(used & 1) || !vdev->ops->restore)
+            continue;
+
+        result = vdev->ops->restore(vmid);
+        if (result) {
+            printh("vdev : restore error, name : %s\n", vdev->name);
+            return result;
+        }
+    }
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Keeps a copy of the state of every virtual device of a guest.
+ *
+ * Virtual devices without snapshot support are left out.
+ */
+hvmm_status_t vdev_snapshot(vmid_t vmid)
 {
     int i, j;
     struct vdev_module *vdev;
-    hvmm_status_t result = HVMM_STATUS_UNKNOWN_ERROR;
+    hvmm_status_t result = HVMM_STATUS_SUCCESS;
 
-    /* TODO : change one level iteration */
     for (i = 0; i < VDEV_LEVEL_MAX; i++) {
         for (j = 0; j < _vdev_size[i]; j++) {
             vdev = _vdev_module[i][j];
-            if (!vdev->ops->save)
+            if (!vdev->ops->snapshot)
                 continue;
 
-            result = vdev->ops->save(vmid);
+            result = vdev->ops->snapshot(vmid);
             if (result) {
-                printh("vdev : save error, name : %s\n", vdev->name);
+                printh("vdev : snapshot error, name : %s\n", vdev->name);
                 return result;
             }
         }
@@ -225,22 +591,53 @@ hvmm_status_t vdev_save(vmid_t vmid)
     return result;
 }
 
-hvmm_status_t vdev_restore(vmid_t vmid)
+/**
+ * @brief Brings the state of every virtual device of a guest back to the
+ *        copy taken by vdev_snapshot().
+ */
+hvmm_status_t vdev_rollback(vmid_t vmid)
 {
     int i, j;
     struct vdev_module *vdev;
-    hvmm_status_t result = HVMM_STATUS_UNKNOWN_ERROR;
+    hvmm_status_t result = HVMM_STATUS_SUCCESS;
+
+    for (i = 0; i < VDEV_LEVEL_MAX; i++) {
+        for (j = 0; j < _vdev_size[i]; j++) {
+            vdev = _vdev_module[i][j];
+            if (!vdev->ops->rollback)
+                continue;
+
+            result = vdev->ops->rollback(vmid);
+            if (result) {
+                printh("vdev : rollback error, name : %s\n", vdev->name);
+                return result;
+            }
+        }
+    }
+
+    return result;
+}
+
+/**
+ * @brief Copies the state of every virtual device of a guest to its clone.
+ *
+ * Virtual devices without clone support keep the state of the clone.
+ */
+hvmm_status_t vdev_clone(vmid_t dst, vmid_t src)
+{
+    int i, j;
+    struct vdev_module *vdev;
+    hvmm_status_t result = HVMM_STATUS_SUCCESS;
 
-    /* TODO : change one level iteration */
     for (i = 0; i < VDEV_LEVEL_MAX; i++) {
         for (j = 0; j < _vdev_size[i]; j++) {
             vdev = _vdev_module[i][j];
-            if (!vdev->ops->restore)
+            if (!vdev->ops->clone)
                 continue;
 
-            result = vdev->ops->restore(vmid);
+            result = vdev->ops->clone(dst, src);
             if (result) {
-                printh("vdev : save error, name : %s\n", vdev->name);
+                printh("vdev : clone error, name : %s\n", vdev->name);
                 return result;
             }
         }
@@ -0,0 +1,282 @@
+#include <vdev_reg.h>
+#include <asm_io.h>
+#include <asm-arm_inline.h>
+#include <armv7_p15.h>
+#include <memory.h>
+#include <page.h>
+#define DEBUG
+#include <log/print.h>
+
+/* Backing storage of the first register of a bank, 0 if it has none */
+static uint32_t *vdev_reg_state(struct vdev_regmap *map,
+        const struct vdev_reg *reg, vmid_t vmid)
+{
+    if (!(reg->flags & VDEV_REG_RW))
+        return 0;
+
+    return (uint32_t *) (map->state + map->stride * vmid + reg->field);
+}
+
+/* Smallest data cache line of the cores */
+#define VDEV_REG_CACHE_LINE     32
+
+/*
+ * The guest maps the shadow page as device memory, uncached, the words
+ * written by the hypervisor are cleaned to the point of coherency.
+ */
+static void vdev_reg_shadow_clean(uint32_t *start, uint32_t size)
+{
+    uint32_t addr = (uint32_t) start & ~(VDEV_REG_CACHE_LINE - 1);
+
+    for (; addr < (uint32_t) start + size; addr += VDEV_REG_CACHE_LINE)
+        clean_dcache_mva(addr);
+    dsb();
+}
+
+static uint32_t *vdev_reg_shadow_word(struct vdev_regmap *map,
+        const struct vdev_reg *reg, vmid_t vmid, uint32_t n)
+{
+    uint32_t *word = &map->shadow[vmid][reg->offset / 4 + n];
+
+    if (reg->flags & VDEV_REG_R)
+        *word = vdev_reg_state(map, reg, vmid)[n];
+    else
+        *word = 0;
+
+    return word;
+}
+
+/* Updates the shadow words of the registers stored in *preg */
+static void vdev_reg_shadow_update(struct vdev_regmap *map, vmid_t vmid,
+        uint32_t *preg)
+{
+    const struct vdev_reg *reg;
+    uint32_t *base;
+    uint32_t i;
+
+    for (i = 0; i < map->nregs; i++) {
+        reg = &map->regs[i];
+        base = vdev_reg_state(map, reg, vmid);
+        if (!base || preg < base || preg >= base + reg->count)
+            continue;
+        vdev_reg_shadow_clean(vdev_reg_shadow_word(map, reg, vmid,
+                preg - base), 4);
+    }
+}
+
+static uint32_t vdev_reg_hw_read(uint32_t addr, enum vdev_access_size size)
+{
+    switch (size) {
+    case VDEV_ACCESS_BYTE:
+        return getb(addr);
+    case VDEV_ACCESS_HWORD:
+        return getw(addr);
+    default:
+        return getl(addr);
+    }
+}
+
+static void vdev_reg_hw_write(uint32_t addr, uint32_t value,
+        enum vdev_access_size size)
+{
+    switch (size) {
+    case VDEV_ACCESS_BYTE:
+        putb(value, addr);
+        break;
+    case VDEV_ACCESS_HWORD:
+        putw(value, addr);
+        break;
+    default:
+        putl(value, addr);
+        break;
+    }
+}
+
+/**
+ * @brief Builds the offset index of a register map and checks its table.
+ *
+ * The index is only ever filled with the same entries, the cpus may all
+ * initialize the map.
+ */
+hvmm_status_t vdev_regmap_init(struct vdev_regmap *map)
+{
+    const struct vdev_reg *reg;
+    uint32_t i, w;
+
+    if (map->nregs > 0xFF)
+        return HVMM_STATUS_BAD_ACCESS;
+
+    for (i = 0; i < map->nregs; i++) {
+        reg = &map->regs[i];
+        if ((reg->offset & 0x3) || reg->size >= VDEV_ACCESS_RESERVED ||
+                reg->offset + reg->count * 4u > map->size ||
+                ((reg->flags & VDEV_REG_RW) && !map->state)) {
+            printh("vdev_reg: bad register %x\n", reg->offset);
+            return HVMM_STATUS_BAD_ACCESS;
+        }
+        for (w = reg->offset / 4; w < reg->offset / 4 + reg->count; w++) {
+            if (map->index[w] && map->index[w] != i + 1) {
+                printh("vdev_reg: register %x overlaps\n", w * 4);
+                return HVMM_STATUS_BAD_ACCESS;
+            }
+            map->index[w] = i + 1;
+        }
+    }
+
+    return HVMM_STATUS_SUCCESS;
+}
+
+/**
+ * @brief Loads the reset values of the registers of a guest.
+ */
+void vdev_regmap_reset(struct vdev_regmap *map, vmid_t vmid)
+{
+    const struct vdev_reg *reg;
+    uint32_t *preg;
+    uint32_t i, n;
+
+    for (i = 0; i < map->nregs; i++) {
+        reg = &map->regs[i];
+        preg = vdev_reg_state(map, reg, vmid);
+        if (!preg || (reg->flags & VDEV_REG_NO_RESET))
+            continue;
+        for (n = 0; n < reg->count; n++) {
+            if (reg->flags & VDEV_REG_RESET_HW)
+                preg[n] = getl(map->hw_base + reg->offset + n * 4);
+            else
+                preg[n] = reg->reset;
+        }
+    }
+}
+
+/**
+ * @brief Serves a guest access to a register map.
+ *
+ * Byte and halfword accesses are served on the bytes of the register they
+ * cover, if the register allows them.
+ */
+hvmm_status_t vdev_regmap_access(struct vdev_regmap *map, uint32_t write,
+        uint32_t offset, uint32_t *pvalue, enum vdev_access_size size)
+{
+    vmid_t vmid = guest_current_vmid();
+    hvmm_status_t ret = HVMM_STATUS_SUCCESS;
+    const struct vdev_reg *reg;
+    uint32_t *preg;
+    uint32_t n, shift, mask, value;
+    uint8_t i;
+
+    if (offset >= map->size || size >= VDEV_ACCESS_RESERVED ||
+            (offset & ((1 << size) - 1)))
+        goto bad;
+
+    i = map->index[offset >> 2];
+    if (!i)
+        goto bad;
+    reg = &map->regs[i - 1];
+    if (size < reg->size)
+        goto bad;
+
+    n = (offset - reg->offset) >> 2;
+    shift = (offset & 0x3) * 8;
+    if (size == VDEV_ACCESS_WORD)
+        mask = 0xFFFFFFFF;
+    else
+        mask = ((1 << (8 << size)) - 1) << shift;
+    preg = vdev_reg_state(map, reg, vmid);
+    if (preg)
+        preg += n;
+
+    if (!write) {
+        if (reg->flags & VDEV_REG_HW_R)
+            *pvalue = vdev_reg_hw_read(map->hw_base + offset, size);
+        else if (reg->flags & VDEV_REG_R)
+            *pvalue = (*preg & mask) >> shift;
+        else
+            *pvalue = 0;
+
+        return HVMM_STATUS_SUCCESS;
+    }
+
+    value = (*pvalue << shift) & mask;
+    if (reg->flags & VDEV_REG_W)
+        *preg = (*preg & ~mask) | value;
+    if (reg->flags & VDEV_REG_HW_W)
+        vdev_reg_hw_write(map->hw_base + offset, *pvalue, size);
+    if (reg->write)
+        ret = reg->write(vmid, n, preg, value, mask);
+    if (preg && map->shadow[vmid])
+        vdev_reg_shadow_update(map, vmid, preg);
+
+    return ret;
+
+bad:
+    printh("vdev_reg: invalid access offset:%x write:%d size:%d\n", offset,
+            write, size);
+
+    return HVMM_STATUS_BAD_ACCESS;
+}
+
+/**
+ * @brief Rewrites the shadow page of a guest from the registers, after
+ * they changed other than by a guest write.
+ */
+void vdev_regmap_sync(struct vdev_regmap *map, vmid_t vmid)
+{
+    const struct vdev_reg *reg;
+    uint32_t i, n;
+
+    if (!map->shadow[vmid])
+        return;
+
+    for (i = 0; i < map->nregs; i++) {
+        reg = &map->regs[i];
+        for (n = 0; n < reg->count; n++)
+            vdev_reg_shadow_word(map, reg, vmid, n);
+    }
+    vdev_reg_shadow_clean(map->shadow[vmid], map->size);
+}
+
+/**
+ * @brief Lets a guest read the registers without trapping.
+ *
+ * A shadow page of the registers is mapped read-only at the IPA of the
+ * window, guest writes fault into vdev_regmap_access() which updates the
+ * page. Offsets without a register read 0 instead of faulting.
+ *
+ * @param ipa Base of the register window, page aligned.
+ * @return HVMM_STATUS_SUCCESS, HVMM_STATUS_UNSUPPORTED_FEATURE if a
+ *         register is read from the hardware, HVMM_STATUS_BUSY if out of
+ *         memory, or the error of memory_share_ro().
+ */
+hvmm_status_t vdev_regmap_shadow(struct vdev_regmap *map, vmid_t vmid,
+        uint32_t ipa)
+{
+    hvmm_status_t ret;
+    uint32_t *page;
+    uint32_t i;
+
+    if (vmid >= NUM_GUESTS_STATIC || map->size > PAGE_SIZE ||
+            (ipa & ~PAGE_MASK))
+        return HVMM_STATUS_BAD_ACCESS;
+    if (map->shadow[vmid]) {
+        vdev_regmap_sync(map, vmid);
+        return HVMM_STATUS_SUCCESS;
+    }
+    for (i = 0; i < map->nregs; i++) {
+        if (map->regs[i].flags & VDEV_REG_HW_R)
+            return HVMM_STATUS_UNSUPPORTED_FEATURE;
+    }
+
+    page = page_zalloc(PAGE_ORDER_4K);
+    if (!page)
+        return HVMM_STATUS_BUSY;
+    map->shadow[vmid] = page;
+    vdev_regmap_sync(map, vmid);
+    ret = memory_share_ro(vmid, ipa, (uint32_t) page, PAGE_SIZE);
+    if (ret != HVMM_STATUS_SUCCESS) {
+        map->shadow[vmid] = 0;
+        page_free(page, PAGE_ORDER_4K);
+    }
+
+    return ret;
+}
@@ -22,5 +22,11 @@ SYSTEM ?= arndale
 #CPPFLAGS	+= -D_SMP_
 #CPPFLAGS	+= -D_MON_
 #CPPFLAGS	+= -D_GDB_
+#CPPFLAGS	+= -D_FIQ_FASTPATH_
+#CPPFLAGS	+= -D_LAZY_STAGE2_
+#CPPFLAGS	+= -D_PAGE_DEDUP_
+#CPPFLAGS	+= -D_CACHE_COLOUR_
+#CPPFLAGS	+= -D_MEMGUARD_
+#CPPFLAGS	+= -D_VDEV_SHADOW_
 CPPFLAGS	+= -mcpu=cortex-a7 -marm
 CPPFLAGS	+= -g
@@ -4,17 +4,55 @@
 #include <gic.h>
 #include <test/tests.h>
 #include <drivers/pwm_timer.h>
+#include <balloon.h>
+#include <channel.h>
 
 
 #define GPFSEL1 0x3F200004
 #define GPSET0 0x3F20001C
 #define GPCLR0 0x3F200028
 
+/* RAM backed by the page pool of the hypervisor, lent to the balloon */
+#define BALLOON_RAM_BASE    0x40000000
+#define BALLOON_RAM_PAGES   (0x02000000 >> 12)
+
+/* bmguest is guest 1, end 1 of channel 0 to guest 0 */
+#define CHANNEL_ID          0
+#define CHANNEL_END         1
+
+/*
+ * Answers each message of guest 0 with the number of the round. Guest 0
+ * speaks first, a guest 0 without a channel driver is sent nothing. A
+ * message is left in its ring while the replies fill the other one.
+ */
+static void channel_poll(struct channel *ch, uint32_t round)
+{
+    uint32_t *msg;
+    uint32_t len;
+    uint32_t sent = 0;
+
+    while (channel_recv(ch, &len)) {
+        msg = channel_send_buf(ch);
+        if (!msg)
+            break;
+        *msg = round;
+        channel_send(ch, sizeof(*msg));
+        channel_recv_done(ch);
+        sent++;
+    }
+    /* one doorbell for the batch */
+    if (sent)
+        channel_notify(ch);
+}
+
 
 /* #define TESTS_ENABLE_PWM_TIMER */
 
 int main()
 {
+    struct channel ch;
+    uint32_t round = 0;
+    int channel;
     uart_print(GUEST_LABEL);
     uart_print("=== Starting platform main, LED ON/OFF ===\n\r");
 //#ifdef TESTS_ENABLE_PWM_TIMER
@@ -27,7 +65,14 @@ int main()
 	ra &= ~(7 << 18);
 	ra |= 1 << 18;
 	PUT32(GPFSEL1, ra);
+	balloon_init(BALLOON_RAM_BASE, BALLOON_RAM_PAGES);
+	channel = !channel_open(&ch, CHANNEL_ID, CHANNEL_END);
+	if (!channel)
+		uart_print("=BMGUEST: no channel ===\n\r");
 	while (1) {
+		balloon_update();
+		if (channel)
+			channel_poll(&ch, round++);
 		PUT32(GPSET0, 1 << 16);
 		 uart_print("=BMGUEST: LED ON ===\n\r");
 		for (ra = 0; ra < 0x100000; ra++)
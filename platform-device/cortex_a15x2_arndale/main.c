@@ -13,10 +13,7 @@
 #define PLATFORM_BASIC_TESTS 0
 
 #define DECLARE_VIRQMAP(name, id, _pirq, _virq) \
-    do {                                        \
-        name[id].map[_pirq].virq = _virq;       \
-        name[id].map[_virq].pirq = _pirq;       \
-    } while (0)
+    interrupt_virqmap_declare(&name[id], _pirq, _virq)
 
 static struct guest_virqmap _guest_virqmap[NUM_GUESTS_STATIC];
 
@@ -126,6 +123,17 @@ static struct memmap_desc guest1_memory_md_ff3[] = {
 };
 
 
+/*
+ * Guest 1 RAM at 0x4000_0000 without a carve-out, backed by page pool frames
+ * as the guest first touches it. bmguest lends it to its memory balloon.
+ */
+static struct memmap_desc guest1_pool_md[] = {
+    {"pool", 0x00000000, MEMMAP_PA_ALLOC, CFG_GUEST1_POOL_RAM_SIZE,
+     MEMATTR_NORMAL_OWB | MEMATTR_NORMAL_IWB
+    },
+    {0, 0, 0, 0,  0},
+};
+
 #if _SMP_
 /**
  * @brief Memory map for guest 2.
@@ -163,7 +171,7 @@ static struct memmap_desc *guest0_mdlist[] = {
 /* Memory Map for Guest 1 */
 static struct memmap_desc *guest1_mdlist[] = {
 	guest1_memory_md,
-	guest_md_empty,
+	guest1_pool_md,     /* 0x4000_0000 */
     guest_md_empty,
     guest_md_empty,
     0
@@ -197,17 +205,10 @@ static uint32_t _timer_irq;
  */
 void setup_interrupt()
 {
-    int i, j;
-    struct virqmap_entry *map;
-
-    for (i = 0; i < NUM_GUESTS_STATIC; i++) {
-        map = _guest_virqmap[i].map;
-        for (j = 0; j < MAX_IRQS; j++) {
-            map[j].enabled = GUEST_IRQ_DISABLE;
-            map[j].virq = VIRQ_INVALID;
-            map[j].pirq = PIRQ_INVALID;
-        }
-    }
+    int i;
+
+    for (i = 0; i < NUM_GUESTS_STATIC; i++)
+        interrupt_virqmap_init(&_guest_virqmap[i]);
 
     for (i = 32; i < 64; i++)
         DECLARE_VIRQMAP(_guest_virqmap, 0, i, i);
@@ -217,6 +218,7 @@ void setup_interrupt()
 
     DECLARE_VIRQMAP(_guest_virqmap, 0, 27, 27);
     DECLARE_VIRQMAP(_guest_virqmap, 0, 64, 64);
+    DECLARE_VIRQMAP(_guest_virqmap, 0, 65, 65);
     DECLARE_VIRQMAP(_guest_virqmap, 0, 66, 66);
     DECLARE_VIRQMAP(_guest_virqmap, 0, 67, 67);
     DECLARE_VIRQMAP(_guest_virqmap, 0, 84, 84);
@@ -233,6 +235,8 @@ void setup_interrupt()
     DECLARE_VIRQMAP(_guest_virqmap, 0, 147, 147);
     DECLARE_VIRQMAP(_guest_virqmap, 0, 156, 156);
     DECLARE_VIRQMAP(_guest_virqmap, 0, 347, 347);
+    /* uart, a basic pending source of the board IC */
+    DECLARE_VIRQMAP(_guest_virqmap, 0, 9999, 9999);
 
 }
 
@@ -358,6 +362,12 @@ int main_cpu_init()
     /* Initialize Virtual Devices */
     if (vdev_init())
         printh("[start_guest] virtual device initialization failed...\n");
+    if (interrupt_vdev_init())
+        printh("[start_guest] interrupt vdev binding failed...\n");
+    /* Rate limit the board sources forwarded to guest 0 */
+    interrupt_guest_ratelimit(0, 65, CFG_VIRQ_RATELIMIT_BOARD_BUDGET);
+    interrupt_guest_ratelimit(0, 66, CFG_VIRQ_RATELIMIT_BOARD_BUDGET);
+    interrupt_guest_ratelimit(0, 9999, CFG_VIRQ_RATELIMIT_BOARD_BUDGET);
 
     /* Begin running test code for newly implemented features */
     if (basic_tests_run(PLATFORM_BASIC_TESTS))
@@ -407,6 +417,8 @@ void secondary_cpu_init(uint32_t cpu)
     /* Initialize Virtual Devices */
     if (vdev_init())
         printh("[start_guest] virtual device initialization failed...\n");
+    if (interrupt_vdev_init())
+        printh("[start_guest] interrupt vdev binding failed...\n");
 
 
 
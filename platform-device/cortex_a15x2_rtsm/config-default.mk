@@ -22,6 +22,11 @@ SYSTEM ?= vexpress
 #CPPFLAGS	+= -DSMP
 #CPPFLAGS	+= -D_MON_
 #CPPFLAGS	+= -D_CPUISOLATED_
+#CPPFLAGS	+= -D_LAZY_STAGE2_
+#CPPFLAGS	+= -D_PAGE_DEDUP_
+#CPPFLAGS	+= -D_CACHE_COLOUR_
+#CPPFLAGS	+= -D_MEMGUARD_
+#CPPFLAGS	+= -D_VDEV_SHADOW_
 CPPFLAGS	+= -D_RPI_
 CPPFLAGS	+= -mcpu=cortex-a7 -marm
 CPPFLAGS	+= -g
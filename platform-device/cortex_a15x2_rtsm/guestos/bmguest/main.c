@@ -4,6 +4,41 @@
 #include <test/tests.h>
 #include <trap.h>
 #include <drivers/sp804_timer.h>
+#include <balloon.h>
+#include <channel.h>
+
+/* RAM backed by the page pool of the hypervisor, lent to the balloon */
+#define BALLOON_RAM_BASE    0xC0000000
+#define BALLOON_RAM_PAGES   (0x02000000 >> 12)
+
+/* bmguest is guest 1, end 1 of channel 0 to guest 0 */
+#define CHANNEL_ID          0
+#define CHANNEL_END         1
+
+/*
+ * Answers each message of guest 0 with the number of the round. Guest 0
+ * speaks first, a guest 0 without a channel driver is sent nothing. A
+ * message is left in its ring while the replies fill the other one.
+ */
+static void channel_poll(struct channel *ch, uint32_t round)
+{
+    uint32_t *msg;
+    uint32_t len;
+    uint32_t sent = 0;
+
+    while (channel_recv(ch, &len)) {
+        msg = channel_send_buf(ch);
+        if (!msg)
+            break;
+        *msg = round;
+        channel_send(ch, sizeof(*msg));
+        channel_recv_done(ch);
+        sent++;
+    }
+    /* one doorbell for the batch */
+    if (sent)
+        channel_notify(ch);
+}
 
 /*
 #define TESTS_ENABLE_SP804_TIMER
@@ -19,6 +54,9 @@
 int main()
 {
     int val;
+    struct channel ch;
+    uint32_t round = 0;
+    int channel;
     uart_print(GUEST_LABEL);
     uart_print("\n\r=== Starting platform main\n\r");
 #ifdef TESTS_ENABLE_SP804_TIMER
@@ -44,7 +82,16 @@ int main()
     WRITE_ACTLR(val);
 #endif
 
-    while (1)
-        ;
+    balloon_init(BALLOON_RAM_BASE, BALLOON_RAM_PAGES);
+    channel = !channel_open(&ch, CHANNEL_ID, CHANNEL_END);
+    if (!channel)
+        uart_print("no channel\n\r");
+    while (1) {
+        balloon_update();
+        if (channel)
+            channel_poll(&ch, round++);
+        for (val = 0; val < 0x100000; val++)
+            dummy(val);
+    }
     return 0;
 }
@@ -65,6 +65,23 @@
 #define MAX_PPI_IRQS 32
 #define MAX_SPI_IRQS (MAX_IRQS - 1024)
 
+/* Mapped irqs per guest virqmap, power of two */
+#define CFG_VIRQMAP_ENTRIES 128
+
+/* Per-source guest interrupt rate limit, budget 0 means unlimited */
+#define CFG_VIRQ_RATELIMIT_BUDGET       0
+#define CFG_VIRQ_RATELIMIT_PERIOD_US    1000
+/* Budget of the board sources guest 0 takes on the RPi2, set at boot */
+#define CFG_VIRQ_RATELIMIT_BOARD_BUDGET 16
+
+/*
+ * FIQ fast path (_FIQ_FASTPATH_): the guest re-arms FIQ control through the
+ * RPi2 interrupt controller vdev, which this platform does not build.
+ */
+#ifdef _FIQ_FASTPATH_
+#error "_FIQ_FASTPATH_ is not supported on cortex_a15x2_rtsm"
+#endif
+
 #define CFG_MEMMAP_PHYS_START      0x80000000
 #define CFG_MEMMAP_PHYS_SIZE       0x7FFFFFFF
 #define CFG_MEMMAP_PHYS_END        (CFG_MEMMAP_PHYS_START+CFG_MEMMAP_PHYS_SIZE)
@@ -73,6 +90,47 @@
 #define CFG_MEMMAP_GUEST1_OFFSET   0xC0000000
 #define CFG_MEMMAP_GUEST2_OFFSET   0xD0000000
 #define CFG_MEMMAP_GUEST3_OFFSET   0xE0000000
+
+/*
+ * Page frame pool of the buddy allocator, above the hyp heap.
+ * Must be 2MB aligned.
+ */
+#define CFG_PAGE_POOL_BASE         (CFG_MEMMAP_MON_OFFSET + 0x0A000000)
+#define CFG_PAGE_POOL_SIZE         0x05000000
+/* Guest 1 RAM allocated from the page pool as it is first touched */
+#define CFG_GUEST1_POOL_RAM_SIZE   SZ_32M
+/* Free page pool frames below which balloons inflate, above which they deflate */
+#define CFG_BALLOON_LOW_PAGES      1024
+#define CFG_BALLOON_HIGH_PAGES     4096
+/* Guest pages looked at by the page sharing scanner per tick */
+#define CFG_PAGE_DEDUP_SCAN_PAGES  16
+
+/*
+ * Cache colouring (_CACHE_COLOUR_): colours of the shared L2 cache, its
+ * way size in 4KB pages (1MB, 16 ways). Guest RAM is backed only by pages
+ * of the colours of the guest, bit n allows colour n, 0 any colour. A
+ * guest with RAM mapped at IPA == PA is left uncoloured, for its DMA.
+ */
+#define CFG_CACHE_COLOURS          16
+#define CFG_GUEST0_COLOURS         0x0FFF
+#define CFG_GUEST1_COLOURS         0xF000
+#define CFG_GUEST2_COLOURS         0x0FFF
+#define CFG_GUEST3_COLOURS         0xF000
+
+/*
+ * Memory bandwidth regulation (_MEMGUARD_): PMU event counted for a guest,
+ * 0x17 L2 data refill, and its budget of events per period of
+ * CFG_MEMGUARD_PERIOD_TICKS hypervisor ticks, 0 means unregulated.
+ */
+#define CFG_MEMGUARD_PMU_IRQ       100         /* PMU SPI 68, cpu0 */
+#define CFG_MEMGUARD_PMU_ROUTE     0           /* GIC routed */
+#define CFG_MEMGUARD_EVENT         0x17
+#define CFG_MEMGUARD_PERIOD_TICKS  1
+#define CFG_GUEST0_MEMGUARD_BUDGET 200000
+#define CFG_GUEST1_MEMGUARD_BUDGET 0
+#define CFG_GUEST2_MEMGUARD_BUDGET 200000
+#define CFG_GUEST3_MEMGUARD_BUDGET 0
+
 #define CFG_GUEST_START_ADDRESS    0x80000000
 
 #define SHARED_ADDRESS (CFG_MEMMAP_GUEST1_OFFSET + 0xEC00000)
@@ -16,10 +16,10 @@
 #define PLATFORM_BASIC_TESTS 4
 
 #define DECLARE_VIRQMAP(name, id, _pirq, _virq) \
-    do {                                        \
-        name[id].map[_pirq].virq = _virq;       \
-        name[id].map[_virq].pirq = _pirq;       \
-    } while (0)
+    interrupt_virqmap_declare(&name[id], _pirq, _virq)
+
+/* Interrupt lines of the RTSM VE GIC handed to guest 0 */
+#define RTSM_NUM_GUEST_IRQS 128
 
 
 static struct guest_virqmap _guest_virqmap[NUM_GUESTS_STATIC];
@@ -173,6 +173,17 @@ static struct memmap_desc guest1_memory_md[] = {
     {0, 0, 0, 0,  0},
 };
 
+/*
+ * Guest 1 RAM at 0xC000_0000 without a carve-out, backed by page pool frames
+ * as the guest first touches it. bmguest lends it to its memory balloon.
+ */
+static struct memmap_desc guest1_pool_md[] = {
+    {"pool", 0x00000000, MEMMAP_PA_ALLOC, CFG_GUEST1_POOL_RAM_SIZE,
+     MEMATTR_NORMAL_OWB | MEMATTR_NORMAL_IWB
+    },
+    {0, 0, 0, 0,  0},
+};
+
 #if _SMP_
 /**
  * @brief Memory map for guest 2.
@@ -233,7 +244,7 @@ static struct memmap_desc *guest1_mdlist[] = {
     guest1_device_md,
     guest_md_empty,
     guest1_memory_md,
-    guest_md_empty,
+    guest1_pool_md,     /* 0xC000_0000 */
     0
 };
 
@@ -285,17 +296,10 @@ static uint32_t _timer_irq;
  */
 void setup_interrupt()
 {
-    int i, j;
-    struct virqmap_entry *map;
-
-    for (i = 0; i < NUM_GUESTS_STATIC; i++) {
-        map = _guest_virqmap[i].map;
-        for (j = 0; j < MAX_IRQS; j++) {
-            map[j].enabled = GUEST_IRQ_DISABLE;
-            map[j].virq = VIRQ_INVALID;
-            map[j].pirq = PIRQ_INVALID;
-        }
-    }
+    int i;
+
+    for (i = 0; i < NUM_GUESTS_STATIC; i++)
+        interrupt_virqmap_init(&_guest_virqmap[i]);
 
     /*
      *  vimm-0, pirq-69, virq-69 = pwm timer driver
@@ -314,7 +318,7 @@ void setup_interrupt()
      *  vimm-0, pirq-41, virq-41 = MCI - pl180
      *  vimm-0, pirq-42, virq-42 = MCI - pl180
      */
-    for (i=0 ; i< MAX_IRQS; i++) {
+    for (i=0 ; i< RTSM_NUM_GUEST_IRQS; i++) {
     	if(i != 26)
     		DECLARE_VIRQMAP(_guest_virqmap, 0, i, i);
     }